@@ -151,6 +151,7 @@ size_t resolve_address(char* name) {
     if (!xstrcmp(name, "OsGetFreeMemoryKilobytes")) return (size_t) OsGetFreeMemoryKilobytes;
     if (!xstrcmp(name, "OsGetTotalMemoryKilobytes")) return (size_t) OsGetTotalMemoryKilobytes;
     if (!xstrcmp(name, "OsGetVersion")) return (size_t) OsGetVersion;
+    if (!xstrcmp(name, "OsDumpSpinlockStats")) return (size_t) OsDumpSpinlockStats;
     if (!xstrcmp(name, "OsSetLocalTime")) return (size_t) OsSetLocalTime;
     if (!xstrcmp(name, "OsGetLocalTime")) return (size_t) OsGetLocalTime;
     if (!xstrcmp(name, "OsSetTimezone")) return (size_t) OsSetTimezone;
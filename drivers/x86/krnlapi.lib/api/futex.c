@@ -0,0 +1,11 @@
+#include "krnlapi.h"
+#include <merlon/futex.h>
+#include <syscall.h>
+
+int OsFutexWait(volatile int* address, int expected, int timeout_ms) {
+    return _system_call(SYSCALL_FUTEX, FUTEX_WAIT, (size_t) address, (size_t) expected, (size_t) timeout_ms, 0);
+}
+
+int OsFutexWake(volatile int* address, int count) {
+    return _system_call(SYSCALL_FUTEX, FUTEX_WAKE, (size_t) address, (size_t) count, 0, 0);
+}
@@ -0,0 +1,26 @@
+#include "krnlapi.h"
+#include <errno.h>
+#include <stddef.h>
+#include <sys/ioring.h>
+
+struct io_ring* io_ring_setup(unsigned int entries) {
+    size_t ring;
+    int res = _system_call(SYSCALL_IORINGSETUP, entries, (size_t) &ring, 0, 0, 0);
+    if (res == 0) {
+        return (struct io_ring*) ring;
+    } else {
+        errno = res;
+        return NULL;
+    }
+}
+
+int io_ring_enter(unsigned int to_submit, unsigned int min_complete, int timeout) {
+    size_t submitted;
+    int res = _system_call(SYSCALL_IORINGENTER, to_submit, min_complete, timeout, (size_t) &submitted, 0);
+    if (res == 0) {
+        return submitted;
+    } else {
+        errno = res;
+        return -1;
+    }
+}
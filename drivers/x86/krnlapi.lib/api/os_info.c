@@ -34,4 +34,8 @@ void OsGetVersion(int* major, int* minor, char* string, int length) {
         *major = -1;
         *minor = -1;
     }
+}
+
+int OsDumpSpinlockStats(const char* name) {
+    return _system_call(SYSCALL_INFO, SYSINFO_DUMP_SPINLOCKS, 0, (size_t) name, 0, 0);
 }
\ No newline at end of file
@@ -3,22 +3,71 @@
 #include <sys/mman.h>
 #include <virtual.h>
 #include <syscall.h>
+#include <machine/config.h>
+#include <_timepage.h>
 
 int OsSetLocalTime(uint64_t time) {
     return _system_call(SYSCALL_TIME, (size_t) &time, 1, 0, 0, 0);
 }
 
-uint64_t OsGetLocalTime(void) {
+static uint64_t ReadTimestamp(void) {
+    uint64_t timestamp;
+    asm volatile ("rdtsc" : "=A" (timestamp));
+    return timestamp;
+}
+
+/*
+ * Works out the time from the page the kernel keeps it in, the same way the
+ * kernel does (see _timepage.h), so we don't need a system call.
+ */
+static uint64_t ReadTimePage(int64_t* timezone_offset_out) {
+    const struct time_page* page = (const struct time_page*) ARCH_TIME_PAGE_ADDRESS;
+
+    uint32_t sequence;
     uint64_t time;
-    _system_call(SYSCALL_TIME, (size_t) &time, 0, 0, 0, 0);
+    do {
+        do {
+            sequence = page->sequence;
+        } while (sequence & 1);
+        asm volatile ("" ::: "memory");
+
+        uint64_t nanos = page->tick_time;
+        if (page->using_tsc) {
+            uint64_t timestamp = ReadTimestamp();
+            uint64_t cycles = timestamp > page->tsc_base ? timestamp - page->tsc_base : 0;
+            uint64_t high = ((cycles >> 32) * page->mult) << (32 - page->shift);
+            uint64_t low = ((cycles & 0xFFFFFFFFULL) * page->mult) >> page->shift;
+            nanos = page->time_base + high + low;
+        }
+        time = page->utc_base + nanos / 1000;
+        *timezone_offset_out = page->timezone_offset;
+
+        asm volatile ("" ::: "memory");
+    } while (sequence != page->sequence);
+
     return time;
 }
 
+uint64_t OsGetLocalTime(void) {
+    int64_t timezone_offset;
+    uint64_t utc = ReadTimePage(&timezone_offset);
+    return utc + timezone_offset;
+}
+
 int OsSetTimezone(const char* name) {
     return _system_call(SYSCALL_TIME, (size_t) name, 3, 0, 0, 0);
 }
 
 int OsGetTimezone(char* name_out, int max_length, uint64_t* offset_out) {
+    if (name_out == NULL) {
+        int64_t offset;
+        ReadTimePage(&offset);
+        if (offset_out != NULL) {
+            *offset_out = offset;
+        }
+        return 0;
+    }
+
     char internal_buffer[128];
     uint64_t offset;
     int res = _system_call(SYSCALL_TIME, (size_t) internal_buffer, 2, 127, (size_t) &offset, 0);
@@ -0,0 +1,14 @@
+#include "krnlapi.h"
+#include <errno.h>
+#include <poll.h>
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+    size_t ready;
+    int res = _system_call(SYSCALL_POLL, (size_t) fds, nfds, timeout, (size_t) &ready, 0);
+    if (res == 0) {
+        return ready;
+    } else {
+        errno = res;
+        return -1;
+    }
+}
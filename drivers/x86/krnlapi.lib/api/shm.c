@@ -0,0 +1,24 @@
+#include "krnlapi.h"
+#include <errno.h>
+#include <sys/mman.h>
+
+int shm_open(const char* name, int oflag, mode_t mode) {
+    size_t fd;
+    int res = _system_call(SYSCALL_SHMOPEN, (size_t) name, oflag, mode, (size_t) &fd, 0);
+    if (res == 0) {
+        return fd;
+    } else {
+        errno = res;
+        return -1;
+    }
+}
+
+int shm_unlink(const char* name) {
+    int res = _system_call(SYSCALL_SHMUNLINK, (size_t) name, 0, 0, 0, 0);
+    if (res == 0) {
+        return 0;
+    } else {
+        errno = res;
+        return -1;
+    }
+}
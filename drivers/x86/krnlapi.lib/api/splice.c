@@ -0,0 +1,10 @@
+#include "krnlapi.h"
+#include <merlon/splice.h>
+
+int OsSplice(int fd_in, int fd_out, size_t length, size_t* moved_out) {
+    return _system_call(SYSCALL_SPLICE, fd_in, fd_out, length, (size_t) moved_out, 0);
+}
+
+int OsVmsplice(int fd, const void* buffer, size_t length, size_t* moved_out) {
+    return _system_call(SYSCALL_VMSPLICE, fd, (size_t) buffer, length, (size_t) moved_out, 0);
+}
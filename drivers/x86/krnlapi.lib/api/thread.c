@@ -0,0 +1,17 @@
+#include "krnlapi.h"
+#include <merlon/thread.h>
+
+int OsCreateThread(void (*entry)(void*), void* arg, void* tls, volatile int* clear_tid, int* tid_out) {
+    return _system_call(SYSCALL_CREATETHREAD, (size_t) entry, (size_t) arg, (size_t) tls, (size_t) clear_tid, (size_t) tid_out);
+}
+
+void OsExitThread(int status) {
+    _system_call(SYSCALL_TERMINATE, status, 0, 0, 0, 0);
+    while (true) {
+        ;
+    }
+}
+
+int OsSetThreadLocalStorage(void* base) {
+    return _system_call(SYSCALL_SETTLS, (size_t) base, 0, 0, 0, 0);
+}
@@ -0,0 +1,13 @@
+#include "krnlapi.h"
+#include <unistd.h>
+#include <errno.h>
+
+int ftruncate(int fd, off_t length) {
+    int res = _system_call(SYSCALL_TRUNCATE, fd, length, 0, 0, 0);
+    if (res == 0) {
+        return 0;
+    } else {
+        errno = res;
+        return -1;
+    }
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <irq.h>
 #include <irql.h>
+#include <thread.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -206,18 +207,22 @@ static void LOCKED_DRIVER_CODE Ps2KeyboardTranslateSet1(uint8_t scancode) {
     extended = false;
 }
 
-void LOCKED_DRIVER_CODE HandleCharacter(void* scancode) {
-    Ps2KeyboardTranslateSet1((size_t) scancode);
+/*
+ * Runs in the keyboard's IRQ thread, with every scancode that came in since it
+ * last ran.
+ */
+static void LOCKED_DRIVER_CODE Ps2KeyboardBottomHalf(const size_t* scancodes, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (scancodes[i] == 0xE0) {
+            extended = true;
+        } else {
+            Ps2KeyboardTranslateSet1(scancodes[i]);
+        }
+    }
 }
 
 static int LOCKED_DRIVER_CODE Ps2KeyboardIrqHandler(struct x86_regs*) {
-	uint8_t scancode = inb(0x60);
-    LogWriteSerial("GOT KEYBRD IRQ\n");
-    if (scancode == 0xE0) {
-        extended = true;
-    } else {
-        DeferUntilIrql(IRQL_STANDARD, HandleCharacter, (void*) (size_t) scancode);
-    }
+    QueueIrqData(PIC_IRQ_BASE + 1, inb(0x60));
     return 0;
 }
 
@@ -291,7 +296,7 @@ void InitPs2Keyboard(void) {
         }
     }
 
-    RegisterIrqHandler(PIC_IRQ_BASE + 1, Ps2KeyboardIrqHandler);
+    RegisterThreadedIrqHandler(PIC_IRQ_BASE + 1, Ps2KeyboardIrqHandler, Ps2KeyboardBottomHalf, FIXED_PRIORITY_KERNEL_HIGH);
     Ps2ControllerEnableDevice(false);
     Ps2ControllerSetIrqEnable(true, false);
 }
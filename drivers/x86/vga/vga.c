@@ -128,42 +128,56 @@ static void ClearScreen(void) {
     }
 }
 
+#define VGA_MSGBOX_CAPACITY 256
+#define VGA_MSG_BATCH       16
+
+static void HandleMessage(struct video_msg* msg) {
+    switch (msg->type) {
+    case VIDMSG_CLEAR_SCREEN:
+        data.colour = (msg->clear.fg << 8) | (msg->clear.bg << 12);
+        ClearScreen();
+        break;
+    case VIDMSG_PUTCHAR: 
+        data.colour = (msg->putchar.fg << 8) | (msg->putchar.bg << 12);
+        DrvConsolePutchar(msg->putchar.c);
+        break;
+    case VIDMSG_PUTCHARS: {
+        data.colour = (msg->putchars.fg << 8) | (msg->putchars.bg << 12);
+        for (int i = 0; i < VID_MAX_PUTCHARS_LEN && msg->putchars.cs[i]; ++i) {
+            DrvConsolePutchar(msg->putchars.cs[i]);
+        }
+        break;
+    }
+    case VIDMSG_SET_CURSOR:
+        data.cursor_x = msg->setcursor.x;
+        data.cursor_y = msg->setcursor.y;
+        break;
+    default:
+        break;
+    }
+}
+
 static void MessageLoop(void*) {
     SetGraphicalPanicHandler(PanicHandler);
 
-    struct msgbox* mbox = CreateMessageBox("vga", sizeof(struct video_msg));
+    /*
+     * Senders wait for space if we fall behind, unless they're above 
+     * IRQL_STANDARD, in which case their output gets dropped.
+     */
+    struct msgbox* mbox = CreateBoundedMessageBox("vga", sizeof(struct video_msg), VGA_MSGBOX_CAPACITY, 0);
     InitVideoConsole(mbox);
 
     while (true) {
-        struct video_msg msg;
-        ReceiveMessage(mbox, &msg);
-
-        switch (msg.type) {
-        case VIDMSG_CLEAR_SCREEN:
-            data.colour = (msg.clear.fg << 8) | (msg.clear.bg << 12);
-            ClearScreen();
-            break;
-        case VIDMSG_PUTCHAR: 
-            data.colour = (msg.putchar.fg << 8) | (msg.putchar.bg << 12);
-            DrvConsolePutchar(msg.putchar.c);
-            VgaSetCursor();
-            break;
-        case VIDMSG_PUTCHARS: {
-            data.colour = (msg.putchars.fg << 8) | (msg.putchars.bg << 12);
-            for (int i = 0; i < VID_MAX_PUTCHARS_LEN && msg.putchars.cs[i]; ++i) {
-                DrvConsolePutchar(msg.putchars.cs[i]);
-            }
-            VgaSetCursor();
-            break;
-        }
-        case VIDMSG_SET_CURSOR:
-            data.cursor_x = msg.setcursor.x;
-            data.cursor_y = msg.setcursor.y;
-            VgaSetCursor();
-            break;
-        default:
-            break;
+        struct video_msg msgs[VGA_MSG_BATCH];
+        int count = ReceiveMessages(mbox, msgs, VGA_MSG_BATCH);
+        for (int i = 0; i < count; ++i) {
+            HandleMessage(&msgs[i]);
         }
+
+        /*
+         * Only need to move the hardware cursor once for the whole batch.
+         */
+        VgaSetCursor();
     }  
 }
 
@@ -9,6 +9,8 @@
 global ArchGetCurrentCpuIndex
 global ArchReadTimestamp
 global ArchStallProcessor
+global ArchRelaxCpu
+global x86EnableInterruptsAndHalt
 
 ArchReadTimestamp:
 	rdtsc
@@ -17,3 +19,14 @@ ArchReadTimestamp:
 ArchStallProcessor:
 	hlt
 	ret
+
+ArchRelaxCpu:
+	pause
+	ret
+
+; An interrupt can't happen in between the sti and the hlt, so if there's one
+; pending it will always wake us up.
+x86EnableInterruptsAndHalt:
+	sti
+	hlt
+	ret
@@ -0,0 +1,100 @@
+
+;
+; x86/asm/smp.s - Application Processor Startup
+;
+; Provides the code the other CPUs start running when they are woken up. They
+; start in 16-bit real mode, so this gets copied to a page in conventional
+; memory, and the parameters at the end get filled in for each CPU before it is
+; started. It can't refer to itself by absolute address, as it doesn't run
+; where it was linked.
+;
+
+global x86ApTrampolineStart
+global x86ApTrampolineProtectedMode
+global x86ApTrampolineGdt
+global x86ApTrampolineGdtBase
+global x86ApTrampolineJump
+global x86ApTrampolineCr3
+global x86ApTrampolineStack
+global x86ApTrampolineCpuIndex
+global x86ApTrampolineEntry
+global x86ApTrampolineEnd
+
+section .text
+[bits 16]
+x86ApTrampolineStart:
+	cli
+	cld
+
+	; We get started at offset 0 of our page, so CS tells us where we are. Keep
+	; the linear address in EBX for when we're in protected mode.
+	mov ax, cs
+	mov ds, ax
+	xor ebx, ebx
+	mov bx, ax
+	shl ebx, 4
+
+	lgdt [x86ApTrampolineGdtr - x86ApTrampolineStart]
+
+	mov eax, cr0
+	or eax, 1
+	mov cr0, eax
+
+	; The jump target was filled in with where x86ApTrampolineProtectedMode got
+	; copied to.
+	o32 jmp far [x86ApTrampolineJump - x86ApTrampolineStart]
+
+[bits 32]
+x86ApTrampolineProtectedMode:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	xor ax, ax
+	mov fs, ax
+	mov gs, ax
+
+	; The bootstrap CPU has identity mapped conventional memory for us, so we
+	; keep running from here once paging is on.
+	mov eax, [ebx + x86ApTrampolineCr3 - x86ApTrampolineStart]
+	mov cr3, eax
+
+	mov eax, cr0
+	or eax, (1 << 31)
+	or eax, (1 << 16)		; enforce read-only pages in ring 0
+	mov cr0, eax
+
+	; Same as the bootstrap CPU, we store the CPU number in DR3.
+	mov eax, [ebx + x86ApTrampolineCpuIndex - x86ApTrampolineStart]
+	mov dr3, eax
+
+	mov esp, [ebx + x86ApTrampolineStack - x86ApTrampolineStart]
+	mov eax, [ebx + x86ApTrampolineEntry - x86ApTrampolineStart]
+	jmp eax
+
+; A temporary GDT with flat kernel code and data segments, until the CPU loads
+; its own one.
+x86ApTrampolineGdt:
+	dq 0
+	dq 0x00CF9A000000FFFF
+	dq 0x00CF92000000FFFF
+
+x86ApTrampolineGdtr:
+	dw 3 * 8 - 1
+x86ApTrampolineGdtBase:
+	dd 0
+
+x86ApTrampolineJump:
+	dd 0
+	dw 0x08
+
+x86ApTrampolineCr3:
+	dd 0
+x86ApTrampolineStack:
+	dd 0
+x86ApTrampolineCpuIndex:
+	dd 0
+x86ApTrampolineEntry:
+	dd 0
+
+x86ApTrampolineEnd:
@@ -8,6 +8,9 @@
 
 global ArchSpinlockAcquire
 global ArchSpinlockRelease
+global ArchSpinlockTryAcquire
+global ArchCompareAndSwap
+global ArchFetchAndAdd
 
 ArchSpinlockAcquire:
 	mov eax, [esp + 4]
@@ -28,3 +31,31 @@ ArchSpinlockRelease:
 	mov eax, [esp + 4]
 	lock btr dword [eax], 0
 	ret
+
+
+ArchSpinlockTryAcquire:
+	mov ecx, [esp + 4]
+	xor eax, eax
+	lock bts dword [ecx], 0
+	setnc al
+	ret
+
+
+; The ticket lock is built on CMPXCHG and XADD, which are both i486 
+; instructions. That's fine, as the i486 is the oldest CPU that we support (see
+; the README).
+ArchCompareAndSwap:
+	mov ecx, [esp + 4]
+	mov eax, [esp + 8]
+	mov edx, [esp + 12]
+	lock cmpxchg dword [ecx], edx
+	sete al
+	movzx eax, al
+	ret
+
+
+ArchFetchAndAdd:
+	mov ecx, [esp + 4]
+	mov eax, [esp + 8]
+	lock xadd dword [ecx], eax
+	ret
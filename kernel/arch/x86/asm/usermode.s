@@ -25,6 +25,9 @@ ArchSwitchToUsermode:
     mov ds, ax
     mov es, ax
     mov fs, ax
+
+    ; GS is the thread-local storage segment
+    mov ax, 0x33
     mov gs, ax
 
     push 0x23            ; Usermode stack segment
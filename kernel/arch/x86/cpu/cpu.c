@@ -10,6 +10,8 @@
 #include <machine/portio.h>
 #include <machine/interrupt.h>
 #include <machine/cmos.h>
+#include <machine/smp.h>
+#include <machine/apic.h>
 #include <errno.h>
 #include <driver.h>
 
@@ -27,8 +29,63 @@ void ArchInitBootstrapCpu(struct cpu*) {
     InitCmos();
 }
 
-bool ArchInitNextCpu(struct cpu*) {
-    return false;
+bool ArchInitNextCpu(struct cpu* cpu) {
+    return x86StartNextCpu(cpu);
+}
+
+/*
+ * The 386 and early 486s don't have CPUID, which we can tell as they don't let
+ * the ID flag be changed.
+ */
+static bool x86HasCpuid(void) {
+    size_t before, after;
+    asm volatile (
+        "pushf; pop %0; mov %0, %1; xor $0x200000, %1; push %1; popf; pushf; pop %1; push %0; popf" 
+        : "=&r"(before), "=&r"(after) :: "cc"
+    );
+    return ((before ^ after) & 0x200000) != 0;
+}
+
+static void x86Cpuid(uint32_t leaf, uint32_t* eax, uint32_t* edx) {
+    uint32_t ebx, ecx;
+    asm volatile ("cpuid" : "=a"(*eax), "=b"(ebx), "=c"(ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+bool ArchHasUsableTimestamp(void) {
+    if (!x86HasCpuid()) {
+        return false;
+    }
+
+    uint32_t max_leaf, edx;
+    x86Cpuid(0, &max_leaf, &edx);
+    if (max_leaf < 1) {
+        return false;
+    }
+
+    x86Cpuid(1, &max_leaf, &edx);
+    return (edx & (1 << 4)) != 0;
+}
+
+/*
+ * The bootstrap CPU uses the PIT, which also keeps the system time, and the
+ * others use their local APIC timer.
+ */
+void ArchIdleWithOneShotTimer(uint64_t nanos) {
+    if (ArchGetCurrentCpuIndex() == 0) {
+        if (StartPitOneShot(nanos)) {
+            x86EnableInterruptsAndHalt();
+            ArchDisableInterrupts();
+            StopPitOneShot();
+            ArchEnableInterrupts();
+        } else {
+            x86EnableInterruptsAndHalt();
+        }
+
+    } else {
+        StartLapicOneShot(nanos);
+        x86EnableInterruptsAndHalt();
+        StartLapicTimer();
+    }
 }
 
 static void x86Reboot(void) {
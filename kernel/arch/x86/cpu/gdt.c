@@ -26,6 +26,7 @@ void x86InitGdt(void)
 	cpu_data->gdt[2] = CreateGdtEntry(0, 0xFFFFFFFF, 0x92, 0xC); // kernel data
 	cpu_data->gdt[3] = CreateGdtEntry(0, 0xFFFFFFFF, 0xFA, 0xC); // user code
 	cpu_data->gdt[4] = CreateGdtEntry(0, 0xFFFFFFFF, 0xF2, 0xC); // user data
+	cpu_data->gdt[6] = CreateGdtEntry(0, 0xFFFFFFFF, 0xF2, 0xC); // user thread-local storage (GS)
 
 	cpu_data->gdtr.size = sizeof(cpu_data->gdt) - 1;
 	cpu_data->gdtr.location = (size_t) &cpu_data->gdt;
@@ -41,4 +42,14 @@ uint16_t x86AddTssToGdt(struct tss* tss)
 	platform_cpu_data_t* cpu_data = GetCpu()->platform_specific;
 	cpu_data->gdt[5] = CreateGdtEntry((size_t) tss, sizeof(struct tss), 0x89, 0x0);
 	return 5 * 0x8;
+}
+
+/*
+ * Moves the user thread-local storage segment. GS only picks up the new base
+ * when it is reloaded, which happens on the way back to usermode.
+ */
+void ArchSetUserTls(size_t base)
+{
+	platform_cpu_data_t* cpu_data = GetCpu()->platform_specific;
+	cpu_data->gdt[6] = CreateGdtEntry(base, 0xFFFFFFFF, 0xF2, 0xC);
 }
\ No newline at end of file
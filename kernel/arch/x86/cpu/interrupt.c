@@ -2,9 +2,11 @@
 #include <machine/regs.h>
 #include <machine/interrupt.h>
 #include <machine/pic.h>
+#include <machine/apic.h>
 #include <log.h> 
 #include <irq.h>
 #include <irql.h>
+#include <cpu.h>
 #include <virtual.h>
 #include <syscall.h>
 #include <panic.h>
@@ -18,6 +20,17 @@
 #define ISR_DIV_ERR     0
 
 static bool ready_for_irqs = false;
+static bool using_apic = false;
+
+/*
+ * Raising and lowering the IRQL doesn't touch the interrupt controller - it
+ * only changes `irql` in the CPU struct. Instead, if an ISA IRQ arrives while
+ * the IRQL is at or above the one it needs, its line gets masked, and it's 
+ * marked in `deferred_irqs` and replayed once the IRQL drops low enough. The
+ * line gets unmasked again when it's replayed. As only one CPU receives the 
+ * ISA IRQs, the mask doesn't need a lock.
+ */
+static uint16_t masked_irqs = 0;
 
 static int GetRequiredIrql(int irq_num) {
     if (irq_num == PIC_IRQ_BASE + 0) {
@@ -27,11 +40,78 @@ static int GetRequiredIrql(int irq_num) {
     }
 }
 
+static void DisableIrqLines(uint16_t mask) {
+    if (!using_apic) {
+        DisablePicLines(mask);
+
+    } else if (ArchGetCurrentCpuIndex() == 0) {
+        /*
+         * The I/O APIC only sends IRQs to the bootstrap CPU, so the other CPUs
+         * have nothing to mask. They still need to take the same spinlocks as
+         * the IRQ handlers do.
+         */
+        DisableIoApicLines(mask);
+    }
+}
+
+/*
+ * Called with interrupts off, from the interrupt handler.
+ */
+static void DeferIrq(int irq) {
+    platform_cpu_data_t* cpu_data = GetCpu()->platform_specific;
+    cpu_data->deferred_irqs |= 1 << irq;
+    masked_irqs |= 1 << irq;
+    DisableIrqLines(masked_irqs);
+    ArchSendEoi(PIC_IRQ_BASE + irq);
+}
+
+/*
+ * Runs any deferred IRQs that the IRQL is now low enough for, the most
+ * important first. Interrupts must be off, and are left on.
+ */
+static void ReplayDeferredIrqs(int irql) {
+    platform_cpu_data_t* cpu_data = GetCpu()->platform_specific;
+
+    while (cpu_data->deferred_irqs != 0) {
+        int irq = 31 - __builtin_clz(cpu_data->deferred_irqs);
+        int required_irql = GetRequiredIrql(PIC_IRQ_BASE + irq);
+        if (required_irql <= irql) {
+            break;
+        }
+
+        cpu_data->deferred_irqs &= ~(1 << irq);
+        masked_irqs &= ~(1 << irq);
+        DisableIrqLines(masked_irqs);
+
+        /*
+         * This raises and lowers the IRQL, which turns interrupts on, and
+         * replays anything that arrives in the meantime.
+         */
+        ReplayIrq(PIC_IRQ_BASE + irq, required_irql);
+        ArchDisableInterrupts();
+    }
+
+    ArchEnableInterrupts();
+}
+
 void x86HandleInterrupt(struct x86_regs* r) {
     int num = r->int_no;
 
     if (num >= PIC_IRQ_BASE && num < PIC_IRQ_BASE + 16) {
-        RespondToIrq(num, GetRequiredIrql(num), r);
+        int required_irql = GetRequiredIrql(num);
+        if (required_irql <= GetIrql()) {
+            DeferIrq(num - PIC_IRQ_BASE);
+        } else {
+            RespondToIrq(num, required_irql, r);
+        }
+
+    } else if (num == APIC_TIMER_VECTOR || num == APIC_IPI_RESCHEDULE_VECTOR || num == APIC_IPI_TLB_VECTOR) {
+        RespondToIrq(num, IRQL_TIMER, r);
+
+    } else if (num == APIC_SPURIOUS_VECTOR) {
+        /*
+         * Spurious local APIC interrupts don't get an EOI.
+         */
 
     } else if (num == ISR_PAGE_FAULT) {
         extern size_t x86GetCr2();
@@ -74,7 +154,11 @@ void x86HandleInterrupt(struct x86_regs* r) {
 }
 
 void ArchSendEoi(int irq_num) {
-    SendPicEoi(irq_num);
+    if (using_apic) {
+        SendLapicEoi();
+    } else {
+        SendPicEoi(irq_num);
+    }
 }
 
 void ArchSetIrql(int irql) {
@@ -84,26 +168,13 @@ void ArchSetIrql(int irql) {
          */
         return;
     }
-    
-    if (irql >= IRQL_DRIVER) {
-        int irq_num = irql - IRQL_DRIVER;
-
-        /*
-         * We want to disable all higher IRQs (as the PIC puts the lowest 
-         * priority interrupts at high numbers), as well as our self. Allow IRQ2
-         * to stay enabled as it is used internally.
-         */
-        uint16_t mask = (0xFFFF ^ ((1 << irq_num) - 1)) & ~(1 << 2);
-        DisablePicLines(mask);
-
-    } else {
-        /*
-         * Allow everything to go through.
-         */
-         DisablePicLines(0x0000);
-    }
 
-    ArchEnableInterrupts();
+    /*
+     * No masking happens here - x86HandleInterrupt() holds back any IRQs that
+     * arrive too early. We just need to catch up on the ones it held back.
+     */
+    ArchDisableInterrupts();
+    ReplayDeferredIrqs(irql);
 }
 
 bool x86IsReadyForIrqs(void) {
@@ -115,6 +186,21 @@ void x86MakeReadyForIrqs(void) {
     RaiseIrql(GetIrql());
 }
 
+bool x86IsUsingApic(void) {
+    return using_apic;
+}
+
+/*
+ * Stops using the PIC, and starts receiving IRQs through the local APIC and the
+ * I/O APIC, which must already be set up. Interrupts must be disabled.
+ */
+void x86SwitchToApic(void) {
+    DisablePicLines(0xFFFF);
+    using_apic = true;
+    DisableIrqLines(masked_irqs);
+    RaiseIrql(GetIrql());
+}
+
 #undef ArchDisableInterrupts
 void ArchDisableInterrupts(void) {
     asm volatile("cli");
@@ -125,6 +211,16 @@ void ArchEnableInterrupts(void) {
     asm volatile("sti");
 }
 
+size_t ArchSaveAndDisableInterrupts(void) {
+    size_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+void ArchRestoreInterrupts(size_t state) {
+    asm volatile ("push %0; popf" :: "r"(state) : "memory", "cc");
+}
+
 #undef ArchGetCurrentCpuIndex
 int ArchGetCurrentCpuIndex(void) {
     unsigned long val;
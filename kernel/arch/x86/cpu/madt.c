@@ -0,0 +1,228 @@
+
+/*
+ * x86/cpu/madt.c - ACPI Multiple APIC Description Table
+ *
+ * Finds the local APICs (i.e. the CPUs) and the I/O APIC in the system. We need
+ * this long before the ACPICA driver gets loaded, so we find and parse the
+ * tables ourselves. Only the RSDT is used, as we can't reach anything the XSDT
+ * could point to that the RSDT can't.
+ */
+
+#include <machine/apic.h>
+#include <virtual.h>
+#include <string.h>
+#include <log.h>
+
+#define MADT_TYPE_LAPIC             0
+#define MADT_TYPE_IOAPIC            1
+#define MADT_TYPE_OVERRIDE          2
+
+#define MADT_LAPIC_ENABLED          1
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+
+} __attribute__((packed));
+
+struct madt_header {
+    struct acpi_sdt_header sdt;
+    uint32_t lapic_address;
+    uint32_t flags;
+
+} __attribute__((packed));
+
+struct madt_entry_header {
+    uint8_t type;
+    uint8_t length;
+
+} __attribute__((packed));
+
+struct madt_lapic {
+    struct madt_entry_header header;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry_header header;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+
+} __attribute__((packed));
+
+struct madt_override {
+    struct madt_entry_header header;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+
+} __attribute__((packed));
+
+static bool IsChecksumValid(uint8_t* table, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; ++i) {
+        sum += table[i];
+    }
+    return sum == 0;
+}
+
+/*
+ * The BIOS areas that might contain the RSDP are in the first 1MB, which is
+ * always mapped in.
+ */
+static struct acpi_rsdp* SearchForRsdp(size_t start, size_t end) {
+    for (size_t addr = start; addr < end; addr += 16) {
+        struct acpi_rsdp* rsdp = (struct acpi_rsdp*) (0xC0000000 + addr);
+        if (!memcmp(rsdp->signature, "RSD PTR ", 8) && IsChecksumValid((uint8_t*) rsdp, sizeof(struct acpi_rsdp))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+static struct acpi_rsdp* FindRsdp(void) {
+    size_t ebda = ((size_t) *((uint16_t*) (0xC0000000 + 0x40E))) << 4;
+    struct acpi_rsdp* rsdp = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        rsdp = SearchForRsdp(ebda, ebda + 1024);
+    }
+    if (rsdp == NULL) {
+        rsdp = SearchForRsdp(0xE0000, 0x100000);
+    }
+    return rsdp;
+}
+
+/*
+ * Tables can be anywhere in physical memory, so they need to be mapped in
+ * before we can read them. We don't know how big a table is until we've mapped
+ * its header, so it might need to be done twice.
+ */
+static struct acpi_sdt_header* MapTable(size_t physical, size_t* mapped_size) {
+    size_t offset = physical & (ARCH_PAGE_SIZE - 1);
+    size_t base = physical - offset;
+    size_t size = offset + sizeof(struct acpi_sdt_header);
+    size_t virt = MapVirt(base, 0, size, VM_READ | VM_LOCK | VM_MAP_HARDWARE, NULL, 0);
+    struct acpi_sdt_header* table = (struct acpi_sdt_header*) (virt + offset);
+
+    if (table->length > sizeof(struct acpi_sdt_header)) {
+        UnmapVirt(virt, size);
+        size = offset + table->length;
+        virt = MapVirt(base, 0, size, VM_READ | VM_LOCK | VM_MAP_HARDWARE, NULL, 0);
+        table = (struct acpi_sdt_header*) (virt + offset);
+    }
+
+    *mapped_size = size;
+    return table;
+}
+
+static void UnmapTable(struct acpi_sdt_header* table, size_t mapped_size) {
+    UnmapVirt(((size_t) table) & ~(ARCH_PAGE_SIZE - 1), mapped_size);
+}
+
+static void ParseMadt(struct madt_header* header, struct x86_madt* madt) {
+    madt->lapic_address = header->lapic_address;
+
+    size_t offset = sizeof(struct madt_header);
+    while (offset + sizeof(struct madt_entry_header) <= header->sdt.length) {
+        struct madt_entry_header* entry = (struct madt_entry_header*) (((size_t) header) + offset);
+        if (entry->length < sizeof(struct madt_entry_header)) {
+            break;
+        }
+
+        if (entry->type == MADT_TYPE_LAPIC) {
+            struct madt_lapic* lapic = (struct madt_lapic*) entry;
+            if ((lapic->flags & MADT_LAPIC_ENABLED) && madt->num_cpus < ARCH_MAX_CPU_ALLOWED) {
+                madt->lapic_ids[madt->num_cpus++] = lapic->apic_id;
+            }
+
+        } else if (entry->type == MADT_TYPE_IOAPIC) {
+            /*
+             * The ISA IRQs will be on the one that starts from zero.
+             */
+            struct madt_ioapic* ioapic = (struct madt_ioapic*) entry;
+            if (madt->ioapic_address == 0 || ioapic->gsi_base == 0) {
+                madt->ioapic_address = ioapic->address;
+                madt->ioapic_gsi_base = ioapic->gsi_base;
+            }
+
+        } else if (entry->type == MADT_TYPE_OVERRIDE) {
+            struct madt_override* override = (struct madt_override*) entry;
+            if (override->bus == 0 && override->source < 16) {
+                madt->isa_irq_gsi[override->source] = override->gsi;
+                madt->isa_irq_flags[override->source] = override->flags;
+            }
+        }
+
+        offset += entry->length;
+    }
+}
+
+/**
+ * Finds and reads the MADT.
+ *
+ * @param madt Filled in with the CPUs and the I/O APIC found in the system.
+ * @return True if there is a usable local APIC and I/O APIC, or false if we
+ *         must continue using the PIC (and only one CPU).
+ */
+bool x86ReadMadt(struct x86_madt* madt) {
+    inline_memset(madt, 0, sizeof(struct x86_madt));
+    for (int i = 0; i < 16; ++i) {
+        madt->isa_irq_gsi[i] = i;
+    }
+
+    struct acpi_rsdp* rsdp = FindRsdp();
+    if (rsdp == NULL) {
+        LogWriteSerial("x86ReadMadt: no RSDP\n");
+        return false;
+    }
+
+    size_t rsdt_size;
+    struct acpi_sdt_header* rsdt = MapTable(rsdp->rsdt_address, &rsdt_size);
+    if (memcmp(rsdt->signature, "RSDT", 4) || !IsChecksumValid((uint8_t*) rsdt, rsdt->length)) {
+        LogWriteSerial("x86ReadMadt: bad RSDT\n");
+        UnmapTable(rsdt, rsdt_size);
+        return false;
+    }
+
+    bool found = false;
+    int num_tables = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
+    for (int i = 0; i < num_tables && !found; ++i) {
+        uint32_t table_address;
+        inline_memcpy(&table_address, ((uint8_t*) (rsdt + 1)) + i * 4, 4);
+
+        size_t table_size;
+        struct acpi_sdt_header* table = MapTable(table_address, &table_size);
+        if (!memcmp(table->signature, "APIC", 4) && IsChecksumValid((uint8_t*) table, table->length)) {
+            ParseMadt((struct madt_header*) table, madt);
+            found = true;
+        }
+        UnmapTable(table, table_size);
+    }
+
+    UnmapTable(rsdt, rsdt_size);
+
+    LogWriteSerial("x86ReadMadt: found %d CPUs, LAPIC at 0x%X, I/O APIC at 0x%X\n", madt->num_cpus, madt->lapic_address, madt->ioapic_address);
+    return found && madt->num_cpus > 0 && madt->lapic_address != 0 && madt->ioapic_address != 0;
+}
@@ -0,0 +1,251 @@
+
+/*
+ * x86/cpu/smp.c - Multiprocessor Support
+ *
+ * Switches from the PIC over to the local APICs and the I/O APIC, starts up the
+ * other CPUs listed in the MADT, and sends the inter-processor interrupts that
+ * the scheduler and virtual memory manager need. If there's no MADT, we keep
+ * using the PIC and only the bootstrap CPU.
+ */
+
+#include <machine/apic.h>
+#include <machine/smp.h>
+#include <machine/gdt.h>
+#include <machine/idt.h>
+#include <machine/tss.h>
+#include <machine/interrupt.h>
+#include <machine/virtual.h>
+#include <physical.h>
+#include <virtual.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <irql.h>
+#include <irq.h>
+#include <cpu.h>
+#include <log.h>
+
+#define AP_STACK_SIZE       (16 * 1024)
+
+#define ICR_INIT            0x4500
+#define ICR_STARTUP         0x4600
+
+extern uint8_t x86ApTrampolineStart;
+extern uint8_t x86ApTrampolineProtectedMode;
+extern uint8_t x86ApTrampolineGdt;
+extern uint8_t x86ApTrampolineGdtBase;
+extern uint8_t x86ApTrampolineJump;
+extern uint8_t x86ApTrampolineCr3;
+extern uint8_t x86ApTrampolineStack;
+extern uint8_t x86ApTrampolineCpuIndex;
+extern uint8_t x86ApTrampolineEntry;
+extern uint8_t x86ApTrampolineEnd;
+
+static struct x86_madt madt;
+static bool smp_initialised = false;
+static bool more_cpus_to_start = false;
+static int next_madt_cpu = 0;
+
+static size_t trampoline_phys = 0;
+static int lapic_ids[ARCH_MAX_CPU_ALLOWED];
+static volatile bool cpu_started;
+
+static struct spinlock tlb_shootdown_lock;
+static volatile bool tlb_flush_pending[ARCH_MAX_CPU_ALLOWED];
+
+/*
+ * The other CPUs jump here from the trampoline, already on their own stack,
+ * with paging on and with DR3 set, so GetCpu() works. Never returns.
+ */
+static void ApMain(void) {
+    x86InitGdt();
+    x86InitIdt();
+    x86InitTss();
+    SetVas(GetKernelVas());
+    InitIrql();
+    InitLapic();
+    StartLapicTimer();
+    x86MakeReadyForIrqs();
+
+    LogWriteSerial("CPU %d (LAPIC %d) has started\n", ArchGetCurrentCpuIndex(), GetLapicId());
+    cpu_started = true;
+
+    StartMultitaskingOnOtherCpu();
+}
+
+static void SetTrampolineParameter(uint8_t* symbol, size_t value) {
+    size_t offset = (size_t) symbol - (size_t) &x86ApTrampolineStart;
+    inline_memcpy((void*) (0xC0000000 + trampoline_phys + offset), &value, sizeof(size_t));
+}
+
+static size_t GetTrampolineAddress(uint8_t* symbol) {
+    return trampoline_phys + ((size_t) symbol - (size_t) &x86ApTrampolineStart);
+}
+
+/*
+ * Starts a CPU using the INIT-SIPI-SIPI sequence, and waits until it has done
+ * its initialisation.
+ */
+static bool StartCpu(struct cpu* cpu, int lapic_id) {
+    size_t stack = MapVirt(0, 0, AP_STACK_SIZE, VM_READ | VM_WRITE | VM_LOCK, NULL, 0);
+
+    SetTrampolineParameter(&x86ApTrampolineCr3, GetKernelVas()->arch_data->p_page_directory);
+    SetTrampolineParameter(&x86ApTrampolineStack, stack + AP_STACK_SIZE);
+    SetTrampolineParameter(&x86ApTrampolineCpuIndex, cpu->cpu_number);
+    SetTrampolineParameter(&x86ApTrampolineEntry, (size_t) ApMain);
+
+    lapic_ids[cpu->cpu_number] = lapic_id;
+    cpu_started = false;
+
+    SendIpi(lapic_id, ICR_INIT);
+    LapicDelayMicro(10000);
+
+    /*
+     * The second startup IPI is only needed if the first one gets lost. If the
+     * CPU did get the first one, it ignores the second one.
+     */
+    for (int attempt = 0; attempt < 2 && !cpu_started; ++attempt) {
+        SendIpi(lapic_id, ICR_STARTUP | (trampoline_phys / ARCH_PAGE_SIZE));
+        for (int i = 0; i < 1000 && !cpu_started; ++i) {
+            LapicDelayMicro(attempt == 0 ? 1 : 1000);
+        }
+    }
+
+    if (!cpu_started) {
+        LogWriteSerial("CPU with LAPIC %d didn't start\n", lapic_id);
+        UnmapVirt(stack, AP_STACK_SIZE);
+    }
+    return cpu_started;
+}
+
+static int HandleRescheduleIpi(platform_irq_context_t*) {
+    PostponeScheduleUntilStandardIrql();
+    return 0;
+}
+
+static int HandleTlbShootdownIpi(platform_irq_context_t*) {
+    asm volatile ("mov %%cr3, %%eax; mov %%eax, %%cr3" ::: "eax", "memory");
+    tlb_flush_pending[ArchGetCurrentCpuIndex()] = false;
+    return 0;
+}
+
+/*
+ * Moves interrupt handling over to the APICs and gets everything ready for
+ * starting the other CPUs. Returns false if we have to stick with the PIC.
+ */
+static bool InitSmp(void) {
+    if (!x86ReadMadt(&madt)) {
+        LogWriteSerial("no usable MADT, so only using the bootstrap CPU\n");
+        return false;
+    }
+
+    InitSpinlock(&tlb_shootdown_lock, "tlb shootdown", IRQL_SCHEDULER);
+    RegisterIrqHandler(APIC_IPI_RESCHEDULE_VECTOR, HandleRescheduleIpi);
+    RegisterIrqHandler(APIC_IPI_TLB_VECTOR, HandleTlbShootdownIpi);
+
+    MapLapic(madt.lapic_address);
+    lapic_ids[0] = GetLapicId();
+
+    ArchDisableInterrupts();
+    InitLapic();
+    InitIoApic(&madt, lapic_ids[0]);
+    x86SwitchToApic();
+
+    CalibrateLapicTimer();
+
+    trampoline_phys = AllocPhysContiguous(ARCH_PAGE_SIZE, 0x1000, 0xA0000, 0);
+    if (trampoline_phys == 0) {
+        LogWriteSerial("no conventional memory for the SMP trampoline\n");
+        return false;
+    }
+
+    size_t size = (size_t) &x86ApTrampolineEnd - (size_t) &x86ApTrampolineStart;
+    inline_memcpy((void*) (0xC0000000 + trampoline_phys), &x86ApTrampolineStart, size);
+    SetTrampolineParameter(&x86ApTrampolineGdtBase, GetTrampolineAddress(&x86ApTrampolineGdt));
+    SetTrampolineParameter(&x86ApTrampolineJump, GetTrampolineAddress(&x86ApTrampolineProtectedMode));
+
+    x86IdentityMapLowMemory(true);
+    return true;
+}
+
+static void FinishSmp(bool all_started) {
+    x86IdentityMapLowMemory(false);
+
+    /*
+     * If a CPU didn't respond, it might still wake up later, so leave its code
+     * there.
+     */
+    if (all_started) {
+        DeallocPhys(trampoline_phys);
+    }
+}
+
+/**
+ * Starts the next CPU listed in the MADT.
+ *
+ * @param cpu The CPU table entry that the new CPU should use.
+ * @return True if a CPU was started, or false if there are no more.
+ */
+bool x86StartNextCpu(struct cpu* cpu) {
+    if (!smp_initialised) {
+        smp_initialised = true;
+        more_cpus_to_start = InitSmp();
+    }
+
+    if (!more_cpus_to_start) {
+        return false;
+    }
+
+    while (next_madt_cpu < madt.num_cpus) {
+        int lapic_id = madt.lapic_ids[next_madt_cpu++];
+        if (lapic_id == lapic_ids[0]) {
+            continue;
+        }
+
+        if (StartCpu(cpu, lapic_id)) {
+            return true;
+        }
+
+        /*
+         * We can't go on, as its CPU table entry would get reused.
+         */
+        more_cpus_to_start = false;
+        FinishSmp(false);
+        return false;
+    }
+
+    more_cpus_to_start = false;
+    FinishSmp(true);
+    return false;
+}
+
+void ArchSendRescheduleIpi(int cpu) {
+    if (x86IsUsingApic()) {
+        SendIpi(lapic_ids[cpu], APIC_IPI_RESCHEDULE_VECTOR);
+    }
+}
+
+/**
+ * Makes every other CPU flush its TLB, and waits until they all have. Must be
+ * called at IRQL_SCHEDULER or below, so we can still receive shootdowns while
+ * we wait for our turn.
+ */
+void x86FlushTlbOnOtherCpus(void) {
+    if (GetCpuCount() == 1) {
+        return;
+    }
+
+    AcquireSpinlock(&tlb_shootdown_lock);
+    int this_cpu = ArchGetCurrentCpuIndex();
+    for (int i = 0; i < GetCpuCount(); ++i) {
+        if (i != this_cpu) {
+            tlb_flush_pending[i] = true;
+            SendIpi(lapic_ids[i], APIC_IPI_TLB_VECTOR);
+        }
+    }
+    for (int i = 0; i < GetCpuCount(); ++i) {
+        while (tlb_flush_pending[i]) {
+            ;
+        }
+    }
+    ReleaseSpinlock(&tlb_shootdown_lock);
+}
@@ -0,0 +1,113 @@
+
+/*
+ * x86/dev/ioapic.c - I/O APIC
+ *
+ * Takes over from the PIC when we are using the local APICs. The ISA IRQs are
+ * all sent to the bootstrap CPU, and keep the vectors they had on the PIC, so
+ * drivers don't need to know which one is in use.
+ */
+
+#include <machine/apic.h>
+#include <machine/pic.h>
+#include <virtual.h>
+
+#define IOAPIC_REG_SELECT           0
+#define IOAPIC_REG_WINDOW           4
+
+#define IOAPIC_VERSION              0x01
+#define IOAPIC_REDIRECTION_LOW(n)   (0x10 + (n) * 2)
+#define IOAPIC_REDIRECTION_HIGH(n)  (0x11 + (n) * 2)
+
+#define IOAPIC_ACTIVE_LOW           0x2000
+#define IOAPIC_LEVEL_TRIGGERED      0x8000
+#define IOAPIC_MASKED               0x10000
+
+/*
+ * The MPS INTI flags used by the MADT's interrupt source overrides.
+ */
+#define INTI_POLARITY_MASK          0x3
+#define INTI_POLARITY_LOW           0x3
+#define INTI_TRIGGER_MASK           0xC
+#define INTI_TRIGGER_LEVEL          0xC
+
+static volatile uint32_t* ioapic = NULL;
+
+/*
+ * Which redirection entry each ISA IRQ uses (or -1 if it isn't routed), and the
+ * low word of that entry, so it can be masked without reading it back.
+ */
+static int irq_redirection[16];
+static uint32_t irq_redirection_low[16];
+
+static uint32_t ReadIoApic(int reg) {
+    ioapic[IOAPIC_REG_SELECT] = reg;
+    return ioapic[IOAPIC_REG_WINDOW];
+}
+
+static void WriteIoApic(int reg, uint32_t value) {
+    ioapic[IOAPIC_REG_SELECT] = reg;
+    ioapic[IOAPIC_REG_WINDOW] = value;
+}
+
+/*
+ * Routes the ISA IRQs to a CPU. They all start out masked; DisableIoApicLines()
+ * gets called when the IRQL is next set, which unmasks them.
+ */
+void InitIoApic(struct x86_madt* madt, int destination_lapic_id) {
+    ioapic = (volatile uint32_t*) MapVirt(madt->ioapic_address, 0, ARCH_PAGE_SIZE, VM_READ | VM_WRITE | VM_LOCK | VM_MAP_HARDWARE, NULL, 0);
+
+    int num_redirections = ((ReadIoApic(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+    for (int i = 0; i < num_redirections; ++i) {
+        WriteIoApic(IOAPIC_REDIRECTION_LOW(i), IOAPIC_MASKED);
+    }
+
+    for (int irq = 0; irq < 16; ++irq) {
+        int entry = madt->isa_irq_gsi[irq] - madt->ioapic_gsi_base;
+        irq_redirection[irq] = -1;
+
+        /*
+         * IRQ 2 is the PIC's cascade, and doesn't exist here (the PIT's IRQ 0
+         * is usually overridden to take its place).
+         */
+        if (irq == 2 || entry < 0 || entry >= num_redirections) {
+            continue;
+        }
+
+        uint32_t low = (PIC_IRQ_BASE + irq) | IOAPIC_MASKED;
+        if ((madt->isa_irq_flags[irq] & INTI_POLARITY_MASK) == INTI_POLARITY_LOW) {
+            low |= IOAPIC_ACTIVE_LOW;
+        }
+        if ((madt->isa_irq_flags[irq] & INTI_TRIGGER_MASK) == INTI_TRIGGER_LEVEL) {
+            low |= IOAPIC_LEVEL_TRIGGERED;
+        }
+
+        irq_redirection[irq] = entry;
+        irq_redirection_low[irq] = low;
+        WriteIoApic(IOAPIC_REDIRECTION_HIGH(entry), ((uint32_t) destination_lapic_id) << 24);
+        WriteIoApic(IOAPIC_REDIRECTION_LOW(entry), low);
+    }
+}
+
+/**
+ * Set which ISA IRQs are disabled, in the same way as DisablePicLines(). Only
+ * the CPU that receives the IRQs should call this.
+ */
+void DisableIoApicLines(uint16_t disabled_irqs) {
+    static uint16_t prev = 0xFFFF;
+    uint16_t changed = prev ^ disabled_irqs;
+
+    for (int irq = 0; irq < 16; ++irq) {
+        if (!(changed & (1 << irq)) || irq_redirection[irq] == -1) {
+            continue;
+        }
+
+        if (disabled_irqs & (1 << irq)) {
+            irq_redirection_low[irq] |= IOAPIC_MASKED;
+        } else {
+            irq_redirection_low[irq] &= ~IOAPIC_MASKED;
+        }
+        WriteIoApic(IOAPIC_REDIRECTION_LOW(irq_redirection[irq]), irq_redirection_low[irq]);
+    }
+
+    prev = disabled_irqs;
+}
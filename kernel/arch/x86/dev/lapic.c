@@ -0,0 +1,176 @@
+
+/*
+ * x86/dev/lapic.c - Local APIC
+ *
+ * Each CPU has its own local APIC, which receives interrupts on its behalf and
+ * lets it send inter-processor interrupts (IPIs) to the other CPUs. They all
+ * live at the same physical address, and each CPU only ever sees its own. The
+ * bootstrap CPU keeps using the PIT as its timer, but the other CPUs use the
+ * local APIC timer, set to tick at the same rate (except when idle, when it is
+ * set to go off just once).
+ */
+
+#include <machine/apic.h>
+#include <virtual.h>
+#include <timer.h>
+#include <irq.h>
+#include <log.h>
+
+#define LAPIC_REG_ID                0x020
+#define LAPIC_REG_TPR               0x080
+#define LAPIC_REG_EOI               0x0B0
+#define LAPIC_REG_SVR               0x0F0
+#define LAPIC_REG_ICR_LOW           0x300
+#define LAPIC_REG_ICR_HIGH          0x310
+#define LAPIC_REG_LVT_TIMER         0x320
+#define LAPIC_REG_LVT_LINT0         0x350
+#define LAPIC_REG_TIMER_INITIAL     0x380
+#define LAPIC_REG_TIMER_CURRENT     0x390
+#define LAPIC_REG_TIMER_DIVIDE      0x3E0
+
+#define LAPIC_SVR_ENABLE            0x100
+#define LAPIC_LVT_MASKED            0x10000
+#define LAPIC_TIMER_PERIODIC        0x20000
+#define LAPIC_TIMER_DIVIDE_BY_16    0x3
+#define LAPIC_ICR_PENDING           0x1000
+
+/*
+ * How long to measure the local APIC timer for, and how often it should go off
+ * (the same as the PIT).
+ */
+#define CALIBRATION_NS              (100ULL * 1000 * 1000)
+#define LAPIC_TIMER_PERIOD_NS       (20ULL * 1000 * 1000)
+
+static volatile uint32_t* lapic = NULL;
+
+static uint32_t ticks_per_period;
+static uint64_t period_nanos;
+static uint32_t ticks_per_milli;
+
+static uint32_t ReadLapic(int reg) {
+    return lapic[reg / 4];
+}
+
+static void WriteLapic(int reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+void MapLapic(size_t physical) {
+    lapic = (volatile uint32_t*) MapVirt(physical, 0, ARCH_PAGE_SIZE, VM_READ | VM_WRITE | VM_LOCK | VM_MAP_HARDWARE, NULL, 0);
+}
+
+/*
+ * Enables the local APIC of the current CPU. The PIC is not used when the local
+ * APICs are, so its connection (LINT0) is masked.
+ */
+void InitLapic(void) {
+    WriteLapic(LAPIC_REG_TPR, 0);
+    WriteLapic(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    WriteLapic(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+int GetLapicId(void) {
+    return ReadLapic(LAPIC_REG_ID) >> 24;
+}
+
+void SendLapicEoi(void) {
+    WriteLapic(LAPIC_REG_EOI, 0);
+}
+
+/**
+ * Sends an inter-processor interrupt.
+ *
+ * @param lapic_id The local APIC ID of the CPU to send it to.
+ * @param command The low word of the interrupt command register, e.g. the
+ *                vector number for a normal IPI.
+ */
+void SendIpi(int lapic_id, uint32_t command) {
+    /*
+     * The two halves of the command register must be written without anyone
+     * else on this CPU sending an IPI in between.
+     */
+    size_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+    while (ReadLapic(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        ;
+    }
+    WriteLapic(LAPIC_REG_ICR_HIGH, ((uint32_t) lapic_id) << 24);
+    WriteLapic(LAPIC_REG_ICR_LOW, command);
+
+    asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+static int HandleLapicTimer(platform_irq_context_t*) {
+    ReceivedTimer(period_nanos);
+    return 0;
+}
+
+/*
+ * Works out how fast the local APIC timer runs by timing it against the system
+ * time. Must be called on the bootstrap CPU, with interrupts enabled.
+ */
+void CalibrateLapicTimer(void) {
+    WriteLapic(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    WriteLapic(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+
+    /*
+     * If there's no timestamp counter, the system time only changes when the
+     * PIT ticks, so start counting right as it does.
+     */
+    uint64_t time = GetSystemTimer();
+    while (GetSystemTimer() == time) {
+        ;
+    }
+    uint64_t start_time = GetSystemTimer();
+    WriteLapic(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+
+    while (GetSystemTimer() - start_time < CALIBRATION_NS) {
+        ;
+    }
+
+    uint32_t ticks = 0xFFFFFFFF - ReadLapic(LAPIC_REG_TIMER_CURRENT);
+    uint64_t elapsed = GetSystemTimer() - start_time;
+    WriteLapic(LAPIC_REG_TIMER_INITIAL, 0);
+
+    ticks_per_milli = ((uint64_t) ticks) * 1000000ULL / elapsed;
+    ticks_per_period = ((uint64_t) ticks) * LAPIC_TIMER_PERIOD_NS / elapsed;
+    period_nanos = LAPIC_TIMER_PERIOD_NS;
+
+    RegisterIrqHandler(APIC_TIMER_VECTOR, HandleLapicTimer);
+    LogWriteSerial("local APIC timer: %d ticks per ms\n", ticks_per_milli);
+}
+
+/*
+ * Starts the periodic timer on the current CPU. CalibrateLapicTimer() must have
+ * been called first.
+ */
+void StartLapicTimer(void) {
+    WriteLapic(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    WriteLapic(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    WriteLapic(LAPIC_REG_TIMER_INITIAL, ticks_per_period);
+}
+
+/*
+ * Replaces the periodic timer with a single interrupt after `nanos` nanoseconds
+ * (or as long as the timer can count). StartLapicTimer() goes back to the
+ * periodic timer.
+ */
+void StartLapicOneShot(uint64_t nanos) {
+    uint64_t ticks = nanos * ticks_per_milli / 1000000ULL;
+    WriteLapic(LAPIC_REG_LVT_TIMER, APIC_TIMER_VECTOR);
+    WriteLapic(LAPIC_REG_TIMER_INITIAL, ticks == 0 ? 1 : (ticks > 0xFFFFFFFFULL ? 0xFFFFFFFF : ticks));
+}
+
+/*
+ * Busy waits using the local APIC timer. Only usable on a CPU that isn't using
+ * it as its periodic timer (i.e. the bootstrap CPU).
+ */
+void LapicDelayMicro(uint32_t micros) {
+    uint32_t ticks = ((uint64_t) ticks_per_milli) * micros / 1000;
+    WriteLapic(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    WriteLapic(LAPIC_REG_TIMER_INITIAL, ticks == 0 ? 1 : ticks);
+    while (ReadLapic(LAPIC_REG_TIMER_CURRENT) != 0) {
+        ;
+    }
+}
@@ -8,6 +8,7 @@
 #define PIC2_DATA       0xA1
 
 #define PIC_EOI         0x20
+#define PIC_REG_IRR     0x0A
 #define PIC_REG_ISR     0x0B
 
 #define ICW1_ICW4       0x01
@@ -49,6 +50,14 @@ bool IsPicIrqSpurious(int irq_num) {
     return false;
 }
 
+/*
+ * Whether an IRQ has been raised but not yet sent to the CPU (e.g. because
+ * interrupts are disabled).
+ */
+bool IsPicIrqPending(int irq_num) {
+    return (ReadPicReg(PIC_REG_IRR) & (1 << (irq_num - PIC_IRQ_BASE))) != 0;
+}
+
 void SendPicEoi(int irq_num) {
     if (irq_num >= PIC_IRQ_BASE + 8) {
         outb(PIC2_COMMAND, PIC_EOI);
@@ -7,19 +7,122 @@
 #include <timer.h>
 #include <irq.h>
 
+#define PIT_FREQUENCY           1193182ULL
+
+/*
+ * The periodic timer uses mode 2 (rate generator) rather than a square wave, 
+ * so that a latched count is just how many counts are left in the period.
+ */
+#define PIT_CHANNEL0_PERIODIC   0x34
+#define PIT_CHANNEL0_ONE_SHOT   0x30
+#define PIT_CHANNEL0_LATCH      0x00
+#define PIT_READ_BACK_STATUS    0xE2
+#define PIT_STATUS_OUTPUT       0x80
+
+static int pit_divisor = 0;
 static uint64_t pit_nanos = 0;
 
+/*
+ * How many counts the one-shot timer is set to, or 0 if the timer is periodic.
+ * The IRQ handler puts the timer back into periodic mode after the one-shot
+ * goes off, as switching modes before then could cause an extra IRQ.
+ */
+static uint16_t one_shot_count = 0;
+
+/*
+ * The part of the last period that had already gone by when the one-shot was
+ * started. It gets reported along with the one-shot, as ReceivedTimer() can 
+ * only be called from the IRQ handler.
+ */
+static uint16_t carried_count = 0;
+
+static uint64_t CountsToNanos(uint64_t counts) {
+    return counts * 1000000000ULL / PIT_FREQUENCY;
+}
+
+static void WriteCount(uint16_t count) {
+	outb(0x40, count & 0xFF);
+	outb(0x40, count >> 8);
+}
+
 static int HandlePit(struct x86_regs*) {
-    ReceivedTimer(pit_nanos);
+    if (one_shot_count != 0) {
+        outb(0x43, PIT_CHANNEL0_PERIODIC);
+        WriteCount(pit_divisor);
+        ReceivedTimer(CountsToNanos((uint32_t) one_shot_count + carried_count));
+        one_shot_count = 0;
+        carried_count = 0;
+    } else {
+        ReceivedTimer(pit_nanos);
+    }
     return 0;
 }
 
 void InitPit(int hertz) { 
-	int divisor = 1193180 / hertz;
-	outb(0x43, 0x36);
-	outb(0x40, divisor & 0xFF);
-	outb(0x40, divisor >> 8);
+	pit_divisor = PIT_FREQUENCY / hertz;
+	outb(0x43, PIT_CHANNEL0_PERIODIC);
+	WriteCount(pit_divisor);
 
-    pit_nanos = 1000000000ULL / hertz;
+    pit_nanos = CountsToNanos(pit_divisor);
     RegisterIrqHandler(PIC_IRQ_BASE + 0, HandlePit);
 }
+
+static uint16_t ReadCount(void) {
+    outb(0x43, PIT_CHANNEL0_LATCH);
+    uint16_t count = inb(0x40);
+    count |= ((uint16_t) inb(0x40)) << 8;
+    return count;
+}
+
+/*
+ * Stops the periodic interrupt, and instead interrupts once after `nanos`
+ * nanoseconds (or as long as the PIT can count, which is about 55ms). Returns
+ * false if the last one-shot interrupt hasn't happened yet, or a periodic one 
+ * is waiting to be handled. Must be called with interrupts disabled.
+ */
+bool StartPitOneShot(uint64_t nanos) {
+    if (one_shot_count != 0) {
+        return false;
+    }
+
+    /*
+     * The count has to be read before checking for a waiting IRQ, as if the 
+     * period ends in between, the IRQ will account for it instead.
+     */
+    uint16_t remaining = ReadCount();
+    if (IsPicIrqPending(PIC_IRQ_BASE + 0)) {
+        return false;
+    }
+    carried_count = pit_divisor - MIN(remaining, pit_divisor);
+
+    uint64_t counts = nanos * PIT_FREQUENCY / 1000000000ULL;
+    one_shot_count = counts == 0 ? 1 : (counts > 0xFFFF ? 0xFFFF : counts);
+	outb(0x43, PIT_CHANNEL0_ONE_SHOT);
+	WriteCount(one_shot_count);
+    return true;
+}
+
+/*
+ * Cuts the one-shot short if it hasn't gone off yet, by making it go off right
+ * away. The IRQ handler then reports the time that actually passed, and goes
+ * back to the periodic interrupt. Must be called with interrupts disabled.
+ */
+void StopPitOneShot(void) {
+    if (one_shot_count == 0) {
+        return;
+    }
+
+    outb(0x43, PIT_READ_BACK_STATUS);
+    if (inb(0x40) & PIT_STATUS_OUTPUT) {
+        /*
+         * It has already gone off, and the IRQ is on its way.
+         */
+        return;
+    }
+
+    uint16_t remaining = ReadCount();
+    uint32_t elapsed = one_shot_count - MIN(remaining, one_shot_count) + 1;
+    one_shot_count = MIN(elapsed, 0xFFFF);
+	outb(0x43, PIT_CHANNEL0_ONE_SHOT);
+	WriteCount(1);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <common.h>
+#include <arch.h>
+
+/*
+ * The ISA IRQs keep the vectors they had on the PIC (32 to 47). The vectors for
+ * the local APIC must stay below 128, as the interrupt stubs sign extend the
+ * vector number.
+ */
+#define APIC_TIMER_VECTOR           48
+#define APIC_IPI_RESCHEDULE_VECTOR  49
+#define APIC_IPI_TLB_VECTOR         50
+#define APIC_SPURIOUS_VECTOR        127
+
+/*
+ * The parts of the ACPI MADT that we care about.
+ */
+struct x86_madt {
+    size_t lapic_address;
+    int num_cpus;
+    uint8_t lapic_ids[ARCH_MAX_CPU_ALLOWED];
+
+    size_t ioapic_address;
+    int ioapic_gsi_base;
+
+    /*
+     * Where each ISA IRQ is connected to the I/O APIC, and its polarity and
+     * trigger mode (using the MPS INTI flags format).
+     */
+    int isa_irq_gsi[16];
+    uint16_t isa_irq_flags[16];
+};
+
+bool x86ReadMadt(struct x86_madt* madt);
+
+void MapLapic(size_t physical);
+void InitLapic(void);
+int GetLapicId(void);
+void SendLapicEoi(void);
+void SendIpi(int lapic_id, uint32_t command);
+void CalibrateLapicTimer(void);
+void StartLapicTimer(void);
+void StartLapicOneShot(uint64_t nanos);
+void LapicDelayMicro(uint32_t micros);
+
+void InitIoApic(struct x86_madt* madt, int destination_lapic_id);
+void DisableIoApicLines(uint16_t disabled_irqs);
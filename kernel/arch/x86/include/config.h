@@ -25,6 +25,7 @@
 #define ARCH_KRNL_SBRK_BASE     0xC4000000
 #define ARCH_KRNL_SBRK_LIMIT    0xFFC00000
 #define ARCH_PROG_LOADER_BASE   0xBFC00000
+#define ARCH_TIME_PAGE_ADDRESS  0xBFFFF000
 
 #define ARCH_MAX_CPU_ALLOWED    16
 
@@ -47,6 +48,12 @@ typedef struct {
     struct gdt_ptr gdtr;
     struct idt_ptr idtr;
 
+    /*
+     * ISA IRQs that arrived while the IRQL was too high for them, and are
+     * waiting for it to drop. See ArchSetIrql().
+     */
+    uint16_t deferred_irqs;
+
 } platform_cpu_data_t;
 
 typedef struct {
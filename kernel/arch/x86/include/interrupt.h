@@ -4,5 +4,8 @@
 
 bool x86IsReadyForIrqs(void);
 void x86MakeReadyForIrqs(void);
+bool x86IsUsingApic(void);
+void x86SwitchToApic(void);
+void x86EnableInterruptsAndHalt(void);
 
 void HandleNmi(void);
\ No newline at end of file
@@ -8,4 +8,5 @@
 void InitPic(void);
 void SendPicEoi(int irq_num);
 bool IsPicIrqSpurious(int irq_num);
+bool IsPicIrqPending(int irq_num);
 void DisablePicLines(uint16_t irq_bitfield);
\ No newline at end of file
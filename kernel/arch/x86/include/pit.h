@@ -1,3 +1,7 @@
 #pragma once
 
-void InitPit(int hertz);
\ No newline at end of file
+#include <common.h>
+
+void InitPit(int hertz);
+bool StartPitOneShot(uint64_t nanos);
+void StopPitOneShot(void);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <common.h>
+
+struct cpu;
+
+bool x86StartNextCpu(struct cpu* cpu);
+void x86FlushTlbOnOtherCpus(void);
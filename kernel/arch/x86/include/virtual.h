@@ -1,5 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdbool.h>
 
-__attribute__((fastcall)) size_t x86KernelMemoryToPhysical(size_t virtual);
\ No newline at end of file
+__attribute__((fastcall)) size_t x86KernelMemoryToPhysical(size_t virtual);
+void x86IdentityMapLowMemory(bool map);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <machine/virtual.h>
+#include <machine/smp.h>
 #include <assert.h>
 #include <string.h>
 #include <arch.h>
@@ -139,6 +140,17 @@ void ArchSetVas(struct vas* vas) {
 
 void ArchFlushTlb(struct vas* vas) {
 	ArchSetVas(vas);
+	x86FlushTlbOnOtherCpus();
+}
+
+/*
+ * While other CPUs are being started, they need to turn on paging while they
+ * are still running from conventional memory. The page table that maps the low
+ * memory at 0xC0000000 maps it at 0x00000000 too if we let it.
+ */
+void x86IdentityMapLowMemory(bool map) {
+	kernel_page_directory[0] = map ? kernel_page_directory[768] : 0;
+	ArchFlushTlb(GetKernelVas());
 }
 
 void ArchInitVas(struct vas* vas) {
@@ -181,8 +181,20 @@ void RegisterTfwTests(void) {
     RegisterTfwWaitTests();
     RegisterTfwIrqlTests();
     RegisterTfwSemaphoreTests();
+    RegisterTfwRwLockTests();
+    RegisterTfwFutexTests();
+    RegisterTfwSpinlockTests();
+    RegisterTfwMailboxTests();
+    RegisterTfwMessageTests();
+    RegisterTfwPollTests();
+    RegisterTfwSharedMemoryTests();
+    RegisterTfwAioRingTests();
     RegisterTfwPhysTests();
     RegisterTfwHeapAdtTests(); 
+    RegisterTfwRunQueueTests();
+    RegisterTfwThreadListTests();
+    RegisterTfwTimerWheelTests();
+    RegisterTfwTimerTests();
 }
 
 void InitTfw(void) {
@@ -0,0 +1,108 @@
+
+#include <asyncio.h>
+#include <sys/ioring.h>
+#include <filedes.h>
+#include <file.h>
+#include <vnode.h>
+#include <dev.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+#include <errno.h>
+#include <virtual.h>
+
+#ifndef NDEBUG
+
+TFW_CREATE_TEST(AioRingPipes) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct fd_table* table = CreateFdTable();
+    int fd;
+    assert(CreateFd(table, CreateFile(CreatePipe(), 0, 0, true, true), &fd, 0) == 0);
+
+    struct io_ring* mem = MapVirtEasy(GetAioRingSize(4), false);
+    struct aio_ring* ring = CreateAioRing(GetVas(), table, mem, 4, false);
+    struct io_ring_sqe* sqes = IO_RING_SQES(mem);
+    struct io_ring_cqe* cqes = IO_RING_CQES(mem);
+    assert(mem->entries == 4);
+    uint32_t submitted;
+
+    /*
+     * A read of an empty pipe waits in a worker, until a write submitted after
+     * it gets done by another.
+     */
+    char in[6] = {0};
+    char out[6] = "hello";
+    sqes[0] = (struct io_ring_sqe) {
+        .opcode = IO_RING_OP_READ, .fd = fd, .buffer = in, .length = 5, .offset = IO_RING_SEEK_POSITION, .user_data = 1
+    };
+    mem->sq_tail = 1;
+    assert(SubmitToAioRing(ring, 8, &submitted) == 0);
+    assert(submitted == 1 && mem->sq_head == 1);
+    assert(WaitForAioRing(ring, 1, 50) == 0);
+    assert(mem->cq_tail == 0);
+
+    sqes[1] = (struct io_ring_sqe) {
+        .opcode = IO_RING_OP_WRITE, .fd = fd, .buffer = out, .length = 5, .offset = IO_RING_SEEK_POSITION, .user_data = 2
+    };
+    mem->sq_tail = 2;
+    assert(SubmitToAioRing(ring, 8, &submitted) == 0);
+    assert(submitted == 1);
+    assert(WaitForAioRing(ring, 2, -1) == 0);
+    assert(mem->cq_tail == 2);
+    assert(cqes[0].user_data + cqes[1].user_data == 3);
+    assert(cqes[0].error == 0 && cqes[0].transferred == 5);
+    assert(cqes[1].error == 0 && cqes[1].transferred == 5);
+    assert(!strcmp(in, "hello"));
+    mem->cq_head = 2;
+
+    /*
+     * Bad requests fail straight away.
+     */
+    sqes[2] = (struct io_ring_sqe) {.opcode = IO_RING_OP_READ, .fd = fd + 1, .buffer = in, .length = 5, .user_data = 3};
+    sqes[3] = (struct io_ring_sqe) {.opcode = 99, .fd = fd, .user_data = 4};
+    mem->sq_tail = 4;
+    assert(SubmitToAioRing(ring, 8, &submitted) == 0);
+    assert(submitted == 2 && mem->cq_tail == 4);
+    assert(cqes[2].user_data == 3 && cqes[2].error == EBADF);
+    assert(cqes[3].user_data == 4 && cqes[3].error == EINVAL);
+
+    /*
+     * Submissions are left on the queue while there's no room for their
+     * completions.
+     */
+    for (int i = 0; i < 4; ++i) {
+        sqes[i] = (struct io_ring_sqe) {.opcode = IO_RING_OP_NOP, .user_data = 5 + i};
+    }
+    mem->sq_tail = 8;
+    assert(SubmitToAioRing(ring, 8, &submitted) == 0);
+    assert(submitted == 2 && mem->sq_head == 6);
+    mem->cq_head = 6;
+    assert(SubmitToAioRing(ring, 8, &submitted) == 0);
+    assert(submitted == 2 && mem->sq_head == 8 && mem->cq_tail == 8);
+    assert(cqes[3].user_data == 8);
+    mem->cq_head = 8;
+
+    /*
+     * Destroying the ring cancels a read that would never finish.
+     */
+    sqes[0] = (struct io_ring_sqe) {.opcode = IO_RING_OP_READ, .fd = fd, .buffer = in, .length = 5, .user_data = 9};
+    mem->sq_tail = 9;
+    assert(SubmitToAioRing(ring, 8, &submitted) == 0);
+    assert(submitted == 1);
+    DestroyAioRing(ring);
+    assert(mem->cq_tail == 9);
+    assert(cqes[0].user_data == 9 && cqes[0].error == ECANCELED);
+
+    UnmapVirt((size_t) mem, GetAioRingSize(4));
+    DestroyFdTable(table);
+}
+
+void RegisterTfwAioRingTests(void) {
+    RegisterTfwTest("Asynchronous I/O rings complete requests out of order", TFW_SP_ALL_CLEAR, AioRingPipes, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include <futex.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <log.h>
+#include <irql.h>
+#include <errno.h>
+#include <thread.h>
+#include <virtual.h>
+#include <arch.h>
+
+#ifndef NDEBUG
+
+static volatile int* futex_word;
+static volatile int futex_results[3];
+
+static void FutexWaitingThread(void* context) {
+    int index = (int) (size_t) context;
+    futex_results[index] = FutexWait((size_t) futex_word, 5, index == 2 ? 10000 : -1);
+
+    while (true) {
+        Schedule();
+    }
+}
+
+static int CountFutexWaitersWoken(void) {
+    int count = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (futex_results[i] != -1) {
+            assert(futex_results[i] == 0);
+            ++count;
+        }
+    }
+    return count;
+}
+
+TFW_CREATE_TEST(FutexWaitAndWake) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    /*
+     * The word has to be somewhere usermode could see it.
+     */
+    futex_word = (volatile int*) MapVirt(0, 0, ARCH_PAGE_SIZE, VM_READ | VM_WRITE | VM_USER | VM_LOCAL | VM_LOCK, NULL, 0);
+    *futex_word = 5;
+    size_t address = (size_t) futex_word;
+
+    assert(FutexWait(address, 4, -1) == EAGAIN);
+    assert(FutexWait(address + 1, 5, -1) == EINVAL);
+    assert(FutexWait(address, 5, 0) == ETIMEDOUT);
+    assert(FutexWait(address, 5, 20) == ETIMEDOUT);
+    assert(FutexWake(address, 1) == 0);
+
+    /*
+     * Only as many threads as asked for get woken up, whether or not they have
+     * a timeout.
+     */
+    for (int i = 0; i < 3; ++i) {
+        futex_results[i] = -1;
+        CreateThread(FutexWaitingThread, (void*) (size_t) i, GetVas(), "");
+    }
+    SleepMilli(50);
+    assert(CountFutexWaitersWoken() == 0);
+
+    assert(FutexWake(address, 2) == 0);
+    SleepMilli(50);
+    assert(CountFutexWaitersWoken() == 2);
+
+    assert(FutexWake(address + sizeof(int), 5) == 0);
+    SleepMilli(50);
+    assert(CountFutexWaitersWoken() == 2);
+
+    assert(FutexWake(address, 5) == 0);
+    SleepMilli(50);
+    assert(CountFutexWaitersWoken() == 3);
+
+    UnmapVirt(address, ARCH_PAGE_SIZE);
+}
+
+void RegisterTfwFutexTests(void) {
+    RegisterTfwTest("Futexes check the word, time out and wake N waiters", TFW_SP_ALL_CLEAR, FutexWaitAndWake, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
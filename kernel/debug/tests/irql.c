@@ -6,6 +6,10 @@
 #include <log.h>
 #include <arch.h>
 #include <irql.h>
+#include <irq.h>
+#include <errno.h>
+#include <thread.h>
+#include <timer.h>
 
 #ifndef NDEBUG
 
@@ -256,6 +260,89 @@ TFW_CREATE_TEST(DeferWithDeferringInHandler) { TFW_IGNORE_UNUSED
     assert(counter == 50);
 }
 
+static void RecordOrder(void* context) {
+    int v = (size_t) context;
+    assert(counter == v - 1);
+    counter = v;
+}
+
+TFW_CREATE_TEST(DeferKeepsOrderWithinLevel) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+    counter = 0;
+
+    RaiseIrql(IRQL_SCHEDULER);
+    for (int i = 1; i <= 20; ++i) {
+        DeferUntilIrql(IRQL_STANDARD, RecordOrder, (void*) (size_t) i);
+    }
+    assert(counter == 0);
+    assert(GetNumberInDeferQueue() == 20);
+    LowerIrql(IRQL_STANDARD);
+    assert(counter == 20);
+    assert(GetNumberInDeferQueue() == 0);
+}
+
+TFW_CREATE_TEST(DeferOnCpuRunsOnNextLower) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+    counter = 0;
+
+    RaiseIrql(IRQL_HIGH);
+    assert(DeferUntilIrqlOnCpu(ArchGetCurrentCpuIndex(), IRQL_STANDARD, defer_me_6, (void*) 2) == 0);
+    assert(DeferUntilIrqlOnCpu(ArchGetCurrentCpuIndex(), IRQL_HIGH, defer_me_6, (void*) 1) == 0);
+    assert(counter == 0);
+    LowerIrql(IRQL_SCHEDULER);
+    assert(counter == 1);
+    LowerIrql(IRQL_STANDARD);
+    assert(counter == 2);
+}
+
+#define TEST_THREADED_IRQ 250
+
+static int threaded_irq_raised;
+static int threaded_irq_batches;
+static size_t threaded_irq_data[8];
+static int threaded_irq_count;
+
+static int ThreadedIrqTopHalf(platform_irq_context_t*) {
+    QueueIrqData(TEST_THREADED_IRQ, ++threaded_irq_raised);
+    return 0;
+}
+
+static void ThreadedIrqBottomHalf(const size_t* data, int count) {
+    assert(GetIrql() == IRQL_STANDARD);
+    threaded_irq_batches++;
+    for (int i = 0; i < count; ++i) {
+        threaded_irq_data[threaded_irq_count++] = data[i];
+    }
+}
+
+TFW_CREATE_TEST(ThreadedIrqBatches) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+    threaded_irq_raised = 0;
+    threaded_irq_batches = 0;
+    threaded_irq_count = 0;
+
+    assert(RegisterThreadedIrqHandler(TEST_THREADED_IRQ, ThreadedIrqTopHalf, ThreadedIrqBottomHalf, FIXED_PRIORITY_KERNEL_HIGH) == 0);
+    assert(RegisterThreadedIrqHandler(TEST_THREADED_IRQ, ThreadedIrqTopHalf, ThreadedIrqBottomHalf, FIXED_PRIORITY_KERNEL_HIGH) == EEXIST);
+
+    /*
+     * A burst of interrupts should only wake the thread once, and it should
+     * get everything in order.
+     */
+    RaiseIrql(IRQL_DRIVER);
+    for (int i = 0; i < 8; ++i) {
+        ReplayIrq(TEST_THREADED_IRQ, IRQL_DRIVER);
+    }
+    assert(threaded_irq_batches == 0);
+    LowerIrql(IRQL_STANDARD);
+    SleepMilli(50);
+
+    assert(threaded_irq_batches == 1);
+    assert(threaded_irq_count == 8);
+    for (int i = 0; i < 8; ++i) {
+        assert(threaded_irq_data[i] == (size_t) i + 1);
+    }
+}
+
 void RegisterTfwIrqlTests(void) {
     RegisterTfwTest("RaiseIrql, LowerIrql and GetIrql work", TFW_SP_AFTER_HEAP, RaiseLowerTest, PANIC_UNIT_TEST_OK, 0);
     RegisterTfwTest("DeferUntilIrql gets run immediately at level", TFW_SP_AFTER_HEAP, DeferRunsImmediatelyAtLevel, PANIC_UNIT_TEST_OK, 0);
@@ -268,6 +355,9 @@ void RegisterTfwIrqlTests(void) {
     RegisterTfwTest("DeferUntilIrql doesn't run handlers below current level", TFW_SP_AFTER_HEAP, DeferDoesntRunLowHandlers, PANIC_UNIT_TEST_OK, 0);
     RegisterTfwTest("DeferUntilIrql when handler calls LowerIrql", TFW_SP_AFTER_HEAP, DeferWithLoweringInHandler, PANIC_UNIT_TEST_OK, 0);
     RegisterTfwTest("DeferUntilIrql when handler calls DeferUntilIrql", TFW_SP_AFTER_HEAP, DeferWithDeferringInHandler, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("DeferUntilIrql keeps calls at the same level in order", TFW_SP_AFTER_HEAP, DeferKeepsOrderWithinLevel, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("DeferUntilIrqlOnCpu runs on the next lowering", TFW_SP_AFTER_HEAP, DeferOnCpuRunsOnNextLower, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Threaded IRQs run their bottom half in batches", TFW_SP_ALL_CLEAR, ThreadedIrqBatches, PANIC_UNIT_TEST_OK, 0);
 }
 
 #endif
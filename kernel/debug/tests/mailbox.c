@@ -0,0 +1,165 @@
+
+#include <mailbox.h>
+#include <transfer.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+#include <errno.h>
+#include <thread.h>
+#include <virtual.h>
+#include <arch.h>
+
+#ifndef NDEBUG
+
+TFW_CREATE_TEST(MailboxWrapsAround) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct mailbox* mbox = MailboxCreate(16);
+    char in[32];
+    char out[32];
+    for (int i = 0; i < 32; ++i) {
+        in[i] = 'a' + i;
+    }
+
+    /*
+     * Writes stop once it's full, rather than blocking again.
+     */
+    struct transfer tr = CreateKernelTransfer(in, 20, 0, TRANSFER_WRITE);
+    assert(MailboxAccess(mbox, &tr) == 0);
+    assert(tr.length_remaining == 4);
+    assert(MailboxWaitAddable(mbox, 0) == EAGAIN);
+
+    tr = CreateKernelTransfer(out, 10, 0, TRANSFER_READ);
+    assert(MailboxAccess(mbox, &tr) == 0);
+    assert(tr.length_remaining == 0);
+    assert(!memcmp(in, out, 10));
+
+    tr = CreateKernelTransfer(in + 16, 10, 0, TRANSFER_WRITE);
+    assert(MailboxAccess(mbox, &tr) == 0);
+    assert(tr.length_remaining == 0);
+
+    /*
+     * The data now goes around the end of the buffer.
+     */
+    tr = CreateKernelTransfer(out, 32, 0, TRANSFER_READ);
+    assert(MailboxAccess(mbox, &tr) == 0);
+    assert(tr.length_remaining == 16);
+    assert(!memcmp(in + 10, out, 16));
+
+    tr = CreateKernelTransfer(out, 32, 0, TRANSFER_READ);
+    tr.blockable = false;
+    assert(MailboxAccess(mbox, &tr) == EAGAIN);
+
+    uint8_t c;
+    assert(MailboxAdd(mbox, 0, 'x') == 0);
+    assert(MailboxGet(mbox, 0, &c) == 0 && c == 'x');
+    assert(MailboxGet(mbox, 0, &c) == EAGAIN);
+
+    MailboxDestroy(mbox);
+}
+
+static struct mailbox* lend_mbox;
+static char lend_data[ARCH_PAGE_SIZE * 2];
+static volatile bool lend_returned;
+static volatile int lend_result;
+static volatile size_t lend_amount;
+
+static void LendingThread(void*) {
+    size_t pages[2] = {(size_t) lend_data, (size_t) lend_data + ARCH_PAGE_SIZE};
+    size_t lent;
+    lend_result = MailboxLend(lend_mbox, pages, 100, ARCH_PAGE_SIZE, true, &lent);
+    lend_amount = lent;
+    lend_returned = true;
+
+    while (true) {
+        Schedule();
+    }
+}
+
+TFW_CREATE_TEST(MailboxLending) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    lend_mbox = MailboxCreate(16);
+    lend_returned = false;
+    for (int i = 0; i < ARCH_PAGE_SIZE * 2; ++i) {
+        lend_data[i] = i % 251;
+    }
+
+    /*
+     * The loan can't start until what's already there has been read.
+     */
+    assert(MailboxAdd(lend_mbox, 0, 'x') == 0);
+    CreateThread(LendingThread, NULL, GetVas(), "");
+    SleepMilli(50);
+
+    uint8_t c;
+    assert(MailboxGet(lend_mbox, 0, &c) == 0 && c == 'x');
+
+    static char out[ARCH_PAGE_SIZE];
+    struct transfer tr = CreateKernelTransfer(out, 1000, 0, TRANSFER_READ);
+    assert(MailboxAccess(lend_mbox, &tr) == 0);
+    assert(tr.length_remaining == 0);
+    assert(!memcmp(out, lend_data + 100, 1000));
+    assert(MailboxAdd(lend_mbox, 0, 'y') == EAGAIN);
+    SleepMilli(50);
+    assert(!lend_returned);
+
+    /*
+     * This crosses from the first page to the second.
+     */
+    tr = CreateKernelTransfer(out, ARCH_PAGE_SIZE, 0, TRANSFER_READ);
+    assert(MailboxAccess(lend_mbox, &tr) == 0);
+    assert(tr.length_remaining == 1000);
+    assert(!memcmp(out, lend_data + 1100, ARCH_PAGE_SIZE - 1000));
+    SleepMilli(50);
+    assert(lend_returned);
+    assert(lend_result == 0 && lend_amount == ARCH_PAGE_SIZE);
+    assert(MailboxAdd(lend_mbox, 0, 'y') == 0);
+}
+
+TFW_CREATE_TEST(MailboxLendingStopped) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    lend_mbox = MailboxCreate(16);
+    lend_returned = false;
+
+    /*
+     * Non-blocking loans don't start unless someone is waiting to read.
+     */
+    size_t pages[1] = {(size_t) lend_data};
+    size_t lent;
+    assert(MailboxLend(lend_mbox, pages, 0, 100, false, &lent) == EAGAIN);
+    assert(lent == 0);
+
+    CreateThread(LendingThread, NULL, GetVas(), "");
+    SleepMilli(50);
+
+    static char out[10];
+    struct transfer tr = CreateKernelTransfer(out, 10, 0, TRANSFER_READ);
+    assert(MailboxAccess(lend_mbox, &tr) == 0);
+    assert(!memcmp(out, lend_data + 100, 10));
+    SleepMilli(50);
+    assert(!lend_returned);
+
+    /*
+     * The lender should get back how much was read, and nothing else can be
+     * lent afterwards.
+     */
+    MailboxStopLending(lend_mbox);
+    SleepMilli(50);
+    assert(lend_returned);
+    assert(lend_result == 0 && lend_amount == 10);
+    assert(MailboxLend(lend_mbox, pages, 0, 100, true, &lent) == EPIPE);
+    assert(lent == 0);
+}
+
+void RegisterTfwMailboxTests(void) {
+    RegisterTfwTest("Mailboxes copy around the end of the ring buffer", TFW_SP_ALL_CLEAR, MailboxWrapsAround, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Mailboxes can be lent pages to read from", TFW_SP_ALL_CLEAR, MailboxLending, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Mailboxes wake the lender when lending is stopped", TFW_SP_ALL_CLEAR, MailboxLendingStopped, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
@@ -0,0 +1,92 @@
+
+#include <message.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+#include <errno.h>
+#include <thread.h>
+#include <timer.h>
+#include <virtual.h>
+
+#ifndef NDEBUG
+
+static struct msgbox* test_msgbox;
+static volatile int messages_sent;
+
+static void BlockingSenderThread(void*) {
+    for (int i = 100; i < 110; ++i) {
+        SendMessage(test_msgbox, &i);
+        messages_sent++;
+    }
+
+    while (true) {
+        Schedule();
+    }
+}
+
+TFW_CREATE_TEST(BoundedMessageBoxBatches) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct msgbox* mbox = CreateBoundedMessageBox("test", sizeof(int), 8, MSGBOX_FAIL_WHEN_FULL);
+    for (int i = 0; i < 8; ++i) {
+        assert(SendMessage(mbox, &i) == 0);
+    }
+    int extra = 8;
+    assert(SendMessage(mbox, &extra) == EAGAIN);
+
+    int out[8];
+    assert(ReceiveMessages(mbox, out, 5) == 5);
+    for (int i = 0; i < 5; ++i) {
+        assert(out[i] == i);
+    }
+
+    /*
+     * These go around the end of the ring.
+     */
+    for (int i = 8; i < 13; ++i) {
+        assert(SendMessage(mbox, &i) == 0);
+    }
+    assert(ReceiveMessages(mbox, out, 8) == 8);
+    for (int i = 0; i < 8; ++i) {
+        assert(out[i] == i + 5);
+    }
+
+    assert(SendMessage(mbox, &extra) == 0);
+    assert(ReceiveMessage(mbox, out) == 0);
+    assert(out[0] == 8);
+    DestroyMessageBox(mbox);
+}
+
+TFW_CREATE_TEST(BoundedMessageBoxBlocks) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    test_msgbox = CreateBoundedMessageBox("test", sizeof(int), 4, 0);
+    messages_sent = 0;
+    CreateThread(BlockingSenderThread, NULL, GetVas(), "");
+    SleepMilli(100);
+    assert(messages_sent == 4);
+
+    /*
+     * Receiving makes room for the sender, which is woken up to fill it again.
+     */
+    int out[4];
+    int expected = 100;
+    while (expected < 110) {
+        int count = ReceiveMessages(test_msgbox, out, 4);
+        for (int i = 0; i < count; ++i) {
+            assert(out[i] == expected++);
+        }
+    }
+    SleepMilli(50);
+    assert(messages_sent == 10);
+}
+
+void RegisterTfwMessageTests(void) {
+    RegisterTfwTest("Bounded message boxes receive in batches", TFW_SP_ALL_CLEAR, BoundedMessageBoxBatches, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Bounded message boxes block senders when full", TFW_SP_ALL_CLEAR, BoundedMessageBoxBlocks, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
@@ -0,0 +1,74 @@
+
+#include <polltable.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <dev.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+#include <errno.h>
+#include <thread.h>
+#include <timer.h>
+#include <virtual.h>
+
+#ifndef NDEBUG
+
+static struct vnode* test_pipes[2];
+
+static void LateWriterThread(void*) {
+    SleepMilli(100);
+    char c = 'x';
+    struct transfer tr = CreateKernelTransfer(&c, 1, 0, TRANSFER_WRITE);
+    VnodeOpWrite(test_pipes[1], &tr);
+
+    while (true) {
+        Schedule();
+    }
+}
+
+TFW_CREATE_TEST(PollPipes) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    test_pipes[0] = CreatePipe();
+    test_pipes[1] = CreatePipe();
+    int events[2] = {VNODE_WAIT_READ, VNODE_WAIT_READ | VNODE_WAIT_WRITE};
+    int revents[2];
+    int ready;
+
+    /*
+     * Empty pipes can be written to, but not read from.
+     */
+    assert(PollVnodes(test_pipes, events, revents, 2, 0, &ready) == 0);
+    assert(ready == 1);
+    assert(revents[0] == 0);
+    assert(revents[1] == VNODE_WAIT_WRITE);
+
+    events[1] = VNODE_WAIT_READ;
+    uint64_t start = GetSystemTimer();
+    assert(PollVnodes(test_pipes, events, revents, 2, 50, &ready) == 0);
+    assert(ready == 0);
+    assert(GetSystemTimer() - start >= 50ULL * 1000000ULL);
+
+    /*
+     * Blocks until the other thread writes.
+     */
+    CreateThread(LateWriterThread, NULL, GetVas(), "");
+    assert(PollVnodes(test_pipes, events, revents, 2, -1, &ready) == 0);
+    assert(ready == 1);
+    assert(revents[0] == 0);
+    assert(revents[1] == VNODE_WAIT_READ);
+
+    BreakPipe(test_pipes[0]);
+    assert(PollVnodes(test_pipes, events, revents, 1, -1, &ready) == 0);
+    assert(ready == 1);
+    assert(revents[0] == (VNODE_WAIT_READ | VNODE_WAIT_ERROR));
+}
+
+void RegisterTfwPollTests(void) {
+    RegisterTfwTest("Polling pipes waits for them to be ready", TFW_SP_ALL_CLEAR, PollPipes, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
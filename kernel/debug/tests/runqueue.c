@@ -0,0 +1,128 @@
+
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <thread.h>
+#include <runqueue.h>
+#include <stdlib.h>
+
+#ifndef NDEBUG
+
+static struct run_queue test_queue;
+static struct thread test_threads[64];
+
+TFW_CREATE_TEST(RunQueueOrdering) { TFW_IGNORE_UNUSED
+    RunQueueInit(&test_queue);
+    assert(RunQueuePeek(&test_queue) == NULL);
+    assert(RunQueueDeleteTop(&test_queue) == NULL);
+
+    /*
+     * Two threads on each of 32 different priorities, inserted in a scrambled
+     * order.
+     */
+    for (int i = 0; i < 64; ++i) {
+        inline_memset(&test_threads[i], 0, sizeof(struct thread));
+        test_threads[i].priority = ((i * 37) % 32) * 8;
+        RunQueueInsert(&test_queue, &test_threads[i]);
+        assert(test_queue.num_threads == i + 1);
+    }
+
+    int prev_priority = -1;
+    struct thread* prev = NULL;
+    for (int i = 0; i < 64; ++i) {
+        struct thread* thr = RunQueuePeek(&test_queue);
+        assert(RunQueueDeleteTop(&test_queue) == thr);
+        assert(thr->priority >= prev_priority);
+
+        /*
+         * Threads of the same priority come out in the order they went in.
+         */
+        if (thr->priority == prev_priority) {
+            assert(thr > prev);
+        }
+        prev_priority = thr->priority;
+        prev = thr;
+    }
+
+    assert(test_queue.num_threads == 0);
+    assert(RunQueuePeek(&test_queue) == NULL);
+}
+
+TFW_CREATE_TEST(RunQueueDeletion) { TFW_IGNORE_UNUSED
+    RunQueueInit(&test_queue);
+
+    for (int i = 0; i < 64; ++i) {
+        inline_memset(&test_threads[i], 0, sizeof(struct thread));
+        test_threads[i].priority = 255 - i;
+        RunQueueInsert(&test_queue, &test_threads[i]);
+    }
+
+    /*
+     * Remove from the middle, and then the highest priority one.
+     */
+    RunQueueDelete(&test_queue, &test_threads[20]);
+    assert(!RunQueueContains(&test_queue, &test_threads[20]));
+    assert(RunQueuePeek(&test_queue) == &test_threads[63]);
+    RunQueueDelete(&test_queue, &test_threads[63]);
+    assert(RunQueuePeek(&test_queue) == &test_threads[62]);
+
+    /*
+     * Putting something at the front of its level shouldn't jump it ahead of
+     * a more important thread.
+     */
+    test_threads[20].priority = 255;
+    RunQueueInsertAtFront(&test_queue, &test_threads[20]);
+    assert(RunQueuePeek(&test_queue) == &test_threads[62]);
+
+    test_threads[63].priority = 0;
+    RunQueueInsertAtFront(&test_queue, &test_threads[63]);
+    assert(RunQueuePeek(&test_queue) == &test_threads[63]);
+
+    int count = 0;
+    while (RunQueueDeleteTop(&test_queue) != NULL) {
+        ++count;
+    }
+    assert(count == 64);
+}
+
+static bool IsEvenPriority(struct thread* thr, void* context) {
+    (void) context;
+    return thr->priority % 2 == 0;
+}
+
+static bool NeverMatches(struct thread* thr, void* context) {
+    (void) thr;
+    (void) context;
+    return false;
+}
+
+TFW_CREATE_TEST(RunQueueSearch) { TFW_IGNORE_UNUSED
+    RunQueueInit(&test_queue);
+
+    for (int i = 0; i < 64; ++i) {
+        inline_memset(&test_threads[i], 0, sizeof(struct thread));
+        test_threads[i].priority = 101 + i * 2;
+        RunQueueInsert(&test_queue, &test_threads[i]);
+    }
+
+    assert(RunQueueFind(&test_queue, IsEvenPriority, NULL) == NULL);
+    assert(RunQueueFind(&test_queue, NeverMatches, NULL) == NULL);
+
+    RunQueueDelete(&test_queue, &test_threads[40]);
+    RunQueueDelete(&test_queue, &test_threads[50]);
+    test_threads[40].priority = 60;
+    test_threads[50].priority = 50;
+    RunQueueInsert(&test_queue, &test_threads[40]);
+    RunQueueInsert(&test_queue, &test_threads[50]);
+    assert(RunQueueFind(&test_queue, IsEvenPriority, NULL) == &test_threads[50]);
+}
+
+void RegisterTfwRunQueueTests(void) {
+    RegisterTfwTest("Run queues pick the highest priority thread", TFW_SP_ALL_CLEAR, RunQueueOrdering, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Run queues handle deletion and front insertion", TFW_SP_ALL_CLEAR, RunQueueDeletion, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Run queues can be searched", TFW_SP_ALL_CLEAR, RunQueueSearch, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
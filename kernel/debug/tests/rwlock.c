@@ -0,0 +1,110 @@
+
+#include <rwlock.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+#include <thread.h>
+#include <timer.h>
+#include <errno.h>
+#include <virtual.h>
+
+#ifndef NDEBUG
+
+static struct rwlock* test_rwlock;
+static volatile bool writer_has_lock;
+static volatile bool late_reader_has_lock;
+
+static void WriterThread(void*) {
+    AcquireRwLockWrite(test_rwlock);
+    writer_has_lock = true;
+    SleepMilli(200);
+    assert(!late_reader_has_lock);
+    writer_has_lock = false;
+    ReleaseRwLockWrite(test_rwlock);
+
+    while (true) {
+        Schedule();
+    }
+}
+
+static void LateReaderThread(void*) {
+    AcquireRwLockRead(test_rwlock);
+    assert(!writer_has_lock);
+    late_reader_has_lock = true;
+    ReleaseRwLockRead(test_rwlock);
+
+    while (true) {
+        Schedule();
+    }
+}
+
+TFW_CREATE_TEST(RwLockWriterPreference) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    test_rwlock = CreateRwLock("test");
+    writer_has_lock = false;
+    late_reader_has_lock = false;
+
+    /*
+     * Readers don't keep each other out.
+     */
+    AcquireRwLockRead(test_rwlock);
+    AcquireRwLockRead(test_rwlock);
+    assert(DestroyRwLock(test_rwlock) == EBUSY);
+
+    /*
+     * A waiting writer stops new readers getting in, and gets the lock before
+     * them once the existing readers are done.
+     */
+    CreateThread(WriterThread, NULL, GetVas(), "");
+    SleepMilli(100);
+    assert(!writer_has_lock);
+    CreateThread(LateReaderThread, NULL, GetVas(), "");
+    SleepMilli(100);
+    assert(!late_reader_has_lock);
+
+    ReleaseRwLockRead(test_rwlock);
+    SleepMilli(50);
+    assert(!writer_has_lock);
+    ReleaseRwLockRead(test_rwlock);
+    SleepMilli(50);
+    assert(writer_has_lock);
+
+    SleepMilli(300);
+    assert(late_reader_has_lock);
+    assert(DestroyRwLock(test_rwlock) == 0);
+}
+
+TFW_CREATE_TEST(SpinRwLockIrql) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct spin_rwlock lock;
+    InitSpinRwLock(&lock, "test", IRQL_SCHEDULER);
+
+    int first = AcquireSpinRwLockRead(&lock);
+    assert(first == IRQL_STANDARD);
+    assert(GetIrql() == IRQL_SCHEDULER);
+    int second = AcquireSpinRwLockRead(&lock);
+    assert(second == IRQL_SCHEDULER);
+    assert(lock.readers == 2);
+    ReleaseSpinRwLockRead(&lock, second);
+    ReleaseSpinRwLockRead(&lock, first);
+    assert(GetIrql() == IRQL_STANDARD);
+
+    AcquireSpinRwLockWrite(&lock);
+    assert(IsSpinRwLockWriteHeld(&lock));
+    assert(GetIrql() == IRQL_SCHEDULER);
+    ReleaseSpinRwLockWrite(&lock);
+    assert(!IsSpinRwLockWriteHeld(&lock));
+    assert(GetIrql() == IRQL_STANDARD);
+}
+
+void RegisterTfwRwLockTests(void) {
+    RegisterTfwTest("Reader-writer locks prefer writers", TFW_SP_ALL_CLEAR, RwLockWriterPreference, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Spinning reader-writer locks restore the IRQL", TFW_SP_ALL_CLEAR, SpinRwLockIrql, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include <thread.h>
 #include <errno.h>
 #include <virtual.h>
+#include <process.h>
 #include <stdlib.h>
 
 #ifndef NDEBUG
@@ -67,6 +68,125 @@ TFW_CREATE_TEST(SemaphoreTimeout2) { TFW_IGNORE_UNUSED
     assert(Thread1Ok);
 }
 
+TFW_CREATE_TEST(SemaphoreNoWait) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct semaphore* sem = CreateSemaphore("", 2, 0);
+    assert(AcquireSemaphore(sem, 0) == 0);
+    assert(AcquireSemaphore(sem, 0) == 0);
+    assert(AcquireSemaphore(sem, 0) == EAGAIN);
+    ReleaseSemaphore(sem);
+    assert(AcquireSemaphore(sem, 0) == 0);
+    assert(DestroySemaphore(sem, SEM_REQUIRE_ZERO) == EBUSY);
+    assert(ReleaseSemaphoreEx(sem, 5) == 2);
+    assert(DestroySemaphore(sem, SEM_REQUIRE_ZERO) == 0);
+}
+
+static struct semaphore* counter_mutex;
+static volatile int counter;
+static volatile int counter_threads_done;
+
+static void CounterThread(void*) {
+    for (int i = 0; i < 1000; ++i) {
+        AcquireMutex(counter_mutex, -1);
+        assert(GetMutexOwner(counter_mutex) == GetThread());
+        int value = counter;
+        if (i % 100 == 0) {
+            Schedule();
+        }
+        counter = value + 1;
+        if (i == 999) {
+            counter_threads_done++;
+        }
+        ReleaseMutex(counter_mutex);
+    }
+
+    while (true) {
+        Schedule();
+    }
+}
+
+TFW_CREATE_TEST(AdaptiveMutexContention) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    counter_mutex = CreateMutex("counter");
+    counter = 0;
+    counter_threads_done = 0;
+    assert(GetMutexOwner(counter_mutex) == NULL);
+
+    for (int i = 0; i < 8; ++i) {
+        CreateThread(CounterThread, NULL, GetVas(), "");
+    }
+    while (true) {
+        AcquireMutex(counter_mutex, -1);
+        int done = counter_threads_done;
+        ReleaseMutex(counter_mutex);
+        if (done == 8) {
+            break;
+        }
+        SleepMilli(50);
+    }
+
+    assert(counter == 8000);
+    assert(GetMutexOwner(counter_mutex) == NULL);
+    assert(DestroyMutex(counter_mutex) == 0);
+}
+
+static struct semaphore* inherit_mutex;
+static volatile bool holder_may_release;
+static volatile bool waiter_has_mutex;
+
+static void InheritHolderThread(void*) {
+    AcquireMutex(inherit_mutex, -1);
+    while (!holder_may_release) {
+        SleepMilli(10);
+    }
+    ReleaseMutex(inherit_mutex);
+
+    while (true) {
+        Schedule();
+    }
+}
+
+static void InheritWaiterThread(void*) {
+    AcquireMutex(inherit_mutex, -1);
+    waiter_has_mutex = true;
+    ReleaseMutex(inherit_mutex);
+
+    while (true) {
+        Schedule();
+    }
+}
+
+TFW_CREATE_TEST(MutexPriorityInheritance) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    inherit_mutex = CreateMutex("inherit");
+    holder_may_release = false;
+    waiter_has_mutex = false;
+
+    struct thread* holder = CreateThreadEx(InheritHolderThread, NULL, GetVas(), "", GetProcess(), SCHEDULE_POLICY_FIXED, 200, 0);
+    SleepMilli(50);
+    assert(GetMutexOwner(inherit_mutex) == holder);
+    assert(holder->priority == 200);
+
+    /*
+     * The holder should run with the waiter's priority until it lets go.
+     */
+    CreateThreadEx(InheritWaiterThread, NULL, GetVas(), "", GetProcess(), SCHEDULE_POLICY_FIXED, 10, 0);
+    SleepMilli(50);
+    assert(!waiter_has_mutex);
+    assert(holder->priority == 10);
+    assert(holder->base_priority == 200);
+
+    holder_may_release = true;
+    SleepMilli(100);
+    assert(waiter_has_mutex);
+    assert(holder->priority == 200);
+    assert(holder->inherited_priority == NO_INHERITED_PRIORITY);
+    assert(DestroyMutex(inherit_mutex) == 0);
+}
+
 static void Thread3(void* ignored) {
     (void) ignored;
 
@@ -159,6 +279,9 @@ TFW_CREATE_TEST(SchedulerHeartAttack) { TFW_IGNORE_UNUSED
 void RegisterTfwSemaphoreTests(void) {
     RegisterTfwTest("Semaphores with timeouts can be woken via timeout", TFW_SP_ALL_CLEAR, SemaphoreTimeout1, PANIC_UNIT_TEST_OK, 0);
     RegisterTfwTest("Semaphores with timeouts can be woken via release", TFW_SP_ALL_CLEAR, SemaphoreTimeout2, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Semaphores can be acquired without waiting", TFW_SP_ALL_CLEAR, SemaphoreNoWait, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Adaptive mutexes give mutual exclusion", TFW_SP_ALL_CLEAR, AdaptiveMutexContention, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Mutex holders inherit the priority of waiters", TFW_SP_ALL_CLEAR, MutexPriorityInheritance, PANIC_UNIT_TEST_OK, 0);
     RegisterTfwTest("Scheduler stress test with semaphores (1)", TFW_SP_ALL_CLEAR, SchedulerHeartAttack, PANIC_UNIT_TEST_OK, 3);
     RegisterTfwTest("Scheduler stress test with semaphores (2)", TFW_SP_ALL_CLEAR, SchedulerHeartAttack, PANIC_UNIT_TEST_OK, 4);
     RegisterNightlyTfwTest("Scheduler stress test with semaphores (3)", TFW_SP_ALL_CLEAR, SchedulerHeartAttack, PANIC_UNIT_TEST_OK, 80);
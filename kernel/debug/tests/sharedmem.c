@@ -0,0 +1,71 @@
+
+#include <sharedmem.h>
+#include <file.h>
+#include <vfs.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <virtual.h>
+#include <arch.h>
+
+#ifndef NDEBUG
+
+TFW_CREATE_TEST(SharedMemoryMappings) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct file* first;
+    struct file* second;
+    assert(OpenSharedMemory("tfw", O_CREAT | O_RDWR, 0600, &first) == 0);
+    assert(OpenSharedMemory("tfw", O_CREAT | O_RDWR, 0600, &second) == 0);
+    assert(first->node == second->node);
+    assert(OpenSharedMemory("tfw", O_CREAT | O_EXCL | O_RDWR, 0600, &second) == EEXIST);
+    assert(OpenSharedMemory("", O_CREAT | O_RDWR, 0600, &second) == EINVAL);
+
+    size_t size = ARCH_PAGE_SIZE * 4;
+    assert(VnodeOpTruncate(first->node, size) == 0);
+
+    /*
+     * Two mappings of the same object see each other's writes, and new pages
+     * start out zeroed.
+     */
+    uint8_t* a = (uint8_t*) MapVirt(0, 0, size, VM_READ | VM_WRITE | VM_FILE, first, 0);
+    uint8_t* b = (uint8_t*) MapVirt(0, 0, size, VM_READ | VM_WRITE | VM_FILE, second, 0);
+    assert(a != b);
+    assert(a[ARCH_PAGE_SIZE * 2] == 0);
+    a[ARCH_PAGE_SIZE * 2] = 0x55;
+    b[ARCH_PAGE_SIZE * 3 + 7] = 0xAA;
+    assert(b[ARCH_PAGE_SIZE * 2] == 0x55);
+    assert(a[ARCH_PAGE_SIZE * 3 + 7] == 0xAA);
+    assert(a[0] == 0 && b[0] == 0);
+
+    /*
+     * Can grow, but can't cut off pages which have been touched.
+     */
+    assert(VnodeOpTruncate(first->node, ARCH_PAGE_SIZE * 2) == EBUSY);
+    assert(VnodeOpTruncate(first->node, size * 2) == 0);
+    assert(a[ARCH_PAGE_SIZE * 2] == 0x55);
+
+    /*
+     * Mappings and open files stay valid after unlinking.
+     */
+    assert(UnlinkSharedMemory("tfw") == 0);
+    assert(UnlinkSharedMemory("tfw") == ENOENT);
+    assert(OpenSharedMemory("tfw", O_RDWR, 0, &second) == ENOENT);
+    assert(b[ARCH_PAGE_SIZE * 3 + 7] == 0xAA);
+
+    UnmapVirt((size_t) a, size);
+    UnmapVirt((size_t) b, size);
+    DereferenceFile(first);
+    DereferenceFile(second);
+}
+
+void RegisterTfwSharedMemoryTests(void) {
+    RegisterTfwTest("Shared memory objects share pages between mappings", TFW_SP_ALL_CLEAR, SharedMemoryMappings, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
@@ -0,0 +1,67 @@
+
+#include <spinlock.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <irql.h>
+
+#ifndef NDEBUG
+
+TFW_CREATE_TEST(SpinlockTickets) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct spinlock lock;
+    InitSpinlock(&lock, "test", IRQL_SCHEDULER);
+    assert(!IsSpinlockHeld(&lock));
+
+    assert(AcquireSpinlock(&lock) == IRQL_STANDARD);
+    assert(IsSpinlockHeld(&lock));
+    assert(GetIrql() == IRQL_SCHEDULER);
+    assert(!TryAcquireSpinlock(&lock));
+    assert(GetIrql() == IRQL_SCHEDULER);
+    ReleaseSpinlock(&lock);
+    assert(!IsSpinlockHeld(&lock));
+    assert(GetIrql() == IRQL_STANDARD);
+
+    /*
+     * A failed try shouldn't have taken a ticket, or the lock would never
+     * become free again.
+     */
+    assert(lock.next_ticket == 1 && lock.now_serving == 1);
+    assert(TryAcquireSpinlock(&lock));
+    ReleaseSpinlock(&lock);
+    assert(lock.next_ticket == 2 && lock.now_serving == 2);
+}
+
+TFW_CREATE_TEST(SpinlockStats) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    static struct spinlock lock;
+    InitSpinlock(&lock, "tracked test", IRQL_SCHEDULER);
+
+    AcquireSpinlock(&lock);
+    ReleaseSpinlock(&lock);
+    assert(lock.stats.acquisitions == 0);
+
+    TrackSpinlock(&lock);
+    for (int i = 0; i < 5; ++i) {
+        AcquireSpinlock(&lock);
+        ReleaseSpinlock(&lock);
+    }
+    assert(TryAcquireSpinlock(&lock));
+    ReleaseSpinlock(&lock);
+
+    assert(lock.stats.acquisitions == 6);
+    assert(lock.stats.contended_acquisitions == 0);
+    assert(lock.stats.spin_cycles == 0);
+    DumpSpinlockStats("tracked test");
+}
+
+void RegisterTfwSpinlockTests(void) {
+    RegisterTfwTest("Spinlocks hand out tickets", TFW_SP_AFTER_HEAP, SpinlockTickets, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Tracked spinlocks count acquisitions", TFW_SP_AFTER_HEAP, SpinlockStats, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
@@ -0,0 +1,87 @@
+
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <thread.h>
+#include <threadlist.h>
+
+#ifndef NDEBUG
+
+static struct thread_list test_list;
+static struct thread_list other_list;
+static struct thread test_threads[8];
+
+static void CheckListOrder(struct thread_list* list, int* expected, int count) {
+    struct thread* iter = list->head;
+    struct thread* prev = NULL;
+    for (int i = 0; i < count; ++i) {
+        assert(iter == &test_threads[expected[i]]);
+        assert(iter->links[list->index].prev == prev);
+        assert(ThreadListContains(list, iter));
+        prev = iter;
+        iter = iter->links[list->index].next;
+    }
+    assert(iter == NULL);
+    assert(list->tail == prev);
+}
+
+TFW_CREATE_TEST(ThreadListMiddleDeletion) { TFW_IGNORE_UNUSED
+    ThreadListInit(&test_list, NEXT_INDEX_SEMAPHORE);
+    inline_memset(test_threads, 0, sizeof(test_threads));
+
+    for (int i = 1; i < 6; ++i) {
+        ThreadListInsert(&test_list, &test_threads[i]);
+    }
+    ThreadListInsertAtFront(&test_list, &test_threads[0]);
+    CheckListOrder(&test_list, (int[]) {0, 1, 2, 3, 4, 5}, 6);
+
+    ThreadListDelete(&test_list, &test_threads[3]);
+    assert(!ThreadListContains(&test_list, &test_threads[3]));
+    CheckListOrder(&test_list, (int[]) {0, 1, 2, 4, 5}, 5);
+
+    ThreadListDelete(&test_list, &test_threads[5]);
+    ThreadListDelete(&test_list, &test_threads[0]);
+    CheckListOrder(&test_list, (int[]) {1, 2, 4}, 3);
+
+    /*
+     * Deleted threads can go straight back on.
+     */
+    ThreadListInsert(&test_list, &test_threads[3]);
+    CheckListOrder(&test_list, (int[]) {1, 2, 4, 3}, 4);
+
+    assert(ThreadListDeleteTop(&test_list) == &test_threads[1]);
+    assert(ThreadListDeleteTop(&test_list) == &test_threads[2]);
+    assert(ThreadListDeleteTop(&test_list) == &test_threads[4]);
+    assert(ThreadListDeleteTop(&test_list) == &test_threads[3]);
+    assert(test_list.head == NULL && test_list.tail == NULL);
+}
+
+TFW_CREATE_TEST(ThreadListMembership) { TFW_IGNORE_UNUSED
+    ThreadListInit(&test_list, NEXT_INDEX_SEMAPHORE);
+    ThreadListInit(&other_list, NEXT_INDEX_SEMAPHORE);
+    inline_memset(test_threads, 0, sizeof(test_threads));
+
+    /*
+     * Lists using the same index are still told apart.
+     */
+    ThreadListInsert(&test_list, &test_threads[0]);
+    ThreadListInsert(&other_list, &test_threads[1]);
+    assert(ThreadListContains(&test_list, &test_threads[0]));
+    assert(!ThreadListContains(&test_list, &test_threads[1]));
+    assert(ThreadListContains(&other_list, &test_threads[1]));
+    assert(!ThreadListContains(&other_list, &test_threads[0]));
+
+    ThreadListDelete(&other_list, &test_threads[1]);
+    assert(!ThreadListContains(&other_list, &test_threads[1]));
+    assert(other_list.head == NULL && other_list.tail == NULL);
+    CheckListOrder(&test_list, (int[]) {0}, 1);
+}
+
+void RegisterTfwThreadListTests(void) {
+    RegisterTfwTest("Thread lists can delete from the middle", TFW_SP_ALL_CLEAR, ThreadListMiddleDeletion, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Thread lists track which list a thread is on", TFW_SP_ALL_CLEAR, ThreadListMembership, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
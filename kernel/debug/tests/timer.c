@@ -0,0 +1,46 @@
+#include <timer.h>
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <log.h>
+#include <irql.h>
+#include <arch.h>
+#include <thread.h>
+
+#ifndef NDEBUG
+
+/*
+ * Sleeps in short bursts (so the CPU keeps going idle) until the real time 
+ * clock ticks over to the next second.
+ */
+static uint64_t WaitForNextRtcSecond(void) {
+    uint64_t start = ArchGetUtcTime(0);
+    while (ArchGetUtcTime(0) == start) {
+        SleepMilli(5);
+    }
+    return GetTickTimer();
+}
+
+TFW_CREATE_TEST(TickClockKeepsPace) { TFW_IGNORE_UNUSED
+    EXACT_IRQL(IRQL_STANDARD);
+
+    /*
+     * Going idle switches the timer to one-shot mode and back hundreds of times
+     * here, so any time lost doing so adds up quickly. Each end can be spotted
+     * up to a sleep late.
+     */
+    uint64_t start = WaitForNextRtcSecond();
+    uint64_t end = start;
+    for (int i = 0; i < 5; ++i) {
+        end = WaitForNextRtcSecond();
+    }
+    uint64_t elapsed_ms = (end - start) / 1000000;
+    LogWriteSerial("tick clock counted %d ms over 5 RTC seconds\n", (int) elapsed_ms);
+    assert(elapsed_ms > 4850 && elapsed_ms < 5150);
+}
+
+void RegisterTfwTimerTests(void) {
+    RegisterNightlyTfwTest("The tick clock keeps pace with the RTC while idle", TFW_SP_ALL_CLEAR, TickClockKeepsPace, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
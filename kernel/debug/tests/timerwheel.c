@@ -0,0 +1,143 @@
+
+#include <debug.h>
+#include <assert.h>
+#include <panic.h>
+#include <string.h>
+#include <log.h>
+#include <timerwheel.h>
+#include <stdlib.h>
+
+#ifndef NDEBUG
+
+static struct timer_wheel test_wheel;
+static struct timer_wheel_entry test_entries[64];
+static uint64_t fired_at[64];
+static int num_fired;
+
+static void RecordFiring(void* context) {
+    int index = (int) (size_t) context;
+    fired_at[index] = test_wheel.next_tick - 1;
+    ++num_fired;
+}
+
+static void InitTestEntries(void) {
+    num_fired = 0;
+    for (int i = 0; i < 64; ++i) {
+        fired_at[i] = 0;
+        TimerWheelEntryInit(&test_entries[i], RecordFiring, (void*) (size_t) i);
+    }
+}
+
+TFW_CREATE_TEST(TimerWheelExpiry) { TFW_IGNORE_UNUSED
+    TimerWheelInit(&test_wheel, 100);
+    InitTestEntries();
+
+    /*
+     * Spread over the first three levels, in a scrambled order.
+     */
+    for (int i = 0; i < 64; ++i) {
+        TimerWheelInsert(&test_wheel, &test_entries[i], 100 + ((i * 37) % 64) * 97);
+    }
+    assert(test_wheel.num_pending == 64);
+
+    /*
+     * Advancing by uneven steps shouldn't matter - everything goes off on the
+     * exact tick.
+     */
+    uint64_t tick = 100;
+    while (num_fired < 64) {
+        tick += rand() % 50;
+        TimerWheelAdvance(&test_wheel, tick);
+        assert(test_wheel.next_tick == tick + 1);
+    }
+
+    for (int i = 0; i < 64; ++i) {
+        assert(fired_at[i] == (uint64_t) (100 + ((i * 37) % 64) * 97));
+        assert(!test_entries[i].pending);
+    }
+    assert(test_wheel.num_pending == 0);
+}
+
+TFW_CREATE_TEST(TimerWheelSingleSteps) { TFW_IGNORE_UNUSED
+    TimerWheelInit(&test_wheel, 0);
+    InitTestEntries();
+
+    /*
+     * Includes ones right on level boundaries, and ones too far away to fit in
+     * the wheel at all.
+     */
+    uint64_t expiries[8] = {0, 63, 64, 4095, 4096, 262144, 16777216, 20000000};
+    for (int i = 0; i < 8; ++i) {
+        TimerWheelInsert(&test_wheel, &test_entries[i], expiries[i]);
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        TimerWheelAdvance(&test_wheel, expiries[i] - (expiries[i] == 0 ? 0 : 1));
+        assert(num_fired == (expiries[i] == 0 ? 1 : i));
+        TimerWheelAdvance(&test_wheel, expiries[i]);
+        assert(num_fired == i + 1);
+        assert(fired_at[i] == expiries[i]);
+    }
+}
+
+TFW_CREATE_TEST(TimerWheelCancellation) { TFW_IGNORE_UNUSED
+    TimerWheelInit(&test_wheel, 0);
+    InitTestEntries();
+
+    for (int i = 0; i < 64; ++i) {
+        TimerWheelInsert(&test_wheel, &test_entries[i], i * 100);
+    }
+
+    for (int i = 0; i < 64; i += 2) {
+        assert(TimerWheelCancel(&test_wheel, &test_entries[i]));
+        assert(!TimerWheelCancel(&test_wheel, &test_entries[i]));
+    }
+    assert(test_wheel.num_pending == 32);
+
+    TimerWheelAdvance(&test_wheel, 64 * 100);
+    assert(num_fired == 32);
+    for (int i = 0; i < 64; ++i) {
+        assert(fired_at[i] == (i % 2 == 0 ? 0 : (uint64_t) i * 100));
+    }
+
+    /*
+     * Timers that went off can't be cancelled, but can be reused.
+     */
+    assert(!TimerWheelCancel(&test_wheel, &test_entries[1]));
+    TimerWheelInsert(&test_wheel, &test_entries[1], 10);
+    TimerWheelAdvance(&test_wheel, 64 * 100 + 1);
+    assert(num_fired == 33);
+}
+
+TFW_CREATE_TEST(TimerWheelNextEvent) { TFW_IGNORE_UNUSED
+    TimerWheelInit(&test_wheel, 10);
+    InitTestEntries();
+    assert(TimerWheelGetNextEvent(&test_wheel) == TIMER_WHEEL_NO_EVENT);
+
+    /*
+     * Level 0 timers are exact, but for further ones we only get told when
+     * they'll be cascaded.
+     */
+    TimerWheelInsert(&test_wheel, &test_entries[0], 50);
+    assert(TimerWheelGetNextEvent(&test_wheel) == 50);
+    TimerWheelInsert(&test_wheel, &test_entries[1], 1000);
+    assert(TimerWheelGetNextEvent(&test_wheel) == 50);
+    TimerWheelCancel(&test_wheel, &test_entries[0]);
+    assert(TimerWheelGetNextEvent(&test_wheel) == 960);
+
+    TimerWheelAdvance(&test_wheel, 999);
+    assert(num_fired == 0);
+    assert(TimerWheelGetNextEvent(&test_wheel) == 1000);
+    TimerWheelAdvance(&test_wheel, 1000);
+    assert(num_fired == 1);
+    assert(TimerWheelGetNextEvent(&test_wheel) == TIMER_WHEEL_NO_EVENT);
+}
+
+void RegisterTfwTimerWheelTests(void) {
+    RegisterTfwTest("Timer wheels fire timers at the right tick", TFW_SP_ALL_CLEAR, TimerWheelExpiry, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Timer wheels cascade timers on level boundaries", TFW_SP_ALL_CLEAR, TimerWheelSingleSteps, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Timer wheels can cancel timers", TFW_SP_ALL_CLEAR, TimerWheelCancellation, PANIC_UNIT_TEST_OK, 0);
+    RegisterTfwTest("Timer wheels know when the next timer could go off", TFW_SP_ALL_CLEAR, TimerWheelNextEvent, PANIC_UNIT_TEST_OK, 0);
+}
+
+#endif
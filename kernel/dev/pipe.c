@@ -17,6 +17,12 @@
 #include <dirent.h>
 #include <panic.h>
 #include <ksignal.h>
+#include <thread.h>
+#include <virtual.h>
+#include <irql.h>
+#include <file.h>
+#include <fcntl.h>
+#include <dev.h>
 #include <mailbox.h>
 
 #define PIPE_SIGNATURE 0xa306a9b939f6d794
@@ -29,6 +35,11 @@ struct pipe {
 
 #define PIPE_SIZE 2048
 
+/*
+ * The most pages that VmsplicePipe() will lend at once.
+ */
+#define PIPE_MAX_LENT_PAGES 16
+
 static int ReadWrite(struct vnode* node, struct transfer* tr) {
     struct pipe* pipe = node->data;
     if (pipe->broken) {
@@ -42,9 +53,30 @@ static int ReadWrite(struct vnode* node, struct transfer* tr) {
     return MailboxAccess(pipe->mbox, tr);
 }
 
+static int Wait(struct vnode* node, int events, struct poll_table* table) {
+    struct pipe* pipe = node->data;
+
+    /*
+     * Once it's broken, reads give end-of-file and writes fail, straight away.
+     */
+    if (pipe->broken) {
+        return (events & (VNODE_WAIT_READ | VNODE_WAIT_WRITE)) | VNODE_WAIT_ERROR;
+    }
+
+    int ready = 0;
+    if ((events & VNODE_WAIT_READ) && MailboxPoll(pipe->mbox, false, table)) {
+        ready |= VNODE_WAIT_READ;
+    }
+    if ((events & VNODE_WAIT_WRITE) && MailboxPoll(pipe->mbox, true, table)) {
+        ready |= VNODE_WAIT_WRITE;
+    }
+    return ready;
+}
+
 static const struct vnode_operations dev_ops = {
     .read           = ReadWrite,
     .write          = ReadWrite,
+    .wait           = Wait,
 };
 
 /*
@@ -54,6 +86,8 @@ void BreakPipe(struct vnode* node) {
     struct pipe* pipe = node->data;
     if (pipe->sig == PIPE_SIGNATURE) {
         pipe->broken = true;
+        MailboxStopLending(pipe->mbox);
+        MailboxNotifyPollers(pipe->mbox);
     } else {
         PanicEx(PANIC_UNKNOWN, "some wonky driver set stat.st_mode = S_IFIFO,"
                              "but it doesn't use struct pipe internally!");
@@ -75,3 +109,168 @@ struct vnode* CreatePipe(void)
     node->data = pipe;
     return node;
 }
+
+static struct pipe* GetPipe(struct vnode* node) {
+    if (IFTODT(node->stat.st_mode) != DT_FIFO) {
+        return NULL;
+    }
+    struct pipe* pipe = node->data;
+    return pipe->sig == PIPE_SIGNATURE ? pipe : NULL;
+}
+
+bool IsPipe(struct vnode* node) {
+    return GetPipe(node) != NULL;
+}
+
+struct splice_context {
+    struct file* file;
+    bool into_pipe;
+};
+
+static int CopyBetweenPipeAndFile(uint8_t* data, int length, void* context, int* copied) {
+    struct splice_context* splice = context;
+    struct file* file = splice->file;
+
+    if (!splice->into_pipe && (file->flags & O_APPEND)) {
+        file->seek_position = file->node->stat.st_size;
+    }
+
+    struct transfer io = CreateKernelTransfer(
+        data, length, file->seek_position, splice->into_pipe ? TRANSFER_READ : TRANSFER_WRITE
+    );
+    int res = (splice->into_pipe ? ReadFile : WriteFile)(file, &io);
+    *copied = length - io.length_remaining;
+    file->seek_position += *copied;
+    return res;
+}
+
+/**
+ * Moves data between a pipe and a file without it going through a user 
+ * buffer. The file is read or written straight into or out of the pipe's 
+ * buffer, at the file's seek position.
+ *
+ * @param pipe_file The pipe to read from or write to.
+ * @param file      The other file, which must not be a pipe.
+ * @param into_pipe True to read from `file` into the pipe, false to go from the
+ *                  pipe to `file`.
+ * @param moved     Set to the number of bytes moved. Zero means the end of the
+ *                  file (or the pipe) was reached.
+ * @return 0 on success, or an errno code.
+ */
+int SplicePipe(struct file* pipe_file, struct file* file, bool into_pipe, uint64_t length, uint64_t* moved) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    *moved = 0;
+    struct pipe* pipe = GetPipe(pipe_file->node);
+    if (pipe == NULL || GetPipe(file->node) != NULL) {
+        return EINVAL;
+    }
+    if (into_pipe ? (!pipe_file->can_write || !file->can_read) : (!pipe_file->can_read || !file->can_write)) {
+        return EBADF;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    if (pipe->broken) {
+        if (!into_pipe) {
+            return 0;
+        }
+        RaiseSignal(GetThread(), SIGPIPE, false);
+        return EPIPE;
+    }
+
+    struct splice_context context = {.file = file, .into_pipe = into_pipe};
+    bool blockable = !(pipe_file->node->flags & O_NONBLOCK);
+    return MailboxAccessWith(pipe->mbox, into_pipe, length, blockable, CopyBetweenPipeAndFile, &context, moved);
+}
+
+/**
+ * Writes user memory into a pipe without copying it into the pipe's buffer. 
+ * The pages are pinned and lent to the pipe, and readers copy out of them 
+ * directly. Up to PIPE_MAX_LENT_PAGES pages are done at once, and this waits 
+ * until they have been read, or the pipe breaks. If the pipe is non-blocking, 
+ * this returns as soon as a reader has taken some of the data instead.
+ *
+ * While they're pinned, the pages are copy-on-write, so the data that gets read
+ * is what was there when this was called.
+ *
+ * @param moved Set to the number of bytes written.
+ * @return 0 on success, EFAULT if the memory isn't readable, or another errno
+ *         code.
+ */
+int VmsplicePipe(struct file* pipe_file, size_t address, size_t length, uint64_t* moved) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    *moved = 0;
+    struct pipe* pipe = GetPipe(pipe_file->node);
+    if (pipe == NULL) {
+        return EINVAL;
+    }
+    if (!pipe_file->can_write) {
+        return EBADF;
+    }
+    if (pipe->broken) {
+        RaiseSignal(GetThread(), SIGPIPE, false);
+        return EPIPE;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    size_t offset = address % ARCH_PAGE_SIZE;
+    size_t first_page = address - offset;
+    length = MIN(length, PIPE_MAX_LENT_PAGES * ARCH_PAGE_SIZE - offset);
+    int num_pages = (offset + length + ARCH_PAGE_SIZE - 1) / ARCH_PAGE_SIZE;
+
+    struct vas_entry* entries[PIPE_MAX_LENT_PAGES];
+    size_t pages[PIPE_MAX_LENT_PAGES];
+    int num_pinned = 0;
+    int res = 0;
+
+    /*
+     * Touching each page first brings it in if it was swapped out, or not 
+     * loaded yet.
+     */
+    for (; num_pinned < num_pages; ++num_pinned) {
+        size_t virtual = first_page + num_pinned * ARCH_PAGE_SIZE;
+        size_t dummy;
+        if (virtual < ARCH_USER_AREA_BASE || virtual >= ARCH_USER_AREA_LIMIT || ReadWordFromUsermode((size_t*) virtual, &dummy) != 0) {
+            break;
+        }
+        entries[num_pinned] = PinUserPage(virtual);
+        if (entries[num_pinned] == NULL) {
+            break;
+        }
+        pages[num_pinned] = MapVirt(entries[num_pinned]->physical, 0, ARCH_PAGE_SIZE, VM_READ | VM_LOCK | VM_MAP_HARDWARE, NULL, 0);
+    }
+
+    if (num_pinned == 0) {
+        res = EFAULT;
+    } else {
+        length = MIN(length, num_pinned * ARCH_PAGE_SIZE - offset);
+        size_t lent;
+        res = MailboxLend(pipe->mbox, pages, offset, length, !(pipe_file->node->flags & O_NONBLOCK), &lent);
+        *moved = lent;
+    }
+
+    for (int i = 0; i < num_pinned; ++i) {
+        UnmapVirt(pages[i], ARCH_PAGE_SIZE);
+        UnpinUserPage(entries[i]);
+    }
+
+    /*
+     * A non-blocking loan only goes ahead if a reader is already waiting, so
+     * otherwise just copy as much as fits into the pipe's buffer.
+     */
+    if (res == EAGAIN) {
+        struct transfer tr = CreateTransferReadingFromUser((const void*) address, length, 0);
+        tr.blockable = false;
+        res = MailboxAccess(pipe->mbox, &tr);
+        *moved = length - tr.length_remaining;
+    }
+    if (res == EPIPE) {
+        RaiseSignal(GetThread(), SIGPIPE, false);
+    }
+    return res;
+}
@@ -178,6 +178,28 @@ static int SubordinateWrite(struct vnode* node, struct transfer* tr) {
     return res;
 }
 
+static int PollMailboxes(int events, struct mailbox* readable, struct mailbox* writable, struct poll_table* table) {
+    int ready = 0;
+    if ((events & VNODE_WAIT_READ) && MailboxPoll(readable, false, table)) {
+        ready |= VNODE_WAIT_READ;
+    }
+    if ((events & VNODE_WAIT_WRITE) && MailboxPoll(writable, true, table)) {
+        ready |= VNODE_WAIT_WRITE;
+    }
+    return ready;
+}
+
+static int MasterWait(struct vnode* node, int events, struct poll_table* table) {
+    struct master_data* internal = node->data;
+    return PollMailboxes(events, internal->display_buffer, internal->keybrd_buffer, table);
+}
+
+static int SubordinateWait(struct vnode* node, int events, struct poll_table* table) {
+    struct sub_data* internal = (struct sub_data*) node->data;
+    struct master_data* master_internal = (struct master_data*) internal->master->data;
+    return PollMailboxes(events, master_internal->flushed_buffer, master_internal->display_buffer, table);
+}
+
 static int MasterClose(struct vnode* node) {
     struct master_data* internal = (struct master_data*) node->data;
     MailboxDestroy(internal->display_buffer);
@@ -236,12 +258,14 @@ static const struct vnode_operations master_operations = {
     .read           = MasterRead,
     .write          = MasterWrite,
     .close          = MasterClose,
+    .wait           = MasterWait,
 };
 
 static const struct vnode_operations subordinate_operations = {
     .read           = SubordinateRead,
     .write          = SubordinateWrite,
     .ioctl          = SubordinateIoctl,
+    .wait           = SubordinateWait,
 };
 
 void CreatePseudoTerminal(struct vnode** master, struct vnode** subordinate) {
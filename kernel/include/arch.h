@@ -15,7 +15,9 @@
 *	- ARCH_MAX_CPU_ALLOWED
 *	- ARCH_MAX_RAM_KBS
 *	- ARCH_BIG_ENDIAN or ARCH_LITTLE_ENDIAN
-*	- the address in the kernel area, ARCH_PROG_LOADER_BASE, where the program loader lives, and
+*	- the address in the kernel area, ARCH_PROG_LOADER_BASE, where the program loader lives,
+*	- the user address, ARCH_TIME_PAGE_ADDRESS, of the read-only page holding the clock, which
+*		must be at or above ARCH_PROG_LOADER_BASE so that it is kept on exec, and
 * 	- the valid user area, via ARCH_USER_AREA_BASE and ARCH_USER_AREA_LIMIT
 * 	- the valid kernel area, via ARCH_KRNL_SBRK_BASE and ARCH_KRNL_SBRK_LIMIT
 *    		(the kernel and user areas must not overlap, but ARCH_USER_AREA_LIMIT may equal ARCH_KRNL_SBRK_BASE
@@ -65,6 +67,15 @@ struct arch_driver_t;
 */
 void ArchStallProcessor(void);
 
+/*
+* Turns off the current CPU's periodic timer, sets it to interrupt once after (at 
+* most) `nanos` nanoseconds, and waits for an interrupt. The periodic timer is
+* back on by the time it returns. Must be called with interrupts disabled, and
+* returns with them enabled. Any time that passes must still get reported to
+* ReceivedTimer().
+*/
+void ArchIdleWithOneShotTimer(uint64_t nanos);
+
 #define ARCH_POWER_STATE_REBOOT	1
 #define ARCH_POWER_STATE_SHUTDOWN 2
 #define ARCH_POWER_STATE_SLEEP 3
@@ -72,6 +83,25 @@ int ArchSetPowerState(int power_state);
 
 void ArchSpinlockAcquire(volatile size_t* lock);
 void ArchSpinlockRelease(volatile size_t* lock);
+bool ArchSpinlockTryAcquire(volatile size_t* lock);
+
+/*
+* Atomically sets `*value` to `desired` if it is currently `expected`, across
+* all CPUs. Returns whether it did.
+*/
+bool ArchCompareAndSwap(volatile uint32_t* value, uint32_t expected, uint32_t desired);
+
+/*
+* Atomically adds `amount` to `*value` across all CPUs, and returns what it was
+* beforehand.
+*/
+uint32_t ArchFetchAndAdd(volatile uint32_t* value, uint32_t amount);
+
+/*
+* Tells the CPU that we are in a busy-wait loop, so it can save power or give
+* its resources to another hyperthread.
+*/
+void ArchRelaxCpu(void);
 
 /*
 * To be called repeatedly until it returns NULL. Each time will return a new memory
@@ -84,6 +114,11 @@ struct boot_memory_entry* ArchGetMemory(struct kernel_boot_info* boot_info) warn
 
 uint64_t ArchReadTimestamp(void);
 
+/*
+* Whether ArchReadTimestamp() counts at a steady enough rate to keep time with.
+*/
+bool ArchHasUsableTimestamp(void);
+
 void ArchFlushTlb(struct vas* vas);
 void ArchAddMapping(struct vas* vas, struct vas_entry* entry);
 void ArchUpdateMapping(struct vas* vas, struct vas_entry* entry);
@@ -102,6 +137,12 @@ size_t ArchPrepareStack(size_t addr);
 
 void ArchSwitchToUsermode(size_t entry_point, size_t user_stack, void* arg);
 
+/*
+* Sets where the current CPU's user thread-local storage starts. It only needs
+* to take effect by the time the CPU next returns to usermode.
+*/
+void ArchSetUserTls(size_t base);
+
 void ArchCallGlobalConstructors(void);
 
 void ArchInitDev(bool fs);
@@ -143,6 +184,13 @@ void ArchSendEoi(int irq_num);
  */
 void ArchSetIrql(int irql);
 
+/*
+* For short sections that must not be interrupted, but can be reached with
+* interrupts either on or off.
+*/
+size_t ArchSaveAndDisableInterrupts(void);
+void ArchRestoreInterrupts(size_t state);
+
 void ArchInitBootstrapCpu(struct cpu* cpu);
 
 /*
@@ -151,4 +199,11 @@ void ArchInitBootstrapCpu(struct cpu* cpu);
  */
 bool ArchInitNextCpu(struct cpu* cpu);
 
+/*
+ * Interrupts another CPU so that it notices its `postponed_task_switch` as soon
+ * as possible. May do nothing, in which case it will be noticed on the CPU's 
+ * next timer interrupt.
+ */
+void ArchSendRescheduleIpi(int cpu);
+
 
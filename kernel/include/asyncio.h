@@ -0,0 +1,18 @@
+#pragma once
+
+#include <common.h>
+
+/*
+ * Asynchronous I/O rings - see sys/ioring.h for the layout shared with the
+ * program using it.
+ */
+
+struct aio_ring;
+struct vas;
+struct fd_table;
+
+size_t GetAioRingSize(int entries);
+struct aio_ring* CreateAioRing(struct vas* vas, struct fd_table* fd_table, void* memory, int entries, bool user);
+int SubmitToAioRing(struct aio_ring* ring, uint32_t to_submit, uint32_t* submitted_out);
+int WaitForAioRing(struct aio_ring* ring, uint32_t min_complete, int timeout_ms);
+void DestroyAioRing(struct aio_ring* ring);
@@ -6,7 +6,7 @@
 
 struct vas;
 struct thread;
-struct tree;
+struct cpu_deferrals;
 
 struct cpu {
     struct vas* current_vas;
@@ -15,13 +15,9 @@ struct cpu {
     size_t cpu_number;
     int irql;
 
-    struct heap_adt* deferred_functions;
-    struct heap_adt* irq_deferred_functions;
+    struct cpu_deferrals* deferrals;
     bool init_irql_done;
     bool postponed_task_switch;
-
-    struct tree* global_vas_mappings;
-    struct spinlock global_mappings_lock;
 };
 
 void InitCpuTable(void);
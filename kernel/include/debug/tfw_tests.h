@@ -8,6 +8,18 @@ void RegisterTfwIrqlTests(void);
 void RegisterTfwAVLTreeTests(void);
 void RegisterTfwHeapAdtTests(void);
 void RegisterTfwSemaphoreTests(void);
+void RegisterTfwRwLockTests(void);
+void RegisterTfwFutexTests(void);
+void RegisterTfwSpinlockTests(void);
+void RegisterTfwMailboxTests(void);
+void RegisterTfwMessageTests(void);
+void RegisterTfwPollTests(void);
+void RegisterTfwSharedMemoryTests(void);
+void RegisterTfwAioRingTests(void);
 void RegisterTfwWaitTests(void);
+void RegisterTfwRunQueueTests(void);
+void RegisterTfwThreadListTests(void);
+void RegisterTfwTimerWheelTests(void);
+void RegisterTfwTimerTests(void);
 
 #endif
\ No newline at end of file
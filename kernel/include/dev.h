@@ -1,5 +1,7 @@
 #pragma once
 
+#include <common.h>
+
 void InitNullDevice(void);
 void InitRandomDevice(void);
 
@@ -7,5 +9,10 @@ struct vnode;
 
 void CreatePseudoTerminal(struct vnode** master, struct vnode** subordinate);
 
+struct file;
+
 struct vnode* CreatePipe(void);
-void BreakPipe(struct vnode* node);
\ No newline at end of file
+void BreakPipe(struct vnode* node);
+bool IsPipe(struct vnode* node);
+int SplicePipe(struct file* pipe_file, struct file* file, bool into_pipe, uint64_t length, uint64_t* moved);
+int VmsplicePipe(struct file* pipe_file, size_t address, size_t length, uint64_t* moved);
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <common.h>
+
+void InitFutexes(void);
+int FutexWait(size_t address, int expected, int timeout_ms);
+int FutexWake(size_t address, int count);
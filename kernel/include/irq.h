@@ -9,7 +9,11 @@
 #define UNHANDLED_FAULT_DIVISION    3
 
 typedef int(*irq_handler_t)(platform_irq_context_t*);
+typedef void(*irq_bottom_half_t)(const size_t* data, int count);
 
 int RegisterIrqHandler(int irq_num, irq_handler_t handler);
+int RegisterThreadedIrqHandler(int irq_num, irq_handler_t top_half, irq_bottom_half_t bottom_half, int priority);
+void QueueIrqData(int irq_num, size_t data);
 void RespondToIrq(int irq_num, int required_irql, platform_irq_context_t* context);
+void ReplayIrq(int irq_num, int required_irql);
 void UnhandledFault(int type);
\ No newline at end of file
@@ -38,6 +38,7 @@
 
 void PostponeScheduleUntilStandardIrql(void);
 void DeferUntilIrql(int irql, void(*handler)(void*), void* context);
+int DeferUntilIrqlOnCpu(int cpu_index, int irql, void(*handler)(void*), void* context);
 int GetIrql(void);
 int RaiseIrql(int level);
 void LowerIrql(int level);
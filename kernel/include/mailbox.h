@@ -3,31 +3,10 @@
 #include <common.h>
 
 struct mailbox;
+struct transfer;
+struct poll_table;
 
-
-#include <heap.h>
-#include <assert.h>
-#include <common.h>
-#include <spinlock.h>
-#include <semaphore.h>
-#include <errno.h>
-#include <thread.h>
-#include <panic.h>
-#include <log.h>
-#include <irql.h>
-
-struct mailbox {
-    uint8_t* data;
-    int total_size;
-    int used_size;
-    int start_pos;
-    int end_pos;
-    struct semaphore* full_sem;
-    struct semaphore* empty_sem;
-    struct semaphore* add_mtx;
-    struct semaphore* get_mtx;
-    struct semaphore* inner_mtx;
-};
+typedef int (*mailbox_copy_t)(uint8_t* data, int length, void* context, int* copied);
 
 struct mailbox* MailboxCreate(int size);
 void MailboxDestroy(struct mailbox* mbox);
@@ -37,4 +16,9 @@ int MailboxAdd(struct mailbox* mbox, int timeout, uint8_t c);
 int MailboxWaitGettable(struct mailbox* mbox, int timeout);
 int MailboxGet(struct mailbox* mbox, int timeout, uint8_t* c);
 
-int MailboxAccess(struct mailbox* mbox, struct transfer* tr);
\ No newline at end of file
+int MailboxAccess(struct mailbox* mbox, struct transfer* tr);
+int MailboxAccessWith(struct mailbox* mbox, bool write, uint64_t max, bool blockable, mailbox_copy_t copy, void* context, uint64_t* moved);
+int MailboxLend(struct mailbox* mbox, const size_t* pages, size_t offset, size_t length, bool blockable, size_t* lent);
+void MailboxStopLending(struct mailbox* mbox);
+bool MailboxPoll(struct mailbox* mbox, bool write, struct poll_table* table);
+void MailboxNotifyPollers(struct mailbox* mbox);
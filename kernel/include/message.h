@@ -2,9 +2,13 @@
 
 #include <common.h>
 
+#define MSGBOX_FAIL_WHEN_FULL   1
+
 struct msgbox;
 
 struct msgbox* CreateMessageBox(const char* name, int payload_size);
+struct msgbox* CreateBoundedMessageBox(const char* name, int payload_size, int capacity, int flags);
 void DestroyMessageBox(struct msgbox* mbox);
 int SendMessage(struct msgbox* mbox, void* payload);
 int ReceiveMessage(struct msgbox* mbox, void* payload);
+int ReceiveMessages(struct msgbox* mbox, void* payloads, int max_count);
@@ -109,6 +109,7 @@ enum {
     PANIC_CONFLICTING_ALLOCATION_REQUIREMENTS,
     PANIC_BUS_FAULT,
     PANIC_MEMORY_FAULT,
+    PANIC_DEFERRED_QUEUE_FULL,
 
     _PANIC_HIGHEST_VALUE
 };
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <common.h>
+#include <spinlock.h>
+
+/*
+ * Lets a thread wait for any one of a number of objects to become ready, for
+ * implementing poll(). 
+ *
+ * Anything that can be waited on has a `struct poll_head`, and calls 
+ * NotifyPoll() on it whenever its state changes. A thread that wants to wait
+ * passes a `struct poll_table` to each object, which calls PollWait() to add 
+ * the table to its head before checking whether it is ready. If nothing was 
+ * ready, the thread blocks until one of the heads it was added to gets 
+ * notified, and then checks again.
+ */
+
+struct poll_entry;
+struct vnode;
+
+struct poll_head {
+    struct spinlock lock;
+    struct poll_entry* entries;
+};
+
+struct poll_table {
+    struct semaphore* wakeup;
+    struct spinlock lock;
+    bool woken;
+    struct poll_entry* entries;
+};
+
+void InitPollHead(struct poll_head* head);
+void PollWait(struct poll_table* table, struct poll_head* head);
+void NotifyPoll(struct poll_head* head);
+int PollVnodes(struct vnode** nodes, const int* events, int* revents, int count, int timeout_ms, int* ready_out);
@@ -6,6 +6,16 @@
 
 struct fd_table;
 struct vnode;
+struct thread;
+struct aio_ring;
+
+/*
+ * Threads other than the first get their user stacks in fixed-size slots below
+ * the main stack, so that each one has a distinct address. A bit is set in
+ * `user_stack_slots` for each slot that is in use.
+ */
+#define USER_THREAD_STACK_SIZE  (1024 * 1024)
+#define MAX_USER_THREAD_STACKS  64
 
 struct process {
     pid_t pid;
@@ -20,6 +30,8 @@ struct process {
     int retv;
     bool terminated;
     struct vnode* cwd;
+    uint32_t user_stack_slots[MAX_USER_THREAD_STACKS / 32];
+    struct aio_ring* aio_ring;
 };
 
 void InitProcess(void);
@@ -35,7 +47,13 @@ pid_t GetPid(struct process* prcss);
 
 struct fd_table* GetFdTable(struct process* prcss); 
 
+void LockProcess(struct process* prcss);
+void UnlockProcess(struct process* prcss);
+
 void AddThreadToProcess(struct process* prcss, struct thread* thr);
+bool RemoveThreadFromProcess(struct process* prcss, struct thread* thr);
+int AllocUserStackSlot(struct process* prcss);
+void FreeUserStackSlot(struct process* prcss, int slot);
 struct process* CreateProcessWithEntryPoint(pid_t parent, void(*entry_point)(void*), void* arg);
 
 struct thread* GetArbitraryThreadFromProcess(struct process* p);
\ No newline at end of file
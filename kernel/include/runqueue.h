@@ -0,0 +1,28 @@
+#pragma once
+
+#include <common.h>
+#include <threadlist.h>
+
+/*
+ * One list per priority level (0 is the highest, 255 is idle). A two-level
+ * bitmap records which levels are non-empty, so that the highest priority
+ * ready thread can be found with two bit scans instead of walking a list.
+ */
+#define RUN_QUEUE_NUM_PRIORITIES    256
+#define RUN_QUEUE_BITMAP_WORDS      (RUN_QUEUE_NUM_PRIORITIES / 32)
+
+struct run_queue {
+    struct thread_list levels[RUN_QUEUE_NUM_PRIORITIES];
+    uint32_t level_bitmap[RUN_QUEUE_BITMAP_WORDS];
+    uint32_t word_bitmap;
+    int num_threads;
+};
+
+void RunQueueInit(struct run_queue* rq);
+void RunQueueInsert(struct run_queue* rq, struct thread* thr);
+void RunQueueInsertAtFront(struct run_queue* rq, struct thread* thr);
+void RunQueueDelete(struct run_queue* rq, struct thread* thr);
+struct thread* RunQueuePeek(struct run_queue* rq);
+struct thread* RunQueueDeleteTop(struct run_queue* rq);
+bool RunQueueContains(struct run_queue* rq, struct thread* thr);
+struct thread* RunQueueFind(struct run_queue* rq, bool (*match)(struct thread*, void*), void* context);
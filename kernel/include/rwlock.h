@@ -0,0 +1,39 @@
+#pragma once
+
+#include <common.h>
+
+/*
+ * Reader-writer locks, for tables that are read far more often than they are
+ * changed. Any number of readers can hold the lock at once, or a single writer.
+ * Writers get preference - once one is waiting, no new readers are let in - so
+ * that a steady stream of readers can't keep them out forever.
+ *
+ * `struct rwlock` blocks while it waits, like a mutex. `struct spin_rwlock`
+ * spins, like a spinlock, and raises the IRQL while it's held.
+ */
+
+struct rwlock;
+
+struct rwlock* CreateRwLock(const char* name);
+void AcquireRwLockRead(struct rwlock* lock);
+void ReleaseRwLockRead(struct rwlock* lock);
+void AcquireRwLockWrite(struct rwlock* lock);
+void ReleaseRwLockWrite(struct rwlock* lock);
+int DestroyRwLock(struct rwlock* lock);
+
+struct spin_rwlock {
+    volatile size_t guard;
+    volatile int readers;
+    volatile int waiting_writers;
+    volatile bool writer;
+    char name[16];
+    int irql;
+    int writer_prev_irql;
+};
+
+void InitSpinRwLock(struct spin_rwlock* lock, const char* name, int irql);
+int AcquireSpinRwLockRead(struct spin_rwlock* lock);
+void ReleaseSpinRwLockRead(struct spin_rwlock* lock, int prev_irql);
+void AcquireSpinRwLockWrite(struct spin_rwlock* lock);
+void ReleaseSpinRwLockWrite(struct spin_rwlock* lock);
+bool IsSpinRwLockWriteHeld(struct spin_rwlock* lock);
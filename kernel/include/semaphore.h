@@ -18,9 +18,10 @@ int ReleaseSemaphoreEx(struct semaphore* sem, int count);
 int DestroySemaphore(struct semaphore* sem, int mode);
 int FillSemaphore(struct semaphore* sem);
 
-#define CreateMutex(name) CreateSemaphore(name, 1, 0)
+struct semaphore* CreateAdaptiveMutex(const char* name);
+struct thread* GetMutexOwner(struct semaphore* mtx);
+
+#define CreateMutex(name) CreateAdaptiveMutex(name)
 #define AcquireMutex(mtx, timeout_ms) AcquireSemaphore(mtx, timeout_ms)
 #define ReleaseMutex(mtx) ReleaseSemaphore(mtx)
 #define DestroyMutex(mtx) DestroySemaphore(mtx, SEM_REQUIRE_ZERO)
-
-void CancelSemaphoreOfThread(struct thread* thr);
\ No newline at end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <common.h>
+#include <sys/types.h>
+
+#define SHM_MAX_NAME    63
+
+struct vnode;
+struct file;
+
+void InitSharedMemory(void);
+int OpenSharedMemory(const char* name, int flags, mode_t mode, struct file** out);
+int UnlinkSharedMemory(const char* name);
+bool IsSharedMemory(struct vnode* node);
+size_t LockSharedMemoryPage(struct vnode* node, off_t offset, bool* fresh);
+void UnlockSharedMemoryPage(struct vnode* node);
@@ -4,14 +4,39 @@
 
 struct thread;
 
+/*
+ * Contention counters, for locks that have been passed to TrackSpinlock(). The
+ * cycle counts come from ArchReadTimestamp(), and stay at zero if the CPU has
+ * no timestamp counter. They are only updated while the lock is held, so they
+ * don't need to be atomic.
+ */
+struct spinlock_stats {
+    uint32_t acquisitions;
+    uint32_t contended_acquisitions;
+    uint64_t spin_cycles;
+    uint64_t max_hold_cycles;
+    uint64_t acquired_at;
+};
+
+/*
+ * Spinlocks are ticket locks, so CPUs get the lock in the order they asked for
+ * it. The lock is free when `now_serving` has caught up to `next_ticket`.
+ */
 struct spinlock {
-    size_t lock;
+    volatile uint32_t next_ticket;
+    volatile uint32_t now_serving;
     char name[16];
     int irql;
     int prev_irql;
+    int owner_cpu;
+    bool tracked;
+    struct spinlock_stats stats;
 };
 
 void InitSpinlock(struct spinlock* lock, const char* name, int irql);
 int AcquireSpinlock(struct spinlock* lock);
+bool TryAcquireSpinlock(struct spinlock* lock);
 void ReleaseSpinlock(struct spinlock* lock);
-bool IsSpinlockHeld(struct spinlock* lock);
\ No newline at end of file
+bool IsSpinlockHeld(struct spinlock* lock);
+void TrackSpinlock(struct spinlock* lock);
+void DumpSpinlockStats(const char* name);
@@ -8,8 +8,12 @@ int HandleSystemCall(int call, size_t a, size_t b, size_t c, size_t d, size_t e)
 #define SYSINFO_TOTAL_RAM_KB    1
 #define SYSINFO_OS_VERSION      2
 #define SYSINFO_IS_SUPPORTED    3
+#define SYSINFO_DUMP_SPINLOCKS  4
 
-#define _SYSINFO_NUM_CMDS       4
+#define _SYSINFO_NUM_CMDS       5
+
+#define FUTEX_WAIT              0
+#define FUTEX_WAKE              1
 
 int SysYield(size_t, size_t, size_t, size_t, size_t);
 int SysTerminate(size_t, size_t, size_t, size_t, size_t);
@@ -37,3 +41,14 @@ int SysNanosleep(size_t, size_t, size_t, size_t, size_t);
 int SysSignal(size_t, size_t, size_t, size_t, size_t);
 int SysPgid(size_t, size_t, size_t, size_t, size_t);
 int SysAlarm(size_t, size_t, size_t, size_t, size_t);
+int SysFutex(size_t, size_t, size_t, size_t, size_t);
+int SysCreateThread(size_t, size_t, size_t, size_t, size_t);
+int SysSetTls(size_t, size_t, size_t, size_t, size_t);
+int SysSplice(size_t, size_t, size_t, size_t, size_t);
+int SysVmsplice(size_t, size_t, size_t, size_t, size_t);
+int SysPoll(size_t, size_t, size_t, size_t, size_t);
+int SysShmOpen(size_t, size_t, size_t, size_t, size_t);
+int SysShmUnlink(size_t, size_t, size_t, size_t, size_t);
+int SysTruncate(size_t, size_t, size_t, size_t, size_t);
+int SysIoRingSetup(size_t, size_t, size_t, size_t, size_t);
+int SysIoRingEnter(size_t, size_t, size_t, size_t, size_t);
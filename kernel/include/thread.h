@@ -2,6 +2,8 @@
 
 #include <common.h>
 #include <signal.h>
+#include <timerwheel.h>
+#include <threadlist.h>
 
 struct semaphore;
 struct process;
@@ -14,6 +16,9 @@ struct process;
 #define THREAD_STATE_TERMINATED                             5
 #define THREAD_STATE_STOPPED                                6
 #define THREAD_STATE_WAITING_FOR_SIGNAL                     7
+#define THREAD_STATE_WAITING_FOR_RWLOCK                     8
+#define THREAD_STATE_WAITING_FOR_FUTEX                      9
+#define THREAD_STATE_WAITING_FOR_TERMINATED_THREADS         10
 
 #define SCHEDULE_POLICY_FIXED             0
 #define SCHEDULE_POLICY_USER_HIGHER       1
@@ -25,13 +30,19 @@ struct process;
 #define FIXED_PRIORITY_IDLE               255
 
 /*
- * Determines which of the 'next' pointers are used to manage the list.
+ * The value of `inherited_priority` when no one is waiting on a mutex that the
+ * thread holds. It's less important than any real priority.
+ */
+#define NO_INHERITED_PRIORITY             256
+
+/*
+ * Determines which of the list links are used to manage the list.
  * A thread can be on multiple lists so long as they are different numbers.
- * Can increase the number of 'next' pointers in the thread struct to make them distinct if needed.
+ * Can increase the number of links in the thread struct to make them distinct if needed.
  */
 #define NEXT_INDEX_READY       0
-#define NEXT_INDEX_SLEEP       1
-#define NEXT_INDEX_SEMAPHORE   2
+#define NEXT_INDEX_SEMAPHORE   1
+#define NEXT_INDEX_RWLOCK      1        // can't wait on a semaphore and a rwlock at once
 #define NEXT_INDEX_TERMINATED  0        // terminated can share the ready list
 
 struct thread {
@@ -46,18 +57,30 @@ struct thread {
     void (*initial_address)(void*);
 
     /*
-     * Allows a thread to be on a timer and a semaphore list at the same time.
-     * Very sketchy stuff.
+     * Allows a thread to be on the ready and a semaphore list at the same time.
+     * Indexed by the NEXT_INDEX_ values.
      */
-    struct thread* next[3];
+    struct thread_list_link links[2];
 
     int thread_id;
     int state;
     void* argument;
     uint64_t time_used;
     char* name;
-    int priority;
     int schedule_policy;
+
+    /*
+     * `priority` is the one the scheduler uses. It's normally `base_priority`
+     * (which is what the policy sets), but is raised to `inherited_priority`
+     * while a more important thread waits on a mutex this one holds. Those
+     * mutexes are kept on `contended_mutexes`. Only changed with the scheduler
+     * lock held.
+     */
+    int priority;
+    int base_priority;
+    int inherited_priority;
+    struct semaphore* contended_mutexes;
+
     size_t canary_position;
     bool timed_out;
     bool timed_out_due_to_signal;
@@ -66,6 +89,13 @@ struct thread {
 
     struct semaphore* waiting_on_semaphore;
 
+    /*
+     * Whether the thread's semaphore wait has a timeout, and so its sleep timer
+     * might wake it before it gets the semaphore. Set before it goes on the
+     * wait list.
+     */
+    bool semaphore_wait_timed;
+
     struct process* process;
 
     bool signal_intr;
@@ -74,6 +104,18 @@ struct thread {
     sigset_t prev_blocked_signals;
     size_t user_common_signal_handler;
 
+    /*
+     * For threads in user processes. `user_tls` is the base of the thread's
+     * thread-local storage. If `clear_tid_address` is set, the thread's id is 
+     * written there when it starts, and zero is written there (and any futex
+     * waiters woken) when it exits - that's what lets other threads join it.
+     * `user_stack_slot` is the process' stack slot the thread's user stack is
+     * in, or -1 for the main stack.
+     */
+    size_t user_tls;
+    size_t clear_tid_address;
+    int user_stack_slot;
+
     /*
      * The system time at which this task's time has expired. If this is 0, then the task will not have a set time limit.
      * This value is set to GetSystemTimer() + TIMESLICE_LENGTH_MS when the task is scheduled in, and doesn't change until
@@ -83,7 +125,23 @@ struct thread {
     uint64_t gifted_timeslice;
 
     uint64_t sleep_expiry;
+    struct timer_wheel_entry sleep_timer;
     int alarm_id;
+
+    /*
+     * The CPU whose run queue the thread is on, or that it last ran on. The
+     * affinity is a preferred CPU (or -1 for none), but is only a hint. A 
+     * pinned thread will only ever run on `cpu`.
+     */
+    int cpu;
+    int cpu_affinity;
+    bool pinned;
+
+    /*
+     * Set while a CPU is using this thread's stack, which can be slightly 
+     * longer than the thread is actually running for.
+     */
+    volatile bool on_cpu;
 };
 
 bool HasBeenSignalled();
@@ -96,6 +154,7 @@ void UnpreventScheduler(void);
 
 void InitScheduler(void);
 void StartMultitasking(void);
+void StartMultitaskingOnOtherCpu(void);
 
 void AssertSchedulerLockHeld(void);
 
@@ -113,6 +172,7 @@ void BlockThread(int reason);
 void UnblockThread(struct thread* thr);
 void UnblockThreadGiftingTimeslice(struct thread* thr);
 int SetThreadPriority(struct thread* thread, int policy, int priority);
+void SetInheritedPriority(struct thread* thr, int priority);
 
 void StopThread(struct thread* thr);
 void ContinueThread(struct thread* thr);
@@ -121,11 +181,16 @@ int SleepUntil(uint64_t system_time_ns);
 int SleepNano(uint64_t delta_ns);
 int SleepMilli(uint32_t delta_ms);
 
-void HandleSleepWakeups(void* sys_time_ptr); // used internally between timer.c and thread.c
+void HandleSleepWakeups(void* context); // used internally between timer.c and thread.c
 void InitIdle(void);
 void InitCleaner(void);
+size_t TakeCachedKernelStack(size_t size);
+void TrimKernelStackCache(void);
 
 struct process* CreateUsermodeProcess(struct process* parent, const char* filename);
+int CreateUserThread(size_t entry_point, size_t argument, size_t tls, size_t clear_tid_address, int* thread_id);
+void ExitUserThread(int status);
+void SetUserTls(size_t base);
 
 /*
  * A thread can lock itself onto the current cpu. Task switches *STILL OCCUR*, but we ensure that
@@ -137,4 +202,6 @@ struct process* CreateUsermodeProcess(struct process* parent, const char* filena
  */
 void AssignThreadToCpu(void);
 void UnassignThreadToCpu(void);
+int SetThreadAffinity(struct thread* thr, int cpu);
+void SetIdleThread(struct thread* thr, int cpu);
 
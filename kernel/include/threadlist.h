@@ -3,6 +3,18 @@
 #include <common.h>
 
 struct thread;
+struct thread_list;
+
+/*
+ * The links a thread uses to sit on a thread list. Each thread has one of these
+ * per list index. `list` says which list (if any) the thread is currently on, so
+ * membership can be checked without walking the list.
+ */
+struct thread_list_link {
+    struct thread* next;
+    struct thread* prev;
+    struct thread_list* list;
+};
 
 struct thread_list {
     struct thread* head;
@@ -3,9 +3,18 @@
 #include <common.h>
 
 uint64_t GetSystemTimer(void);
+uint64_t GetTickTimer(void);
 
 void ReceivedTimer(uint64_t nanos);
 void InitTimer(void);
+void InitClocksource(void);
+void InitWallClock(void);
+void IdleUntilNextTimerEvent(void);
+
+uint64_t GetUtcTime(void);
+int SetUtcTime(uint64_t utc);
+int64_t GetTimezoneOffset(void);
+int MapTimePageIntoAddressSpace(void);
 
 int CreateAlarmAbsolute(uint64_t system_time_ns, void (*callback)(void*), void* arg, int* id_out);
 int CreateAlarmMicro(uint64_t delta_us, void (*callback)(void*), void* arg, int* id_out);
@@ -18,4 +27,6 @@ int InstallUnixAlarm(uint64_t microseconds, uint64_t* remaining_microsecs);
  */
 struct thread;
 void QueueForSleep(struct thread* thr);
-bool TryDequeueForSleep(struct thread* thr);
\ No newline at end of file
+bool TryDequeueForSleep(struct thread* thr);
+void InterruptSleep(struct thread* thr);
+void InitSleepTimer(struct thread* thr);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <common.h>
+
+/*
+ * Four levels of 64 slots. Each level covers 64 times the range of the one
+ * below it, so with one tick per level 0 slot, timers up to 2^24 ticks away can
+ * be placed directly. Anything further out gets parked at the far end and
+ * re-placed when it gets there.
+ */
+#define TIMER_WHEEL_LEVELS          4
+#define TIMER_WHEEL_SLOT_BITS       6
+#define TIMER_WHEEL_SLOTS           (1 << TIMER_WHEEL_SLOT_BITS)
+
+#define TIMER_WHEEL_NO_EVENT        ((uint64_t) -1)
+
+struct timer_wheel_entry {
+    struct timer_wheel_entry* next;
+    struct timer_wheel_entry* prev;
+    struct timer_wheel_entry** slot;
+    uint64_t expiry;
+    void (*handler)(void*);
+    void* context;
+    bool pending;
+};
+
+struct timer_wheel {
+    struct timer_wheel_entry* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t next_tick;
+    int num_pending;
+};
+
+void TimerWheelInit(struct timer_wheel* wheel, uint64_t current_tick);
+void TimerWheelEntryInit(struct timer_wheel_entry* entry, void (*handler)(void*), void* context);
+void TimerWheelInsert(struct timer_wheel* wheel, struct timer_wheel_entry* entry, uint64_t expiry);
+bool TimerWheelCancel(struct timer_wheel* wheel, struct timer_wheel_entry* entry);
+void TimerWheelAdvance(struct timer_wheel* wheel, uint64_t current_tick);
+uint64_t TimerWheelGetNextEvent(struct timer_wheel* wheel);
@@ -35,7 +35,7 @@ struct vas_entry {
     uint8_t file            : 1;        /* Whether or not the page is file-mapped. */
     uint8_t cow             : 1;        /* */
     uint8_t swapfile        : 1;        /* Whether or not the page has been moved to a swapfile. Will not occur if 'file' is set (will back to that file instead)*/
-    uint8_t                 : 1;           
+    uint8_t shared_memory   : 1;        /* Backed by a shared memory object (in 'file_node'), which owns the physical page. 'file' is clear. */
     uint8_t read            : 1;
     uint8_t write           : 1;
 
@@ -91,6 +91,9 @@ int WipeUsermodePages(void);
 
 size_t GetPhysFromVirt(size_t virtual);
 
+struct vas_entry* PinUserPage(size_t virtual);
+void UnpinUserPage(struct vas_entry* entry);
+
 struct vas* GetKernelVas(void);     // a kernel vas
 struct vas* GetVas(void);           // current vas
 
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 
 struct vnode;
+struct poll_table;
 
 /*
 * Operations which can be performed on an abstract file. They may be left NULL,
@@ -42,6 +43,13 @@ struct vnode;
 *   follow: default ENOTDIR
 *           Returns the vnode associated with a child of the current vnode.
 *           Fails on files (ENOTDIR).
+*
+*   wait: default events & (VNODE_WAIT_READ | VNODE_WAIT_WRITE)
+*           Returns which of the VNODE_WAIT_* events in `events` the file is 
+*           ready for right now, without blocking. VNODE_WAIT_ERROR can be
+*           returned even if it wasn't asked for. If `table` is not NULL, it 
+*           must be added (with PollWait) to whatever gets notified when that 
+*           changes, before checking. Files that never block can leave it NULL.
 */
 
 #define VNODE_WAIT_READ             (1 << 0)
@@ -62,6 +70,7 @@ struct vnode_operations {
     int (*truncate)(struct vnode* node, off_t offset);
     int (*create)(struct vnode* node, struct vnode** out, const char* name, int flags, mode_t mode);
     int (*follow)(struct vnode* node, struct vnode** out, const char* name);
+    int (*wait)(struct vnode* node, int events, struct poll_table* table);
 
     /*
      * Must fail with EISDIR on directories. Should only decrement st.st_nlink, 
@@ -117,4 +126,5 @@ uint8_t VnodeOpDirentType(struct vnode* node);
 int VnodeOpCreate(struct vnode* node, struct vnode** out, const char* name, int flags, mode_t mode);
 int VnodeOpFollow(struct vnode* node, struct vnode** out, const char* name);
 int VnodeOpUnlink(struct vnode* node);
-int VnodeOpDelete(struct vnode* node);
\ No newline at end of file
+int VnodeOpDelete(struct vnode* node);
+int VnodeOpWait(struct vnode* node, int events, struct poll_table* table);
\ No newline at end of file
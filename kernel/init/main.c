@@ -24,6 +24,8 @@
 #include <string.h>
 #include <filesystem.h>
 #include <driver.h>
+#include <futex.h>
+#include <sharedmem.h>
 
 /*
  * Next steps:
@@ -110,6 +112,7 @@ static void InitSerialDebugging(void) {
 void InitThread(void*) {
     InitRandomDevice();
     InitNullDevice();
+    InitSharedMemory();
     InitConsole();
     InitProcess();
     InitDiskCaches();
@@ -156,9 +159,12 @@ void KernelMain(struct kernel_boot_info* boot_info) {
     InitVfs();
     InitTimer();
     InitScheduler();    
+    InitFutexes();
     InitDiskUtil();
     InitHeap();
     InitBootstrapCpu();
+    InitClocksource();
+    InitWallClock();
     InitVirt();
     ReinitPhys();
     InitOtherCpu();
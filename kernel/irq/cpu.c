@@ -19,9 +19,9 @@ static void InitCpuTableEntry(int index) {
     struct cpu* cpu = cpu_table + index;
     cpu->cpu_number = index;
     cpu->irql = IRQL_STANDARD;
-    cpu->global_vas_mappings = NULL;
     cpu->current_vas = NULL;
     cpu->current_thread = NULL;
+    cpu->deferrals = NULL;
     cpu->init_irql_done = false;
     cpu->postponed_task_switch = false;
     if (index == 0) {
@@ -29,8 +29,6 @@ static void InitCpuTableEntry(int index) {
     } else {
         cpu->platform_specific = AllocHeapZero(sizeof(platform_cpu_data_t));
     }
-
-    InitSpinlock(&cpu_table[index].global_mappings_lock, "gml", IRQL_SCHEDULER);
 }
 
 /*
@@ -59,11 +57,12 @@ void InitOtherCpu(void) {
      * there isn't a CPU there, we don't increment `num_cpus_running` so the 
      * entry won't get used.
      */
-    InitCpuTableEntry(1);
-
-    while (ArchInitNextCpu(cpu_table + num_cpus_running)) {
-        ++num_cpus_running;
+    while (num_cpus_running < ARCH_MAX_CPU_ALLOWED) {
         InitCpuTableEntry(num_cpus_running);
+        if (!ArchInitNextCpu(cpu_table + num_cpus_running)) {
+            break;
+        }
+        ++num_cpus_running;
     }
 
     MarkTfwStartPoint(TFW_SP_AFTER_ALL_CPU);
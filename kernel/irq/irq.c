@@ -10,11 +10,39 @@
 #include <ksignal.h>
 #include <signal.h>
 #include <panic.h>
+#include <heap.h>
+#include <semaphore.h>
+#include <virtual.h>
 
 #define HIGHEST_IRQ_NUM 256
 
+#define IRQ_RING_LENGTH 64
+
 static struct linked_list* irq_table[HIGHEST_IRQ_NUM] = {0};
 
+/*
+ * A threaded IRQ has its top half registered as a normal handler, which does
+ * the bare minimum with the device and queues whatever it read into the ring.
+ * The bottom half runs in its own kernel thread, and gets everything that was
+ * queued since it last ran in one go. The top half only wakes the thread when
+ * the ring goes from empty to not empty, so a burst costs one wakeup.
+ *
+ * The ring is guarded by `guard` with interrupts off, as the top half can run
+ * on any CPU at any IRQL down to the IRQ's own.
+ */
+struct irq_thread {
+    irq_bottom_half_t bottom_half;
+    struct semaphore* wakeup;
+    volatile size_t guard;
+    bool wakeup_pending;
+    int head;
+    int count;
+    int dropped;
+    size_t ring[IRQ_RING_LENGTH];
+};
+
+static struct irq_thread* irq_threads[HIGHEST_IRQ_NUM] = {0};
+
 int RegisterIrqHandler(int irq_num, irq_handler_t handler) {
     if (irq_num < 0 || irq_num >= HIGHEST_IRQ_NUM || handler == NULL) {
         return EINVAL;
@@ -28,10 +56,92 @@ int RegisterIrqHandler(int irq_num, irq_handler_t handler) {
     return 0; 
 }
 
-void RespondToIrq(int irq, int req_irl, platform_irq_context_t* context) {
-    int irql = RaiseIrql(req_irl);
-    ArchSendEoi(irq);
-    
+static void WakeIrqThread(void* context) {
+    struct irq_thread* thr = context;
+    ReleaseSemaphore(thr->wakeup);
+}
+
+static void IrqThread(void* context) {
+    struct irq_thread* thr = context;
+    size_t batch[IRQ_RING_LENGTH];
+
+    while (true) {
+        AcquireSemaphore(thr->wakeup, -1);
+
+        size_t prev = ArchSaveAndDisableInterrupts();
+        ArchSpinlockAcquire(&thr->guard);
+        int count = thr->count;
+        for (int i = 0; i < count; ++i) {
+            batch[i] = thr->ring[(thr->head + i) % IRQ_RING_LENGTH];
+        }
+        thr->head = (thr->head + count) % IRQ_RING_LENGTH;
+        thr->count = 0;
+        thr->wakeup_pending = false;
+        ArchSpinlockRelease(&thr->guard);
+        ArchRestoreInterrupts(prev);
+
+        thr->bottom_half(batch, count);
+    }
+}
+
+/**
+ * Registers an IRQ handler that is split into two halves. `top_half` is called
+ * like any other IRQ handler, and should just deal with the device and pass
+ * what it gets to QueueIrqData(). `bottom_half` is then called at 
+ * IRQL_STANDARD from a kernel thread running at the given fixed priority, with
+ * all of the data that was queued since it last ran.
+ *
+ * @return 0 on success, EINVAL if the arguments are bad, or EEXIST if the IRQ
+ *         already has a bottom half.
+ */
+int RegisterThreadedIrqHandler(int irq_num, irq_handler_t top_half, irq_bottom_half_t bottom_half, int priority) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    if (irq_num < 0 || irq_num >= HIGHEST_IRQ_NUM || bottom_half == NULL) {
+        return EINVAL;
+    }
+    if (irq_threads[irq_num] != NULL) {
+        return EEXIST;
+    }
+
+    struct irq_thread* thr = AllocHeapZero(sizeof(struct irq_thread));
+    thr->bottom_half = bottom_half;
+    thr->wakeup = CreateSemaphore("irq thread", 1, 1);
+    irq_threads[irq_num] = thr;
+
+    CreateThreadEx(IrqThread, thr, GetKernelVas(), "irq thread", GetProcess(), SCHEDULE_POLICY_FIXED, priority, 0);
+    return RegisterIrqHandler(irq_num, top_half);
+}
+
+/**
+ * Queues data for the bottom half of a threaded IRQ. It should only be called 
+ * from that IRQ's top half. If the bottom half has fallen so far behind that
+ * the ring is full, the data is dropped.
+ */
+void QueueIrqData(int irq_num, size_t data) {
+    struct irq_thread* thr = irq_threads[irq_num];
+    assert(thr != NULL);
+
+    size_t prev = ArchSaveAndDisableInterrupts();
+    ArchSpinlockAcquire(&thr->guard);
+    bool wake = false;
+    if (thr->count == IRQ_RING_LENGTH) {
+        thr->dropped++;
+    } else {
+        thr->ring[(thr->head + thr->count) % IRQ_RING_LENGTH] = data;
+        thr->count++;
+        wake = !thr->wakeup_pending;
+        thr->wakeup_pending = true;
+    }
+    ArchSpinlockRelease(&thr->guard);
+    ArchRestoreInterrupts(prev);
+
+    if (wake) {
+        DeferUntilIrql(IRQL_SCHEDULER, WakeIrqThread, thr);
+    }
+}
+
+static void CallIrqHandlers(int irq, platform_irq_context_t* context) {
     if (irq_table[irq] != NULL) {
         struct linked_list_node* iter = ListGetFirstNode(irq_table[irq]);
         while (iter != NULL) {
@@ -49,7 +159,23 @@ void RespondToIrq(int irq, int req_irl, platform_irq_context_t* context) {
             iter = ListGetNextNode(iter);
         }
     }
-    
+}
+
+void RespondToIrq(int irq, int req_irl, platform_irq_context_t* context) {
+    int irql = RaiseIrql(req_irl);
+    ArchSendEoi(irq);
+    CallIrqHandlers(irq, context);
+    LowerIrql(irql);
+}
+
+/**
+ * Runs the handlers for an IRQ that was held back because the IRQL was too high
+ * when it arrived. The EOI has already been sent, and there is no interrupt
+ * context, so `context` is NULL.
+ */
+void ReplayIrq(int irq, int req_irl) {
+    int irql = RaiseIrql(req_irl);
+    CallIrqHandlers(irq, NULL);
     LowerIrql(irql);
 }
 
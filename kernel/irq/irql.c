@@ -3,15 +3,121 @@
 #include <cpu.h>
 #include <irql.h>
 #include <log.h>
-#include <priorityqueue.h>
+#include <heap.h>
+#include <errno.h>
 #include <thread.h>
 #include <assert.h>
 
+/*
+ * Each CPU has a ring of deferred calls for every IRQL, and a bitmap of the
+ * levels that have any, so that deferring and running them are both O(1).
+ *
+ * Only the CPU itself touches its rings, and only with interrupts off, so they
+ * don't need a lock.
+ *
+ * Other CPUs post work through `remote`, a bounded multi-producer queue. Each
+ * slot has a sequence number, so producers can claim slots with a compare and
+ * swap on `remote_tail`, and the owning CPU can tell which ones have been 
+ * filled in. It moves them onto its rings whenever it lowers its IRQL.
+ */
+#define DEFERRED_RING_LENGTH    32
+#define REMOTE_QUEUE_LENGTH     64
+#define NUM_IRQLS               (IRQL_HIGH + 1)
+
 struct deferment {
     void (*handler)(void*);
     void* context;
 };
 
+struct deferred_ring {
+    struct deferment entries[DEFERRED_RING_LENGTH];
+    uint32_t head;
+    uint32_t tail;
+};
+
+struct remote_deferment {
+    volatile uint32_t sequence;
+    int irql;
+    void (*handler)(void*);
+    void* context;
+};
+
+struct cpu_deferrals {
+    uint32_t nonempty_levels[(NUM_IRQLS + 31) / 32];
+    int count;
+    struct deferred_ring rings[NUM_IRQLS];
+
+    uint32_t remote_head;
+    volatile uint32_t remote_tail;
+    struct remote_deferment remote[REMOTE_QUEUE_LENGTH];
+};
+
+/*
+ * Interrupts must be off.
+ */
+static void PushDeferment(struct cpu_deferrals* deferrals, int irql, void(*handler)(void*), void* context) {
+    struct deferred_ring* ring = &deferrals->rings[irql];
+    if (ring->tail - ring->head >= DEFERRED_RING_LENGTH) {
+        PanicEx(PANIC_DEFERRED_QUEUE_FULL, "too many deferred calls at one level");
+    }
+
+    ring->entries[ring->tail++ % DEFERRED_RING_LENGTH] = (struct deferment) {.handler = handler, .context = context};
+    deferrals->nonempty_levels[irql / 32] |= 1U << (irql % 32);
+    deferrals->count++;
+}
+
+static void PushDefermentFromAnyIrql(struct cpu_deferrals* deferrals, int irql, void(*handler)(void*), void* context) {
+    size_t interrupt_state = ArchSaveAndDisableInterrupts();
+    PushDeferment(deferrals, irql, handler, context);
+    ArchRestoreInterrupts(interrupt_state);
+}
+
+/*
+ * Returns the highest level with anything deferred to it, or -1 if there is
+ * nothing. Interrupts must be off.
+ */
+static int GetHighestDeferredLevel(struct cpu_deferrals* deferrals) {
+    for (int i = (NUM_IRQLS + 31) / 32 - 1; i >= 0; --i) {
+        if (deferrals->nonempty_levels[i] != 0) {
+            return i * 32 + 31 - __builtin_clz(deferrals->nonempty_levels[i]);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Interrupts must be off.
+ */
+static struct deferment PopDeferment(struct cpu_deferrals* deferrals, int irql) {
+    struct deferred_ring* ring = &deferrals->rings[irql];
+    assert(ring->head != ring->tail);
+
+    struct deferment deferment = ring->entries[ring->head % DEFERRED_RING_LENGTH];
+    if (++ring->head == ring->tail) {
+        deferrals->nonempty_levels[irql / 32] &= ~(1U << (irql % 32));
+    }
+    deferrals->count--;
+    return deferment;
+}
+
+static bool HasRemoteDeferment(struct cpu_deferrals* deferrals) {
+    struct remote_deferment* slot = &deferrals->remote[deferrals->remote_head % REMOTE_QUEUE_LENGTH];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == deferrals->remote_head + 1;
+}
+
+/*
+ * Moves work that other CPUs have posted onto our own rings. Interrupts must be
+ * off.
+ */
+static void TakeRemoteDeferments(struct cpu_deferrals* deferrals) {
+    while (HasRemoteDeferment(deferrals)) {
+        struct remote_deferment* slot = &deferrals->remote[deferrals->remote_head % REMOTE_QUEUE_LENGTH];
+        PushDeferment(deferrals, slot->irql, slot->handler, slot->context);
+        __atomic_store_n(&slot->sequence, deferrals->remote_head + REMOTE_QUEUE_LENGTH, __ATOMIC_RELEASE);
+        deferrals->remote_head++;
+    }
+}
+
 /**
  * Runs a function at an IRQL lower than or equal to the current IRQL. If the 
  * IRQLs match, the function will be run immediately. If the target IRQL is 
@@ -32,9 +138,52 @@ void DeferUntilIrql(int irql, void(*handler)(void*), void* context) {
         PanicEx(PANIC_INVALID_IRQL, "invalid irql on DeferUntilIrql");
 
     } else if (cpu->init_irql_done) {
-        struct deferment defer = {.context = context, .handler = handler};
-        HeapAdtInsert(cpu->deferred_functions, (void*) &defer, irql);
+        PushDefermentFromAnyIrql(cpu->deferrals, irql, handler, context);
+    }
+}
+
+/**
+ * Gets another CPU to run a function at a given IRQL. It runs the next time
+ * that CPU lowers its IRQL to `irql` or below - which, if it's already there,
+ * happens after it gets sent a reschedule IPI. Can be called at any IRQL. On
+ * the current CPU, it won't run until the IRQL is next lowered.
+ *
+ * @return 0 on success, or EAGAIN if the CPU's queue is full, or it hasn't
+ *         called InitIrql() yet.
+ */
+int DeferUntilIrqlOnCpu(int cpu_index, int irql, void(*handler)(void*), void* context) {
+    assert(irql >= IRQL_STANDARD && irql <= IRQL_HIGH);
+
+    struct cpu* cpu = GetCpuAtIndex(cpu_index);
+    if (!cpu->init_irql_done) {
+        return EAGAIN;
     }
+
+    struct cpu_deferrals* deferrals = cpu->deferrals;
+    if (cpu_index == (int) ArchGetCurrentCpuIndex()) {
+        PushDefermentFromAnyIrql(deferrals, irql, handler, context);
+        return 0;
+    }
+
+    uint32_t pos;
+    struct remote_deferment* slot;
+    while (true) {
+        pos = deferrals->remote_tail;
+        slot = &deferrals->remote[pos % REMOTE_QUEUE_LENGTH];
+        int32_t diff = (int32_t) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff < 0) {
+            return EAGAIN;
+        } else if (diff == 0 && ArchCompareAndSwap(&deferrals->remote_tail, pos, pos + 1)) {
+            break;
+        }
+    }
+
+    slot->irql = irql;
+    slot->handler = handler;
+    slot->context = context;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    ArchSendRescheduleIpi(cpu_index);
+    return 0;
 }
 
 int GetIrql(void) {
@@ -59,48 +208,34 @@ int RaiseIrql(int level) {
 
 void LowerIrql(int target_level) {
     struct cpu* cpu = GetCpu();
-    struct heap_adt* deferred_functions = cpu->deferred_functions;
+    struct cpu_deferrals* deferrals = cpu->deferrals;
     int current_level = cpu->irql;
 
     if (target_level > current_level) {
         PanicEx(PANIC_INVALID_IRQL, "invalid irql on LowerIrql");
     }
 
-    while (cpu->init_irql_done && HeapAdtGetUsedSize(deferred_functions) > 0) {
-        struct heap_adt_result next = HeapAdtPeek(deferred_functions);
-
-        assert((int) next.priority <= current_level || 
-            (next.priority == IRQL_STANDARD_HIGH_PRIORITY && current_level == IRQL_STANDARD));
-
-        if ((int) next.priority >= target_level) {
-            current_level = next.priority;
-            if (current_level == IRQL_STANDARD_HIGH_PRIORITY) {
-                current_level = IRQL_STANDARD;
-            }
-            
-            /*
-             * Must Pop() before we call the handler (otherwise if the handler 
-             * does a raise/lower, it will retrigger itself and cause a 
-             * recursion loop), and must also get data off the queue before we 
-             * Pop(). Also must only actually lower the IRQL after doing this, 
-             * so we don't get interrupted in between (as someone else could 
-             * then Raise/Lower, and mess us up.)
-             */
-            struct deferment* deferred_call = (struct deferment*) next.data;
-            void* context = deferred_call->context;
-            void (*handler)(void*) = deferred_call->handler;
-            if (handler == NULL) {
-                ArchSetIrql(current_level);
-                continue;
-            }
-            HeapAdtPop(deferred_functions);
-            cpu->irql = current_level;
-            ArchSetIrql(current_level);
-            handler(context);
-
-        } else {
+    while (cpu->init_irql_done) {
+        ArchDisableInterrupts();
+        TakeRemoteDeferments(deferrals);
+
+        int level = GetHighestDeferredLevel(deferrals);
+        if (level < target_level) {
             break;
         }
+
+        /*
+         * Must take it off the ring before we call the handler (otherwise if
+         * the handler does a raise/lower, it will retrigger itself and cause a
+         * recursion loop). Also must only actually lower the IRQL after doing
+         * this, so we don't get interrupted in between (as someone else could
+         * then Raise/Lower, and mess us up.)
+         */
+        struct deferment deferred_call = PopDeferment(deferrals, level);
+        current_level = level == IRQL_STANDARD_HIGH_PRIORITY ? IRQL_STANDARD : level;
+        cpu->irql = current_level;
+        ArchSetIrql(current_level);
+        deferred_call.handler(deferred_call.context);
     }
 
     current_level = target_level;
@@ -121,12 +256,22 @@ void PostponeScheduleUntilStandardIrql(void) {
 }
 
 void InitIrql(void) {
-    GetCpu()->deferred_functions = HeapAdtCreate(
-        32, true, sizeof(struct deferment)
-    );
+    struct cpu_deferrals* deferrals = AllocHeapZero(sizeof(struct cpu_deferrals));
+    for (uint32_t i = 0; i < REMOTE_QUEUE_LENGTH; ++i) {
+        deferrals->remote[i].sequence = i;
+    }
+    GetCpu()->deferrals = deferrals;
     GetCpu()->init_irql_done = true;
 }
 
+/**
+ * Returns how many deferred calls the current CPU has waiting, including ones
+ * posted by other CPUs.
+ */
 int GetNumberInDeferQueue(void) {
-    return HeapAdtGetUsedSize(GetCpu()->deferred_functions);
+    struct cpu_deferrals* deferrals = GetCpu()->deferrals;
+    if (deferrals == NULL) {
+        return 0;
+    }
+    return deferrals->count + (HasRemoteDeferment(deferrals) ? 1 : 0);
 }
\ No newline at end of file
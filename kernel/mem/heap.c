@@ -601,6 +601,7 @@ void FreeHeap(void* ptr) {
 
 void InitHeap(void) {
     InitSpinlock(&heap_spinlock, "heapspin", IRQL_SCHEDULER); 
+    TrackSpinlock(&heap_spinlock);
     MarkTfwStartPoint(TFW_SP_AFTER_HEAP);
 }
 
@@ -10,6 +10,7 @@
 #include <irql.h>
 #include <log.h>
 #include <virtual.h>
+#include <thread.h>
 #include <panic.h>
 
 static struct spinlock phys_lock;
@@ -153,9 +154,11 @@ static void EvictPagesIfNeeded(void*) {
 
     if (pages_left < NUM_RESERVE_PAGES) {
         SetDiskCaches(DISKCACHE_TOSS);
+        TrimKernelStackCache();
 
     } else if (pages_left < NUM_RESERVE_PAGES * 3 / 2) {
         SetDiskCaches(DISKCACHE_REDUCE);
+        TrimKernelStackCache();
     }
 
     int timeout = 0;
@@ -261,6 +264,7 @@ size_t AllocPhysContiguous(
  */
 void InitPhys(struct kernel_boot_info* boot_info) {
     InitSpinlock(&phys_lock, "phys", IRQL_SCHEDULER);
+    TrackSpinlock(&phys_lock);
 
 	while (true) {
 		struct boot_memory_entry* range = ArchGetMemory(boot_info);
@@ -0,0 +1,267 @@
+
+/*
+ * mem/sharedmem.c - Shared Memory Objects
+ *
+ * Named objects which any process can open and map, so that unrelated
+ * processes can share physical pages. Each one is a regular file vnode, sized
+ * with truncate, and mapped with VM_FILE like any other file. Instead of being
+ * read from disk into a private page, though, faulting on a mapping of one
+ * gives the object's own page for that offset, so every mapping sees the same
+ * memory.
+ *
+ * Pages are allocated (and zeroed) the first time anyone touches them, and are
+ * freed once the object has been unlinked and the last open file or mapping of
+ * it goes away. Mappings hold a reference on the open file, which holds one on
+ * the vnode, and the name table holds one until it is unlinked.
+ *
+ * The pages can't be swapped out while the object exists, as there's no way to
+ * find and unmap every mapping of a physical page.
+ */
+
+#include <sharedmem.h>
+#include <vfs.h>
+#include <heap.h>
+#include <physical.h>
+#include <virtual.h>
+#include <semaphore.h>
+#include <linkedlist.h>
+#include <spinlock.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <irql.h>
+#include <arch.h>
+#include <sys/stat.h>
+
+/*
+ * Stops one process using up all of the physical memory just by sizing an
+ * object, as the page array is allocated up front.
+ */
+#define SHM_MAX_SIZE (256 * 1024 * 1024)
+
+struct shared_memory {
+    char name[SHM_MAX_NAME + 1];
+    struct spinlock lock;
+
+    /*
+     * The physical address of each page, or 0 if it hasn't been touched yet.
+     */
+    size_t* pages;
+    size_t num_pages;
+};
+
+/*
+ * Vnodes of all objects which haven't been unlinked.
+ */
+static struct linked_list* shm_table;
+static struct semaphore* shm_table_lock;
+
+static int Truncate(struct vnode* node, off_t size) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct shared_memory* shm = node->data;
+    if (size > SHM_MAX_SIZE) {
+        return EINVAL;
+    }
+
+    size_t num_pages = BytesToPages(size);
+    size_t* pages = num_pages == 0 ? NULL : AllocHeapZero(sizeof(size_t) * num_pages);
+
+    AcquireSpinlock(&shm->lock);
+
+    /*
+     * Pages that have been touched could be mapped anywhere, so they can't be
+     * cut off.
+     */
+    for (size_t i = num_pages; i < shm->num_pages; ++i) {
+        if (shm->pages[i] != 0) {
+            ReleaseSpinlock(&shm->lock);
+            if (pages != NULL) {
+                FreeHeap(pages);
+            }
+            return EBUSY;
+        }
+    }
+
+    size_t* old_pages = shm->pages;
+    if (old_pages != NULL) {
+        memcpy(pages, old_pages, sizeof(size_t) * MIN(num_pages, shm->num_pages));
+    }
+    shm->pages = pages;
+    shm->num_pages = num_pages;
+    node->stat.st_size = size;
+    ReleaseSpinlock(&shm->lock);
+
+    if (old_pages != NULL) {
+        FreeHeap(old_pages);
+    }
+    return 0;
+}
+
+/*
+ * Nothing can have the object mapped or open any more.
+ */
+static int Close(struct vnode* node) {
+    struct shared_memory* shm = node->data;
+    for (size_t i = 0; i < shm->num_pages; ++i) {
+        if (shm->pages[i] != 0) {
+            DeallocPhys(shm->pages[i]);
+        }
+    }
+    if (shm->pages != NULL) {
+        FreeHeap(shm->pages);
+    }
+    FreeHeap(shm);
+    return 0;
+}
+
+static const struct vnode_operations shm_ops = {
+    .truncate       = Truncate,
+    .close          = Close,
+};
+
+bool IsSharedMemory(struct vnode* node) {
+    return node->ops.close == Close;
+}
+
+/**
+ * Gets the physical page which backs an offset into a shared memory object,
+ * allocating it if it hasn't been used before. The object is left locked so
+ * that a new page can be zeroed before anyone else can get to it, and so
+ * UnlockSharedMemoryPage() must always be called afterwards.
+ *
+ * @param fresh Set to true if the page was just allocated, and needs zeroing.
+ * @return The physical address, or 0 if the offset is past the end of the
+ *         object.
+ */
+size_t LockSharedMemoryPage(struct vnode* node, off_t offset, bool* fresh) {
+    MAX_IRQL(IRQL_SCHEDULER);
+
+    struct shared_memory* shm = node->data;
+    AcquireSpinlock(&shm->lock);
+
+    *fresh = false;
+    if (offset >= node->stat.st_size) {
+        return 0;
+    }
+
+    size_t index = offset / ARCH_PAGE_SIZE;
+    if (shm->pages[index] == 0) {
+        shm->pages[index] = AllocPhys();
+        *fresh = true;
+    }
+    return shm->pages[index];
+}
+
+void UnlockSharedMemoryPage(struct vnode* node) {
+    struct shared_memory* shm = node->data;
+    ReleaseSpinlock(&shm->lock);
+}
+
+static struct vnode* FindSharedMemory(const char* name) {
+    struct linked_list_node* iter = ListGetFirstNode(shm_table);
+    while (iter != NULL) {
+        struct vnode* node = ListGetDataFromNode(iter);
+        struct shared_memory* shm = node->data;
+        if (!strcmp(shm->name, name)) {
+            return node;
+        }
+        iter = ListGetNextNode(iter);
+    }
+    return NULL;
+}
+
+static int CheckSharedMemoryName(const char* name) {
+    if (strlen(name) == 0) {
+        return EINVAL;
+    }
+    if (strlen(name) > SHM_MAX_NAME) {
+        return ENAMETOOLONG;
+    }
+    return 0;
+}
+
+/**
+ * Opens a shared memory object by name, creating it (with a size of zero) if
+ * O_CREAT is passed and it doesn't exist yet.
+ *
+ * @param flags O_CREAT, O_EXCL, O_CLOEXEC, and the access mode.
+ * @return 0 on success, ENOENT if it doesn't exist and O_CREAT wasn't passed,
+ *         EEXIST if it does exist and O_CREAT and O_EXCL were passed, or
+ *         EINVAL or ENAMETOOLONG if the name isn't valid.
+ */
+int OpenSharedMemory(const char* name, int flags, mode_t mode, struct file** out) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    int res = CheckSharedMemoryName(name);
+    if (res != 0) {
+        return res;
+    }
+
+    AcquireMutex(shm_table_lock, -1);
+    struct vnode* node = FindSharedMemory(name);
+    if (node != NULL && (flags & O_CREAT) && (flags & O_EXCL)) {
+        ReleaseMutex(shm_table_lock);
+        return EEXIST;
+    }
+
+    if (node == NULL) {
+        if (!(flags & O_CREAT)) {
+            ReleaseMutex(shm_table_lock);
+            return ENOENT;
+        }
+
+        struct shared_memory* shm = AllocHeapZero(sizeof(struct shared_memory));
+        strcpy(shm->name, name);
+        InitSpinlock(&shm->lock, "shm", IRQL_SCHEDULER);
+
+        node = CreateVnode(shm_ops, (struct stat) {
+            .st_mode = S_IFREG | (mode & (S_IRWXU | S_IRWXG | S_IRWXO)),
+            .st_nlink = 1,
+            .st_size = 0,
+            .st_dev = NextDevId()
+        });
+        node->data = shm;
+
+        /*
+         * The table keeps the reference that CreateVnode() gives us.
+         */
+        ListInsertEnd(shm_table, node);
+    }
+
+    bool can_read = (flags & O_ACCMODE) != O_WRONLY;
+    bool can_write = (flags & O_ACCMODE) != O_RDONLY;
+    *out = CreateFile(node, mode, flags & O_CLOEXEC, can_read, can_write);
+    ReleaseMutex(shm_table_lock);
+    return 0;
+}
+
+/**
+ * Removes the name of a shared memory object, so it can't be opened again.
+ * Anyone that already has it open or mapped can keep using it.
+ */
+int UnlinkSharedMemory(const char* name) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    int res = CheckSharedMemoryName(name);
+    if (res != 0) {
+        return res;
+    }
+
+    AcquireMutex(shm_table_lock, -1);
+    struct vnode* node = FindSharedMemory(name);
+    if (node == NULL) {
+        ReleaseMutex(shm_table_lock);
+        return ENOENT;
+    }
+    ListDeleteData(shm_table, node);
+    ReleaseMutex(shm_table_lock);
+
+    DereferenceVnode(node);
+    return 0;
+}
+
+void InitSharedMemory(void) {
+    shm_table = ListCreate();
+    shm_table_lock = CreateMutex("shm table");
+}
@@ -25,6 +25,7 @@
 #include <vfs.h>
 #include <errno.h>
 #include <ksignal.h>
+#include <sharedmem.h>
 
 // TODO: lots of locks! especially the global cpu one
 
@@ -41,6 +42,12 @@ static size_t SplitLargePageEntryIntoMultiple(
  */
 static struct vas* kernel_vas;
 
+/*
+ * Mappings in the kernel area are shared between every VAS, and every CPU.
+ */
+static struct tree* global_vas_mappings;
+static struct spinlock global_mappings_lock;
+
 static bool virt_initialised = false;
 
 static int VirtAvlComparator(void* a, void* b) {
@@ -411,8 +418,12 @@ void FindVirtToEvictRecursive(
     // TODO: we really need a better page swapper that doesn't just pick the
     //       first page it sees.
     
+    /*
+     * Pages with more than one reference (e.g. after a fork, or while pinned)
+     * can't go, as the others would be left with a freed physical page.
+     */
     struct vas_entry* entry = node->data;
-    if (!entry->lock && entry->allocated && entry->in_ram) {
+    if (!entry->lock && entry->allocated && entry->in_ram && entry->ref_count == 1) {
         int rank = GetPageEvictionRank(vas, entry);
 
         /*
@@ -457,7 +468,7 @@ void FindVirtToEvict(
 ) {
     int count = 0;
     if (include_globals) {
-        FindVirtToEvictRecursive(vas, GetCpu()->global_vas_mappings->root, lowest_rank, lowest_ranked, &count, prev_swaps);
+        FindVirtToEvictRecursive(vas, global_vas_mappings->root, lowest_rank, lowest_ranked, &count, prev_swaps);
     }
     FindVirtToEvictRecursive(vas, vas->mappings->root, lowest_rank, lowest_ranked, &count, prev_swaps);
 }
@@ -506,9 +517,9 @@ static void InsertIntoAvl(struct vas* vas, struct vas_entry* entry) {
     assert(IsSpinlockHeld(&vas->lock));
     
     if (entry->global) { 
-        AcquireSpinlock(&GetCpu()->global_mappings_lock);
-        TreeInsert(GetCpu()->global_vas_mappings, entry);
-        ReleaseSpinlock(&GetCpu()->global_mappings_lock);
+        AcquireSpinlock(&global_mappings_lock);
+        TreeInsert(global_vas_mappings, entry);
+        ReleaseSpinlock(&global_mappings_lock);
 
     } else {        
         TreeInsert(vas->mappings, entry);
@@ -521,9 +532,9 @@ static void DeleteFromAvl(struct vas* vas, struct vas_entry* entry) {
 
     assert(IsSpinlockHeld(&vas->lock));
     if (entry->global) {
-        AcquireSpinlock(&GetCpu()->global_mappings_lock);
-        TreeDelete(GetCpu()->global_vas_mappings, entry);
-        ReleaseSpinlock(&GetCpu()->global_mappings_lock);
+        AcquireSpinlock(&global_mappings_lock);
+        TreeDelete(global_vas_mappings, entry);
+        ReleaseSpinlock(&global_mappings_lock);
 
     } else {
         TreeDelete(vas->mappings, entry); 
@@ -593,6 +604,15 @@ static void AddMapping(struct vas* vas, size_t physical, size_t virtual, int fla
     entry->file = (flags & VM_FILE) ? 1 : 0;
     entry->user = (flags & VM_USER) ? 1 : 0;
     entry->share_on_fork = (flags & VM_SHARED) ? 1 : 0;
+    entry->shared_memory = file != NULL && IsSharedMemory(file->node);
+    if (entry->shared_memory) {
+        /*
+         * The whole point is that everyone sees the same pages, so it isn't
+         * really file-backed, and it's never copied on fork.
+         */
+        entry->file = 0;
+        entry->share_on_fork = 1;
+    }
     entry->evict_first = (flags & VM_EVICT_FIRST) ? 1 : 0;
     entry->relocatable = (flags & VM_RELOCATABLE) ? 1 : 0;
     entry->hard_io_failure = (flags & VM_HARD_IO_FAIL) ? 1 : 0;
@@ -674,16 +694,16 @@ static bool IsRangeInUse(struct vas* vas, size_t virtual, size_t pages) {
         return true;
     }
 
-    AcquireSpinlock(&GetCpu()->global_mappings_lock);
+    AcquireSpinlock(&global_mappings_lock);
     dummy.virtual = virtual;
     for (size_t i = 0; i < pages; ++i) {
-        if (TreeContains(GetCpu()->global_vas_mappings, (void*) &dummy)) {
+        if (TreeContains(global_vas_mappings, (void*) &dummy)) {
             in_use = true;
             break;
         }
         dummy.virtual += ARCH_PAGE_SIZE;
     }
-    ReleaseSpinlock(&GetCpu()->global_mappings_lock);
+    ReleaseSpinlock(&global_mappings_lock);
 
     return in_use;
 }
@@ -797,6 +817,9 @@ size_t MapVirtEx(struct vas* vas, size_t physical, size_t virtual, size_t pages,
     RETURN_FAIL_IF(EACCES, (flags & VM_FILE) && !file->can_read);
     RETURN_FAIL_IF(EACCES, (flags & VM_FILE) && !file->can_write && (flags & VM_WRITE));
 
+    bool shared_memory = (flags & VM_FILE) && IsSharedMemory(file->node);
+    RETURN_FAIL_IF(EINVAL, shared_memory && pos % ARCH_PAGE_SIZE != 0);
+
     /*
      * Get a virtual memory range that is not currently in use.
      */
@@ -820,8 +843,11 @@ size_t MapVirtEx(struct vas* vas, size_t physical, size_t virtual, size_t pages,
      * going to be greater than actually just adding 2 pages in the first place.
      * 
      * May want to increase this value furher in the future (e.g. maybe to 4 or 8)?
+     * 
+     * Shared memory pages each hold a reference to the file, so they're always
+     * kept separate.
      */
-    bool multi_page_mapping = (((flags & VM_LOCK) == 0) || ((flags & VM_MAP_HARDWARE) != 0)) && pages >= 3;
+    bool multi_page_mapping = (((flags & VM_LOCK) == 0) || ((flags & VM_MAP_HARDWARE) != 0)) && pages >= 3 && !shared_memory;
 
     for (size_t i = 0; i < (multi_page_mapping ? 1 : pages); ++i) {
         if (flags & VM_FILE) {
@@ -860,7 +886,7 @@ static struct vas_entry* GetVirtEntry(struct vas* vas, size_t virtual) {
     struct vas_entry dummy = {.num_pages = 1, .virtual = virtual & ~(ARCH_PAGE_SIZE - 1)};
     struct vas_entry* res = (struct vas_entry*) TreeGet(vas->mappings, (void*) &dummy);
     if (res == NULL) {
-        AcquireSpinlock(&GetCpu()->global_mappings_lock);
+        AcquireSpinlock(&global_mappings_lock);
        
         // TODO: possible mark the page as in use - but will need to add a lot of release calls around the place
             /*
@@ -869,8 +895,8 @@ static struct vas_entry* GetVirtEntry(struct vas* vas, size_t virtual) {
             * Then any callers of GetVirtEntry must remember to UnlockVirt(Ex) afterwards
             */
 
-        res = (struct vas_entry*) TreeGet(GetCpu()->global_vas_mappings, (void*) &dummy);
-        ReleaseSpinlock(&GetCpu()->global_mappings_lock);
+        res = (struct vas_entry*) TreeGet(global_vas_mappings, (void*) &dummy);
+        ReleaseSpinlock(&global_mappings_lock);
     }
     return res;
 }
@@ -1075,9 +1101,54 @@ static void BringInBlankPage(struct vas* vas, struct vas_entry* entry, size_t fa
     ArchFlushTlb(vas);
 }
 
+/*
+ * Maps the shared memory object's page in. This is also needed if the entry is
+ * already in RAM, as after a fork the entry is shared with another address
+ * space which may not have mapped it yet.
+ */
+static void BringInSharedMemoryPage(struct vas* vas, struct vas_entry* entry, int fault_type) {
+    assert(entry->num_pages == 1);
+
+    if (((fault_type & VM_READ) && !entry->read) || ((fault_type & VM_WRITE) && !entry->write) || ((fault_type & VM_EXEC) && !entry->exec)) {
+        UnhandledFault(UNHANDLED_FAULT_SEGV);
+        return;
+    }
+
+    bool fresh;
+    size_t physical = LockSharedMemoryPage(entry->file_node->node, entry->file_offset, &fresh);
+    if (physical == 0) {
+        /*
+         * Past the end of the object.
+         */
+        UnlockSharedMemoryPage(entry->file_node->node);
+        UnhandledFault(UNHANDLED_FAULT_SEGV);
+        return;
+    }
+
+    entry->physical = physical;
+    entry->in_ram = true;
+    entry->allow_temp_write = fresh;
+    ArchUpdateMapping(vas, entry);
+    ArchFlushTlb(vas);
+
+    if (fresh) {
+        inline_memset((void*) entry->virtual, 0, ARCH_PAGE_SIZE);
+        entry->allow_temp_write = false;
+        ArchUpdateMapping(vas, entry);
+        ArchFlushTlb(vas);
+    }
+    UnlockSharedMemoryPage(entry->file_node->node);
+}
+
 static int BringIntoMemory(struct vas* vas, struct vas_entry* entry, bool allow_cow, size_t faulting_virt, int fault_type) {
     assert(IsSpinlockHeld(&vas->lock));
 
+    if (entry->shared_memory) {
+        LogWriteSerial("--> SHARED MEMORY\n");
+        BringInSharedMemoryPage(vas, entry, fault_type);
+        return 0;
+    }
+
     if (entry->cow && allow_cow) {
         assert(entry->num_pages == 1);
         LogWriteSerial("--> COW\n");
@@ -1239,6 +1310,13 @@ static bool DereferenceEntry(struct vas* vas, struct vas_entry* entry) {
             assert(!entry->swapfile);   // can't be on swap, as putting on swap clears allocated bit
             DeallocPhys(entry->physical);
         }
+        if (entry->shared_memory) {
+            /*
+             * The object owns the page, and frees it once this (or some other
+             * reference) is the last one to go.
+             */
+            DereferenceFile(entry->file_node);
+        }
 
         ArchSetPageUsageBits(vas, entry, false, false);
         DeleteFromAvl(vas, entry);
@@ -1249,6 +1327,78 @@ static bool DereferenceEntry(struct vas* vas, struct vas_entry* entry) {
     return needs_tlb_flush;
 }
 
+/**
+ * Takes a reference on a page of user memory in the current address space, so
+ * that its physical page stays around until UnpinUserPage() is called, even if
+ * the process unmaps it in the meantime. Ordinary private pages are also marked
+ * copy-on-write, so that if the process writes to the page, it gets a copy and
+ * the pinned page stays as it was.
+ *
+ * The page needs to be in memory already (e.g. by touching it first).
+ *
+ * @return The page's mapping, or NULL if there's no readable user page there,
+ *         or it isn't in memory.
+ */
+struct vas_entry* PinUserPage(size_t virtual) {
+    struct vas* vas = GetVas();
+    AcquireSpinlock(&vas->lock);
+
+    struct vas_entry* entry = GetVirtEntry(vas, virtual);
+    if (entry == NULL || !entry->user || !entry->read || !entry->in_ram || entry->num_pages != 1) {
+        ReleaseSpinlock(&vas->lock);
+        return NULL;
+    }
+
+    entry->ref_count++;
+    if (entry->allocated && !entry->lock && !entry->cow && !entry->file && !entry->share_on_fork) {
+        entry->cow = true;
+        ArchUpdateMapping(vas, entry);
+        ArchFlushTlb(vas);
+    }
+
+    ReleaseSpinlock(&vas->lock);
+    return entry;
+}
+
+/**
+ * Drops the reference taken by PinUserPage(). Must be called from the same 
+ * address space.
+ */
+void UnpinUserPage(struct vas_entry* entry) {
+    struct vas* vas = GetVas();
+    AcquireSpinlock(&vas->lock);
+
+    if (entry->ref_count == 1 && GetVirtEntry(vas, entry->virtual) != entry) {
+        /*
+         * The process wrote to it and got its own copy, so we have the only
+         * reference, and the page isn't mapped anywhere.
+         */
+        if (entry->allocated) {
+            DeallocPhys(entry->physical);
+        }
+        if (entry->shared_memory) {
+            DereferenceFile(entry->file_node);
+        }
+        FreeHeap(entry);
+
+    } else if (entry->ref_count == 2 && entry->cow && GetVirtEntry(vas, entry->virtual) == entry) {
+        /*
+         * We had the only other reference, so the page is ours alone again, 
+         * and doesn't need to be copy-on-write any more (just like in 
+         * BringIntoMemoryFromCow()). Leaving it set would stop it being evicted.
+         */
+        entry->ref_count--;
+        entry->cow = false;
+        ArchUpdateMapping(vas, entry);
+        ArchFlushTlb(vas);
+
+    } else if (DereferenceEntry(vas, entry)) {
+        ArchFlushTlb(vas);
+    }
+
+    ReleaseSpinlock(&vas->lock);
+}
+
 static void WipeUsermodePagesRecursive(struct tree_node* node) {
     if (node == NULL) {
         return;
@@ -1357,7 +1507,17 @@ int UnmapVirt(size_t virtual, size_t bytes) {
             ArchAddMapping(new_vas, entry);*/
 
         } else {
-            PanicEx(PANIC_UNKNOWN, "can't fork with a hardware-mapped page");
+            /*
+             * Hardware-mapped pages (e.g. the time page) aren't ours to copy,
+             * so the child just gets the same mapping.
+             */
+            entry->ref_count++;
+            TreeInsert(new_vas->mappings, entry);
+
+            struct vas* current_vas = GetVas();
+            SetVas(new_vas);
+            ArchAddMapping(new_vas, entry);
+            SetVas(current_vas);
         }
         
     } else {
@@ -1412,14 +1572,14 @@ struct vas* CopyVas(struct vas* new_vas) {
     //struct vas* new_vas = CreateVas();
     LogWriteSerial("[CopyVas]: created new... (0x%X)\n", new_vas);
     AcquireSpinlock(&vas->lock);
-    AcquireSpinlock(&GetCpu()->global_mappings_lock);
+    AcquireSpinlock(&global_mappings_lock);
     LogWriteSerial("[CopyVas]: locked...\n");
     // no need to change global - it's already there!
     CopyVasRecursive(vas->mappings->root, new_vas);
     LogWriteSerial("[CopyVas]: recursion done...\n");
     ArchFlushTlb(vas);
     LogWriteSerial("[CopyVas]: tlb flushed...\n");
-    ReleaseSpinlock(&GetCpu()->global_mappings_lock);
+    ReleaseSpinlock(&global_mappings_lock);
     ReleaseSpinlock(&vas->lock);
     LogWriteSerial("[CopyVas]: done!\n");
     return new_vas;
@@ -1445,8 +1605,10 @@ void InitVirt(void) {
     //       someone reads or writes to current_vas;
 
     assert(!virt_initialised);
-    GetCpu()->global_vas_mappings = TreeCreate();
-    TreeSetComparator(GetCpu()->global_vas_mappings, VirtAvlComparator);
+    global_vas_mappings = TreeCreate();
+    TreeSetComparator(global_vas_mappings, VirtAvlComparator);
+    InitSpinlock(&global_mappings_lock, "gml", IRQL_SCHEDULER);
+    TrackSpinlock(&global_mappings_lock);
     ArchInitVirt();
 
     kernel_vas = GetVas();
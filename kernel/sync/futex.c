@@ -0,0 +1,215 @@
+
+/*
+ * sync/futex.c - Fast User-Space Locks
+ *
+ * Lets user programs build locks out of an ordinary word of memory. They only
+ * need to make a system call when the lock is contended: to sleep until the
+ * word changes, or to wake up whoever is sleeping on it.
+ *
+ * Waiters are kept in a hash table, keyed by address space and virtual address,
+ * so that each bucket only has its own lock. The waiter records live on the
+ * waiting threads' kernel stacks, so nothing gets allocated.
+ */
+
+#include <futex.h>
+#include <thread.h>
+#include <virtual.h>
+#include <spinlock.h>
+#include <transfer.h>
+#include <timer.h>
+#include <errno.h>
+#include <irql.h>
+#include <assert.h>
+
+struct futex_waiter {
+    struct thread* thread;
+    struct vas* vas;
+    size_t address;
+    bool blocked;
+    bool woken;
+    struct futex_waiter* next;
+    struct futex_waiter* prev;
+};
+
+struct futex_bucket {
+    struct spinlock lock;
+    struct futex_waiter* head;
+    struct futex_waiter* tail;
+};
+
+#define FUTEX_HASH_BITS     6
+#define FUTEX_HASH_BUCKETS  (1 << FUTEX_HASH_BITS)
+
+/*
+ * Waits with no timeout still go on the sleep timer, so that signals can cut
+ * them short. They just get one that's far enough away to never go off.
+ */
+#define FUTEX_FOREVER_NS    (1ULL << 62)
+
+static struct futex_bucket buckets[FUTEX_HASH_BUCKETS];
+
+void InitFutexes(void) {
+    for (int i = 0; i < FUTEX_HASH_BUCKETS; ++i) {
+        InitSpinlock(&buckets[i].lock, "futex", IRQL_SCHEDULER);
+        buckets[i].head = NULL;
+        buckets[i].tail = NULL;
+    }
+}
+
+static struct futex_bucket* GetFutexBucket(struct vas* vas, size_t address) {
+    uint32_t key = (uint32_t) (((size_t) vas >> 4) ^ (address >> 2));
+    return &buckets[(key * 0x9E3779B1U) >> (32 - FUTEX_HASH_BITS)];
+}
+
+static void AddFutexWaiter(struct futex_bucket* bucket, struct futex_waiter* waiter) {
+    waiter->next = NULL;
+    waiter->prev = bucket->tail;
+    if (bucket->tail == NULL) {
+        bucket->head = waiter;
+    } else {
+        bucket->tail->next = waiter;
+    }
+    bucket->tail = waiter;
+}
+
+static void RemoveFutexWaiter(struct futex_bucket* bucket, struct futex_waiter* waiter) {
+    if (waiter->prev == NULL) {
+        bucket->head = waiter->next;
+    } else {
+        waiter->prev->next = waiter->next;
+    }
+    if (waiter->next == NULL) {
+        bucket->tail = waiter->prev;
+    } else {
+        waiter->next->prev = waiter->prev;
+    }
+}
+
+/**
+ * Blocks the current thread, as long as the word at a user address still holds
+ * the expected value. The check and going to sleep happen atomically with
+ * respect to FutexWake().
+ *
+ * @param address    The user address of the word, which must be aligned.
+ * @param expected   The value the word must have for the thread to block.
+ * @param timeout_ms How long to wait for, in milliseconds, or -1 to wait forever.
+ * @return 0 if woken by FutexWake(), EAGAIN if the word didn't hold `expected`,
+ *         ETIMEDOUT if the timeout expired, EINTR if a signal arrived, or
+ *         EFAULT or EINVAL if the address is bad.
+ */
+int FutexWait(size_t address, int expected, int timeout_ms) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    if (address % sizeof(int) != 0 || timeout_ms < -1) {
+        return EINVAL;
+    }
+    if (timeout_ms == 0) {
+        return ETIMEDOUT;
+    }
+
+    struct thread* thr = GetThread();
+    struct futex_waiter waiter = {
+        .thread = thr, .vas = GetVas(), .address = address,
+        .blocked = false, .woken = false
+    };
+    struct futex_bucket* bucket = GetFutexBucket(waiter.vas, address);
+
+    /*
+     * Reading the word could page fault, so it can't be done with the bucket
+     * locked. Instead we get on the queue first, so that any wake up that comes
+     * after we've read the word will see us.
+     */
+    AcquireSpinlock(&bucket->lock);
+    AddFutexWaiter(bucket, &waiter);
+    ReleaseSpinlock(&bucket->lock);
+
+    int value;
+    struct transfer io = CreateTransferReadingFromUser((const void*) address, sizeof(int), 0);
+    int res = PerformTransfer(&value, &io, sizeof(int));
+    if (res == 0 && value != expected) {
+        res = EAGAIN;
+    }
+
+    AcquireSpinlock(&bucket->lock);
+    if (res != 0 || waiter.woken) {
+        if (!waiter.woken) {
+            RemoveFutexWaiter(bucket, &waiter);
+        }
+        ReleaseSpinlock(&bucket->lock);
+        return waiter.woken ? 0 : res;
+    }
+
+    waiter.blocked = true;
+    LockScheduler();
+    if (timeout_ms == -1) {
+        thr->sleep_expiry = GetSystemTimer() + FUTEX_FOREVER_NS;
+    } else {
+        thr->sleep_expiry = GetSystemTimer() + ((uint64_t) timeout_ms) * 1000ULL * 1000ULL;
+    }
+    QueueForSleep(thr);
+    BlockThread(THREAD_STATE_WAITING_FOR_FUTEX);
+    UnlockScheduler();
+    ReleaseSpinlock(&bucket->lock);
+
+    /*
+     * If we were woken by the timer (or a signal), a wake up might have still
+     * got to us first, in which case it counts.
+     */
+    AcquireSpinlock(&bucket->lock);
+    bool woken = waiter.woken;
+    if (!woken) {
+        RemoveFutexWaiter(bucket, &waiter);
+    }
+    ReleaseSpinlock(&bucket->lock);
+
+    if (woken) {
+        return 0;
+    }
+    return thr->timed_out_due_to_signal ? EINTR : ETIMEDOUT;
+}
+
+/**
+ * Wakes up threads in the current address space that are waiting on a user
+ * address with FutexWait().
+ *
+ * @param address The user address the threads are waiting on.
+ * @param count   The most threads to wake up.
+ * @return 0 on success, or EINVAL if the address isn't aligned.
+ */
+int FutexWake(size_t address, int count) {
+    MAX_IRQL(IRQL_SCHEDULER);
+
+    if (address % sizeof(int) != 0) {
+        return EINVAL;
+    }
+
+    struct vas* vas = GetVas();
+    struct futex_bucket* bucket = GetFutexBucket(vas, address);
+
+    AcquireSpinlock(&bucket->lock);
+    struct futex_waiter* iter = bucket->head;
+    while (iter != NULL && count > 0) {
+        struct futex_waiter* next = iter->next;
+        if (iter->vas == vas && iter->address == address) {
+            RemoveFutexWaiter(bucket, iter);
+            iter->woken = true;
+            --count;
+
+            /*
+             * Those that haven't blocked yet will see they've been woken when
+             * they next look. Those that have might have been woken up by the
+             * timer or a signal already.
+             */
+            if (iter->blocked) {
+                LockScheduler();
+                if (TryDequeueForSleep(iter->thread)) {
+                    UnblockThread(iter->thread);
+                }
+                UnlockScheduler();
+            }
+        }
+        iter = next;
+    }
+    ReleaseSpinlock(&bucket->lock);
+    return 0;
+}
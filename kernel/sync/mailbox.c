@@ -1,34 +1,77 @@
 
 /*
- * adt/mailbox.c - Blocking Buffers
+ * sync/mailbox.c - Blocking Buffers
  *
  * Implements fixed-sized byte queues that can block on read/write if they are
  * empty/full. Useful for implementing pipes and ptys.
+ *
+ * The data is a ring buffer, protected by a single mutex. Transfers copy as
+ * much as they can in one go, which is at most two memcpys (one up to the end
+ * of the buffer, and one from the start of it), so the number of lock
+ * operations doesn't depend on how many bytes are moved.
+ *
+ * Instead of copying data in, a writer can also lend the mailbox a set of pages
+ * with MailboxLend(). Readers then copy straight out of those pages, and the 
+ * writer waits until they have all been read. Loans only start once the ring 
+ * buffer is empty, and nothing else can be written until the loan is used up, 
+ * so the data still comes out in the order it was put in. The owner of the
+ * mailbox can stop lending with MailboxStopLending() (e.g. when a pipe breaks),
+ * so writers aren't left waiting for readers that will never come.
+ *
+ * Threads that are waiting block on a semaphore which is used as a wait queue.
+ * It is kept 'full' so that acquiring it blocks, and it is released once (and
+ * only once) when there's someone to wake. Whoever is woken wakes the next one
+ * if there's still something left for it. Anyone polling the mailbox is 
+ * notified at the same time.
  */
 
 #include <heap.h>
 #include <assert.h>
 #include <common.h>
-#include <spinlock.h>
 #include <semaphore.h>
 #include <errno.h>
-#include <thread.h>
-#include <panic.h>
-#include <log.h>
+#include <string.h>
 #include <irql.h>
+#include <arch.h>
 #include <transfer.h>
+#include <mailbox.h>
+#include <polltable.h>
+
+#define MAILBOX_READ    0
+#define MAILBOX_WRITE   1
+#define MAILBOX_LEND    2
+
+struct mailbox_wait_queue {
+    struct semaphore* sem;
+    int waiting;
+    bool wakeup_pending;
+};
+
+struct mailbox_loan {
+    const size_t* pages;
+    size_t offset;
+    size_t length;
+    size_t consumed;
+
+    /*
+     * Whether `loan_done` has been released for the lender, and not acquired
+     * yet. Stops it being released twice.
+     */
+    bool signalled;
+    bool cancelled;
+};
 
 struct mailbox {
     uint8_t* data;
     int total_size;
     int used_size;
     int start_pos;
-    int end_pos;
-    struct semaphore* full_sem;
-    struct semaphore* empty_sem;
-    struct semaphore* add_mtx;
-    struct semaphore* get_mtx;
-    struct semaphore* inner_mtx;
+    struct semaphore* mtx;
+    struct mailbox_loan* loan;
+    struct semaphore* loan_done;
+    bool lending_stopped;
+    struct mailbox_wait_queue queues[3];
+    struct poll_head poll;
 };
 
 struct mailbox* MailboxCreate(int size) {
@@ -38,222 +81,365 @@ struct mailbox* MailboxCreate(int size) {
         .total_size = size,
         .used_size = 0,
         .start_pos = 0,
-        .end_pos = 0,
-        .full_sem = CreateSemaphore("mbfull", size, size),
-        .empty_sem = CreateSemaphore("mbempty", size, 0),
-        .add_mtx = CreateMutex("mbadd"),
-        .get_mtx = CreateMutex("mbget"),
-        .inner_mtx = CreateMutex("mbinner")
+        .mtx = CreateMutex("mailbox"),
+        .loan = NULL,
+        .loan_done = CreateSemaphore("mbloan", 1, 1),
+        .lending_stopped = false,
+        .queues = {
+            [MAILBOX_READ] = {.sem = CreateSemaphore("mbreadable", 1, 1)},
+            [MAILBOX_WRITE] = {.sem = CreateSemaphore("mbwritable", 1, 1)},
+            [MAILBOX_LEND] = {.sem = CreateSemaphore("mblendable", 1, 1)},
+        },
     };
+    InitPollHead(&mbox->poll);
     return mbox;
 }
 
 void MailboxDestroy(struct mailbox* mbox) {
-    DestroySemaphore(mbox->full_sem, SEM_DONT_CARE);
-    DestroySemaphore(mbox->empty_sem, SEM_DONT_CARE);
-    DestroyMutex(mbox->add_mtx);
-    DestroyMutex(mbox->get_mtx);
-    DestroyMutex(mbox->inner_mtx);
+    for (int i = 0; i < 3; ++i) {
+        DestroySemaphore(mbox->queues[i].sem, SEM_DONT_CARE);
+    }
+    DestroySemaphore(mbox->loan_done, SEM_DONT_CARE);
+    DestroyMutex(mbox->mtx);
+    FreeHeap(mbox->data);
     FreeHeap(mbox);
 }
 
-static int MailboxWaitAddableInternal(struct mailbox* mbox, int timeout) {
-    LogWriteSerial("MailboxWaitAddableInternal start\n");
-    int res = AcquireMutex(mbox->add_mtx, timeout);
-    if (res != 0) {
-        LogWriteSerial("MailboxWaitAddableInternal err\n");
-        return res;
+static bool MailboxIsReady(struct mailbox* mbox, int op) {
+    switch (op) {
+    case MAILBOX_READ:
+        return mbox->used_size > 0 || mbox->loan != NULL;
+    case MAILBOX_WRITE:
+        return mbox->loan == NULL && mbox->used_size < mbox->total_size;
+    default:
+        return mbox->lending_stopped || (mbox->loan == NULL && mbox->used_size == 0);
     }
-    if ((res = AcquireSemaphore(mbox->empty_sem, timeout))) {
-        ReleaseMutex(mbox->add_mtx);
-    }
-    LogWriteSerial("MailboxWaitAddableInternal end\n");
-    return res;
 }
 
-int MailboxWaitAddable(struct mailbox* mbox, int timeout) {
-    int res = MailboxWaitAddableInternal(mbox, timeout);
-    if (res != 0) {
-        return res;
+/*
+ * Wakes up one thread on each wait queue that has something to do now. The
+ * mailbox's mutex must be held.
+ */
+static void MailboxWakeReady(struct mailbox* mbox) {
+    for (int op = 0; op < 3; ++op) {
+        struct mailbox_wait_queue* queue = &mbox->queues[op];
+        if (queue->waiting > 0 && !queue->wakeup_pending && MailboxIsReady(mbox, op)) {
+            queue->wakeup_pending = true;
+            ReleaseSemaphore(queue->sem);
+        }
     }
-    ReleaseSemaphore(mbox->empty_sem);
-    ReleaseMutex(mbox->add_mtx);
-    return 0;
+    NotifyPoll(&mbox->poll);
 }
 
-int MailboxAddMany(struct mailbox* mbox, int timeout, uint8_t* c, uint64_t max, uint64_t* added) {
-    *added = 0;
+/*
+ * Waits until the mailbox is ready for an operation. It must be called with 
+ * the mailbox's mutex held, and it is still held when it returns (even if it 
+ * fails).
+ */
+static int MailboxWaitLocked(struct mailbox* mbox, int op, int timeout) {
+    struct mailbox_wait_queue* queue = &mbox->queues[op];
+
+    while (!MailboxIsReady(mbox, op)) {
+        if (timeout == 0) {
+            return EAGAIN;
+        }
+
+        queue->waiting++;
+        ReleaseMutex(mbox->mtx);
+        int res = AcquireSemaphore(queue->sem, timeout);
+        AcquireMutex(mbox->mtx, -1);
+        queue->waiting--;
 
-    if (max <= 0 || added == NULL) {
-        return EINVAL;
+        if (res == 0) {
+            queue->wakeup_pending = false;
+        } else if (!MailboxIsReady(mbox, op)) {
+            return res;
+        }
     }
-    
-    int res = MailboxWaitAddableInternal(mbox, timeout);
-    if (res != 0) {
-        return res;
+
+    return 0;
+}
+
+/*
+ * Wakes the thread which lent the current loan, so it can check on it. The
+ * mailbox's mutex must be held.
+ */
+static void MailboxSignalLender(struct mailbox* mbox) {
+    struct mailbox_loan* loan = mbox->loan;
+    if (!loan->signalled) {
+        loan->signalled = true;
+        ReleaseSemaphore(mbox->loan_done);
     }
+}
+
+/*
+ * Reads out of the pages that were lent to the mailbox, and ends the loan if
+ * they have all been read. The lender gets woken either way, as a non-blocking
+ * lender only waits for the first read.
+ */
+static int MailboxReadLoanLocked(struct mailbox* mbox, uint64_t max, mailbox_copy_t copy, void* context, uint64_t* moved) {
+    struct mailbox_loan* loan = mbox->loan;
+    uint64_t remaining = MIN(max, loan->length - loan->consumed);
+    int res = 0;
+
+    while (remaining > 0) {
+        size_t pos = loan->offset + loan->consumed;
+        int segment = MIN(remaining, ARCH_PAGE_SIZE - pos % ARCH_PAGE_SIZE);
+        int copied = 0;
+        res = copy((uint8_t*) loan->pages[pos / ARCH_PAGE_SIZE] + pos % ARCH_PAGE_SIZE, segment, context, &copied);
 
-    uint64_t acquisitions = 1;
-    while (acquisitions < max && AcquireSemaphore(mbox->empty_sem, 0) == 0) {
-        ++acquisitions;
+        loan->consumed += copied;
+        remaining -= copied;
+        *moved += copied;
+        if (res != 0 || copied != segment) {
+            break;
+        }
     }
 
-    AcquireMutex(mbox->inner_mtx, -1);
-    for (uint64_t i = 0; i < acquisitions; ++i) {
-        mbox->data[mbox->end_pos] = c[i];
-        mbox->end_pos = (mbox->end_pos + 1) % mbox->total_size;
-        mbox->used_size++;
+    if (*moved > 0) {
+        MailboxSignalLender(mbox);
     }
-    ReleaseMutex(mbox->inner_mtx);
-    ReleaseMutex(mbox->add_mtx);
-    
-    LockScheduler();
-    ReleaseSemaphoreEx(mbox->full_sem, acquisitions);
-    UnlockScheduler();
-
-    *added = acquisitions;
-    return 0;
+    if (loan->consumed == loan->length) {
+        mbox->loan = NULL;
+    }
+    return res;
 }
 
-int MailboxAdd(struct mailbox* mbox, int timeout, uint8_t c) {
-    int res = MailboxWaitAddableInternal(mbox, timeout);
-    if (res != 0) {
+/*
+ * Moves up to `max` bytes in or out of the mailbox, calling `copy` for each
+ * contiguous segment. Stops early if `copy` fails or comes up short. The 
+ * mailbox's mutex must be held.
+ */
+static int MailboxTransferLocked(struct mailbox* mbox, bool write, uint64_t max, mailbox_copy_t copy, void* context, uint64_t* moved) {
+    int res = 0;
+
+    if (!write && mbox->loan != NULL) {
+        assert(mbox->used_size == 0);
+        res = MailboxReadLoanLocked(mbox, max, copy, context, moved);
+        MailboxWakeReady(mbox);
         return res;
     }
 
-    AcquireMutex(mbox->inner_mtx, -1);
-    mbox->data[mbox->end_pos] = c;
-    mbox->end_pos = (mbox->end_pos + 1) % mbox->total_size;
-    mbox->used_size++;
-    ReleaseMutex(mbox->inner_mtx);
-    ReleaseMutex(mbox->add_mtx);
+    int available = write ? mbox->total_size - mbox->used_size : mbox->used_size;
+    int remaining = (int) MIN(max, (uint64_t) available);
+    int pos = write ? (mbox->start_pos + mbox->used_size) % mbox->total_size : mbox->start_pos;
+
+    while (remaining > 0) {
+        int segment = MIN(remaining, mbox->total_size - pos);
+        int copied = 0;
+        res = copy(mbox->data + pos, segment, context, &copied);
+
+        if (write) {
+            mbox->used_size += copied;
+        } else {
+            mbox->start_pos = (mbox->start_pos + copied) % mbox->total_size;
+            mbox->used_size -= copied;
+        }
+        pos = (pos + copied) % mbox->total_size;
+        remaining -= copied;
+        *moved += copied;
+        if (res != 0 || copied != segment) {
+            break;
+        }
+    }
 
-    ReleaseSemaphore(mbox->full_sem);
+    MailboxWakeReady(mbox);
+    return res;
+}
+
+static int MailboxWait(struct mailbox* mbox, int op, int timeout) {
+    AcquireMutex(mbox->mtx, -1);
+    int res = MailboxWaitLocked(mbox, op, timeout);
+    MailboxWakeReady(mbox);
+    ReleaseMutex(mbox->mtx);
+    return res;
+}
+
+int MailboxWaitAddable(struct mailbox* mbox, int timeout) {
+    return MailboxWait(mbox, MAILBOX_WRITE, timeout);
+}
+
+int MailboxWaitGettable(struct mailbox* mbox, int timeout) {
+    return MailboxWait(mbox, MAILBOX_READ, timeout);
+}
+
+static int CopyIntoMailbox(uint8_t* data, int len, void* context, int* copied) {
+    memcpy(data, context, len);
+    *copied = len;
     return 0;
 }
 
-static int MailboxWaitGettableInternal(struct mailbox* mbox, int timeout) {
-    // TODO: you'll want to create a flag in struct semaphore* call 'interruptable'
-    //       or have 'timeout == -2' mean non-interruptable
+static int CopyOutOfMailbox(uint8_t* data, int len, void* context, int* copied) {
+    memcpy(context, data, len);
+    *copied = len;
+    return 0;
+}
 
-    LogWriteSerial("MailboxWaitGettableInternal start\n");
+static int CopyWithTransfer(uint8_t* data, int len, void* context, int* copied) {
+    struct transfer* tr = context;
+    uint64_t old_remaining = tr->length_remaining;
+    int res = PerformTransfer(data, tr, len);
+    *copied = old_remaining - tr->length_remaining;
+    return res;
+}
 
-    int res = AcquireMutex(mbox->get_mtx, timeout);
-    if (res != 0) {
-        LogWriteSerial("MailboxWaitGettableInternal err\n");
-        return res;
-    }
-    if ((res = AcquireSemaphore(mbox->full_sem, timeout))) {
-        ReleaseMutex(mbox->get_mtx);
+static int MailboxAccessByte(struct mailbox* mbox, bool write, int timeout, uint8_t* c) {
+    AcquireMutex(mbox->mtx, -1);
+    int res = MailboxWaitLocked(mbox, write ? MAILBOX_WRITE : MAILBOX_READ, timeout);
+    if (res == 0) {
+        uint64_t moved = 0;
+        MailboxTransferLocked(mbox, write, 1, write ? CopyIntoMailbox : CopyOutOfMailbox, c, &moved);
     }
-    LogWriteSerial("MailboxWaitGettableInternal end\n");
+    ReleaseMutex(mbox->mtx);
     return res;
 }
 
-int MailboxWaitGettable(struct mailbox* mbox, int timeout) {
-    int res = MailboxWaitGettableInternal(mbox, timeout);
-    if (res != 0) {
-        return res;
-    }
-    ReleaseSemaphore(mbox->full_sem);
-    ReleaseMutex(mbox->get_mtx);
-    return 0;
+int MailboxAdd(struct mailbox* mbox, int timeout, uint8_t c) {
+    return MailboxAccessByte(mbox, true, timeout, &c);
 }
 
 int MailboxGet(struct mailbox* mbox, int timeout, uint8_t* c) {
-    int res = MailboxWaitGettableInternal(mbox, timeout);
-    if (res != 0) {
-        return res;
+    return MailboxAccessByte(mbox, false, timeout, c);
+}
+
+/**
+ * Reads or writes a mailbox, with `copy` moving the data to or from wherever it
+ * needs to go. It is called with the mailbox locked, for each contiguous 
+ * segment of the mailbox in turn, and should set `copied` to the number of 
+ * bytes it actually moved. If `blockable` is set, this waits until some data 
+ * (or space) is available, and then moves as much as it can without blocking
+ * again.
+ *
+ * @return 0 if anything was moved (the amount is put in `moved`), EAGAIN if 
+ *         `blockable` is clear and nothing could be moved, or the error from
+ *         `copy`.
+ */
+int MailboxAccessWith(struct mailbox* mbox, bool write, uint64_t max, bool blockable, mailbox_copy_t copy, void* context, uint64_t* moved) {
+    *moved = 0;
+
+    AcquireMutex(mbox->mtx, -1);
+    int res = MailboxWaitLocked(mbox, write ? MAILBOX_WRITE : MAILBOX_READ, blockable ? -1 : 0);
+    if (res == 0) {
+        res = MailboxTransferLocked(mbox, write, max, copy, context, moved);
     }
+    ReleaseMutex(mbox->mtx);
 
-    AcquireMutex(mbox->inner_mtx, -1);
-    
-    *c = mbox->data[mbox->start_pos];
-    mbox->start_pos = (mbox->start_pos + 1) % mbox->total_size;
-    mbox->used_size--;
+    return *moved > 0 ? 0 : res;
+}
 
-    ReleaseMutex(mbox->inner_mtx);
-    ReleaseMutex(mbox->get_mtx);
-    ReleaseSemaphore(mbox->empty_sem);
-    return 0;
+/**
+ * Reads or writes a mailbox. If the transfer is blockable, it waits until some
+ * data (or space) is available, and then transfers as much as it can without
+ * blocking again.
+ *
+ * @return 0 on success, EAGAIN if the transfer isn't blockable and nothing 
+ *         could be transferred, or an error from PerformTransfer().
+ */
+int MailboxAccess(struct mailbox* mbox, struct transfer* tr) {
+    bool write = tr->direction == TRANSFER_WRITE;
+    if (tr->length_remaining == 0) {
+        return MailboxWait(mbox, write ? MAILBOX_WRITE : MAILBOX_READ, 0);
+    }
+
+    uint64_t moved;
+    return MailboxAccessWith(mbox, write, tr->length_remaining, tr->blockable, CopyWithTransfer, tr, &moved);
 }
 
-int MailboxGetMany(struct mailbox* mbox, int timeout, uint8_t* c, uint64_t max, uint64_t* added) {
-    *added = 0;
-    
-    if (max <= 0 || added == NULL) {
-        return EINVAL;
+/**
+ * Lends a set of pages to the mailbox, so that readers can copy out of them
+ * directly. `pages` holds the kernel virtual address of each page, and the 
+ * data starts `offset` bytes into the first one. The pages must stay mapped
+ * until this returns.
+ *
+ * If `blockable` is set, this waits for the mailbox to be empty, and then for
+ * readers to read all `length` bytes. Otherwise, the loan only goes ahead if 
+ * the mailbox is empty and a reader is already waiting, and whatever that 
+ * reader doesn't take is taken back.
+ *
+ * @param lent Set to the number of bytes that were read.
+ * @return 0 if any of the data was read, EAGAIN if `blockable` is clear and the
+ *         loan couldn't start, or EPIPE if lending was stopped before anything
+ *         was read.
+ */
+int MailboxLend(struct mailbox* mbox, const size_t* pages, size_t offset, size_t length, bool blockable, size_t* lent) {
+    *lent = 0;
+    if (length == 0) {
+        return 0;
+    }
+
+    struct mailbox_loan loan = {
+        .pages = pages, .offset = offset, .length = length, .consumed = 0,
+        .signalled = false, .cancelled = false,
+    };
+
+    AcquireMutex(mbox->mtx, -1);
+    int res = MailboxWaitLocked(mbox, MAILBOX_LEND, blockable ? -1 : 0);
+    if (res == 0 && mbox->lending_stopped) {
+        res = EPIPE;
+    }
+    if (res == 0 && !blockable && mbox->queues[MAILBOX_READ].waiting == 0) {
+        res = EAGAIN;
     }
-    
-    int res = MailboxWaitGettableInternal(mbox, timeout);
     if (res != 0) {
+        ReleaseMutex(mbox->mtx);
         return res;
     }
+    mbox->loan = &loan;
+    MailboxWakeReady(mbox);
 
-    uint64_t acquisitions = 1;
-    while (acquisitions < max && AcquireSemaphore(mbox->full_sem, 0) == 0) {
-        ++acquisitions;
-    }
+    while (mbox->loan == &loan) {
+        ReleaseMutex(mbox->mtx);
+        AcquireSemaphore(mbox->loan_done, -1);
+        AcquireMutex(mbox->mtx, -1);
+        loan.signalled = false;
 
-    AcquireMutex(mbox->inner_mtx, -1);
-    for (uint64_t i = 0; i < acquisitions; ++i) {
-        c[i] = mbox->data[mbox->start_pos];
-        mbox->start_pos = (mbox->start_pos + 1) % mbox->total_size;
-        mbox->used_size--;
+        if (mbox->loan == &loan && !blockable && loan.consumed > 0) {
+            mbox->loan = NULL;
+            MailboxWakeReady(mbox);
+        }
     }
-    ReleaseMutex(mbox->inner_mtx);
-    ReleaseMutex(mbox->get_mtx);
-    
-    LockScheduler();
-    ReleaseSemaphoreEx(mbox->empty_sem, acquisitions);
-    UnlockScheduler();
-
-    *added = acquisitions;
-    return 0;
+    ReleaseMutex(mbox->mtx);
+
+    *lent = loan.consumed;
+    return loan.consumed == 0 && loan.cancelled ? EPIPE : 0;
 }
 
-int MailboxAccess(struct mailbox* mbox, struct transfer* tr) {
-    const int CHUNK_SIZE = 256;
+/**
+ * Ends the current loan (if there is one) without waiting for the rest of it
+ * to be read, and makes any later calls to MailboxLend() fail with EPIPE.
+ */
+void MailboxStopLending(struct mailbox* mbox) {
+    EXACT_IRQL(IRQL_STANDARD);
 
-    bool write = tr->direction == TRANSFER_WRITE;
-    if (tr->length_remaining == 0) {
-        return (write ? MailboxWaitAddable : MailboxWaitGettable)(mbox, 0);
+    AcquireMutex(mbox->mtx, -1);
+    mbox->lending_stopped = true;
+    if (mbox->loan != NULL) {
+        mbox->loan->cancelled = true;
+        MailboxSignalLender(mbox);
+        mbox->loan = NULL;
+        MailboxWakeReady(mbox);
     }
+    ReleaseMutex(mbox->mtx);
+}
 
-    bool done_any = false;
-    while (tr->length_remaining > 0) {
-        bool can_block = tr->blockable && !done_any;
-        uint8_t c[CHUNK_SIZE];
-        uint64_t added;
-        int res;
-        uint64_t len = MIN(tr->length_remaining, CHUNK_SIZE);
-        if (write) {
-            uint64_t old_remaining = tr->length_remaining;
-            PerformTransfer(c, tr, len);
-            uint64_t transferred = old_remaining - tr->length_remaining;
-            res = MailboxAddMany(mbox, can_block ? -1 : 0, c, transferred, &added);
-            if (transferred != added ) {
-                if (added > transferred) {
-                    LogWriteSerial("add = %d, transf = %d\n", (int) added, (int) transferred);
-                    PanicEx(PANIC_UNKNOWN, "reverting more than we took??");
-                }
-                RevertTransfer(tr, transferred - added);
-                //SleepMilli(10); // give time to fill for hopefully faster transfer
-            }
-        } else {
-            res = MailboxGetMany(mbox, can_block ? -1 : 0, c, len, &added);
-            if (added != len) {
-                //SleepMilli(10); // give time to fill for hopefully faster transfer
-            }
-        }
-        if (res != 0) {
-            return done_any ? 0 : res;
-        }
-        if (!write) {
-            PerformTransfer(c, tr, added);
-        }
-        done_any = true;
-    }
-    return 0;
+/**
+ * Checks whether the mailbox can be read from (or written to) without 
+ * blocking, and adds `table` to the mailbox's poll head so that it gets woken
+ * when that changes.
+ */
+bool MailboxPoll(struct mailbox* mbox, bool write, struct poll_table* table) {
+    PollWait(table, &mbox->poll);
+
+    AcquireMutex(mbox->mtx, -1);
+    bool ready = MailboxIsReady(mbox, write ? MAILBOX_WRITE : MAILBOX_READ);
+    ReleaseMutex(mbox->mtx);
+    return ready;
 }
 
+/**
+ * Wakes anyone polling the mailbox, for when its owner changes something the
+ * mailbox doesn't know about (e.g. a pipe being broken).
+ */
+void MailboxNotifyPollers(struct mailbox* mbox) {
+    NotifyPoll(&mbox->poll);
+}
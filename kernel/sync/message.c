@@ -1,6 +1,20 @@
 
 /*
  * adt/msgbox.c - Message Queues
+ *
+ * Message boxes made with CreateMessageBox() are unbounded: each message is
+ * copied into its own heap allocation and put on a list.
+ *
+ * Ones made with CreateBoundedMessageBox() instead allocate a ring of fixed-size
+ * slots up front, and messages are copied in and out of those, so sending and
+ * receiving never touch the heap. When the ring is full, sending either blocks
+ * or fails with EAGAIN, depending on MSGBOX_FAIL_WHEN_FULL. ReceiveMessages()
+ * takes everything that's waiting (up to a limit) in one go.
+ *
+ * Bounded boxes are protected by a spinlock, so that messages can still be sent
+ * at IRQL_SCHEDULER (as long as the send doesn't need to block). Threads that
+ * are waiting block on a semaphore used as a wait queue, in the same way as 
+ * mailboxes do.
  */
 
 #include <heap.h>
@@ -16,6 +30,13 @@
 #include <irql.h>
 #include <transfer.h>
 #include <linkedlist.h>
+#include <message.h>
+
+struct msgbox_wait_queue {
+    struct semaphore* sem;
+    int waiting;
+    bool wakeup_pending;
+};
 
 struct msgbox {
     char* name;
@@ -23,6 +44,17 @@ struct msgbox {
     struct linked_list* data;
     struct spinlock lock;
     struct semaphore* sem;
+
+    /*
+     * Only used by bounded message boxes.
+     */
+    uint8_t* slots;
+    int capacity;
+    int head;
+    int count;
+    int flags;
+    struct msgbox_wait_queue senders;
+    struct msgbox_wait_queue receivers;
 };
 
 struct msgbox* CreateMessageBox(const char* name, int payload_size) {
@@ -37,14 +69,146 @@ struct msgbox* CreateMessageBox(const char* name, int payload_size) {
     return mbox;
 }
 
+/**
+ * Creates a message box which can hold at most `capacity` messages, all of
+ * which are allocated now.
+ *
+ * @param flags MSGBOX_FAIL_WHEN_FULL if senders should get EAGAIN instead of
+ *              blocking when the box is full.
+ */
+struct msgbox* CreateBoundedMessageBox(const char* name, int payload_size, int capacity, int flags) {
+    assert(capacity > 0);
+
+    struct msgbox* mbox = AllocHeap(sizeof(struct msgbox));
+    *mbox = (struct msgbox) {
+        .name = strdup(name),
+        .payload_size = payload_size,
+        .slots = AllocHeap(payload_size * capacity),
+        .capacity = capacity,
+        .flags = flags,
+        .senders = {.sem = CreateSemaphore("msgboxw", 1, 1)},
+        .receivers = {.sem = CreateSemaphore("msgboxr", 1, 1)},
+    };
+    InitSpinlock(&mbox->lock, "msgboxl", IRQL_SCHEDULER);
+    return mbox;
+}
+
 void DestroyMessageBox(struct msgbox* mbox) {
-    // TODO: empty out the contents of the list properly
-    ListDestroy(mbox->data);
+    if (mbox->capacity != 0) {
+        DestroySemaphore(mbox->senders.sem, SEM_DONT_CARE);
+        DestroySemaphore(mbox->receivers.sem, SEM_DONT_CARE);
+        FreeHeap(mbox->slots);
+    } else {
+        // TODO: empty out the contents of the list properly
+        ListDestroy(mbox->data);
+    }
     FreeHeap(mbox->name);
     FreeHeap(mbox);
 }
 
+/*
+ * Wakes up a thread on the wait queue, if there is one and it hasn't already
+ * been woken. The message box's spinlock must be held.
+ */
+static void WakeMessageBoxQueue(struct msgbox_wait_queue* queue) {
+    if (queue->waiting > 0 && !queue->wakeup_pending) {
+        queue->wakeup_pending = true;
+        ReleaseSemaphore(queue->sem);
+    }
+}
+
+/*
+ * Blocks on a wait queue. It must be called with the spinlock held, and it is 
+ * held again when it returns. The caller needs to check the condition it was 
+ * waiting for again afterwards.
+ */
+static void WaitOnMessageBoxQueue(struct msgbox* mbox, struct msgbox_wait_queue* queue) {
+    queue->waiting++;
+    ReleaseSpinlock(&mbox->lock);
+    AcquireSemaphore(queue->sem, -1);
+    AcquireSpinlock(&mbox->lock);
+    queue->waiting--;
+    queue->wakeup_pending = false;
+}
+
+static int SendBoundedMessage(struct msgbox* mbox, void* payload) {
+    /*
+     * We can't block if we were called with a spinlock held.
+     */
+    bool can_block = !(mbox->flags & MSGBOX_FAIL_WHEN_FULL) && GetIrql() == IRQL_STANDARD;
+
+    AcquireSpinlock(&mbox->lock);
+    while (mbox->count == mbox->capacity) {
+        if (!can_block) {
+            ReleaseSpinlock(&mbox->lock);
+            return EAGAIN;
+        }
+        WaitOnMessageBoxQueue(mbox, &mbox->senders);
+    }
+
+    int slot = (mbox->head + mbox->count) % mbox->capacity;
+    memcpy(mbox->slots + slot * mbox->payload_size, payload, mbox->payload_size);
+    mbox->count++;
+
+    WakeMessageBoxQueue(&mbox->receivers);
+    if (mbox->count < mbox->capacity) {
+        WakeMessageBoxQueue(&mbox->senders);
+    }
+    ReleaseSpinlock(&mbox->lock);
+    return 0;
+}
+
+/**
+ * Receives up to `max_count` messages from a bounded message box, blocking 
+ * until there is at least one. They are written one after another into 
+ * `payloads`.
+ *
+ * @return The number of messages received.
+ */
+int ReceiveMessages(struct msgbox* mbox, void* payloads, int max_count) {
+    EXACT_IRQL(IRQL_STANDARD);
+    assert(mbox->capacity != 0);
+    assert(max_count > 0);
+
+    AcquireSpinlock(&mbox->lock);
+    while (mbox->count == 0) {
+        WaitOnMessageBoxQueue(mbox, &mbox->receivers);
+    }
+
+    /*
+     * At most two copies: up to the end of the ring, and then from the start.
+     */
+    int received = mbox->count < max_count ? mbox->count : max_count;
+    int first = mbox->capacity - mbox->head;
+    if (first > received) {
+        first = received;
+    }
+    uint8_t* out = payloads;
+    memcpy(out, mbox->slots + mbox->head * mbox->payload_size, first * mbox->payload_size);
+    memcpy(out + first * mbox->payload_size, mbox->slots, (received - first) * mbox->payload_size);
+    mbox->head = (mbox->head + received) % mbox->capacity;
+    mbox->count -= received;
+
+    WakeMessageBoxQueue(&mbox->senders);
+    if (mbox->count > 0) {
+        WakeMessageBoxQueue(&mbox->receivers);
+    }
+    ReleaseSpinlock(&mbox->lock);
+    return received;
+}
+
+/**
+ * Sends a message. The payload is copied, so it can be reused straight away.
+ *
+ * @return 0 on success, or EAGAIN if the message box is bounded and full, and 
+ *         either it was created with MSGBOX_FAIL_WHEN_FULL or the caller is
+ *         above IRQL_STANDARD.
+ */
 int SendMessage(struct msgbox* mbox, void* payload) {
+    if (mbox->capacity != 0) {
+        return SendBoundedMessage(mbox, payload);
+    }
+
     /* 
      * Need to copy it into kernel memory as messages may cross VAS boundaries.
      */
@@ -63,6 +227,11 @@ int SendMessage(struct msgbox* mbox, void* payload) {
 }
 
 int ReceiveMessage(struct msgbox* mbox, void* payload) {
+    if (mbox->capacity != 0) {
+        ReceiveMessages(mbox, payload, 1);
+        return 0;
+    }
+
     int res = AcquireSemaphore(mbox->sem, -1);  // TODO: make this an EINTR-able acquire
     if (res != 0) {
         return res;
@@ -77,4 +246,4 @@ int ReceiveMessage(struct msgbox* mbox, void* payload) {
     FreeHeap(data);
 
     return 0;
-}
\ No newline at end of file
+}
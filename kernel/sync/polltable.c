@@ -0,0 +1,169 @@
+
+/*
+ * sync/polltable.c - Waiting on Many Objects
+ *
+ * Each poll table has a semaphore which is used as an event: it is kept 'full'
+ * so that acquiring it blocks, and the first notification to reach the table 
+ * releases it. The table stays on every head it was added to until the wait is
+ * over, so that nothing gets missed between checking the objects and blocking.
+ */
+
+#include <polltable.h>
+#include <semaphore.h>
+#include <vnode.h>
+#include <heap.h>
+#include <assert.h>
+#include <errno.h>
+#include <irql.h>
+#include <timer.h>
+
+struct poll_entry {
+    struct poll_head* head;
+    struct poll_table* table;
+    struct poll_entry* next_in_head;
+    struct poll_entry* next_in_table;
+};
+
+void InitPollHead(struct poll_head* head) {
+    InitSpinlock(&head->lock, "pollhead", IRQL_SCHEDULER);
+    head->entries = NULL;
+}
+
+/**
+ * Adds a poll table to an object's poll head, so that it gets woken when the
+ * object is next notified. `table` may be NULL, in which case this does 
+ * nothing. The object should check whether it is ready after calling this, and
+ * not before.
+ */
+void PollWait(struct poll_table* table, struct poll_head* head) {
+    if (table == NULL) {
+        return;
+    }
+
+    struct poll_entry* entry = AllocHeap(sizeof(struct poll_entry));
+    entry->head = head;
+    entry->table = table;
+    entry->next_in_table = table->entries;
+    table->entries = entry;
+
+    AcquireSpinlock(&head->lock);
+    entry->next_in_head = head->entries;
+    head->entries = entry;
+    ReleaseSpinlock(&head->lock);
+}
+
+/**
+ * Wakes every thread which is polling an object. This should be called after 
+ * anything which might have made the object ready.
+ */
+void NotifyPoll(struct poll_head* head) {
+    MAX_IRQL(IRQL_SCHEDULER);
+
+    AcquireSpinlock(&head->lock);
+    for (struct poll_entry* entry = head->entries; entry != NULL; entry = entry->next_in_head) {
+        struct poll_table* table = entry->table;
+        AcquireSpinlock(&table->lock);
+        if (!table->woken) {
+            table->woken = true;
+            ReleaseSemaphore(table->wakeup);
+        }
+        ReleaseSpinlock(&table->lock);
+    }
+    ReleaseSpinlock(&head->lock);
+}
+
+static void RemoveFromPollHead(struct poll_entry* entry) {
+    struct poll_head* head = entry->head;
+
+    AcquireSpinlock(&head->lock);
+    struct poll_entry** prev = &head->entries;
+    while (*prev != entry) {
+        assert(*prev != NULL);
+        prev = &(*prev)->next_in_head;
+    }
+    *prev = entry->next_in_head;
+    ReleaseSpinlock(&head->lock);
+}
+
+/**
+ * Waits for any of a set of vnodes to be ready. Entries in `nodes` may be NULL,
+ * in which case they are skipped. The vnodes must stay referenced until this
+ * returns.
+ *
+ * @param events     What to wait for on each vnode (VNODE_WAIT_READ, etc.).
+ * @param revents    Set to which of those each vnode is ready for. 
+ *                   VNODE_WAIT_ERROR may be set without being asked for.
+ * @param timeout_ms How long to wait, -1 to wait forever, or 0 to just check 
+ *                   them once.
+ * @param ready_out  Set to the number of vnodes which are ready, which is 0 if
+ *                   the timeout expired.
+ * @return 0 on success, or an errno code.
+ */
+int PollVnodes(struct vnode** nodes, const int* events, int* revents, int count, int timeout_ms, int* ready_out) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct poll_table table = {
+        .wakeup = timeout_ms == 0 ? NULL : CreateSemaphore("poll", 1, 1),
+        .woken = false,
+        .entries = NULL,
+    };
+    InitSpinlock(&table.lock, "polltable", IRQL_SCHEDULER);
+
+    uint64_t deadline = GetSystemTimer() + ((uint64_t) timeout_ms) * 1000000ULL;
+    bool first_pass = timeout_ms != 0;
+    int ready;
+    int res = 0;
+
+    while (true) {
+        ready = 0;
+        for (int i = 0; i < count; ++i) {
+            if (nodes[i] == NULL) {
+                revents[i] = 0;
+                continue;
+            }
+            revents[i] = VnodeOpWait(nodes[i], events[i], first_pass ? &table : NULL);
+            if (revents[i] != 0) {
+                ++ready;
+            }
+        }
+        first_pass = false;
+
+        if (ready > 0 || timeout_ms == 0) {
+            break;
+        }
+
+        int wait_ms = -1;
+        if (timeout_ms > 0) {
+            uint64_t now = GetSystemTimer();
+            if (now >= deadline) {
+                break;
+            }
+            wait_ms = (int) ((deadline - now + 999999) / 1000000);
+        }
+
+        res = AcquireSemaphore(table.wakeup, wait_ms);
+        if (res == ETIMEDOUT) {
+            res = 0;
+            break;
+        } else if (res != 0) {
+            break;
+        }
+
+        AcquireSpinlock(&table.lock);
+        table.woken = false;
+        ReleaseSpinlock(&table.lock);
+    }
+
+    while (table.entries != NULL) {
+        struct poll_entry* entry = table.entries;
+        table.entries = entry->next_in_table;
+        RemoveFromPollHead(entry);
+        FreeHeap(entry);
+    }
+    if (table.wakeup != NULL) {
+        DestroySemaphore(table.wakeup, SEM_DONT_CARE);
+    }
+
+    *ready_out = ready;
+    return res;
+}
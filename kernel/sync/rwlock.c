@@ -0,0 +1,232 @@
+
+/*
+ * sync/rwlock.c - Reader-Writer Locks
+ *
+ * The blocking kind works like the semaphores: it has its own spinlock, and
+ * only takes the scheduler lock to block or wake threads. Releases hand the
+ * lock straight over to the threads they wake, so a woken thread already holds
+ * it and doesn't need to check again.
+ */
+
+#include <rwlock.h>
+#include <thread.h>
+#include <threadlist.h>
+#include <spinlock.h>
+#include <heap.h>
+#include <errno.h>
+#include <string.h>
+#include <irql.h>
+#include <arch.h>
+#include <assert.h>
+#include <panic.h>
+
+struct rwlock {
+    struct spinlock lock;
+    const char* name;
+    int readers;
+    bool writer;
+    struct thread_list waiting_readers;
+    struct thread_list waiting_writers;
+};
+
+struct rwlock* CreateRwLock(const char* name) {
+    MAX_IRQL(IRQL_SCHEDULER);
+
+    struct rwlock* rw = AllocHeap(sizeof(struct rwlock));
+    InitSpinlock(&rw->lock, "rwlock", IRQL_SCHEDULER);
+    rw->name = name;
+    rw->readers = 0;
+    rw->writer = false;
+    ThreadListInit(&rw->waiting_readers, NEXT_INDEX_RWLOCK);
+    ThreadListInit(&rw->waiting_writers, NEXT_INDEX_RWLOCK);
+    return rw;
+}
+
+/*
+ * Puts the current thread on a wait list and blocks until whoever takes it off
+ * has given it the lock. Called with the lock's spinlock held, and releases it.
+ */
+static void WaitForRwLock(struct rwlock* rw, struct thread_list* list) {
+    struct thread* thr = GetThread();
+    if (thr == NULL) {
+        Panic(PANIC_SEM_BLOCK_WITHOUT_THREAD);
+    }
+
+    ThreadListInsert(list, thr);
+    LockScheduler();
+    BlockThread(THREAD_STATE_WAITING_FOR_RWLOCK);
+    UnlockScheduler();
+    ReleaseSpinlock(&rw->lock);
+}
+
+static void WakeRwLockWaiter(struct thread_list* list) {
+    struct thread* thr = ThreadListDeleteTop(list);
+    LockScheduler();
+    UnblockThread(thr);
+    UnlockScheduler();
+}
+
+/*
+ * Works out who gets the lock next, once it has become free. The spinlock must
+ * be held.
+ */
+static void HandOverRwLock(struct rwlock* rw) {
+    assert(rw->readers == 0 && !rw->writer);
+
+    if (rw->waiting_writers.head != NULL) {
+        rw->writer = true;
+        WakeRwLockWaiter(&rw->waiting_writers);
+
+    } else {
+        while (rw->waiting_readers.head != NULL) {
+            rw->readers++;
+            WakeRwLockWaiter(&rw->waiting_readers);
+        }
+    }
+}
+
+void AcquireRwLockRead(struct rwlock* rw) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    AcquireSpinlock(&rw->lock);
+    if (!rw->writer && rw->waiting_writers.head == NULL) {
+        rw->readers++;
+        ReleaseSpinlock(&rw->lock);
+        return;
+    }
+    WaitForRwLock(rw, &rw->waiting_readers);
+}
+
+void ReleaseRwLockRead(struct rwlock* rw) {
+    AcquireSpinlock(&rw->lock);
+    assert(rw->readers > 0 && !rw->writer);
+    if (--rw->readers == 0) {
+        HandOverRwLock(rw);
+    }
+    ReleaseSpinlock(&rw->lock);
+}
+
+void AcquireRwLockWrite(struct rwlock* rw) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    AcquireSpinlock(&rw->lock);
+    if (!rw->writer && rw->readers == 0) {
+        rw->writer = true;
+        ReleaseSpinlock(&rw->lock);
+        return;
+    }
+    WaitForRwLock(rw, &rw->waiting_writers);
+}
+
+void ReleaseRwLockWrite(struct rwlock* rw) {
+    AcquireSpinlock(&rw->lock);
+    assert(rw->writer && rw->readers == 0);
+    rw->writer = false;
+    HandOverRwLock(rw);
+    ReleaseSpinlock(&rw->lock);
+}
+
+/**
+ * Deallocates a reader-writer lock.
+ *
+ * @return 0 on success, or EBUSY if it is still held.
+ */
+int DestroyRwLock(struct rwlock* rw) {
+    MAX_IRQL(IRQL_SCHEDULER);
+
+    AcquireSpinlock(&rw->lock);
+    bool busy = rw->writer || rw->readers != 0;
+    ReleaseSpinlock(&rw->lock);
+    if (busy) {
+        return EBUSY;
+    }
+    FreeHeap(rw);
+    return 0;
+}
+
+void InitSpinRwLock(struct spin_rwlock* rw, const char* name, int irql) {
+    assert(strlen(name) <= 15);
+    assert(irql >= IRQL_SCHEDULER);
+    rw->guard = 0;
+    rw->readers = 0;
+    rw->waiting_writers = 0;
+    rw->writer = false;
+    rw->irql = irql;
+    strcpy(rw->name, name);
+}
+
+/**
+ * Acquires a spinning reader-writer lock for reading, raising to its IRQL.
+ *
+ * @return The previous IRQL, which must be passed to ReleaseSpinRwLockRead().
+ */
+int AcquireSpinRwLockRead(struct spin_rwlock* rw) {
+    int prev_irql = RaiseIrql(rw->irql);
+    while (true) {
+        ArchSpinlockAcquire(&rw->guard);
+        if (!rw->writer && rw->waiting_writers == 0) {
+            rw->readers++;
+            ArchSpinlockRelease(&rw->guard);
+            return prev_irql;
+        }
+        ArchSpinlockRelease(&rw->guard);
+
+        while (rw->writer || rw->waiting_writers != 0) {
+            ArchRelaxCpu();
+        }
+    }
+}
+
+void ReleaseSpinRwLockRead(struct spin_rwlock* rw, int prev_irql) {
+    ArchSpinlockAcquire(&rw->guard);
+    assert(rw->readers > 0);
+    rw->readers--;
+    ArchSpinlockRelease(&rw->guard);
+    LowerIrql(prev_irql);
+}
+
+void AcquireSpinRwLockWrite(struct spin_rwlock* rw) {
+    int prev_irql = RaiseIrql(rw->irql);
+
+    /*
+     * Registering as a waiting writer stops any new readers getting in.
+     */
+    ArchSpinlockAcquire(&rw->guard);
+    rw->waiting_writers++;
+    ArchSpinlockRelease(&rw->guard);
+
+    while (true) {
+        ArchSpinlockAcquire(&rw->guard);
+        if (!rw->writer && rw->readers == 0) {
+            rw->writer = true;
+            rw->waiting_writers--;
+            rw->writer_prev_irql = prev_irql;
+            ArchSpinlockRelease(&rw->guard);
+            return;
+        }
+        ArchSpinlockRelease(&rw->guard);
+
+        while (rw->writer || rw->readers != 0) {
+            ArchRelaxCpu();
+        }
+    }
+}
+
+void ReleaseSpinRwLockWrite(struct spin_rwlock* rw) {
+    if (!rw->writer) {
+        PanicEx(PANIC_SPINLOCK_RELEASED_BEFORE_ACQUIRED, rw->name);
+    }
+
+    int prev_irql = rw->writer_prev_irql;
+    ArchSpinlockAcquire(&rw->guard);
+    rw->writer = false;
+    ArchSpinlockRelease(&rw->guard);
+    LowerIrql(prev_irql);
+}
+
+/**
+ * Like IsSpinlockHeld(), this is only for writing assertions.
+ */
+bool IsSpinRwLockWriteHeld(struct spin_rwlock* rw) {
+    return rw->writer;
+}
@@ -10,38 +10,255 @@
 #include <assert.h>
 #include <panic.h>
 #include <log.h>
+#include <spinlock.h>
+#include <arch.h>
 
+/*
+ * Each semaphore has its own lock, so that semaphores don't contend with each
+ * other, or with the scheduler. The scheduler lock is only taken to actually
+ * block or wake a thread, and must be taken after the semaphore's lock, never
+ * before it.
+ */
 struct semaphore {
+    struct spinlock lock;
     const char* name;
     int max_count;
     int current_count;
     struct thread_list waiting_list;
+
+    /*
+     * Adaptive mutexes keep track of which thread holds them. Someone trying to
+     * acquire one that's held by a thread running on another CPU will spin for
+     * a little while first, as it's probably going to be released sooner than
+     * it would take to block and be woken up again.
+     */
+    bool adaptive;
+    struct thread* volatile owner;
+
+    /*
+     * Adaptive mutexes also do priority inheritance. While anyone is waiting,
+     * the mutex sits on its owner's `contended_mutexes` list, and the owner
+     * runs at `waiter_priority` (the most important waiter's priority) if that
+     * is better than its own. These are only changed with the scheduler lock
+     * held.
+     */
+    int waiter_priority;
+    bool contended;
+    struct semaphore* next_contended;
 };
 
+/*
+ * How many times to check if an adaptive mutex has been released before giving
+ * up and blocking.
+ */
+#define MUTEX_SPIN_LIMIT 1000
+
+/*
+ * How far down a chain of mutex owners (each waiting on the next) a priority
+ * gets passed on. Stops a deadlock from looping forever.
+ */
+#define MAX_INHERITANCE_DEPTH 8
+
 struct semaphore* CreateSemaphore(const char* name, int max_count, int initial_count) {
     MAX_IRQL(IRQL_SCHEDULER);
 
     struct semaphore* sem = AllocHeap(sizeof(struct semaphore));
+    InitSpinlock(&sem->lock, "semaphore", IRQL_SCHEDULER);
     sem->name = name;
     sem->max_count = max_count;
     sem->current_count = initial_count;
     ThreadListInit(&sem->waiting_list, NEXT_INDEX_SEMAPHORE);
+    sem->adaptive = false;
+    sem->owner = NULL;
+    sem->waiter_priority = NO_INHERITED_PRIORITY;
+    sem->contended = false;
+    sem->next_contended = NULL;
     return sem;
 }
 
+/**
+ * Creates a mutex that spins briefly before blocking if its owner is running.
+ * Used with the normal mutex (or semaphore) functions.
+ */
+struct semaphore* CreateAdaptiveMutex(const char* name) {
+    struct semaphore* mtx = CreateSemaphore(name, 1, 0);
+    mtx->adaptive = true;
+    return mtx;
+}
+
+/**
+ * Returns the thread holding an adaptive mutex, or NULL if it's free, or was
+ * acquired before multitasking started. Only for debugging - it can change as
+ * soon as it has been read.
+ */
+struct thread* GetMutexOwner(struct semaphore* mtx) {
+    return mtx->owner;
+}
+
 int FillSemaphore(struct semaphore* sem) {
     int res = 0;
-    LockScheduler();
+    AcquireSpinlock(&sem->lock);
     if (sem->current_count <= sem->max_count) {
         res = sem->max_count - sem->current_count;
         sem->current_count = sem->max_count;
     } else {
         res = -1;
     }
-    UnlockScheduler();
+    ReleaseSpinlock(&sem->lock);
     return res;
 }
 
+/*
+ * Waits for an adaptive mutex to be released, as long as its owner is running
+ * on another CPU. The semaphore's lock must be held, and it is dropped between
+ * checks. There's no guarantee the mutex is still free by the time we return.
+ */
+static void SpinWhileOwnerRunning(struct semaphore* sem) {
+    struct thread* owner = sem->owner;
+    if (owner == NULL || owner == GetThread()) {
+        return;
+    }
+
+    /*
+     * Threads don't exit while holding a kernel mutex, and releasing it needs
+     * the semaphore's lock. So the owner can only be looked at while we have
+     * the lock and have just seen that it's still the owner - otherwise it
+     * could have exited and been freed in the meantime.
+     */
+    for (int i = 0; i < MUTEX_SPIN_LIMIT; ++i) {
+        if (sem->owner != owner || owner->state != THREAD_STATE_RUNNING) {
+            break;
+        }
+        ReleaseSpinlock(&sem->lock);
+        ArchRelaxCpu();
+        AcquireSpinlock(&sem->lock);
+    }
+}
+
+static int GetBestWaiterPriority(struct semaphore* sem) {
+    int best = NO_INHERITED_PRIORITY;
+    for (struct thread* iter = sem->waiting_list.head; iter != NULL; iter = iter->links[NEXT_INDEX_SEMAPHORE].next) {
+        if (iter->priority < best) {
+            best = iter->priority;
+        }
+    }
+    return best;
+}
+
+static void RemoveContendedMutex(struct thread* owner, struct semaphore* sem) {
+    struct semaphore** iter = &owner->contended_mutexes;
+    while (*iter != sem) {
+        iter = &(*iter)->next_contended;
+    }
+    *iter = sem->next_contended;
+    sem->next_contended = NULL;
+    sem->contended = false;
+}
+
+static void RecalculateInheritedPriority(struct thread* thr) {
+    int best = NO_INHERITED_PRIORITY;
+    for (struct semaphore* iter = thr->contended_mutexes; iter != NULL; iter = iter->next_contended) {
+        if (iter->waiter_priority < best) {
+            best = iter->waiter_priority;
+        }
+    }
+    SetInheritedPriority(thr, best);
+}
+
+/*
+ * Lends a waiting thread's priority to the owner of the mutex, and if the owner
+ * is itself waiting on a mutex, to that one's owner, and so on. The scheduler
+ * lock must be held.
+ *
+ * Priorities are only ever taken back when a mutex changes hands or a wait is
+ * cancelled, and only from that mutex's owner. So a thread further down a
+ * chain can stay boosted for a little longer than it needs to, but never for
+ * less.
+ */
+static void InheritPriority(struct semaphore* sem, int priority) {
+    AssertSchedulerLockHeld();
+
+    for (int depth = 0; depth < MAX_INHERITANCE_DEPTH; ++depth) {
+        if (priority < sem->waiter_priority) {
+            sem->waiter_priority = priority;
+        }
+
+        struct thread* owner = sem->owner;
+        if (owner == NULL) {
+            return;
+        }
+        if (!sem->contended) {
+            sem->next_contended = owner->contended_mutexes;
+            owner->contended_mutexes = sem;
+            sem->contended = true;
+        }
+        if (priority >= owner->priority) {
+            return;
+        }
+        SetInheritedPriority(owner, priority);
+
+        bool waiting = owner->state == THREAD_STATE_WAITING_FOR_SEMAPHORE || owner->state == THREAD_STATE_WAITING_FOR_SEMAPHORE_WITH_TIMEOUT;
+        sem = owner->waiting_on_semaphore;
+        if (!waiting || sem == NULL || !sem->adaptive) {
+            return;
+        }
+    }
+}
+
+/*
+ * Gives a contended adaptive mutex to one of the threads waiting on it, which
+ * must have already been taken off the wait list. Both the mutex's lock and the
+ * scheduler lock must be held.
+ */
+static void HandOverMutex(struct semaphore* sem, struct thread* new_owner) {
+    struct thread* old_owner = sem->owner;
+    if (sem->contended) {
+        RemoveContendedMutex(old_owner, sem);
+    }
+
+    sem->owner = new_owner;
+    sem->waiter_priority = GetBestWaiterPriority(sem);
+    if (old_owner != NULL) {
+        RecalculateInheritedPriority(old_owner);
+    }
+    if (sem->waiter_priority != NO_INHERITED_PRIORITY) {
+        InheritPriority(sem, sem->waiter_priority);
+    }
+}
+
+/*
+ * Called by a thread that has woken up from waiting with a timeout (or because
+ * of a signal). If it's still on the wait list, it really did time out, and
+ * takes itself off. Otherwise, a release got to it first, so it now holds the
+ * semaphore.
+ */
+static bool CancelSemaphoreWait(struct semaphore* sem, struct thread* thr) {
+    AcquireSpinlock(&sem->lock);
+    bool still_waiting = ThreadListContains(&sem->waiting_list, thr);
+    if (still_waiting) {
+        ThreadListDelete(&sem->waiting_list, thr);
+
+        /*
+         * The owner may have been boosted on our account.
+         */
+        LockScheduler();
+        thr->waiting_on_semaphore = NULL;
+        if (sem->adaptive) {
+            sem->waiter_priority = GetBestWaiterPriority(sem);
+            if (sem->contended) {
+                struct thread* owner = sem->owner;
+                if (sem->waiting_list.head == NULL) {
+                    RemoveContendedMutex(owner, sem);
+                }
+                RecalculateInheritedPriority(owner);
+            }
+        }
+        UnlockScheduler();
+    }
+    ReleaseSpinlock(&sem->lock);
+    return still_waiting;
+}
+
 /**
  * Acquires (i.e. does the waits or P operation on) a semaphore. The timeout is
  * given in milliseconds. If 0, we return without blocking - if the lock can't
@@ -58,7 +275,7 @@ int AcquireSemaphore(struct semaphore* sem, int timeout_ms) {
     EXACT_IRQL(IRQL_STANDARD);
     assert(sem != NULL);
 
-    LockScheduler();
+    AcquireSpinlock(&sem->lock);
 
     struct thread* thr = GetThread();
     if (thr == NULL) {
@@ -67,76 +284,108 @@ int AcquireSemaphore(struct semaphore* sem, int timeout_ms) {
         } else {
             Panic(PANIC_SEM_BLOCK_WITHOUT_THREAD);
         }
-        UnlockScheduler();
+        ReleaseSpinlock(&sem->lock);
         return 0;
     }
 
     thr->timed_out = false;
 
+    if (sem->adaptive && timeout_ms != 0 && sem->current_count >= sem->max_count) {
+        SpinWhileOwnerRunning(sem);
+    }
+
     if (sem->current_count < sem->max_count) {
         sem->current_count++;
-    } else {
-        thr->waiting_on_semaphore = sem;
-
-        if (timeout_ms == 0) {
-            thr->timed_out = true;
+        sem->owner = sem->adaptive ? thr : NULL;
+        ReleaseSpinlock(&sem->lock);
+        return 0;
+    }
 
-        } else if (timeout_ms == -1) {
-            ThreadListInsert(&sem->waiting_list, thr);
-            BlockThread(THREAD_STATE_WAITING_FOR_SEMAPHORE);
+    if (timeout_ms == 0) {
+        ReleaseSpinlock(&sem->lock);
+        return EAGAIN;
+    }
 
-        } else {
-            ThreadListInsert(&sem->waiting_list, thr);
-            thr->sleep_expiry = GetSystemTimer() + ((uint64_t) timeout_ms) * 1000ULL * 1000ULL;
-            QueueForSleep(thr);
-            BlockThread(THREAD_STATE_WAITING_FOR_SEMAPHORE_WITH_TIMEOUT);
-        }
-    } 
+    /*
+     * We keep the semaphore locked until we've blocked, so that a release
+     * can't try to wake us up before then.
+     */
+    thr->semaphore_wait_timed = timeout_ms != -1;
+    ThreadListInsert(&sem->waiting_list, thr);
 
+    LockScheduler();
+    thr->waiting_on_semaphore = sem;
+    if (sem->adaptive) {
+        InheritPriority(sem, thr->priority);
+    }
+    if (timeout_ms == -1) {
+        BlockThread(THREAD_STATE_WAITING_FOR_SEMAPHORE);
+    } else {
+        thr->sleep_expiry = GetSystemTimer() + ((uint64_t) timeout_ms) * 1000ULL * 1000ULL;
+        QueueForSleep(thr);
+        BlockThread(THREAD_STATE_WAITING_FOR_SEMAPHORE_WITH_TIMEOUT);
+    }
     UnlockScheduler();
-    return thr->timed_out ? (timeout_ms == 0 ? EAGAIN : ETIMEDOUT) : 0;
+    ReleaseSpinlock(&sem->lock);
+
+    if (thr->timed_out && !CancelSemaphoreWait(sem, thr)) {
+        thr->timed_out = false;
+    }
+
+    return thr->timed_out ? ETIMEDOUT : 0;
 }
 
+/*
+ * The semaphore's lock must be held.
+ */
 static void DecrementSemaphore(struct semaphore* sem, bool first) {
+    assert(IsSpinlockHeld(&sem->lock));
+
     if (sem->waiting_list.head == NULL) {
         if (sem->current_count == 0) {
             Panic(PANIC_NEGATIVE_SEMAPHORE);
         }
         sem->current_count--;
+        assert(!sem->contended);
+        sem->owner = NULL;
+        return;
+    }
 
-    } else {
-        struct thread* top = ThreadListDeleteTop(&sem->waiting_list);
-
-        if (top->state == THREAD_STATE_WAITING_FOR_SEMAPHORE_WITH_TIMEOUT) {
-            /*
-            * If it's in this state, it means it's either on the ready queue, 
-            * after just having finisherd a sleep, OR it's on the sleep queue.
-            * 
-            * If it's on the sleep queue, we need to remove it from there.
-            * Otherwise, we do nothing, as it's already on the ready queue.
-            */
-            bool on_sleep_queue = TryDequeueForSleep(top);
-            if (on_sleep_queue) {
-                /*
-                * Change the state to prevent UnblockThread from seeing it's in
-                * the timeout state and calling CancelSemaphoreOfThread.
-                */
-                top->state = THREAD_STATE_READY;
-                if (first) {
-                    UnblockThreadGiftingTimeslice(top);
-                } else {
-                    UnblockThread(top);
-                }
-            }
+    /*
+     * The count stays the same, as we hand the semaphore straight over to the
+     * thread that was waiting.
+     */
+    struct thread* top = ThreadListDeleteTop(&sem->waiting_list);
 
-        } else {
+    LockScheduler();
+    top->waiting_on_semaphore = NULL;
+    if (sem->adaptive) {
+        HandOverMutex(sem, top);
+    }
+    if (top->semaphore_wait_timed) {
+        /*
+         * If the timer has already gone off (or a signal cancelled it), it has
+         * been woken up already, and may even be running. It will see that
+         * it's no longer on the wait list, so knows that it got the semaphore.
+         * Its state can't be used to tell, as it stays on the list until it
+         * runs again.
+         */
+        if (TryDequeueForSleep(top)) {
             if (first) {
                 UnblockThreadGiftingTimeslice(top);
             } else {
                 UnblockThread(top);
             }
         }
+
+    } else {
+        if (first) {
+            UnblockThreadGiftingTimeslice(top);
+        } else {
+            UnblockThread(top);
+        }
     }
+    UnlockScheduler();
 }
 
 int ReleaseSemaphoreEx(struct semaphore* sem, int count) {
@@ -144,12 +393,14 @@ int ReleaseSemaphoreEx(struct semaphore* sem, int count) {
         return 0;
     }
     
+    AcquireSpinlock(&sem->lock);
     assert(sem->current_count > 0);
     int decrements = 0;
     do {
         ++decrements;
         DecrementSemaphore(sem, decrements == 0);
     } while (--count && sem->current_count > 0);
+    ReleaseSpinlock(&sem->lock);
 
     return decrements;
 }
@@ -158,11 +409,8 @@ int ReleaseSemaphoreEx(struct semaphore* sem, int count) {
  * Releases (i.e., does the signal, or V operation on) a semaphore.
  */
 void ReleaseSemaphore(struct semaphore* sem) {
-    MAX_IRQL(IRQL_HIGH);
-
-    LockScheduler();
+    MAX_IRQL(IRQL_SCHEDULER);
     ReleaseSemaphoreEx(sem, 1);
-    UnlockScheduler();
 }
 
 /**
@@ -173,26 +421,13 @@ void ReleaseSemaphore(struct semaphore* sem) {
 int DestroySemaphore(struct semaphore* sem, int flags) {
     MAX_IRQL(IRQL_SCHEDULER);
 
-    int ret = 0;
-    LockScheduler();
+    AcquireSpinlock(&sem->lock);
     if ((flags == SEM_REQUIRE_ZERO && sem->current_count != 0) ||
         (flags == SEM_REQUIRE_FULL && sem->current_count != sem->max_count)) {
-        ret = EBUSY;
-    } else {
-        FreeHeap(sem);
+        ReleaseSpinlock(&sem->lock);
+        return EBUSY;
     }
-    UnlockScheduler();
-    return ret;
-}
-
-/**
- * Used to cancel a semaphore that has been timed out, by removing the thread 
- * from the semaphore wait list. If this doesn't occur, the sleep wakeup routine
- * will allow the thread to continue running, which will lead to a crash if that
- * thread then attempts to acquire the same semaphore.
- */
-void CancelSemaphoreOfThread(struct thread* thr) {
-    AssertSchedulerLockHeld();
-    assert(ThreadListContains(&thr->waiting_on_semaphore->waiting_list, thr));
-    ThreadListDelete(&thr->waiting_on_semaphore->waiting_list, thr);
+    ReleaseSpinlock(&sem->lock);
+    FreeHeap(sem);
+    return 0;
 }
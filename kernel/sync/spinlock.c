@@ -6,40 +6,126 @@
 #include <log.h>
 #include <assert.h>
 
+#define MAX_TRACKED_SPINLOCKS 32
+
+/*
+ * Tracking doesn't need the heap, so that locks which are set up before it
+ * (e.g. the physical memory lock) can still be tracked.
+ */
+static struct spinlock* tracked_locks[MAX_TRACKED_SPINLOCKS];
+static int num_tracked_locks = 0;
+static volatile size_t tracked_locks_guard = 0;
+
+/*
+ * CPUs without a timestamp counter (e.g. the i486) fault on ArchReadTimestamp(),
+ * so tracked locks only count acquisitions on those. This gets worked out the
+ * first time a lock is tracked, before any lock has `tracked` set.
+ */
+static bool count_cycles = false;
+static bool checked_for_timestamp = false;
+
+static inline bool IsCountingCycles(struct spinlock* lock) {
+    return lock->tracked && count_cycles;
+}
+
 void InitSpinlock(struct spinlock* lock, const char* name, int irql) {
     assert(strlen(name) <= 15);
     assert(irql >= IRQL_SCHEDULER);
-    lock->lock = 0;
+    lock->next_ticket = 0;
+    lock->now_serving = 0;
+    lock->owner_cpu = -1;
     lock->irql = irql;
+    lock->tracked = false;
+    memset(&lock->stats, 0, sizeof(struct spinlock_stats));
     strcpy(lock->name, name);
 }
 
-int AcquireSpinlock(struct spinlock* lock) {
-    if (lock->lock != 0) {
-        PanicEx(PANIC_SPINLOCK_DOUBLE_ACQUISITION, lock->name);
+static void MarkSpinlockAcquired(struct spinlock* lock, int prior_irql) {
+    lock->prev_irql = prior_irql;
+    lock->owner_cpu = ArchGetCurrentCpuIndex();
+    if (lock->tracked) {
+        lock->stats.acquisitions++;
+        if (count_cycles) {
+            lock->stats.acquired_at = ArchReadTimestamp();
+        }
     }
+}
 
+int AcquireSpinlock(struct spinlock* lock) {
     /* 
      * It's okay to take a spinlock to a higher level, and this is used for
      * things like, e.g. releasing a semaphore from an interrupt handler.
      */
     int prior_irql = RaiseIrql(lock->irql);
-    if (prior_irql < lock->irql) {
-        RaiseIrql(lock->irql);
+
+    /*
+     * Another CPU holding the lock is fine (we'll just spin), but if we hold it 
+     * ourselves we'd spin forever. Only we can write our own index into 
+     * `owner_cpu`, so it's safe to check this without holding the lock.
+     */
+    if (IsSpinlockHeld(lock) && lock->owner_cpu == (int) ArchGetCurrentCpuIndex()) {
+        PanicEx(PANIC_SPINLOCK_DOUBLE_ACQUISITION, lock->name);
     }
 
-    ArchSpinlockAcquire(&lock->lock);
-    lock->prev_irql = prior_irql;
+    uint32_t ticket = ArchFetchAndAdd(&lock->next_ticket, 1);
+    if (__atomic_load_n(&lock->now_serving, __ATOMIC_ACQUIRE) != ticket) {
+        uint64_t spin_start = IsCountingCycles(lock) ? ArchReadTimestamp() : 0;
+        while (__atomic_load_n(&lock->now_serving, __ATOMIC_ACQUIRE) != ticket) {
+            ArchRelaxCpu();
+        }
+        if (lock->tracked) {
+            lock->stats.contended_acquisitions++;
+        }
+        if (IsCountingCycles(lock)) {
+            lock->stats.spin_cycles += ArchReadTimestamp() - spin_start;
+        }
+    }
+
+    MarkSpinlockAcquired(lock, prior_irql);
     return prior_irql;
 }
 
+/**
+ * Attempts to acquire a spinlock without spinning. On success, this behaves
+ * exactly like AcquireSpinlock, and the lock must be released with 
+ * ReleaseSpinlock. On failure, the IRQL is left unchanged.
+ * 
+ * This allows locks to be taken 'out of order' without risking deadlock, as
+ * we can just back off if someone else has it.
+ * 
+ * @return True if the lock was acquired, false otherwise.
+ */
+bool TryAcquireSpinlock(struct spinlock* lock) {
+    int prior_irql = RaiseIrql(lock->irql);
+
+    /*
+     * We can only take a ticket if it would be served straight away.
+     */
+    uint32_t serving = __atomic_load_n(&lock->now_serving, __ATOMIC_ACQUIRE);
+    if (!ArchCompareAndSwap(&lock->next_ticket, serving, serving + 1)) {
+        LowerIrql(prior_irql);
+        return false;
+    }
+
+    MarkSpinlockAcquired(lock, prior_irql);
+    return true;
+}
+
 void ReleaseSpinlock(struct spinlock* lock) {
-    if (lock->lock == 0) {
+    if (!IsSpinlockHeld(lock)) {
         PanicEx(PANIC_SPINLOCK_RELEASED_BEFORE_ACQUIRED, lock->name);
     }
 
+    if (IsCountingCycles(lock)) {
+        uint64_t held = ArchReadTimestamp() - lock->stats.acquired_at;
+        if (held > lock->stats.max_hold_cycles) {
+            lock->stats.max_hold_cycles = held;
+        }
+    }
+
     int old_irql = lock->prev_irql;
-    ArchSpinlockRelease(&lock->lock);
+    lock->owner_cpu = -1;
+    __atomic_store_n(&lock->now_serving, lock->now_serving + 1, __ATOMIC_RELEASE);
     LowerIrql(old_irql);
 }
 
@@ -48,5 +134,54 @@ void ReleaseSpinlock(struct spinlock* lock) {
  * and writing assertion statements. 
  */
 bool IsSpinlockHeld(struct spinlock* lock) {
-    return lock->lock;
+    return lock->next_ticket != lock->now_serving;
+}
+
+/**
+ * Starts keeping contention counters for a lock, so they can be written out
+ * with DumpSpinlockStats(). If too many locks are already being tracked, this
+ * does nothing.
+ */
+void TrackSpinlock(struct spinlock* lock) {
+    size_t prev = ArchSaveAndDisableInterrupts();
+    ArchSpinlockAcquire(&tracked_locks_guard);
+    if (!checked_for_timestamp) {
+        count_cycles = ArchHasUsableTimestamp();
+        checked_for_timestamp = true;
+    }
+    if (num_tracked_locks < MAX_TRACKED_SPINLOCKS) {
+        tracked_locks[num_tracked_locks++] = lock;
+        lock->tracked = true;
+    }
+    ArchSpinlockRelease(&tracked_locks_guard);
+    ArchRestoreInterrupts(prev);
+}
+
+/**
+ * Writes the contention counters of each tracked lock with the given name to
+ * the serial port, or of every tracked lock if `name` is NULL. Cycle counts
+ * are in units of 1024 cycles, as the log can only print 32-bit numbers, and
+ * are left out if the CPU has no timestamp counter.
+ */
+void DumpSpinlockStats(const char* name) {
+    for (int i = 0; i < num_tracked_locks; ++i) {
+        struct spinlock* lock = tracked_locks[i];
+        if (name != NULL && strcmp(name, lock->name)) {
+            continue;
+        }
+
+        struct spinlock_stats stats = lock->stats;
+        if (!count_cycles) {
+            LogWriteSerial(
+                "[spinlock]: %s: %u acquisitions, %u contended\n",
+                lock->name, stats.acquisitions, stats.contended_acquisitions
+            );
+            continue;
+        }
+        LogWriteSerial(
+            "[spinlock]: %s: %u acquisitions, %u contended, %u kcycles spinning, %u kcycles max hold\n",
+            lock->name, stats.acquisitions, stats.contended_acquisitions,
+            (uint32_t) (stats.spin_cycles >> 10), (uint32_t) (stats.max_hold_cycles >> 10)
+        );
+    }
 }
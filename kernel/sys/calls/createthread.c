@@ -0,0 +1,17 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <thread.h>
+#include <transfer.h>
+
+int SysCreateThread(size_t entry_point, size_t argument, size_t tls, size_t clear_tid_address, size_t thread_id_out) {
+    int thread_id;
+    int res = CreateUserThread(entry_point, argument, tls, clear_tid_address, &thread_id);
+    if (res != 0) {
+        return res;
+    }
+    if (thread_id_out != 0) {
+        return WriteWordToUsermode((size_t*) thread_id_out, thread_id);
+    }
+    return 0;
+}
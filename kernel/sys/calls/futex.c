@@ -0,0 +1,14 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <futex.h>
+
+int SysFutex(size_t op, size_t address, size_t value, size_t timeout_ms, size_t) {
+    switch (op) {
+    case FUTEX_WAIT:
+        return FutexWait(address, (int) value, (int) timeout_ms);
+    case FUTEX_WAKE:
+        return FutexWake(address, (int) value);
+    }
+    return EINVAL;
+}
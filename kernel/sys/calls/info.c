@@ -5,6 +5,7 @@
 #include <log.h>
 #include <common.h>
 #include <physical.h>
+#include <spinlock.h>
 
 int SysInfo(size_t cmd, size_t result_word, size_t result_str, size_t arg, size_t) {
     switch (cmd) {
@@ -24,6 +25,23 @@ int SysInfo(size_t cmd, size_t result_word, size_t result_str, size_t arg, size_
     }
     case SYSINFO_IS_SUPPORTED:
         return arg < _SYSINFO_NUM_CMDS ? 0 : ENOSYS;
+    case SYSINFO_DUMP_SPINLOCKS: {
+        /*
+         * Goes to the serial port, for either the locks with the given name, 
+         * or all of the tracked ones if there isn't one.
+         */
+        if (result_str == 0) {
+            DumpSpinlockStats(NULL);
+            return 0;
+        }
+        char name[16];
+        int res = ReadStringFromUsermode(name, (const char*) result_str, sizeof(name));
+        if (res != 0) {
+            return res;
+        }
+        DumpSpinlockStats(name);
+        return 0;
+    }
     }
     return ENOSYS;
 }
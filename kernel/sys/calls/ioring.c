@@ -0,0 +1,56 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <process.h>
+#include <transfer.h>
+#include <virtual.h>
+#include <asyncio.h>
+#include <sys/ioring.h>
+
+int SysIoRingSetup(size_t entries, size_t ring_out, size_t, size_t, size_t) {
+	if (entries == 0 || entries > IO_RING_MAX_ENTRIES || (entries & (entries - 1)) != 0) {
+		return EINVAL;
+	}
+
+	struct process* prcss = GetProcess();
+	LockProcess(prcss);
+	if (prcss->aio_ring != NULL) {
+		UnlockProcess(prcss);
+		return EBUSY;
+	}
+
+	/*
+	 * Locked, so that the workers never have to wait for the ring to be
+	 * swapped back in.
+	 */
+	int error;
+	size_t ring = MapVirtEx(
+		GetVas(), 0, 0, BytesToPages(GetAioRingSize(entries)),
+		VM_READ | VM_WRITE | VM_USER | VM_LOCK | VM_LOCAL, NULL, 0, &error
+	);
+	if (ring == 0) {
+		UnlockProcess(prcss);
+		return error;
+	}
+	prcss->aio_ring = CreateAioRing(prcss->vas, prcss->fd_table, (void*) ring, entries, true);
+	UnlockProcess(prcss);
+
+	return WriteWordToUsermode((size_t*) ring_out, ring);
+}
+
+int SysIoRingEnter(size_t to_submit, size_t min_complete, size_t timeout, size_t submitted_out, size_t) {
+	struct aio_ring* ring = GetProcess()->aio_ring;
+	if (ring == NULL) {
+		return EINVAL;
+	}
+
+	uint32_t submitted;
+	int res = SubmitToAioRing(ring, to_submit, &submitted);
+	if (res == 0 && min_complete > 0) {
+		res = WaitForAioRing(ring, min_complete, (int) timeout);
+	}
+	if (res != 0) {
+		return res;
+	}
+	return WriteWordToUsermode((size_t*) submitted_out, submitted);
+}
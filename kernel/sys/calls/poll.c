@@ -0,0 +1,95 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <process.h>
+#include <filedes.h>
+#include <transfer.h>
+#include <file.h>
+#include <vnode.h>
+#include <heap.h>
+#include <polltable.h>
+#include <poll.h>
+
+static int PollEventsToVnode(int events) {
+	return ((events & POLLIN) ? VNODE_WAIT_READ : 0) | ((events & POLLOUT) ? VNODE_WAIT_WRITE : 0);
+}
+
+static int VnodeEventsToPoll(int events) {
+	return ((events & VNODE_WAIT_READ) ? POLLIN : 0) | ((events & VNODE_WAIT_WRITE) ? POLLOUT : 0) |
+		   ((events & VNODE_WAIT_ERROR) ? POLLERR : 0);
+}
+
+/*
+ * Waits on the files, and fills in each `revents`.
+ */
+static int PollFiles(struct pollfd* pfds, size_t count, int timeout, int* ready_out) {
+	struct file** files = AllocHeap(sizeof(struct file*) * count + 1);
+	struct vnode** nodes = AllocHeap(sizeof(struct vnode*) * count + 1);
+	int* events = AllocHeap(sizeof(int) * count + 1);
+	int* revents = AllocHeap(sizeof(int) * count + 1);
+
+	/*
+	 * Negative file descriptors are ignored, but invalid ones are reported 
+	 * straight away.
+	 */
+	struct fd_table* table = GetFdTable(GetProcess());
+	int invalid = 0;
+	for (size_t i = 0; i < count; ++i) {
+		nodes[i] = NULL;
+		events[i] = PollEventsToVnode(pfds[i].events);
+		if (pfds[i].fd < 0) {
+			files[i] = NULL;
+		} else if (GetFileFromFd(table, pfds[i].fd, &files[i]) != 0) {
+			files[i] = NULL;
+			++invalid;
+		} else {
+			ReferenceFile(files[i]);
+			nodes[i] = files[i]->node;
+		}
+	}
+
+	int ready;
+	int res = PollVnodes(nodes, events, revents, count, invalid > 0 ? 0 : timeout, &ready);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (files[i] != NULL) {
+			pfds[i].revents = VnodeEventsToPoll(revents[i]);
+			DereferenceFile(files[i]);
+		} else {
+			pfds[i].revents = pfds[i].fd < 0 ? 0 : POLLNVAL;
+		}
+	}
+
+	FreeHeap(files);
+	FreeHeap(nodes);
+	FreeHeap(events);
+	FreeHeap(revents);
+
+	*ready_out = ready + invalid;
+	return res;
+}
+
+int SysPoll(size_t fds, size_t count, size_t timeout, size_t ready_out, size_t) {
+	if (count > PROC_MAX_FD) {
+		return EINVAL;
+	}
+
+	size_t size = sizeof(struct pollfd) * count;
+	struct pollfd* pfds = AllocHeap(size + 1);
+	struct transfer tr = CreateTransferReadingFromUser((const void*) fds, size, 0);
+	int ready;
+	int res = PerformTransfer(pfds, &tr, size);
+	if (res == 0) {
+		res = PollFiles(pfds, count, (int) timeout, &ready);
+	}
+	if (res == 0) {
+		tr = CreateTransferWritingToUser((void*) fds, size, 0);
+		res = PerformTransfer(pfds, &tr, size);
+	}
+	FreeHeap(pfds);
+
+	if (res != 0) {
+		return res;
+	}
+	return WriteWordToUsermode((size_t*) ready_out, ready);
+}
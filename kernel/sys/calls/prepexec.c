@@ -6,6 +6,7 @@
 #include <virtual.h>
 #include <filedes.h>
 #include <log.h>
+#include <asyncio.h>
 
 int SysPrepExec(size_t, size_t, size_t, size_t, size_t) {
 	LogWriteSerial("SysPrepExec 1\n");
@@ -14,6 +15,11 @@ int SysPrepExec(size_t, size_t, size_t, size_t, size_t) {
 		return EINVAL;
 	}
 	LogWriteSerial("SysPrepExec 2\n");
+	struct process* prcss = GetProcess();
+	if (prcss->aio_ring != NULL) {
+		DestroyAioRing(prcss->aio_ring);
+		prcss->aio_ring = NULL;
+	}
 	if (WipeUsermodePages()) {
 		LogWriteSerial("SysPrepExec E2\n");
 		return ENOTRECOVERABLE;
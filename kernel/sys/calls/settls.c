@@ -0,0 +1,9 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <thread.h>
+
+int SysSetTls(size_t base, size_t, size_t, size_t, size_t) {
+    SetUserTls(base);
+    return 0;
+}
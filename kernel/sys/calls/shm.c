@@ -0,0 +1,51 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <transfer.h>
+#include <fcntl.h>
+#include <process.h>
+#include <vfs.h>
+#include <filedes.h>
+#include <sharedmem.h>
+
+int SysShmOpen(size_t name, size_t flags, size_t mode, size_t fdout, size_t) {
+	char path[SHM_MAX_NAME + 2];
+	int fd;
+	int res;
+
+	if (flags & ~(O_CREAT | O_EXCL | O_CLOEXEC | O_ACCMODE)) {
+		return EINVAL;
+	}
+
+	if ((res = ReadStringFromUsermode(path, (const char*) name, SHM_MAX_NAME + 2))) {
+		return res;
+	}
+
+	struct file* file;
+	if ((res = OpenSharedMemory(path, flags, mode, &file))) {
+		return res;
+	}
+
+	struct fd_table* table = GetFdTable(GetProcess());
+	if ((res = CreateFd(table, file, &fd, flags & O_CLOEXEC))) {
+		CloseFile(file);
+		return res;
+	}
+
+	if ((res = WriteWordToUsermode((size_t*) fdout, fd))) {
+		CloseFile(file);
+		RemoveFd(table, file);
+		return res;
+	}
+
+	return 0;
+}
+
+int SysShmUnlink(size_t name, size_t, size_t, size_t, size_t) {
+	char path[SHM_MAX_NAME + 2];
+	int res = ReadStringFromUsermode(path, (const char*) name, SHM_MAX_NAME + 2);
+	if (res != 0) {
+		return res;
+	}
+	return UnlinkSharedMemory(path);
+}
@@ -0,0 +1,46 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <process.h>
+#include <filedes.h>
+#include <transfer.h>
+#include <file.h>
+#include <dev.h>
+
+int SysSplice(size_t fd_in, size_t fd_out, size_t length, size_t moved_out, size_t) {
+	struct fd_table* table = GetFdTable(GetProcess());
+	struct file* in;
+	struct file* out;
+	int res;
+
+	if ((res = GetFileFromFd(table, fd_in, &in)) || (res = GetFileFromFd(table, fd_out, &out))) {
+		return res;
+	}
+
+	uint64_t moved;
+	if (IsPipe(in->node)) {
+		res = SplicePipe(in, out, false, length, &moved);
+	} else {
+		res = SplicePipe(out, in, true, length, &moved);
+	}
+	if (res != 0) {
+		return res;
+	}
+
+	return WriteWordToUsermode((size_t*) moved_out, moved);
+}
+
+int SysVmsplice(size_t fd, size_t buffer, size_t length, size_t moved_out, size_t) {
+	struct file* file;
+	int res = GetFileFromFd(GetFdTable(GetProcess()), fd, &file);
+	if (res != 0) {
+		return res;
+	}
+
+	uint64_t moved;
+	if ((res = VmsplicePipe(file, buffer, length, &moved))) {
+		return res;
+	}
+
+	return WriteWordToUsermode((size_t*) moved_out, moved);
+}
@@ -1,19 +1,19 @@
 #include <syscall.h>
 #include <errno.h>
 #include <transfer.h>
-#include <arch.h>
+#include <timer.h>
 #include <_syscallnum.h>
 #include <string.h>
 
 int SysTime(size_t ptr, size_t op, size_t len, size_t ptr2, size_t) {
-	/* TODO: store this somewhere proper */
-	uint64_t timezone_offset = 1000000ULL * 60 * 60 * 10;
+	uint64_t timezone_offset = GetTimezoneOffset();
 
 	if (op == 0) {
 		/*
-		 * Get local time
+		 * Get local time. Usermode normally reads this from the time page
+		 * instead.
 		 */
-		uint64_t timevalue = ArchGetUtcTime(timezone_offset) + timezone_offset;
+		uint64_t timevalue = GetUtcTime() + timezone_offset;
 		struct transfer io;
 		io = CreateTransferWritingToUser((void*) ptr, sizeof(uint64_t), 0);
 		return PerformTransfer(&timevalue, &io, sizeof(uint64_t));
@@ -29,7 +29,7 @@ int SysTime(size_t ptr, size_t op, size_t len, size_t ptr2, size_t) {
 		if (res != 0) {
 			return res;
 		}
-		return ArchSetUtcTime(timevalue - timezone_offset, timezone_offset);
+		return SetUtcTime(timevalue - timezone_offset);
 
 	} else if (op == 2) {
 		/*
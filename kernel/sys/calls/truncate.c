@@ -0,0 +1,25 @@
+#include <syscall.h>
+#include <errno.h>
+#include <_syscallnum.h>
+#include <process.h>
+#include <vfs.h>
+#include <filedes.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+int SysTruncate(size_t fd, size_t size, size_t, size_t, size_t) {
+	struct file* file;
+	int res = GetFileFromFd(GetFdTable(GetProcess()), fd, &file);
+	if (res != 0) {
+		return res;
+	}
+
+	if (IFTODT(file->node->stat.st_mode) == DT_DIR) {
+		return EISDIR;
+	}
+	if (!file->can_write) {
+		return EINVAL;
+	}
+
+	return VnodeOpTruncate(file->node, size);
+}
@@ -32,6 +32,17 @@ static const system_call_t system_call_table[_SYSCALL_NUM_ENTRIES] = {
 	[SYSCALL_SIGNAL]	= SysSignal,
 	[SYSCALL_PGID]		= SysPgid,
 	[SYSCALL_ALARM]		= SysAlarm,
+	[SYSCALL_FUTEX]		= SysFutex,
+	[SYSCALL_CREATETHREAD]	= SysCreateThread,
+	[SYSCALL_SETTLS]	= SysSetTls,
+	[SYSCALL_SPLICE]	= SysSplice,
+	[SYSCALL_VMSPLICE]	= SysVmsplice,
+	[SYSCALL_POLL]		= SysPoll,
+	[SYSCALL_SHMOPEN]	= SysShmOpen,
+	[SYSCALL_SHMUNLINK]	= SysShmUnlink,
+	[SYSCALL_TRUNCATE]	= SysTruncate,
+	[SYSCALL_IORINGSETUP]	= SysIoRingSetup,
+	[SYSCALL_IORINGENTER]	= SysIoRingEnter,
 };
 
 int HandleSystemCall(int call, size_t a, size_t b, size_t c, size_t d, size_t e) {
@@ -2,16 +2,124 @@
 #include <thread.h>
 #include <virtual.h>
 #include <heap.h>
-#include <message.h>
+#include <threadlist.h>
 #include <log.h>
+#include <spinlock.h>
+#include <irql.h>
 
-static struct msgbox* cleaner_mbox;
+/*
+ * Threads which have terminated, and are waiting for the cleaner. A thread puts
+ * itself on here with the scheduler lock already held, so the list is guarded
+ * by the scheduler lock, and the cleaner gets woken directly instead of through
+ * a semaphore (whose lock must be taken before the scheduler's).
+ */
+static struct thread_list terminated_threads;
+static struct thread* cleaner_thread;
+static bool cleaner_waiting = false;
+
+/*
+ * Kernel stacks of threads that have been cleaned up, kept mapped so that new
+ * threads can reuse them instead of allocating and mapping fresh pages. Only
+ * a few are kept, and they're all given back when memory gets low.
+ */
+#define MAX_CACHED_KERNEL_STACKS 8
+
+struct cached_stack {
+    size_t bottom;
+    size_t size;
+};
+
+static struct spinlock stack_cache_lock;
+static struct cached_stack stack_cache[MAX_CACHED_KERNEL_STACKS];
+static int num_cached_stacks = 0;
+static bool stack_cache_ready = false;
+
+/**
+ * Takes a kernel stack of exactly the given size out of the cache.
+ *
+ * @return The bottom of the stack, or 0 if there isn't a cached stack of that size.
+ */
+size_t TakeCachedKernelStack(size_t size) {
+    if (!stack_cache_ready) {
+        return 0;
+    }
+
+    size_t bottom = 0;
+    AcquireSpinlock(&stack_cache_lock);
+    for (int i = 0; i < num_cached_stacks; ++i) {
+        if (stack_cache[i].size == size) {
+            bottom = stack_cache[i].bottom;
+            stack_cache[i] = stack_cache[--num_cached_stacks];
+            break;
+        }
+    }
+    ReleaseSpinlock(&stack_cache_lock);
+    return bottom;
+}
+
+static void FreeKernelStack(size_t bottom, size_t size) {
+    AcquireSpinlock(&stack_cache_lock);
+    if (num_cached_stacks < MAX_CACHED_KERNEL_STACKS) {
+        stack_cache[num_cached_stacks].bottom = bottom;
+        stack_cache[num_cached_stacks].size = size;
+        ++num_cached_stacks;
+        ReleaseSpinlock(&stack_cache_lock);
+        return;
+    }
+    ReleaseSpinlock(&stack_cache_lock);
+
+    UnmapVirt(bottom, size);
+}
+
+/**
+ * Unmaps all of the cached kernel stacks. Called by the physical memory manager
+ * when memory is running low.
+ */
+void TrimKernelStackCache(void) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    if (!stack_cache_ready) {
+        return;
+    }
+
+    while (true) {
+        AcquireSpinlock(&stack_cache_lock);
+        if (num_cached_stacks == 0) {
+            ReleaseSpinlock(&stack_cache_lock);
+            return;
+        }
+        struct cached_stack stack = stack_cache[--num_cached_stacks];
+        ReleaseSpinlock(&stack_cache_lock);
+
+        UnmapVirt(stack.bottom, stack.size);
+    }
+}
 
 static void CleanerThread(void*) {
-    struct thread* thr;
+    LockScheduler();
+    cleaner_thread = GetThread();
+    UnlockScheduler();
+
     while (true) {
-        ReceiveMessage(cleaner_mbox, &thr);
-        UnmapVirt(thr->kernel_stack_top - thr->kernel_stack_size, thr->kernel_stack_size);
+        LockScheduler();
+        if (terminated_threads.head == NULL) {
+            cleaner_waiting = true;
+            BlockThread(THREAD_STATE_WAITING_FOR_TERMINATED_THREADS);
+            UnlockScheduler();
+            continue;
+        }
+        struct thread* thr = ThreadListDeleteTop(&terminated_threads);
+        UnlockScheduler();
+
+        /*
+         * A thread puts itself on the list just before it switches away for
+         * the last time, so another CPU may still be using its stack.
+         */
+        while (thr->on_cpu) {
+            Schedule();
+        }
+
+        FreeKernelStack(thr->kernel_stack_top - thr->kernel_stack_size, thr->kernel_stack_size);
         FreeHeap(thr->name);
         FreeHeap(thr);
 
@@ -25,7 +133,11 @@ static void CleanerThread(void*) {
 void TerminateThread(struct thread* thr) {
     LockScheduler();
     if (thr == GetThread()) {
-        SendMessage(cleaner_mbox, &thr);
+        ThreadListInsert(&terminated_threads, thr);
+        if (cleaner_waiting) {
+            cleaner_waiting = false;
+            UnblockThread(cleaner_thread);
+        }
         BlockThread(THREAD_STATE_TERMINATED);
     } else {
         thr->needs_termination = true;
@@ -34,6 +146,8 @@ void TerminateThread(struct thread* thr) {
 }
 
 void InitCleaner(void) {
-    cleaner_mbox = CreateMessageBox("cleaner", sizeof(struct thread*));
+    InitSpinlock(&stack_cache_lock, "stack cache", IRQL_SCHEDULER);
+    stack_cache_ready = true;
+    ThreadListInit(&terminated_threads, NEXT_INDEX_TERMINATED);
     CreateThread(CleanerThread, NULL, GetVas(), "cleaner");
 }
@@ -3,23 +3,31 @@
  * thread/idle.c - System Idle Task
  * 
  * A thread that is run if not other thread is available to run. The idle thread
- * must therefore never block.
+ * must therefore never block. Each CPU has its own. While idle, the periodic
+ * timer is turned off, and only the next sleep or alarm will wake the CPU.
  */
 
 #include <arch.h>
 #include <thread.h>
 #include <virtual.h>
 #include <irql.h>
+#include <cpu.h>
+#include <timer.h>
 
 static void IdleThread(void*) {
     while (1) {
-        ArchStallProcessor();
+        int prev_irql = RaiseIrql(IRQL_SCHEDULER);
+        IdleUntilNextTimerEvent();
+        LowerIrql(prev_irql);
     }
 }
 
 void InitIdle(void) {
-    CreateThreadEx(
-        IdleThread, NULL, GetVas(), "idle thread", NULL, 
-        SCHEDULE_POLICY_FIXED, FIXED_PRIORITY_IDLE, 0
-    );
+    for (int i = 0; i < GetCpuCount(); ++i) {
+        struct thread* thr = CreateThreadEx(
+            IdleThread, NULL, GetVas(), "idle thread", NULL, 
+            SCHEDULE_POLICY_FIXED, FIXED_PRIORITY_IDLE, 0
+        );
+        SetIdleThread(thr, i);
+    }
 }
\ No newline at end of file
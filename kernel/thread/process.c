@@ -13,6 +13,7 @@
 #include <tree.h>
 #include <panic.h>
 #include <semaphore.h>
+#include <rwlock.h>
 #include <filedes.h>
 #include <spinlock.h>
 #include <heap.h>
@@ -21,6 +22,7 @@
 #include <log.h>
 #include <ksignal.h>
 #include <linkedlist.h>
+#include <asyncio.h>
 
 struct process_table_node {
     pid_t pid;
@@ -29,7 +31,7 @@ struct process_table_node {
 
 static struct spinlock pid_lock;
 static struct tree* process_table;
-static struct semaphore* process_table_mutex;
+static struct rwlock* process_table_lock;
 
 static int ProcessTableComparator(void* a_, void* b_) {
     struct process_table_node* a = a_;
@@ -50,27 +52,27 @@ static pid_t AllocateNextPid(void) {
 static int InsertIntoProcessTable(struct process* prcss) {
     pid_t pid = AllocateNextPid();
 
-    AcquireMutex(process_table_mutex, -1);
+    AcquireRwLockWrite(process_table_lock);
 
     struct process_table_node* node = AllocHeap(sizeof(struct process_table_node));
     node->pid = pid;
     node->process = prcss;
     TreeInsert(process_table, (void*) node);
 
-    ReleaseMutex(process_table_mutex);
+    ReleaseRwLockWrite(process_table_lock);
 
     return pid;
 }
 
 static void RemoveFromProcessTable(pid_t pid) {
-    AcquireMutex(process_table_mutex, -1);
+    AcquireRwLockWrite(process_table_lock);
 
     struct process_table_node dummy = {.pid = pid};
     struct process_table_node* actual = TreeGet(process_table, (void*) &dummy);
     TreeDelete(process_table, (void*) actual);
     FreeHeap(actual);       // this was allocated on 'InsertIntoProcessTable'
 
-    ReleaseMutex(process_table_mutex);
+    ReleaseRwLockWrite(process_table_lock);
 }
 
 void LockProcess(struct process* prcss) {
@@ -83,7 +85,7 @@ void UnlockProcess(struct process* prcss) {
 
 void InitProcess(void) {
     InitSpinlock(&pid_lock, "pid", IRQL_SCHEDULER);
-    process_table_mutex = CreateMutex("prcss table");
+    process_table_lock = CreateRwLock("prcss table");
     process_table = TreeCreate();
     TreeSetComparator(process_table, ProcessTableComparator);
 }
@@ -104,6 +106,8 @@ struct process* CreateProcessEx(pid_t parent_pid) {
     prcss->pid = InsertIntoProcessTable(prcss);
     prcss->pgid = prcss->pid;
     prcss->fd_table = CreateFdTable();
+    inline_memset(prcss->user_stack_slots, 0, sizeof(prcss->user_stack_slots));
+    prcss->aio_ring = NULL;
 
     if (parent_pid != 0) {
         struct process* parent = GetProcessFromPid(parent_pid);
@@ -136,6 +140,8 @@ struct process* CreateProcess(pid_t parent_pid) {
     prcss->pid = InsertIntoProcessTable(prcss);
     prcss->pgid = prcss->pid;
     prcss->fd_table = CreateFdTable();
+    inline_memset(prcss->user_stack_slots, 0, sizeof(prcss->user_stack_slots));
+    prcss->aio_ring = NULL;
 
     if (parent_pid != 0) {
         struct process* parent = GetProcessFromPid(parent_pid);
@@ -160,6 +166,48 @@ void AddThreadToProcess(struct process* prcss, struct thread* thr) {
     UnlockProcess(prcss);
 }
 
+/**
+ * Takes a thread out of its process, so that it can exit without taking the
+ * rest of the process with it. The last thread can't be removed this way, as
+ * it has to kill the process instead.
+ *
+ * @return True if the thread was removed, or false if it is the only one left.
+ */
+bool RemoveThreadFromProcess(struct process* prcss, struct thread* thr) {
+    LockProcess(prcss);
+    bool last = TreeSize(prcss->threads) <= 1;
+    if (!last) {
+        TreeDelete(prcss->threads, (void*) thr);
+    }
+    UnlockProcess(prcss);
+    return !last;
+}
+
+/**
+ * Reserves one of the process' user thread stack slots.
+ *
+ * @return The slot's index, or -1 if they are all in use.
+ */
+int AllocUserStackSlot(struct process* prcss) {
+    LockProcess(prcss);
+    for (int i = 0; i < MAX_USER_THREAD_STACKS; ++i) {
+        if (!(prcss->user_stack_slots[i / 32] & (1U << (i % 32)))) {
+            prcss->user_stack_slots[i / 32] |= 1U << (i % 32);
+            UnlockProcess(prcss);
+            return i;
+        }
+    }
+    UnlockProcess(prcss);
+    return -1;
+}
+
+void FreeUserStackSlot(struct process* prcss, int slot) {
+    assert(slot >= 0 && slot < MAX_USER_THREAD_STACKS);
+    LockProcess(prcss);
+    prcss->user_stack_slots[slot / 32] &= ~(1U << (slot % 32));
+    UnlockProcess(prcss);
+}
+
 struct process* ForkProcess(size_t user_stub_addr) {
     MAX_IRQL(IRQL_PAGE_FAULT);   
 
@@ -173,6 +221,12 @@ struct process* ForkProcess(size_t user_stub_addr) {
     struct process* new_process = CreateProcessEx(prcss->pid);
     CopyVas(new_process->vas);
     new_process->pgid = prcss->pgid;
+
+    /*
+     * The other threads' stacks get copied along with everything else, so keep
+     * their slots reserved.
+     */
+    inline_memcpy(new_process->user_stack_slots, prcss->user_stack_slots, sizeof(prcss->user_stack_slots));
     LogWriteSerial("created a new process with pid %d\n", new_process->pid);
 
     // TODO: there are probably more things to copy over in the future (e.g. list of open file descriptors, etc.)
@@ -315,6 +369,15 @@ static void KillProcessHelper(void* arg) {
     TreeDestroy(prcss->threads);
     TreeDestroy(prcss->children);
 
+    /*
+     * The ring's workers run in the process' address space, so they must be
+     * gone before it is.
+     */
+    if (prcss->aio_ring != NULL) {
+        DestroyAioRing(prcss->aio_ring);
+        prcss->aio_ring = NULL;
+    }
+
     DestroyVas(prcss->vas);
 
     prcss->terminated = true;
@@ -373,8 +436,7 @@ struct process* GetProcess(void) {
 struct process* CreateProcessWithEntryPoint(pid_t parent, void(*entry_point)(void*), void* args) {
     EXACT_IRQL(IRQL_STANDARD);   
     struct process* prcss = CreateProcess(parent);
-    struct thread* thr = CreateThread(entry_point, args, prcss->vas, "prcssinit");
-    AddThreadToProcess(prcss, thr);
+    CreateThreadEx(entry_point, args, prcss->vas, "prcssinit", prcss, SCHEDULE_POLICY_FIXED, FIXED_PRIORITY_KERNEL_NORMAL, 0);
     return prcss;
 }
 
@@ -399,12 +461,12 @@ struct fd_table* GetFdTable(struct process* prcss) {
 struct process* GetProcessFromPid(pid_t pid) {
     EXACT_IRQL(IRQL_STANDARD);
 
-    AcquireMutex(process_table_mutex, -1);
+    AcquireRwLockRead(process_table_lock);
 
     struct process_table_node dummy = {.pid = pid};
     struct process_table_node* node = TreeGet(process_table, (void*) &dummy);
 
-    ReleaseMutex(process_table_mutex);
+    ReleaseRwLockRead(process_table_lock);
 
     return node == NULL ? NULL : node->process;
 }
@@ -431,9 +493,9 @@ static void GetProcessesFromPgidRecursive(struct tree_node* node, pid_t pgid, st
  */
 struct linked_list* GetProcessesFromPgid(pid_t pgid) {
     struct linked_list* list = ListCreate();
-    AcquireMutex(process_table_mutex, -1);
+    AcquireRwLockRead(process_table_lock);
     GetProcessesFromPgidRecursive(process_table->root, pgid, list);
-    ReleaseMutex(process_table_mutex);
+    ReleaseRwLockRead(process_table_lock);
     return list;
 }
 
@@ -0,0 +1,122 @@
+
+/*
+ * thread/runqueue.c - Priority Run Queues
+ *
+ * Holds the threads that are ready to run, bucketed by priority. Inserting,
+ * removing and finding the highest priority thread are all constant time, so
+ * the cost of a scheduling decision doesn't grow with the number of threads.
+ *
+ * A thread is filed under its `priority` at the time it is inserted, so the
+ * priority of a thread must not be changed while it is on a run queue - take it
+ * off first, and then put it back on afterwards.
+ */
+
+#include <common.h>
+#include <runqueue.h>
+#include <threadlist.h>
+#include <thread.h>
+#include <assert.h>
+#include <string.h>
+
+void RunQueueInit(struct run_queue* rq) {
+    inline_memset(rq, 0, sizeof(struct run_queue));
+    for (int i = 0; i < RUN_QUEUE_NUM_PRIORITIES; ++i) {
+        ThreadListInit(&rq->levels[i], NEXT_INDEX_READY);
+    }
+}
+
+static void MarkLevelUsed(struct run_queue* rq, int level) {
+    rq->level_bitmap[level / 32] |= 1U << (level % 32);
+    rq->word_bitmap |= 1U << (level / 32);
+}
+
+static void MarkLevelEmpty(struct run_queue* rq, int level) {
+    rq->level_bitmap[level / 32] &= ~(1U << (level % 32));
+    if (rq->level_bitmap[level / 32] == 0) {
+        rq->word_bitmap &= ~(1U << (level / 32));
+    }
+}
+
+static int GetLevel(struct thread* thr) {
+    assert(thr->priority >= 0 && thr->priority < RUN_QUEUE_NUM_PRIORITIES);
+    return thr->priority;
+}
+
+void RunQueueInsert(struct run_queue* rq, struct thread* thr) {
+    int level = GetLevel(thr);
+    ThreadListInsert(&rq->levels[level], thr);
+    MarkLevelUsed(rq, level);
+    ++rq->num_threads;
+}
+
+void RunQueueInsertAtFront(struct run_queue* rq, struct thread* thr) {
+    int level = GetLevel(thr);
+    ThreadListInsertAtFront(&rq->levels[level], thr);
+    MarkLevelUsed(rq, level);
+    ++rq->num_threads;
+}
+
+void RunQueueDelete(struct run_queue* rq, struct thread* thr) {
+    int level = GetLevel(thr);
+    ThreadListDelete(&rq->levels[level], thr);
+    if (rq->levels[level].head == NULL) {
+        MarkLevelEmpty(rq, level);
+    }
+    --rq->num_threads;
+}
+
+bool RunQueueContains(struct run_queue* rq, struct thread* thr) {
+    return ThreadListContains(&rq->levels[GetLevel(thr)], thr);
+}
+
+static int GetHighestUsedLevel(struct run_queue* rq) {
+    if (rq->word_bitmap == 0) {
+        return -1;
+    }
+    int word = __builtin_ctz(rq->word_bitmap);
+    return word * 32 + __builtin_ctz(rq->level_bitmap[word]);
+}
+
+struct thread* RunQueuePeek(struct run_queue* rq) {
+    int level = GetHighestUsedLevel(rq);
+    return level == -1 ? NULL : rq->levels[level].head;
+}
+
+struct thread* RunQueueDeleteTop(struct run_queue* rq) {
+    int level = GetHighestUsedLevel(rq);
+    if (level == -1) {
+        return NULL;
+    }
+
+    struct thread* top = ThreadListDeleteTop(&rq->levels[level]);
+    if (rq->levels[level].head == NULL) {
+        MarkLevelEmpty(rq, level);
+    }
+    --rq->num_threads;
+    return top;
+}
+
+/**
+ * Finds the most important thread on the queue that satisfies a condition.
+ * Threads of equal priority are checked in the order they would be run. Unlike
+ * the other operations, this is not constant time.
+ *
+ * @return The first thread for which `match` returns true, or NULL if none do.
+ */
+struct thread* RunQueueFind(struct run_queue* rq, bool (*match)(struct thread*, void*), void* context) {
+    for (int word = 0; word < RUN_QUEUE_BITMAP_WORDS; ++word) {
+        uint32_t levels = rq->level_bitmap[word];
+        while (levels != 0) {
+            int bit = __builtin_ctz(levels);
+            levels &= ~(1U << bit);
+
+            struct thread_list* list = &rq->levels[word * 32 + bit];
+            for (struct thread* iter = list->head; iter != NULL; iter = iter->links[list->index].next) {
+                if (match(iter, context)) {
+                    return iter;
+                }
+            }
+        }
+    }
+    return NULL;
+}
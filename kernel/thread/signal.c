@@ -15,6 +15,7 @@
 #include <ksignal.h>
 #include <signal.h>
 #include <tree.h>
+#include <timer.h>
 
 void StopThread(struct thread* thr) {
     LockScheduler();
@@ -67,6 +68,11 @@ int RaiseSignal(struct thread* thr, int sig_num, bool lock_already_held) {
         }
     }
 
+    /*
+     * Sleeps (and semaphore timeouts) get cut short by a signal.
+     */
+    InterruptSleep(thr);
+
     if (thr->state == THREAD_STATE_WAITING_FOR_SIGNAL) {
         /*
          * TODO: this should probably check if the signal is unblocked in `thr`
@@ -13,6 +13,7 @@
 #include <panic.h>
 #include <common.h>
 #include <threadlist.h>
+#include <runqueue.h>
 #include <tree.h>
 #include <priorityqueue.h>
 #include <progload.h>
@@ -20,11 +21,46 @@
 #include <process.h>
 #include <ksignal.h>
 #include <signal.h>
+#include <transfer.h>
+#include <futex.h>
 
-static struct thread_list ready_list;
+/*
+ * Each CPU has its own queue of ready threads, with its own lock, so that 
+ * scheduling on one CPU doesn't contend with scheduling or wakeups on another.
+ * 
+ * The queue lock is held across a task switch, and released by the thread that
+ * gets switched to. `switched_from` is the thread that was running on the CPU
+ * before that switch, so that the new thread can mark it as no longer in use.
+ * 
+ * Lock ordering is: the scheduler lock, then any run queue locks (in order of 
+ * CPU index), then the switch lock.
+ */
+struct cpu_run_queue {
+    struct spinlock lock;
+    struct spinlock switch_lock;
+    struct run_queue ready;
+    struct thread* idle_thread;
+    struct thread* switched_from;
+    uint64_t next_balance_time;
+    uint64_t prev_switch_time;
+};
+
+static struct cpu_run_queue run_queues[ARCH_MAX_CPU_ALLOWED];
+
+static void FinishTaskSwitch(void);
+
+/*
+ * Protects thread states (i.e. block and wakeup transitions), and the lists
+ * that blocked threads sit on.
+ */
 static struct spinlock scheduler_lock;
-static struct spinlock scheduler_recur_lock;
-static struct spinlock innermost_lock;
+static struct spinlock scheduler_prevent_lock;
+
+/*
+ * How often a CPU will try to even out the number of threads between itself 
+ * and the busiest CPU. Idle CPUs also try to steal work whenever they schedule.
+ */
+#define LOAD_BALANCE_INTERVAL_NS    (100ULL * 1000 * 1000)
 
 /*
 * Local fixed sized arrays and variables need to fit on the kernel stack.
@@ -86,12 +122,16 @@ static void CreateCanary(size_t canary_base) {
 /*
 * Allocates a new page-aligned stack for a kernel thread, and returns
 * the address of either the top of the stack (if it grows downward),
-* or the bottom (if it grows upward).
+* or the bottom (if it grows upward). Stacks of threads that have been
+* cleaned up get reused if there's one of the right size.
 */
 static void CreateKernelStacks(struct thread* thr, int kernel_stack_kb) {
     int total_bytes = (BytesToPages(kernel_stack_kb * 1024) + NUM_CANARY_PAGES) * ARCH_PAGE_SIZE;
     
-    size_t stack_bottom = MapVirt(0, 0, total_bytes, VM_READ | VM_WRITE | VM_LOCK, NULL, 0);
+    size_t stack_bottom = TakeCachedKernelStack(total_bytes);
+    if (stack_bottom == 0) {
+        stack_bottom = MapVirt(0, 0, total_bytes, VM_READ | VM_WRITE | VM_LOCK, NULL, 0);
+    }
     size_t stack_top = stack_bottom + total_bytes;
 
 #ifndef NDEBUG
@@ -131,15 +171,114 @@ void BlockThread(int reason) {
     PostponeScheduleUntilStandardIrql();
 }
 
-void UnblockThread(struct thread* thr) { 
-    AssertSchedulerLockHeld();
-    if (thr->state == THREAD_STATE_WAITING_FOR_SEMAPHORE_WITH_TIMEOUT) {
-        CancelSemaphoreOfThread(thr);
+static struct cpu_run_queue* GetLocalRunQueue(void) {
+    return run_queues + ArchGetCurrentCpuIndex();
+}
+
+/*
+ * The number of threads that want to use a CPU, including the one running on it
+ * right now (unless that's the idle thread).
+ */
+static int GetRunQueueLoad(int cpu) {
+    struct thread* current = GetCpuAtIndex(cpu)->current_thread;
+    bool busy = current != NULL && current != run_queues[cpu].idle_thread;
+    return run_queues[cpu].ready.num_threads + (busy ? 1 : 0);
+}
+
+/*
+ * Works out which CPU a thread should be put on when it becomes ready. Threads
+ * go back to the CPU they last ran on (or the one they have an affinity for), 
+ * unless it is noticeably busier than the least loaded CPU.
+ */
+static int SelectCpuForThread(struct thread* thr) {
+    if (thr->pinned) {
+        return thr->cpu;
+    }
+
+    int preferred = thr->cpu_affinity != -1 ? thr->cpu_affinity : thr->cpu;
+    if (preferred < 0 || preferred >= GetCpuCount()) {
+        preferred = ArchGetCurrentCpuIndex();
+    }
+
+    int best = preferred;
+    int best_load = GetRunQueueLoad(preferred);
+    for (int i = 0; i < GetCpuCount(); ++i) {
+        int load = GetRunQueueLoad(i);
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    return best_load + 1 < GetRunQueueLoad(preferred) ? best : preferred;
+}
+
+/*
+ * Locks the run queue that a ready thread is on. The thread can be moved 
+ * between CPUs by load balancing until we have the lock, so check that it's
+ * still on the queue we locked.
+ */
+static struct cpu_run_queue* LockRunQueueOfThread(struct thread* thr) {
+    while (true) {
+        struct cpu_run_queue* rq = run_queues + thr->cpu;
+        AcquireSpinlock(&rq->lock);
+        if (rq == run_queues + thr->cpu) {
+            return rq;
+        }
+        ReleaseSpinlock(&rq->lock);
     }
-    ThreadListInsert(&ready_list, thr);
-    if (thr->priority < GetThread()->priority) {
+}
+
+/*
+ * Asks another CPU to reschedule, e.g. because a more important thread has been
+ * put onto its queue.
+ */
+static void RequestRescheduleOnCpu(int cpu) {
+    if (cpu == (int) ArchGetCurrentCpuIndex()) {
         PostponeScheduleUntilStandardIrql();
+    } else {
+        /*
+         * It will see this the next time it lowers to IRQL_STANDARD. The IPI
+         * makes that happen straight away, instead of after its next timer
+         * interrupt.
+         */
+        GetCpuAtIndex(cpu)->postponed_task_switch = true;
+        ArchSendRescheduleIpi(cpu);
+    }
+}
+
+/*
+ * Puts a thread onto a ready queue. The lock for that run queue must be held.
+ */
+static void MakeThreadReady(struct cpu_run_queue* rq, struct thread* thr, bool at_front) {
+    assert(IsSpinlockHeld(&rq->lock));
+    thr->state = THREAD_STATE_READY;
+    thr->cpu = rq - run_queues;
+    if (at_front) {
+        RunQueueInsertAtFront(&rq->ready, thr);
+    } else {
+        RunQueueInsert(&rq->ready, thr);
+    }
+}
+
+static void WakeThreadOnCpu(struct thread* thr, int cpu, bool at_front) {
+    struct cpu_run_queue* rq = run_queues + cpu;
+    AcquireSpinlock(&rq->lock);
+    MakeThreadReady(rq, thr, at_front);
+    /*
+     * If the CPU isn't multitasking yet, it will pick up the thread when it
+     * starts.
+     */
+    struct thread* current = GetCpuAtIndex(cpu)->current_thread;
+    if (current != NULL && thr->priority < current->priority) {
+        RequestRescheduleOnCpu(cpu);
     }
+    ReleaseSpinlock(&rq->lock);
+}
+
+void UnblockThread(struct thread* thr) { 
+    AssertSchedulerLockHeld();
+    WakeThreadOnCpu(thr, SelectCpuForThread(thr), false);
 }
 
 void UnblockThreadGiftingTimeslice(struct thread* thr) {
@@ -151,24 +290,20 @@ void UnblockThreadGiftingTimeslice(struct thread* thr) {
         thr->gifted_timeslice += current_expiry - sys_time;
     }
 
-    if (thr->state == THREAD_STATE_WAITING_FOR_SEMAPHORE_WITH_TIMEOUT) {
-        CancelSemaphoreOfThread(thr);
-    }
-    ThreadListInsertAtFront(&ready_list, thr);
-    if (thr->priority < GetThread()->priority) {
-        PostponeScheduleUntilStandardIrql();
-    }
+    /*
+     * The point of gifting is that it runs next, here, so ignore the usual
+     * placement rules unless it can't run here at all.
+     */
+    WakeThreadOnCpu(thr, thr->pinned ? thr->cpu : (int) ArchGetCurrentCpuIndex(), true);
     
     GetThread()->timeslice_expiry = sys_time;
     PostponeScheduleUntilStandardIrql();
 }
 
-void UpdateThreadTimeUsed(void) {
-    static uint64_t prev_time = 0;
-
+static void UpdateThreadTimeUsed(struct cpu_run_queue* rq) {
     uint64_t time = GetSystemTimer();
-    uint64_t time_elapsed = GetSystemTimer() - prev_time;
-    prev_time = time;
+    uint64_t time_elapsed = time - rq->prev_switch_time;
+    rq->prev_switch_time = time;
 
     GetThread()->time_used += time_elapsed;
 }
@@ -206,6 +341,12 @@ void ThreadExecuteInUsermode(void* arg) {
         TerminateThread(thr);
     }
 
+    res = MapTimePageIntoAddressSpace();
+    if (res != 0) {
+        LogDeveloperWarning("COULDN'T MAP THE TIME PAGE!\n");
+        TerminateThread(thr);
+    }
+
     size_t user_stack = CreateUserStack(USER_STACK_MAX_SIZE);
 
     LockScheduler();
@@ -216,6 +357,144 @@ void ThreadExecuteInUsermode(void* arg) {
     ArchSwitchToUsermode(entry_point, user_stack, arg);
 }
 
+struct user_thread_start {
+    size_t entry_point;
+    size_t argument;
+    size_t tls;
+    size_t clear_tid_address;
+    int stack_slot;
+    sigset_t blocked_signals;
+    size_t user_common_signal_handler;
+};
+
+static size_t GetUserThreadStackTop(int slot) {
+    return ARCH_USER_STACK_LIMIT - USER_STACK_MAX_SIZE - slot * USER_THREAD_STACK_SIZE;
+}
+
+static void UserThreadEntry(void* arg) {
+    struct user_thread_start start = *((struct user_thread_start*) arg);
+    FreeHeap(arg);
+
+    /*
+     * The thread sets these up itself, as another CPU might start running it
+     * before CreateUserThread() returns.
+     */
+    struct thread* thr = GetThread();
+    thr->clear_tid_address = start.clear_tid_address;
+    thr->user_stack_slot = start.stack_slot;
+    thr->blocked_signals = start.blocked_signals;
+    thr->user_common_signal_handler = start.user_common_signal_handler;
+    SetUserTls(start.tls);
+
+    if (thr->clear_tid_address != 0) {
+        WriteWordToUsermode((size_t*) thr->clear_tid_address, thr->thread_id);
+    }
+
+    /*
+     * Make it look like the entry point was called with the argument, and a
+     * null return address, so that returning from it just faults.
+     */
+    size_t frame[2] = {0, start.argument};
+    size_t user_stack = GetUserThreadStackTop(start.stack_slot) - sizeof(frame);
+    struct transfer tr = CreateTransferWritingToUser((void*) user_stack, sizeof(frame), 0);
+    if (PerformTransfer(frame, &tr, sizeof(frame)) != 0) {
+        ExitUserThread(-1);
+    }
+
+    LockScheduler();
+    thr->stack_pointer = user_stack;
+    UnlockScheduler();
+
+    ArchSwitchToUsermode(start.entry_point, user_stack, (void*) start.argument);
+}
+
+/**
+ * Starts another thread in the current process, running in usermode. It gets a
+ * user stack of its own, in the process' next free stack slot.
+ *
+ * @param entry_point       The user address to start running at.
+ * @param argument          Passed to the entry point, as if it were a function.
+ * @param tls               The thread's initial thread-local storage base.
+ * @param clear_tid_address If non-zero, a user address for the thread id, as
+ *                          described on `struct thread`.
+ * @param thread_id         The new thread's id is written here.
+ * @return 0 on success, or EAGAIN if the process has no stack slots left.
+ */
+int CreateUserThread(size_t entry_point, size_t argument, size_t tls, size_t clear_tid_address, int* thread_id) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct thread* current = GetThread();
+    struct process* prcss = current->process;
+    assert(prcss != NULL);
+
+    int slot = AllocUserStackSlot(prcss);
+    if (slot == -1) {
+        return EAGAIN;
+    }
+
+    /*
+     * The bottom page of the slot is left unmapped as a guard page.
+     */
+    size_t stack_top = GetUserThreadStackTop(slot);
+    size_t stack_bytes = USER_THREAD_STACK_SIZE - ARCH_PAGE_SIZE;
+    size_t actual_base = MapVirt(0, stack_top - stack_bytes, stack_bytes, VM_READ | VM_WRITE | VM_USER | VM_LOCAL | VM_FIXED_VIRT, NULL, 0);
+    if (actual_base != stack_top - stack_bytes) {
+        FreeUserStackSlot(prcss, slot);
+        return ENOMEM;
+    }
+
+    struct user_thread_start* start = AllocHeap(sizeof(struct user_thread_start));
+    start->entry_point = entry_point;
+    start->argument = argument;
+    start->tls = tls;
+    start->clear_tid_address = clear_tid_address;
+    start->stack_slot = slot;
+    start->blocked_signals = current->blocked_signals;
+    start->user_common_signal_handler = current->user_common_signal_handler;
+
+    struct thread* thr = CreateThreadEx(UserThreadEntry, start, prcss->vas, "uthread", prcss, current->schedule_policy, current->base_priority, 0);
+    *thread_id = thr->thread_id;
+    return 0;
+}
+
+/**
+ * Exits the current user thread. If it is the last one in its process, the
+ * whole process exits with `status`. This function does not return.
+ */
+void ExitUserThread(int status) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    struct thread* thr = GetThread();
+    struct process* prcss = thr->process;
+
+    if (!RemoveThreadFromProcess(prcss, thr)) {
+        KillProcess(status);
+    }
+
+    if (thr->clear_tid_address != 0) {
+        WriteWordToUsermode((size_t*) thr->clear_tid_address, 0);
+        FutexWake(thr->clear_tid_address, 0x7FFFFFFF);
+    }
+
+    if (thr->user_stack_slot != -1) {
+        size_t stack_bytes = USER_THREAD_STACK_SIZE - ARCH_PAGE_SIZE;
+        UnmapVirt(GetUserThreadStackTop(thr->user_stack_slot) - stack_bytes, stack_bytes);
+        FreeUserStackSlot(prcss, thr->user_stack_slot);
+    }
+
+    TerminateThread(thr);
+}
+
+/**
+ * Changes the current thread's thread-local storage base. It's reloaded every
+ * time the thread gets switched to.
+ */
+void SetUserTls(size_t base) {
+    struct thread* thr = GetThread();
+    thr->user_tls = base;
+    ArchSetUserTls(base);
+}
+
 void CreateInitialForkThread(struct process* prcss, struct thread* old) {
     assert(old->waiting_on_semaphore == NULL);
     assert(!old->needs_termination);
@@ -231,7 +510,9 @@ void CreateInitialForkThread(struct process* prcss, struct thread* old) {
      * happens on `CreateUserStack`, which doesn't happen here.
      */
     LogWriteSerial("AAA\n");
-    struct thread* thr = CreateThreadEx(ThreadForkInitialisation, NULL, prcss->vas, "uforked", prcss, old->schedule_policy, old->priority, old->kernel_stack_size / 1024);
+    struct thread* thr = CreateThreadEx(ThreadForkInitialisation, NULL, prcss->vas, "uforked", prcss, old->schedule_policy, old->base_priority, (old->kernel_stack_size - NUM_CANARY_PAGES * ARCH_PAGE_SIZE) / 1024);
+    thr->user_tls = old->user_tls;
+    thr->user_stack_slot = old->user_stack_slot;
    
     /*
      * We only actually care about the final 20 bytes - the part the will get used
@@ -279,12 +560,17 @@ struct thread* CreateThreadEx(void(*entry_point)(void*), void* argument, struct
     thr->initial_address = entry_point;
     thr->state = THREAD_STATE_READY;
     thr->time_used = 0;
+    inline_memset(thr->links, 0, sizeof(thr->links));
     thr->gifted_timeslice = 0;
     thr->name = strdup(name);
     thr->priority = priority;
+    thr->base_priority = priority;
+    thr->inherited_priority = NO_INHERITED_PRIORITY;
+    thr->contended_mutexes = NULL;
     thr->needs_termination = false;
     thr->needs_stopping = false;
     thr->waiting_on_semaphore = NULL;
+    thr->semaphore_wait_timed = false;
     thr->schedule_policy = policy;
     thr->timeslice_expiry = GetSystemTimer() + TIMESLICE_LENGTH_MS;
     thr->vas = vas;
@@ -293,9 +579,17 @@ struct thread* CreateThreadEx(void(*entry_point)(void*), void* argument, struct
     thr->blocked_signals = 0;
     thr->prev_blocked_signals = 0;
     thr->user_common_signal_handler = 0;
+    thr->user_tls = 0;
+    thr->clear_tid_address = 0;
+    thr->user_stack_slot = -1;
     thr->alarm_id = -1;
+    InitSleepTimer(thr);
+    thr->cpu = ArchGetCurrentCpuIndex();
+    thr->cpu_affinity = -1;
+    thr->pinned = false;
+    thr->on_cpu = false;
     thr->thread_id = GetNextThreadId();
-    CreateKernelStacks(thr, kernel_stack_kb == 0 ? DEFAULT_KERNEL_STACK_KB : 0);
+    CreateKernelStacks(thr, kernel_stack_kb == 0 ? (int) DEFAULT_KERNEL_STACK_KB : kernel_stack_kb);
     thr->stack_pointer = ArchPrepareStack(thr->kernel_stack_top);
 
     if (prcss != NULL) {
@@ -305,7 +599,7 @@ struct thread* CreateThreadEx(void(*entry_point)(void*), void* argument, struct
     }
 
     LockScheduler();
-    ThreadListInsert(&ready_list, thr);
+    WakeThreadOnCpu(thr, SelectCpuForThread(thr), false);
     UnlockScheduler();
 
     return thr;
@@ -334,15 +628,14 @@ void ThreadInitialisationHandler(void) {
      * This normally happends in the schedule code, just after the call to ArchSwitchThread,
      * but we forced ourselves to jump here instead, so we'd better do it now.
      */
-    ReleaseSpinlock(&innermost_lock);
-
-    UpdateTimesliceExpiry();
+    FinishTaskSwitch();
 
     /*
-    * To get here, someone must have called thread_schedule(), and therefore
-    * the lock must have been held.
+    * To get here, someone must have called Schedule(), and therefore the run 
+    * queue lock must have been held.
     */
-    UnlockScheduler();
+    ReleaseSpinlock(&GetLocalRunQueue()->lock);
+    LowerIrql(IRQL_STANDARD);
 
 
     /* Anything else you might want to do should be done here... */
@@ -373,60 +666,97 @@ static void UpdatePriority(bool yielded) {
     int policy = thr->schedule_policy;
 
     if (policy != SCHEDULE_POLICY_FIXED) {
-        int new_val = thr->priority + (yielded ? -1 : 1);
+        int new_val = thr->base_priority + (yielded ? -1 : 1);
         if (new_val >= GetMinPriorityValueForPolicy(policy) && new_val <= GetMaxPriorityValueForPolicy(policy)) {
-            thr->priority = new_val;
+            thr->base_priority = new_val;
+            thr->priority = new_val < thr->inherited_priority ? new_val : thr->inherited_priority;
         }
     }
 }
 
 static int scheduler_lock_count = 0;
+static int scheduler_lock_owner = -1;
 static int scheduler_prevent = 0;
 
 void PreventScheduler(void) {
-    AcquireSpinlock(&scheduler_recur_lock);
+    AcquireSpinlock(&scheduler_prevent_lock);
     ++scheduler_prevent;
-    ReleaseSpinlock(&scheduler_recur_lock);
+    ReleaseSpinlock(&scheduler_prevent_lock);
 }
 
 void UnpreventScheduler(void) {
-    AcquireSpinlock(&scheduler_recur_lock);
+    AcquireSpinlock(&scheduler_prevent_lock);
     --scheduler_prevent;
-    ReleaseSpinlock(&scheduler_recur_lock);
+    ReleaseSpinlock(&scheduler_prevent_lock);
 }
 
 void LockScheduler(void) {
-    AcquireSpinlock(&scheduler_recur_lock);
-    if (scheduler_lock_count == 0) {
-        AcquireSpinlock(&scheduler_lock);
-        scheduler_lock.prev_irql = scheduler_recur_lock.prev_irql;
-        scheduler_recur_lock.prev_irql = scheduler_lock.irql;
+    /*
+     * Raising first means we can't get moved to a different CPU while we check
+     * the owner. Only this CPU can set the owner to be itself, so it is safe to
+     * check it without holding the lock.
+     */
+    int prev_irql = RaiseIrql(IRQL_SCHEDULER);
+    if (scheduler_lock_owner == (int) ArchGetCurrentCpuIndex()) {
+        ++scheduler_lock_count;
+        return;
     }
-    AssertSchedulerLockHeld();
-    ++scheduler_lock_count;
-    ReleaseSpinlock(&scheduler_recur_lock);
+
+    AcquireSpinlock(&scheduler_lock);
+    scheduler_lock.prev_irql = prev_irql;
+    scheduler_lock_owner = ArchGetCurrentCpuIndex();
+    scheduler_lock_count = 1;
 }
 
 void UnlockScheduler(void) {
-    AcquireSpinlock(&scheduler_recur_lock);
-    assert(scheduler_lock_count > 0);
-    --scheduler_lock_count;
     AssertSchedulerLockHeld();
-    if (scheduler_lock_count == 0) {
-        scheduler_recur_lock.prev_irql = scheduler_lock.prev_irql;
-        scheduler_lock.prev_irql = GetIrql();
+    assert(scheduler_lock_count > 0);
+    if (--scheduler_lock_count == 0) {
+        scheduler_lock_owner = -1;
         ReleaseSpinlock(&scheduler_lock);
     }
-    ReleaseSpinlock(&scheduler_recur_lock);
 }
 
 void AssertSchedulerLockHeld(void) {
-    assert(IsSpinlockHeld(&scheduler_lock));
+    assert(IsSpinlockHeld(&scheduler_lock) && scheduler_lock_owner == (int) ArchGetCurrentCpuIndex());
+}
+
+/*
+ * Called by a thread just after it has been switched to. The run queue lock is
+ * still held, and must be released by the caller.
+ */
+static void FinishTaskSwitch(void) {
+    struct cpu_run_queue* rq = GetLocalRunQueue();
+
+    /*
+     * Now the previous thread's stack is no longer in use, it can be run on 
+     * another CPU.
+     */
+    if (rq->switched_from != NULL) {
+        rq->switched_from->on_cpu = false;
+        rq->switched_from = NULL;
+    }
+
+    ReleaseSpinlock(&rq->switch_lock);
+    UpdateTimesliceExpiry();
 }
 
-__attribute__((returns_twice)) static void SwitchToNewTask(struct thread* old_thread, struct thread* new_thread) {
+__attribute__((returns_twice)) static void SwitchToNewTask(struct cpu_run_queue* rq, struct thread* old_thread, struct thread* new_thread) {
+    if (new_thread != rq->idle_thread) {
+        RunQueueDelete(&rq->ready, new_thread);
+    }
     new_thread->state = THREAD_STATE_RUNNING;
-    ThreadListDeleteTop(&ready_list);
+    new_thread->cpu = rq - run_queues;
+
+    /*
+     * If the thread got woken up onto our queue just as it was blocking on 
+     * another CPU, that CPU might still be switching away from it. We can't 
+     * start using its stack until that's done.
+     */
+    while (new_thread->on_cpu) {
+        ;
+    }
+    new_thread->on_cpu = true;
 
     /*
      * No IRQs allowed while this happens, as we need to protect the CPU structure.
@@ -435,7 +765,8 @@ __attribute__((returns_twice)) static void SwitchToNewTask(struct thread* old_th
      */
     struct cpu* cpu = GetCpu();
 
-    AcquireSpinlock(&innermost_lock);
+    AcquireSpinlock(&rq->switch_lock);
+    rq->switched_from = cpu->current_thread == NULL ? NULL : old_thread;
 
     if (new_thread->vas != old_thread->vas) {
         SetVas(new_thread->vas);
@@ -443,27 +774,95 @@ __attribute__((returns_twice)) static void SwitchToNewTask(struct thread* old_th
 
     cpu->current_thread = new_thread;
     cpu->current_vas = new_thread->vas;
+    ArchSetUserTls(new_thread->user_tls);
     ArchSwitchThread(old_thread, new_thread);
 
     /*
      * This code doesn't get called on the first time a thread gets run!! It jumps straight from
      * ArchSwitchThread to ThreadInitialisationHandler!
+     * 
+     * We may now be on a different CPU to the one we switched away on.
      */
-    ReleaseSpinlock(&innermost_lock);
+    FinishTaskSwitch();
+}
 
-    UpdateTimesliceExpiry();
+static bool CanMigrateThread(struct thread* thr, void* ignored) {
+    (void) ignored;
+    return !thr->pinned && !thr->on_cpu;
+}
+
+/*
+ * Moves a thread from the busiest CPU to this one. If `idle` is set, this CPU
+ * has nothing else to do, and so any thread that's waiting elsewhere will be 
+ * taken. Otherwise, threads are only moved if the loads are quite uneven.
+ */
+static void BalanceLoad(struct cpu_run_queue* rq, bool idle) {
+    int local = rq - run_queues;
+    int local_load = GetRunQueueLoad(local);
+
+    int busiest = -1;
+    int busiest_load = 0;
+    for (int i = 0; i < GetCpuCount(); ++i) {
+        int load = GetRunQueueLoad(i);
+        if (i != local && run_queues[i].ready.num_threads > 0 && load > busiest_load) {
+            busiest = i;
+            busiest_load = load;
+        }
+    }
+
+    if (busiest == -1 || (!idle && busiest_load < local_load + 2)) {
+        return;
+    }
+
+    /*
+     * We already hold our own lock, so waiting for another one could deadlock 
+     * with a CPU trying to do the same thing to us. If it's busy, just try 
+     * again next time.
+     */
+    struct cpu_run_queue* remote = run_queues + busiest;
+    if (!TryAcquireSpinlock(&remote->lock)) {
+        return;
+    }
+
+    struct thread* thr = RunQueueFind(&remote->ready, CanMigrateThread, NULL);
+    if (thr != NULL) {
+        RunQueueDelete(&remote->ready, thr);
+        MakeThreadReady(rq, thr, false);
+    }
+
+    ReleaseSpinlock(&remote->lock);
 }
 
-static void ScheduleWithLockHeld(void) {
-    if (GetIrql() != IRQL_SCHEDULER) {
-        LogWriteSerial("ScheduleWithLockHeld with irql = %d\n", GetIrql());
+static struct thread* PickNextThread(struct cpu_run_queue* rq) {
+    struct thread* best = RunQueuePeek(&rq->ready);
+
+    if (GetCpuCount() > 1) {
+        /*
+         * If the current thread is still going to run, we don't count as idle
+         * (even if nothing is queued) - otherwise busy CPUs would end up 
+         * stealing work off each other.
+         */
+        struct thread* current = GetThread();
+        bool current_done = current == NULL || current == rq->idle_thread || current->state != THREAD_STATE_RUNNING;
+        bool idle = best == NULL && current_done;
+
+        uint64_t time = GetSystemTimer();
+        if (idle || time >= rq->next_balance_time) {
+            rq->next_balance_time = time + LOAD_BALANCE_INTERVAL_NS;
+            BalanceLoad(rq, idle);
+            best = RunQueuePeek(&rq->ready);
+        }
     }
 
+    return best == NULL ? rq->idle_thread : best;
+}
+
+static void ScheduleWithLockHeld(struct cpu_run_queue* rq) {
     EXACT_IRQL(IRQL_SCHEDULER);
-    AssertSchedulerLockHeld();
+    assert(IsSpinlockHeld(&rq->lock));
 
     struct thread* old_thread = GetThread();
-    struct thread* new_thread = ready_list.head;
+    struct thread* new_thread = PickNextThread(rq);
 
     LogWriteSerial("ScheduleWithLockHeld 0x%X -> 0x%X\n", old_thread, new_thread);
 
@@ -472,39 +871,76 @@ static void ScheduleWithLockHeld(void) {
          * Multitasking not set up yet. Now check if someone has added a task that we can switch to.
          * (If not, we keep waiting until they have, then we can start multitasking).
          */
-        if (ready_list.head != NULL) {
+        if (new_thread != NULL) {
             /*
              * We need a place where it can write the "old" stack pointer to.
              */
             struct thread dummy;
-            SwitchToNewTask(&dummy, new_thread);
+            SwitchToNewTask(rq, &dummy, new_thread);
         }
         return;
     }
     
-    if (new_thread == old_thread || new_thread == NULL) {
+    if (new_thread == old_thread) {
+        /*
+         * If we got woken up again before we managed to switch away, we'll be on 
+         * our own queue. Just take ourselves off it and keep going.
+         */
+        if (old_thread->state == THREAD_STATE_READY) {
+            RunQueueDelete(&rq->ready, old_thread);
+            old_thread->state = THREAD_STATE_RUNNING;
+        }
+        return;
+    }
+
+    if (new_thread == NULL) {
         /*
          * Don't switch if there isn't anything else to switch to!
          */
         return;
     }
 
+    /*
+     * A thread that used up its whole timeslice gets demoted before we decide
+     * whether it keeps the processor.
+     */
+    bool yielded = old_thread->timeslice_expiry > GetSystemTimer();
+    if (!yielded) {
+        UpdatePriority(false);
+    }
+
+    /*
+     * The current thread keeps running if nothing else is at least as important 
+     * (threads of equal priority take turns).
+     */
+    if (old_thread->state == THREAD_STATE_RUNNING && old_thread->priority < new_thread->priority) {
+        if (!yielded) {
+            UpdateTimesliceExpiry();
+        }
+        return;
+    }
+
 #ifndef NDEBUG
     CheckCanary(old_thread->canary_position);
 #endif
 
-    bool yielded = old_thread->timeslice_expiry > GetSystemTimer();
-    UpdatePriority(yielded);
-    UpdateThreadTimeUsed();
+    if (yielded) {
+        UpdatePriority(true);
+    }
+    UpdateThreadTimeUsed(rq);
 
     /*
-     * Put the old task back on the ready list, but only if it didn't block / get suspended.
+     * Put the old task back on the ready queue, but only if it didn't block / get suspended.
      */
     if (old_thread->state == THREAD_STATE_RUNNING) {
-        ThreadListInsert(&ready_list, old_thread);
+        if (old_thread == rq->idle_thread) {
+            old_thread->state = THREAD_STATE_READY;
+        } else {
+            MakeThreadReady(rq, old_thread, false);
+        }
     }
 
-    SwitchToNewTask(old_thread, new_thread);
+    SwitchToNewTask(rq, old_thread, new_thread);
 }
 
 void Schedule(void) {
@@ -513,11 +949,20 @@ void Schedule(void) {
         return;
     }
 
-    //LogWriteSerial("Sch.\n");
+    /*
+     * Raise first so that we can't be moved to another CPU between finding our
+     * run queue and locking it.
+     */
+    int prev_irql = RaiseIrql(IRQL_SCHEDULER);
+    AcquireSpinlock(&GetLocalRunQueue()->lock);
+    ScheduleWithLockHeld(GetLocalRunQueue());
 
-    LockScheduler();
-    ScheduleWithLockHeld();
-    UnlockScheduler();
+    /*
+     * We might be on a different CPU now. Either way, the lock we need to 
+     * release is the one held by whoever switched back to us.
+     */
+    ReleaseSpinlock(&GetLocalRunQueue()->lock);
+    LowerIrql(prev_irql);
 
     /**
      * Used to allow TerminateThread() to kill a foreign process. This is because we can't just yank
@@ -536,15 +981,45 @@ void Schedule(void) {
 }
 
 void InitScheduler() {
-    ThreadListInit(&ready_list, NEXT_INDEX_READY);
+    for (int i = 0; i < ARCH_MAX_CPU_ALLOWED; ++i) {
+        struct cpu_run_queue* rq = run_queues + i;
+        InitSpinlock(&rq->lock, "run queue", IRQL_SCHEDULER);
+        InitSpinlock(&rq->switch_lock, "switch", IRQL_HIGH);
+        RunQueueInit(&rq->ready);
+        rq->idle_thread = NULL;
+        rq->switched_from = NULL;
+        rq->next_balance_time = 0;
+        rq->prev_switch_time = 0;
+    }
     InitSpinlock(&scheduler_lock, "scheduler", IRQL_SCHEDULER);
-    InitSpinlock(&scheduler_recur_lock, "scheduler2", IRQL_SCHEDULER);
-    InitSpinlock(&innermost_lock, "inner scheduler", IRQL_HIGH);
+    TrackSpinlock(&scheduler_lock);
+    InitSpinlock(&scheduler_prevent_lock, "sched prevent", IRQL_SCHEDULER);
+}
+
+/*
+ * Makes a thread the idle thread of a CPU, which gets run whenever that CPU has
+ * nothing else to do. It never sits on a run queue, so it can't be moved to
+ * another CPU.
+ */
+void SetIdleThread(struct thread* thr, int cpu) {
+    LockScheduler();
+    struct cpu_run_queue* rq = LockRunQueueOfThread(thr);
+    assert(thr->state == THREAD_STATE_READY);
+    RunQueueDelete(&rq->ready, thr);
+    ReleaseSpinlock(&rq->lock);
+
+    thr->pinned = true;
+    thr->cpu = cpu;
+    run_queues[cpu].idle_thread = thr;
+    UnlockScheduler();
 }
 
+static volatile bool multitasking_started = false;
+
 [[noreturn]] void StartMultitasking(void) {
     InitIdle();
     InitCleaner();
+    multitasking_started = true;
 
     /*
      * Once this is called, "the game is afoot!" and threads will start running.
@@ -553,6 +1028,54 @@ void InitScheduler() {
     Panic(PANIC_IMPOSSIBLE_RETURN);
 }
 
+/*
+ * Called by each of the other CPUs once they have been initialised. They wait
+ * here until the bootstrap CPU starts multitasking (and so they have an idle
+ * thread), and then they start running threads too.
+ */
+[[noreturn]] void StartMultitaskingOnOtherCpu(void) {
+    while (!multitasking_started) {
+        ArchStallProcessor();
+    }
+
+    Schedule();
+    Panic(PANIC_IMPOSSIBLE_RETURN);
+}
+
+
+/*
+ * Works out the priority the scheduler should use for a thread, from its base
+ * and inherited priorities. The scheduler lock must be held.
+ */
+static void UpdateEffectivePriority(struct thread* thr) {
+    int priority = thr->base_priority < thr->inherited_priority ? thr->base_priority : thr->inherited_priority;
+    if (priority == thr->priority) {
+        return;
+    }
+
+    /*
+     * The ready queue files threads by priority, so it must be taken off and put
+     * back on to be moved to the right place.
+     */
+    struct cpu_run_queue* rq = LockRunQueueOfThread(thr);
+    bool requeue = thr->state == THREAD_STATE_READY && thr != rq->idle_thread;
+    if (requeue) {
+        RunQueueDelete(&rq->ready, thr);
+    }
+
+    thr->priority = priority;
+
+    if (requeue) {
+        RunQueueInsert(&rq->ready, thr);
+    }
+
+    /*
+     * Let the scheduler decide if the change means someone else should now be
+     * running instead.
+     */
+    RequestRescheduleOnCpu(thr->cpu);
+    ReleaseSpinlock(&rq->lock);
+}
 
 /**
  * Sets the priority and/or policy of a thread.
@@ -573,7 +1096,7 @@ void InitScheduler() {
  *       as the user will probably supply thread number, which the kernel then converts to address - or kernel may just make it
  *       a 'current thread' syscall, in which case GetThread() will be valid.
  * 
- * @maxirql IRQL_HIGH
+ * @maxirql IRQL_SCHEDULER
  */
 int SetThreadPriority(struct thread* thr, int policy, int priority) { 
     if (priority < -1 || priority > 255) {
@@ -583,6 +1106,15 @@ int SetThreadPriority(struct thread* thr, int policy, int priority) {
         return EINVAL;
     }
 
+    LockScheduler();
+
+    if (policy == -1) {
+        policy = thr->schedule_policy;
+    }
+    if (priority == -1) {
+        priority = thr->base_priority;
+    }
+
     if (priority < GetMinPriorityValueForPolicy(policy)) {
         priority = GetMinPriorityValueForPolicy(policy);
     }
@@ -590,22 +1122,45 @@ int SetThreadPriority(struct thread* thr, int policy, int priority) {
         priority = GetMaxPriorityValueForPolicy(policy);
     }
 
-    if (policy != -1) {
-        thr->schedule_policy = policy;
-    }
-    if (priority != -1) {
-        thr->priority = priority;
-    }
-
+    thr->schedule_policy = policy;
+    thr->base_priority = priority;
+    UpdateEffectivePriority(thr);
+    UnlockScheduler();
     return 0;
 }
 
+/**
+ * Sets the priority a thread has inherited from the threads waiting on mutexes
+ * it holds, or NO_INHERITED_PRIORITY if there are none. Used by the mutexes.
+ * The scheduler lock must be held.
+ */
+void SetInheritedPriority(struct thread* thr, int priority) {
+    AssertSchedulerLockHeld();
+    thr->inherited_priority = priority;
+    UpdateEffectivePriority(thr);
+}
+
 void AssignThreadToCpu(void) {
-    // NO-OP UNTIL SMP IMPLEMENTED
+    GetThread()->pinned = true;
 }
 
 void UnassignThreadToCpu(void) {
-    // NO-OP UNTIL SMP IMPLEMENTED
+    GetThread()->pinned = false;
+}
+
+/**
+ * Gives a thread a preference to run on a particular CPU. This is only a hint -
+ * the thread may still be run elsewhere if its preferred CPU is busy.
+ * 
+ * @param cpu The index of the CPU to prefer, or -1 to remove the preference.
+ * @return 0 on success, or EINVAL if the CPU doesn't exist.
+ */
+int SetThreadAffinity(struct thread* thr, int cpu) {
+    if (cpu < -1 || cpu >= GetCpuCount()) {
+        return EINVAL;
+    }
+    thr->cpu_affinity = cpu;
+    return 0;
 }
 
 
@@ -4,6 +4,11 @@
  *
  * An allocation-free linked list implementation designed specifically for 
  * `struct thread`. Required by the scheduler.
+ *
+ * The lists are doubly linked, and each thread's links remember which list
+ * they're on, so every operation is constant time. This matters because threads
+ * get removed from the middle of lists all the time (e.g. a semaphore wait
+ * timing out, or a thread changing priority).
  */
 
 #include <common.h>
@@ -21,107 +26,73 @@ void ThreadListInit(struct thread_list* list, int index) {
 }
 
 void ThreadListInsertAtFront(struct thread_list* list, struct thread* thread) {
-#ifndef NDEBUG
-    if (ThreadListContains(list, thread)) {
-        assert(!ThreadListContains(list, thread));
-    }
-#endif
+    struct thread_list_link* link = &thread->links[list->index];
+    assert(link->list == NULL);
 
     if (list->head == NULL) {
         assert(list->tail == NULL);
         list->tail = thread;
+    } else {
+        list->head->links[list->index].prev = thread;
     }
     
-    thread->next[list->index] = list->head;
+    link->next = list->head;
+    link->prev = NULL;
+    link->list = list;
     list->head = thread;
 }
 
 void ThreadListInsert(struct thread_list* list, struct thread* thread) {
-#ifndef NDEBUG
-    if (ThreadListContains(list, thread)) {
-        assert(!ThreadListContains(list, thread));
-    }
-#endif
+    struct thread_list_link* link = &thread->links[list->index];
+    assert(link->list == NULL);
 
     if (list->tail == NULL) {
         assert(list->head == NULL);
         list->head = thread;
 
     } else {
-        list->tail->next[list->index] = thread;
+        list->tail->links[list->index].next = thread;
     }
 
+    link->next = NULL;
+    link->prev = list->tail;
+    link->list = list;
     list->tail = thread;
-    thread->next[list->index] = NULL;
-}
-
-static int ThreadListGetIndex(struct thread_list* list, struct thread* thread) {
-    struct thread* iter = list->head;
-    int i = 0;
-    while (iter != NULL) {
-        if (iter == thread) {
-            return i;
-        }
-        ++i;
-        iter = iter->next[list->index];
-    }
-    return -1;
 }
 
 bool ThreadListContains(struct thread_list* list, struct thread* thread) {
-    return ThreadListGetIndex(list, thread) != -1;
+    return thread->links[list->index].list == list;
 }
 
-static void ProperDelete(struct thread_list* list, struct thread* iter, struct thread* prev) {
-    if (iter == list->head) {
-        list->head = list->head->next[list->index];
+void ThreadListDelete(struct thread_list* list, struct thread* thread) {
+    struct thread_list_link* link = &thread->links[list->index];
+    if (link->list != list) {
+        Panic(PANIC_THREAD_LIST);
+    }
+
+    if (link->prev == NULL) {
+        list->head = link->next;
     } else {
-        prev->next[list->index] = iter->next[list->index];
+        link->prev->links[list->index].next = link->next;
     }
 
-    if (iter == list->tail) {
-        list->tail = prev;
+    if (link->next == NULL) {
+        list->tail = link->prev;
+    } else {
+        link->next->links[list->index].prev = link->prev;
     }
 
+    link->next = NULL;
+    link->prev = NULL;
+    link->list = NULL;
+
     if (list->head == NULL) {
         assert(list->tail == NULL);
     }
 }
 
-static void ThreadListDeleteIndex(struct thread_list* list, int index) {
-    struct thread* iter = list->head;
-    struct thread* prev = NULL;
-
-    assert(index >= 0);
-
-    int i = 0;
-    while (iter != NULL) {
-        if (i == index) {
-            ProperDelete(list, iter, prev);
-            return;
-        }
-        ++i;
-        prev = iter;
-        iter = iter->next[list->index];
-    }
-
-    Panic(PANIC_THREAD_LIST);
-}
-
 struct thread* ThreadListDeleteTop(struct thread_list* list) {
     struct thread* top = list->head;
-    if (list->head == list->tail) {
-        list->tail = NULL;
-    }
-    list->head = list->head->next[list->index];
-
-    if (list->head == NULL) {
-        assert(list->tail == NULL);
-    }
-
+    ThreadListDelete(list, top);
     return top;
 }
-
-void ThreadListDelete(struct thread_list* list, struct thread* thread) {
-    ThreadListDeleteIndex(list, ThreadListGetIndex(list, thread));
-}
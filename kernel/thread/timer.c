@@ -1,6 +1,5 @@
 
 #include <timer.h>
-#include <spinlock.h>
 #include <assert.h>
 #include <cpu.h>
 #include <panic.h>
@@ -13,129 +12,434 @@
 #include <ksignal.h>
 #include <priorityqueue.h>
 #include <threadlist.h>
+#include <timerwheel.h>
+#include <virtual.h>
+#include <spinlock.h>
+#include <_timepage.h>
 
-#define EXPIRED_ALARM ((uint64_t) -1)
 #define MAX_ALARMS 256
 
+/*
+ * Sleeps and alarms are kept in a timer wheel, which counts in units of 2^20
+ * nanoseconds (just over a millisecond).
+ */
+#define TIMER_TICK_SHIFT 20
+
+/*
+ * The longest an idle CPU goes without a timer interrupt, so that it still
+ * looks for work to steal every now and then.
+ */
+#define MAX_TICKLESS_IDLE_NS (100ULL * 1000 * 1000)
+
+#define ALARM_FREE      0
+#define ALARM_PENDING   1
+#define ALARM_EXPIRED   2
+
 struct alarm {
+    struct timer_wheel_entry timer;
     uint64_t wakeup_time;
     void (*callback)(void*);
     void* arg;
+    int state;
+    int next_free;
 };
 
 static struct alarm alarms[MAX_ALARMS];
-static int num_alarms_installed = 0;
+static int first_free_alarm;
+
+/*
+ * Protected by the scheduler lock, as sleeping threads get woken up from its
+ * handlers.
+ */
+static struct timer_wheel timer_wheel;
+
+/*
+ * Set while a CPU has a call to HandleSleepWakeups() deferred.
+ */
+static bool sleep_wakeups_pending[ARCH_MAX_CPU_ALLOWED];
+
+/*
+ * How many timer interrupts to measure the timestamp counter against.
+ */
+#define CLOCK_CALIBRATION_TICKS 5
+
+/*
+ * The system time can be read without any locking. Writers hold
+ * `clock_write_lock`, and make the sequence number odd while they change
+ * anything, so that readers can tell they need to try again. The lock is at
+ * IRQL_TIMER so that nothing on the writer's own CPU can see the sequence
+ * number as odd and wait forever.
+ *
+ * The clock lives in its own page, which gets mapped read-only into every
+ * process, so that user code can read the time the same way we do. See
+ * _timepage.h for how the time gets worked out from it. Anything else in the
+ * page would be visible to user code too, so it gets padded out to a whole
+ * page.
+ */
+static union {
+    struct time_page data;
+    uint8_t padding[ARCH_PAGE_SIZE];
+} time_page __attribute__((aligned(ARCH_PAGE_SIZE)));
+
+static struct time_page* const clock_page = &time_page.data;
+static struct spinlock clock_write_lock;
+
+/*
+ * Timezones can't be changed yet, so everything is in Sydney time.
+ */
+#define DEFAULT_TIMEZONE_OFFSET (1000000LL * 60 * 60 * 10)
+
+static void BeginClockWrite(void) {
+    AcquireSpinlock(&clock_write_lock);
+    clock_page->sequence++;
+    asm volatile ("" ::: "memory");
+}
+
+static void EndClockWrite(void) {
+    asm volatile ("" ::: "memory");
+    clock_page->sequence++;
+    ReleaseSpinlock(&clock_write_lock);
+}
+
+static uint32_t BeginClockRead(void) {
+    uint32_t sequence;
+    do {
+        sequence = clock_page->sequence;
+    } while (sequence & 1);
+    asm volatile ("" ::: "memory");
+    return sequence;
+}
+
+static bool RetryClockRead(uint32_t sequence) {
+    asm volatile ("" ::: "memory");
+    return sequence != clock_page->sequence;
+}
 
-static struct spinlock timer_lock;
-static struct thread_list sleep_list;
+static uint64_t ReadTickTime(void) {
+    uint32_t sequence;
+    uint64_t time;
+    do {
+        sequence = BeginClockRead();
+        time = clock_page->tick_time;
+    } while (RetryClockRead(sequence));
+    return time;
+}
 
-static uint64_t system_time = 0;
-static int sleep_wakeups_posted = 0;
+/*
+ * Done in two halves so that the multiplication can't overflow, however long
+ * it has been.
+ */
+static uint64_t CyclesToNanos(uint64_t cycles) {
+    uint64_t high = ((cycles >> 32) * clock_page->mult) << (32 - clock_page->shift);
+    uint64_t low = ((cycles & 0xFFFFFFFFULL) * clock_page->mult) >> clock_page->shift;
+    return high + low;
+}
 
 void ReceivedTimer(uint64_t nanos) {
     EXACT_IRQL(IRQL_TIMER);
 
     if (ArchGetCurrentCpuIndex() == 0) {
-        /*
-         * Although we are in IRQL_TIMER, we must still lock to prevent other 
-         * CPUs from reading at a bad time. 
-         */
-        AcquireSpinlock(&timer_lock);
-        system_time += nanos;
-        ReleaseSpinlock(&timer_lock);
+        BeginClockWrite();
+        clock_page->tick_time += nanos;
+        EndClockWrite();
     }
 
     /*
      * Preempt the current thread if it has used up its timeslice. 
      */
     struct thread* thr = GetThread();
-    if (thr != NULL && thr->timeslice_expiry != 0 && thr->timeslice_expiry <= system_time) {
+    if (thr != NULL && thr->timeslice_expiry != 0 && thr->timeslice_expiry <= GetSystemTimer()) {
         PostponeScheduleUntilStandardIrql();
     }
 
-    if (GetNumberInDeferQueue() < 8) {
-        DeferUntilIrql(IRQL_STANDARD, HandleSleepWakeups, (void*) &system_time);
+    /*
+     * One pending call handles every sleeper that has expired by the time it
+     * runs, so there's no point queueing another.
+     */
+    int cpu = ArchGetCurrentCpuIndex();
+    if (!sleep_wakeups_pending[cpu]) {
+        sleep_wakeups_pending[cpu] = true;
+        DeferUntilIrql(IRQL_STANDARD, HandleSleepWakeups, NULL);
+    }
+}
+
+/**
+ * Returns the number of nanoseconds since the system was booted. Never takes a
+ * lock, so it can be called at any IRQL.
+ */
+uint64_t GetSystemTimer(void) {
+    uint32_t sequence;
+    uint64_t time;
+    do {
+        sequence = BeginClockRead();
+        if (clock_page->using_tsc) {
+            /*
+             * Another CPU's timestamp counter might be slightly behind the one
+             * the base was taken on.
+             */
+            uint64_t timestamp = ArchReadTimestamp();
+            time = clock_page->time_base + (timestamp > clock_page->tsc_base ? CyclesToNanos(timestamp - clock_page->tsc_base) : 0);
+        } else {
+            time = clock_page->tick_time;
+        }
+    } while (RetryClockRead(sequence));
+    return time;
+}
+
+/**
+ * Returns the system time as counted by timer interrupts alone, even when the
+ * timestamp counter is being used for GetSystemTimer().
+ */
+uint64_t GetTickTimer(void) {
+    return ReadTickTime();
+}
+
+static uint64_t WaitForNextTick(void) {
+    uint64_t time = ReadTickTime();
+    uint64_t next;
+    while ((next = ReadTickTime()) == time) {
+        ;
+    }
+    return next;
+}
+
+/**
+ * Switches the system time over to using the timestamp counter, if there is a
+ * usable one, so it doesn't only move forward on timer interrupts. This works
+ * out the counter's frequency by timing it against the timer interrupts, so
+ * they must already be running.
+ */
+void InitClocksource(void) {
+    if (!ArchHasUsableTimestamp()) {
+        LogWriteSerial("no usable timestamp counter, so the system time will be tick based\n");
+        return;
+    }
+
+    uint64_t start_time = WaitForNextTick();
+    uint64_t start_timestamp = ArchReadTimestamp();
+    uint64_t end_time = start_time;
+    for (int i = 0; i < CLOCK_CALIBRATION_TICKS; ++i) {
+        end_time = WaitForNextTick();
+    }
+    uint64_t end_timestamp = ArchReadTimestamp();
+
+    uint64_t cycles = end_timestamp - start_timestamp;
+    uint64_t nanos = end_time - start_time;
+    if (cycles < nanos / 1000 || nanos == 0) {
+        LogWriteSerial("timestamp counter is too slow to be useful\n");
+        return;
+    }
+
+    /*
+     * Use the largest shift we can while still having the multiplier fit in 32
+     * bits, for the most precision.
+     */
+    int shift = 32;
+    while (shift > 0 && ((nanos >> (64 - shift)) != 0 || (nanos << shift) / cycles > 0xFFFFFFFFULL)) {
+        --shift;
     }
+
+    BeginClockWrite();
+    clock_page->mult = (nanos << shift) / cycles;
+    clock_page->shift = shift;
+    clock_page->tsc_base = end_timestamp;
+    clock_page->time_base = end_time;
+    clock_page->using_tsc = true;
+    EndClockWrite();
+
+    LogWriteSerial("timestamp counter runs at %d kHz\n", (int) (cycles * 1000000ULL / nanos));
+}
+
+/*
+ * Makes UTC time be `utc` microseconds since 1601 as of right now.
+ */
+static void SetUtcBase(uint64_t utc) {
+    uint64_t base = utc - GetSystemTimer() / 1000;
+    BeginClockWrite();
+    clock_page->utc_base = base;
+    EndClockWrite();
+}
+
+/**
+ * Reads the real time clock once, so that the time of day can be worked out
+ * from the system time from then on, without going back to the hardware.
+ */
+void InitWallClock(void) {
+    SetUtcBase(ArchGetUtcTime(clock_page->timezone_offset));
+}
+
+static uint64_t GetUtcBase(int64_t* timezone_offset_out) {
+    uint32_t sequence;
+    uint64_t base;
+    do {
+        sequence = BeginClockRead();
+        base = clock_page->utc_base;
+        *timezone_offset_out = clock_page->timezone_offset;
+    } while (RetryClockRead(sequence));
+    return base;
 }
 
-uint64_t GetSystemTimer(void) {    
-    AcquireSpinlock(&timer_lock);
-    uint64_t value = system_time;
-    ReleaseSpinlock(&timer_lock);
-    return value;
+/**
+ * @return The current UTC time, in microseconds since 1 January 1601.
+ */
+uint64_t GetUtcTime(void) {
+    int64_t timezone_offset;
+    return GetUtcBase(&timezone_offset) + GetSystemTimer() / 1000;
+}
+
+/**
+ * @return The offset of local time from UTC, in microseconds.
+ */
+int64_t GetTimezoneOffset(void) {
+    int64_t timezone_offset;
+    GetUtcBase(&timezone_offset);
+    return timezone_offset;
+}
+
+/**
+ * Sets the time of day, both in the real time clock and in the time we give
+ * out.
+ *
+ * @param utc The new UTC time, in microseconds since 1 January 1601.
+ * @return 0 on success, or an errno value from the real time clock.
+ */
+int SetUtcTime(uint64_t utc) {
+    int res = ArchSetUtcTime(utc, GetTimezoneOffset());
+    if (res != 0) {
+        return res;
+    }
+    SetUtcBase(utc);
+    return 0;
+}
+
+/**
+ * Maps the clock into the current address space at ARCH_TIME_PAGE_ADDRESS, so
+ * that user code can read the time without a system call. It can't be written
+ * to from usermode, and it gets shared on fork and kept on exec.
+ */
+int MapTimePageIntoAddressSpace(void) {
+    int error;
+    MapVirtEx(
+        GetVas(), ArchVirtualToPhysical((size_t) &time_page), ARCH_TIME_PAGE_ADDRESS, 1,
+        VM_READ | VM_USER | VM_LOCK | VM_MAP_HARDWARE | VM_FIXED_VIRT | VM_LOCAL, NULL, 0, &error
+    );
+    return error;
+}
+
+/*
+ * Rounds up, so that nothing goes off early.
+ */
+static uint64_t NanosToTicks(uint64_t nanos) {
+    return (nanos + (1ULL << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
 }
 
 void InitTimer(void) {
-    InitSpinlock(&timer_lock, "timer", IRQL_TIMER);
-    ThreadListInit(&sleep_list, NEXT_INDEX_SLEEP);
+    InitSpinlock(&clock_write_lock, "clock", IRQL_TIMER);
+    clock_page->timezone_offset = DEFAULT_TIMEZONE_OFFSET;
+    TimerWheelInit(&timer_wheel, 0);
+
     memset(alarms, 0, sizeof(alarms));
+    for (int i = 0; i < MAX_ALARMS; ++i) {
+        alarms[i].next_free = i + 1 < MAX_ALARMS ? i + 1 : -1;
+    }
+    first_free_alarm = 0;
+}
+
+static void SleepTimerExpired(void* context) {
+    struct thread* thr = (struct thread*) context;
+    thr->timed_out = true;
+    thr->timed_out_due_to_signal = thr->signal_intr;
+    UnblockThread(thr);
 }
 
+void InitSleepTimer(struct thread* thr) {
+    TimerWheelEntryInit(&thr->sleep_timer, SleepTimerExpired, thr);
+}
+
+/*
+ * Starts the timer that wakes up a thread at `thr->sleep_expiry`. A thread that
+ * has already been signalled gets woken up on the next tick.
+ */
 void QueueForSleep(struct thread* thr) {
     AssertSchedulerLockHeld();
     thr->timed_out = false;
-    ThreadListInsert(&sleep_list, thr);
+    TimerWheelInsert(&timer_wheel, &thr->sleep_timer, thr->signal_intr ? 0 : NanosToTicks(thr->sleep_expiry));
 }
 
 bool TryDequeueForSleep(struct thread* thr) {
     AssertSchedulerLockHeld();
-    
-    struct thread* iter = sleep_list.head;
-    while (iter) {
-        if (iter == thr) {
-            ThreadListDelete(&sleep_list, iter);
-            return true;
-
-        } else {
-            iter = iter->next[NEXT_INDEX_SLEEP];
-        }
-    }
-
-    return false;
+    return TimerWheelCancel(&timer_wheel, &thr->sleep_timer);
 }
 
-static void HandleAlarms(uint64_t time) {
+/*
+ * Wakes a thread that is sleeping (or waiting on a semaphore with a timeout)
+ * because it has been sent a signal. Does nothing if it isn't.
+ */
+void InterruptSleep(struct thread* thr) {
     AssertSchedulerLockHeld();
-    for (int i = 0; i < MAX_ALARMS && num_alarms_installed > 0; ++i) {
-        if (alarms[i].wakeup_time <= time && alarms[i].wakeup_time != 0 && alarms[i].wakeup_time != EXPIRED_ALARM) {
-            alarms[i].wakeup_time = EXPIRED_ALARM;
-            num_alarms_installed--;
-            DeferUntilIrql(IRQL_STANDARD, alarms[i].callback, alarms[i].arg);
-        }
+    if (TimerWheelCancel(&timer_wheel, &thr->sleep_timer)) {
+        SleepTimerExpired(thr);
     }
 }
 
-void HandleSleepWakeups(void* sys_time_ptr) {
+static void AlarmExpired(void* context) {
+    struct alarm* alarm = (struct alarm*) context;
+    alarm->state = ALARM_EXPIRED;
+    DeferUntilIrql(IRQL_STANDARD, alarm->callback, alarm->arg);
+}
+
+void HandleSleepWakeups(void*) {
     EXACT_IRQL(IRQL_STANDARD);
 
+    /*
+     * Mustn't get moved to another CPU between getting the index and clearing
+     * the flag.
+     */
+    int irql = RaiseIrql(IRQL_HIGH);
+    sleep_wakeups_pending[ArchGetCurrentCpuIndex()] = false;
+    LowerIrql(irql);
+
     if (GetThread() == NULL) {
         return;
     }
 
     LockScheduler();
-    if (sleep_wakeups_posted > 0) {
-        --sleep_wakeups_posted;
-    }
-
-    uint64_t system_time = *((uint64_t*) sys_time_ptr);
+    TimerWheelAdvance(&timer_wheel, GetSystemTimer() >> TIMER_TICK_SHIFT);
+    UnlockScheduler();
+}
 
-    HandleAlarms(system_time);
+/**
+ * Waits for an interrupt with the periodic timer turned off, so that an idle
+ * CPU only gets woken up when there is something for it to do. The timer is set
+ * to go off once, when the next sleep or alarm is due.
+ *
+ * Called by the idle thread at IRQL_SCHEDULER, so that if an interrupt makes a
+ * thread ready, we don't switch to it until the timer is back to normal.
+ */
+void IdleUntilNextTimerEvent(void) {
+    EXACT_IRQL(IRQL_SCHEDULER);
 
-    struct thread* iter = sleep_list.head;
-    while (iter) {
-        if (iter->sleep_expiry <= system_time || iter->signal_intr) {
-            ThreadListDelete(&sleep_list, iter);
-            iter->timed_out = true;
-            iter->timed_out_due_to_signal = iter->signal_intr;
-            UnblockThread(iter);
-            iter = sleep_list.head;     // restart, as list changed
+    LockScheduler();
+    uint64_t next_tick = TimerWheelGetNextEvent(&timer_wheel);
+    UnlockScheduler();
 
-        } else {
-            iter = iter->next[NEXT_INDEX_SLEEP];
-        }
+    uint64_t time = GetSystemTimer();
+    uint64_t wait = MAX_TICKLESS_IDLE_NS;
+    if (next_tick != TIMER_WHEEL_NO_EVENT) {
+        uint64_t deadline = next_tick << TIMER_TICK_SHIFT;
+        wait = deadline <= time ? 0 : MIN(wait, deadline - time);
     }
 
-    UnlockScheduler();
+    /*
+     * If an interrupt has left work for us, do that instead. Interrupts must be
+     * off so one can't sneak in between checking and waiting.
+     */
+    ArchDisableInterrupts();
+    if (GetCpu()->postponed_task_switch || GetNumberInDeferQueue() > 0) {
+        ArchEnableInterrupts();
+        return;
+    }
+    ArchIdleWithOneShotTimer(wait);
 }
 
 int SleepUntil(uint64_t system_time_ns) {
@@ -169,23 +473,23 @@ int CreateAlarmAbsolute(uint64_t system_time_ns, void (*callback)(void*), void*
     }
 
     LockScheduler();
-    if (num_alarms_installed >= MAX_ALARMS) {
+    if (first_free_alarm == -1) {
         UnlockScheduler();
         *id_out = -1;
         return EAGAIN;
     }
 
-    for (int i = 0; i < MAX_ALARMS; ++i) {
-        if (alarms[i].wakeup_time == 0) {
-            alarms[i].wakeup_time = system_time_ns;
-            alarms[i].arg = arg;
-            alarms[i].callback = callback;
-            *id_out = i;
-            break;
-        }
-    }
+    int id = first_free_alarm;
+    struct alarm* alarm = &alarms[id];
+    first_free_alarm = alarm->next_free;
 
-    ++num_alarms_installed;
+    alarm->wakeup_time = system_time_ns;
+    alarm->callback = callback;
+    alarm->arg = arg;
+    alarm->state = ALARM_PENDING;
+    TimerWheelEntryInit(&alarm->timer, AlarmExpired, alarm);
+    TimerWheelInsert(&timer_wheel, &alarm->timer, NanosToTicks(system_time_ns));
+    *id_out = id;
 
     UnlockScheduler();
     return 0;
@@ -203,10 +507,14 @@ static int UpdateAlarm(int id, uint64_t* time_left_out, bool destroy) {
     uint64_t sys_time = GetSystemTimer();
     int retv = 0;
 
-    if (alarms[id].wakeup_time == 0) {
+    struct alarm* alarm = &alarms[id];
+    if (alarm->state == ALARM_FREE) {
         retv = EINVAL;
     } else {
-        if (alarms[id].wakeup_time <= sys_time) {
+        if (alarm->state == ALARM_EXPIRED) {
+            *time_left_out = 0;
+
+        } else if (alarm->wakeup_time <= sys_time) {
             /*
              * In the time that they called `DestoryAlarm`, it went off. That's
              * an odd situation, so just pretend it's still got a nanosecond to
@@ -214,14 +522,15 @@ static int UpdateAlarm(int id, uint64_t* time_left_out, bool destroy) {
              */
             *time_left_out = 1;
 
-        } else if (alarms[id].wakeup_time == EXPIRED_ALARM) {
-            *time_left_out = 0;
         } else {
-            *time_left_out = alarms[id].wakeup_time - sys_time;
+            *time_left_out = alarm->wakeup_time - sys_time;
         }
 
         if (destroy) {
-            alarms[id].wakeup_time = 0;
+            TimerWheelCancel(&timer_wheel, &alarm->timer);
+            alarm->state = ALARM_FREE;
+            alarm->next_free = first_free_alarm;
+            first_free_alarm = id;
         }
     }
 
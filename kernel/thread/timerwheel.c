@@ -0,0 +1,196 @@
+
+/*
+ * thread/timerwheel.c - Hierarchical Timer Wheel
+ *
+ * Keeps track of timers so that adding and cancelling one is constant time, and
+ * each tick only has to look at the timers that are actually due. Level 0 has
+ * one slot per tick. Each slot on a higher level covers a whole revolution of
+ * the level below, and its timers get moved down ('cascaded') when the level
+ * below wraps around to the start of that slot.
+ *
+ * A timer wheel has no locking of its own - the owner must provide it. Timer
+ * handlers get called with that lock still held.
+ */
+
+#include <common.h>
+#include <timerwheel.h>
+#include <assert.h>
+#include <string.h>
+
+#define SLOT_MASK               (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level)      ((level) * TIMER_WHEEL_SLOT_BITS)
+#define MAX_DELTA               ((1ULL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+void TimerWheelInit(struct timer_wheel* wheel, uint64_t current_tick) {
+    inline_memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel->next_tick = current_tick;
+}
+
+void TimerWheelEntryInit(struct timer_wheel_entry* entry, void (*handler)(void*), void* context) {
+    inline_memset(entry, 0, sizeof(struct timer_wheel_entry));
+    entry->handler = handler;
+    entry->context = context;
+}
+
+/*
+ * Puts an entry on the level that can hold it without it being due before that
+ * slot gets looked at. Timers too far away to fit get put as far out as
+ * possible, and will get placed again when they are cascaded.
+ */
+static void PlaceEntry(struct timer_wheel* wheel, struct timer_wheel_entry* entry) {
+    uint64_t position = entry->expiry < wheel->next_tick ? wheel->next_tick : entry->expiry;
+    uint64_t delta = position - wheel->next_tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        position = wheel->next_tick + MAX_DELTA;
+    }
+
+    int level = 0;
+    while (delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+        ++level;
+    }
+
+    struct timer_wheel_entry** slot = &wheel->slots[level][(position >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    entry->slot = slot;
+    entry->prev = NULL;
+    entry->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = entry;
+    }
+    *slot = entry;
+}
+
+static void UnlinkEntry(struct timer_wheel_entry* entry) {
+    if (entry->prev == NULL) {
+        *entry->slot = entry->next;
+    } else {
+        entry->prev->next = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    }
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->slot = NULL;
+}
+
+/**
+ * Adds a timer to the wheel. If the expiry has already passed, it goes off on
+ * the next call to TimerWheelAdvance().
+ *
+ * @param entry A timer that isn't already pending.
+ * @param expiry The tick on which the timer's handler should be called.
+ */
+void TimerWheelInsert(struct timer_wheel* wheel, struct timer_wheel_entry* entry, uint64_t expiry) {
+    assert(!entry->pending);
+    entry->expiry = expiry;
+    entry->pending = true;
+    PlaceEntry(wheel, entry);
+    wheel->num_pending++;
+}
+
+/**
+ * Removes a timer from the wheel before it goes off.
+ *
+ * @return True if the timer was removed, or false if it wasn't pending (e.g.
+ *         because it has already gone off).
+ */
+bool TimerWheelCancel(struct timer_wheel* wheel, struct timer_wheel_entry* entry) {
+    if (!entry->pending) {
+        return false;
+    }
+    UnlinkEntry(entry);
+    entry->pending = false;
+    wheel->num_pending--;
+    return true;
+}
+
+static void Cascade(struct timer_wheel* wheel, int level) {
+    struct timer_wheel_entry** slot = &wheel->slots[level][(wheel->next_tick >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    struct timer_wheel_entry* entry = *slot;
+    *slot = NULL;
+
+    while (entry != NULL) {
+        struct timer_wheel_entry* next = entry->next;
+        PlaceEntry(wheel, entry);
+        entry = next;
+    }
+}
+
+/**
+ * Calls the handlers of all timers due on or before a given tick.
+ */
+void TimerWheelAdvance(struct timer_wheel* wheel, uint64_t current_tick) {
+    while (wheel->next_tick <= current_tick) {
+        if (wheel->num_pending == 0) {
+            wheel->next_tick = current_tick + 1;
+            return;
+        }
+
+        uint64_t tick = wheel->next_tick;
+
+        /*
+         * When a level wraps around, bring down the next slot of the level
+         * above it.
+         */
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if ((tick & ((1ULL << LEVEL_SHIFT(level)) - 1)) != 0) {
+                break;
+            }
+            Cascade(wheel, level);
+        }
+
+        /*
+         * Take the whole slot off the wheel first, so that anything a handler
+         * adds goes off on a later tick, even if it lands in this same slot.
+         * The handlers can still cancel the other expired timers.
+         */
+        wheel->next_tick = tick + 1;
+
+        struct timer_wheel_entry* expired = wheel->slots[0][tick & SLOT_MASK];
+        wheel->slots[0][tick & SLOT_MASK] = NULL;
+        for (struct timer_wheel_entry* entry = expired; entry != NULL; entry = entry->next) {
+            entry->slot = &expired;
+        }
+
+        while (expired != NULL) {
+            struct timer_wheel_entry* entry = expired;
+            UnlinkEntry(entry);
+            entry->pending = false;
+            wheel->num_pending--;
+            entry->handler(entry->context);
+        }
+    }
+}
+
+/**
+ * Finds the first tick on which TimerWheelAdvance() will have something to do,
+ * either calling a handler or cascading a timer down a level. Nothing can go
+ * off before then, although it might be that nothing goes off then either.
+ *
+ * @return The tick, or TIMER_WHEEL_NO_EVENT if there are no timers at all.
+ */
+uint64_t TimerWheelGetNextEvent(struct timer_wheel* wheel) {
+    if (wheel->num_pending == 0) {
+        return TIMER_WHEEL_NO_EVENT;
+    }
+
+    uint64_t first = TIMER_WHEEL_NO_EVENT;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        /*
+         * The first time this level gets looked at, and which slot that is.
+         */
+        uint64_t step = 1ULL << LEVEL_SHIFT(level);
+        uint64_t tick = (wheel->next_tick + step - 1) & ~(step - 1);
+        int index = (tick >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+        for (int i = 0; i < TIMER_WHEEL_SLOTS && tick < first; ++i, tick += step) {
+            if (wheel->slots[level][(index + i) & SLOT_MASK] != NULL) {
+                first = tick;
+                break;
+            }
+        }
+    }
+
+    return first;
+}
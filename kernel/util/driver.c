@@ -1,6 +1,6 @@
 #include <arch.h>
 #include <driver.h>
-#include <semaphore.h>
+#include <rwlock.h>
 #include <irql.h>
 #include <tree.h>
 #include <string.h>
@@ -15,9 +15,15 @@
 #include <ctype.h>
 #include <assert.h>
 
-static struct semaphore* driver_table_lock;
-static struct semaphore* symbol_table_lock;
-static struct tree* loaded_drivers;
+/*
+ * Both tables are only changed when a driver gets loaded, so lookups only need
+ * to take the locks for reading. The loaded drivers are kept in two trees, as
+ * we need to look them up by both name and address.
+ */
+static struct rwlock* driver_table_lock;
+static struct rwlock* symbol_table_lock;
+static struct tree* loaded_drivers_by_name;
+static struct tree* loaded_drivers_by_address;
 static struct tree* symbol_table;
 
 struct symbol {
@@ -58,8 +64,7 @@ static int RelocationTableComparator(const void* a, const void* b) {
 static size_t GetDriverAddressWithLockHeld(const char* name) {
     struct loaded_driver dummy = {.filename = (char*) name};
 
-    TreeSetComparator(loaded_drivers, DriverTableComparatorByName);
-    struct loaded_driver* res = TreeGet(loaded_drivers, &dummy);
+    struct loaded_driver* res = TreeGet(loaded_drivers_by_name, &dummy);
     if (res == NULL) {
         return 0;
     }
@@ -67,30 +72,32 @@ static size_t GetDriverAddressWithLockHeld(const char* name) {
 }
 
 static struct loaded_driver* GetDriverFromAddress(size_t relocation_point) {
-    AcquireMutex(driver_table_lock, -1);
+    AcquireRwLockRead(driver_table_lock);
 
-    TreeSetComparator(loaded_drivers, DriverTableComparatorByRelocationPoint);
     struct loaded_driver dummy = {.relocation_point = relocation_point};
-    struct loaded_driver* res = TreeGet(loaded_drivers, &dummy);
+    struct loaded_driver* res = TreeGet(loaded_drivers_by_address, &dummy);
 
-    ReleaseMutex(driver_table_lock);
+    ReleaseRwLockRead(driver_table_lock);
     return res;
 }
 
 size_t GetDriverAddress(const char* name) {
     EXACT_IRQL(IRQL_STANDARD);   
 
-    AcquireMutex(driver_table_lock, -1);
+    AcquireRwLockRead(driver_table_lock);
     size_t res = GetDriverAddressWithLockHeld(name);
-    ReleaseMutex(driver_table_lock);
+    ReleaseRwLockRead(driver_table_lock);
     return res;
 }
 
 void InitSymbolTable(void) {
-    driver_table_lock = CreateMutex("drv table");
-    symbol_table_lock = CreateMutex("sym table");
+    driver_table_lock = CreateRwLock("drv table");
+    symbol_table_lock = CreateRwLock("sym table");
 
-    loaded_drivers = TreeCreate();
+    loaded_drivers_by_name = TreeCreate();
+    TreeSetComparator(loaded_drivers_by_name, DriverTableComparatorByName);
+    loaded_drivers_by_address = TreeCreate();
+    TreeSetComparator(loaded_drivers_by_address, DriverTableComparatorByRelocationPoint);
     symbol_table = TreeCreate();
     TreeSetComparator(symbol_table, SymbolComparator);
 
@@ -122,7 +129,7 @@ void AddSymbol(const char* symbol, size_t address) {
     entry->name = strdup(symbol);
     entry->addr = address;
 
-    AcquireMutex(symbol_table_lock, -1);
+    AcquireRwLockWrite(symbol_table_lock);
     if (TreeContains(symbol_table, entry)) {
         /*
          * The kernel has some symbols declared 'static' to file scope, with
@@ -139,7 +146,7 @@ void AddSymbol(const char* symbol, size_t address) {
     } else {
         TreeInsert(symbol_table, entry);
     }
-    ReleaseMutex(symbol_table_lock);
+    ReleaseRwLockWrite(symbol_table_lock);
 }
 
 size_t GetSymbolAddress(const char* symbol) {
@@ -147,9 +154,9 @@ size_t GetSymbolAddress(const char* symbol) {
 
     struct symbol dummy = {.name = symbol};
 
-    AcquireMutex(symbol_table_lock, -1);
+    AcquireRwLockRead(symbol_table_lock);
     struct symbol* result = TreeGet(symbol_table, &dummy);
-    ReleaseMutex(symbol_table_lock);
+    ReleaseRwLockRead(symbol_table_lock);
 
     if (result == NULL) {
         return 0;
@@ -178,7 +185,8 @@ static int LoadDriver(const char* name) {
 
     assert(drv->relocation_table != NULL);
 
-    TreeInsert(loaded_drivers, drv);
+    TreeInsert(loaded_drivers_by_name, drv);
+    TreeInsert(loaded_drivers_by_address, drv);
     ArchLoadSymbols(file, drv->relocation_point);
     return 0;
 }
@@ -188,10 +196,10 @@ int RequireDriver(const char* name) {
 
     LogWriteSerial("Requiring driver: %s\n", name);
 
-    AcquireMutex(driver_table_lock, -1);
+    AcquireRwLockWrite(driver_table_lock);
 
     if (GetDriverAddressWithLockHeld(name) != 0) {
-        ReleaseMutex(driver_table_lock);
+        ReleaseRwLockWrite(driver_table_lock);
 
         /*
          * Not an error that it's already loaded - ideally no one should care if it has already been loaded
@@ -201,7 +209,7 @@ int RequireDriver(const char* name) {
     }
 
     int res = LoadDriver(name);
-    ReleaseMutex(driver_table_lock);
+    ReleaseRwLockWrite(driver_table_lock);
     return res;
 }
 
@@ -48,6 +48,7 @@ static const char* message_table[_PANIC_HIGHEST_VALUE] = {
 	[PANIC_CONFLICTING_ALLOCATION_REQUIREMENTS]	= "conflicting heap allocation requirements",
 	[PANIC_BUS_FAULT]							= "hardware error on bus",
 	[PANIC_MEMORY_FAULT]						= "hardware error with memory",
+	[PANIC_DEFERRED_QUEUE_FULL]					= "too much deferred work",
 };
 
 static void (*graphical_panic_handler)(int, const char*) = NULL;
@@ -1,22 +1,21 @@
 
 #include <video.h>
 #include <message.h>
-#include <spinlock.h>
-#include <irql.h>
 
 static struct msgbox* video_mbox;
-static struct spinlock lock;
 
 void InitVideoConsole(struct msgbox* mbox) {
     video_mbox = mbox;
-    InitSpinlock(&lock, "video", IRQL_SCHEDULER);
 }
 
+/*
+ * The message box has its own lock, so nothing else is needed here. Callers at
+ * IRQL_STANDARD wait for space if the console falls behind, and only those 
+ * that can't block lose their output.
+ */
 void SendVideoMessage(struct video_msg msg) {
     if (video_mbox != NULL) {
-        AcquireSpinlock(&lock);
         SendMessage(video_mbox, &msg);
-        ReleaseSpinlock(&lock);
     }
 }
 
@@ -0,0 +1,460 @@
+
+/*
+ * vfs/asyncio.c - Asynchronous I/O Rings
+ *
+ * Lets a process queue up reads and writes in memory it shares with the kernel,
+ * and hand over a whole batch of them with one system call. A few worker
+ * threads, which run in the process' address space, take requests off the
+ * queue, perform them with the normal vnode operations, and post the results to
+ * the completion queue. As several requests can be in progress at once, a
+ * single thread can keep a disk busy without waiting on each request.
+ *
+ * The process can change the ring whenever it likes, so the kernel keeps its
+ * own copy of the indices it owns (`sq_head` and `cq_tail`), and always goes
+ * through a transfer to access the ring memory.
+ */
+
+#include <asyncio.h>
+#include <sys/ioring.h>
+#include <semaphore.h>
+#include <linkedlist.h>
+#include <transfer.h>
+#include <filedes.h>
+#include <polltable.h>
+#include <thread.h>
+#include <vnode.h>
+#include <file.h>
+#include <heap.h>
+#include <timer.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <irql.h>
+#include <assert.h>
+
+#define AIO_RING_WORKERS 4
+
+/*
+ * Pipes and terminals might never become ready, which would stop the ring from
+ * ever being destroyed. Workers wait on them with a timeout instead, and give
+ * up if the ring is being destroyed.
+ */
+#define AIO_RING_POLL_MS 100
+
+struct aio_request {
+    struct io_ring_sqe sqe;
+    struct file* file;
+};
+
+struct aio_ring {
+    struct vas* vas;
+    struct fd_table* fd_table;
+    uint8_t* memory;
+    bool user;
+    uint32_t entries;
+
+    /*
+     * Guards everything below.
+     */
+    struct semaphore* lock;
+    uint32_t sq_head;
+    uint32_t cq_tail;
+
+    /*
+     * Requests which have been taken off the submission queue, but haven't had
+     * their completion posted yet. Each one has a completion slot saved for it.
+     */
+    uint32_t in_flight;
+    int waiters;
+    volatile bool closing;
+    struct linked_list* queue;
+
+    /*
+     * Released once for each request put on the queue, for each waiter when a
+     * completion gets posted, and by each worker as it exits.
+     */
+    struct semaphore* work;
+    struct semaphore* completed;
+    struct semaphore* exited;
+};
+
+static size_t GetSubmissionQueueOffset(void) {
+    return (sizeof(struct io_ring) + 15) & ~15;
+}
+
+static size_t GetCompletionQueueOffset(int entries) {
+    return GetSubmissionQueueOffset() + sizeof(struct io_ring_sqe) * entries;
+}
+
+/**
+ * Returns how many bytes of memory a ring with the given number of entries
+ * needs.
+ */
+size_t GetAioRingSize(int entries) {
+    return GetCompletionQueueOffset(entries) + sizeof(struct io_ring_cqe) * entries;
+}
+
+/*
+ * Creates a transfer for memory belonging to the ring's owner - either the ring
+ * itself or a request's buffer. If `into_kernel` is set, the transfer copies
+ * out of that memory, otherwise it copies into it.
+ */
+static struct transfer CreateRingTransfer(struct aio_ring* ring, void* address, size_t length, uint64_t offset, bool into_kernel) {
+    if (!ring->user) {
+        return CreateKernelTransfer(address, length, offset, into_kernel ? TRANSFER_WRITE : TRANSFER_READ);
+    } else if (into_kernel) {
+        return CreateTransferReadingFromUser(address, length, offset);
+    } else {
+        return CreateTransferWritingToUser(address, length, offset);
+    }
+}
+
+static int AccessRing(struct aio_ring* ring, size_t offset, void* data, size_t size, bool write) {
+    struct transfer tr = CreateRingTransfer(ring, ring->memory + offset, size, 0, !write);
+    return PerformTransfer(data, &tr, size);
+}
+
+/*
+ * Works out how many more requests can be taken without running out of
+ * completion slots. The lock must be held.
+ */
+static int GetCompletionSpace(struct aio_ring* ring, uint32_t* space) {
+    uint32_t cq_head;
+    int res = AccessRing(ring, offsetof(struct io_ring, cq_head), &cq_head, sizeof(uint32_t), false);
+    if (res != 0) {
+        return res;
+    }
+
+    /*
+     * If the process has put a bad value in `cq_head`, treating the queue as
+     * full stops anything being overwritten.
+     */
+    uint32_t pending = ring->cq_tail - cq_head;
+    if (pending > ring->entries || pending + ring->in_flight >= ring->entries) {
+        *space = 0;
+    } else {
+        *space = ring->entries - pending - ring->in_flight;
+    }
+    return 0;
+}
+
+/*
+ * Fills in the next completion slot for a request that was in flight, and
+ * wakes anyone waiting for completions. The lock must be held.
+ */
+static void PostCompletion(struct aio_ring* ring, uint64_t user_data, size_t transferred, int error) {
+    assert(ring->in_flight > 0);
+
+    struct io_ring_cqe cqe = {
+        .user_data = user_data,
+        .transferred = transferred,
+        .error = error,
+    };
+
+    /*
+     * If the process has unmapped its own ring there's nowhere for the result
+     * to go, but the slot still counts as used.
+     */
+    size_t offset = GetCompletionQueueOffset(ring->entries) + sizeof(struct io_ring_cqe) * (ring->cq_tail & (ring->entries - 1));
+    AccessRing(ring, offset, &cqe, sizeof(struct io_ring_cqe), true);
+    ring->cq_tail++;
+    AccessRing(ring, offsetof(struct io_ring, cq_tail), &ring->cq_tail, sizeof(uint32_t), true);
+    ring->in_flight--;
+
+    if (ring->waiters > 0) {
+        ReleaseSemaphoreEx(ring->completed, ring->waiters);
+        ring->waiters = 0;
+    }
+}
+
+/*
+ * Reads or writes the file. Regular files and disks always finish eventually,
+ * so can block as normal, but anything else gets polled so the worker notices
+ * if the ring is destroyed.
+ */
+static int PerformAioRequest(struct aio_ring* ring, struct aio_request* req, size_t* transferred) {
+    struct file* file = req->file;
+    struct vnode* node = file->node;
+    bool write = req->sqe.opcode == IO_RING_OP_WRITE;
+
+    if ((!write && !file->can_read) || (write && !file->can_write)) {
+        return EBADF;
+    }
+
+    bool use_seek_position = req->sqe.offset == IO_RING_SEEK_POSITION;
+    uint64_t offset = req->sqe.offset;
+    if (write && (file->flags & O_APPEND)) {
+        offset = node->stat.st_size;
+    } else if (use_seek_position) {
+        offset = file->seek_position;
+    }
+
+    struct transfer io = CreateRingTransfer(ring, req->sqe.buffer, req->sqe.length, offset, write);
+    int type = IFTODT(node->stat.st_mode);
+    bool nonblocking = node->flags & O_NONBLOCK;
+    bool needs_polling = !nonblocking && (type == DT_FIFO || type == DT_CHR);
+    io.blockable = !nonblocking && !needs_polling;
+
+    int res;
+    while (true) {
+        res = (write ? VnodeOpWrite : VnodeOpRead)(node, &io);
+        if (res != EAGAIN || !needs_polling) {
+            break;
+        }
+
+        int events = write ? VNODE_WAIT_WRITE : VNODE_WAIT_READ;
+        int revents;
+        int ready;
+        res = PollVnodes(&node, &events, &revents, 1, AIO_RING_POLL_MS, &ready);
+        if (res != 0) {
+            break;
+        }
+        if (ring->closing) {
+            res = ECANCELED;
+            break;
+        }
+    }
+
+    *transferred = req->sqe.length - io.length_remaining;
+    if (use_seek_position) {
+        file->seek_position = offset + *transferred;
+    }
+    return res;
+}
+
+static void AioWorker(void* arg) {
+    struct aio_ring* ring = arg;
+
+    while (true) {
+        AcquireSemaphore(ring->work, -1);
+        AcquireMutex(ring->lock, -1);
+        if (ring->closing) {
+            ReleaseMutex(ring->lock);
+            break;
+        }
+        struct aio_request* req = ListGetData(ring->queue, 0);
+        ListDeleteIndex(ring->queue, 0);
+        ReleaseMutex(ring->lock);
+
+        size_t transferred = 0;
+        int res = PerformAioRequest(ring, req, &transferred);
+
+        AcquireMutex(ring->lock, -1);
+        PostCompletion(ring, req->sqe.user_data, transferred, res);
+        ReleaseMutex(ring->lock);
+
+        DereferenceFile(req->file);
+        FreeHeap(req);
+    }
+
+    ReleaseSemaphore(ring->exited);
+    TerminateThread(GetThread());
+}
+
+/**
+ * Sets up a ring in memory that has already been mapped, and starts its
+ * workers. The memory must be at least GetAioRingSize() bytes, and stay
+ * mapped until the ring is destroyed.
+ *
+ * @param vas      The address space that the memory, and the buffers of any
+ *                 requests, are in.
+ * @param fd_table Where to look up the file descriptors in requests.
+ * @param entries  The number of slots in each queue, which must be a power of
+ *                 two, and no more than IO_RING_MAX_ENTRIES.
+ * @param user     Whether the memory and buffers belong to usermode.
+ */
+struct aio_ring* CreateAioRing(struct vas* vas, struct fd_table* fd_table, void* memory, int entries, bool user) {
+    EXACT_IRQL(IRQL_STANDARD);
+    assert(entries > 0 && entries <= IO_RING_MAX_ENTRIES && (entries & (entries - 1)) == 0);
+
+    struct aio_ring* ring = AllocHeap(sizeof(struct aio_ring));
+    *ring = (struct aio_ring) {
+        .vas = vas,
+        .fd_table = fd_table,
+        .memory = memory,
+        .user = user,
+        .entries = entries,
+        .lock = CreateMutex("aio ring"),
+        .sq_head = 0,
+        .cq_tail = 0,
+        .in_flight = 0,
+        .waiters = 0,
+        .closing = false,
+        .queue = ListCreate(),
+        .work = CreateSemaphore("aio work", SEM_BIG_NUMBER, SEM_BIG_NUMBER),
+        .completed = CreateSemaphore("aio completed", SEM_BIG_NUMBER, SEM_BIG_NUMBER),
+        .exited = CreateSemaphore("aio exited", AIO_RING_WORKERS, AIO_RING_WORKERS),
+    };
+
+    struct io_ring header = {
+        .sq_head = 0,
+        .sq_tail = 0,
+        .cq_head = 0,
+        .cq_tail = 0,
+        .entries = entries,
+        .sq_offset = GetSubmissionQueueOffset(),
+        .cq_offset = GetCompletionQueueOffset(entries),
+    };
+    AccessRing(ring, 0, &header, sizeof(struct io_ring), true);
+
+    for (int i = 0; i < AIO_RING_WORKERS; ++i) {
+        CreateThreadEx(AioWorker, ring, vas, "aio", NULL, SCHEDULE_POLICY_FIXED, FIXED_PRIORITY_KERNEL_NORMAL, 0);
+    }
+    return ring;
+}
+
+/**
+ * Takes up to `to_submit` requests off the submission queue, and hands them to
+ * the workers. It stops early if the submission queue is empty, or if there
+ * isn't room to post any more completions. Requests which fail straight away
+ * (e.g. due to a bad file descriptor), and no-ops, have their completions
+ * posted before this returns.
+ *
+ * @param submitted_out Set to the number of requests taken.
+ * @return 0 on success, or EINVAL if the ring memory can't be accessed.
+ */
+int SubmitToAioRing(struct aio_ring* ring, uint32_t to_submit, uint32_t* submitted_out) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    AcquireMutex(ring->lock, -1);
+
+    uint32_t sq_tail;
+    uint32_t space;
+    uint32_t submitted = 0;
+    int res = AccessRing(ring, offsetof(struct io_ring, sq_tail), &sq_tail, sizeof(uint32_t), false);
+    if (res == 0) {
+        res = GetCompletionSpace(ring, &space);
+    }
+
+    while (res == 0 && submitted < to_submit && ring->sq_head != sq_tail && space > 0) {
+        struct aio_request* req = AllocHeap(sizeof(struct aio_request));
+        size_t offset = GetSubmissionQueueOffset() + sizeof(struct io_ring_sqe) * (ring->sq_head & (ring->entries - 1));
+        res = AccessRing(ring, offset, &req->sqe, sizeof(struct io_ring_sqe), false);
+        if (res != 0) {
+            FreeHeap(req);
+            break;
+        }
+
+        ring->sq_head++;
+        ring->in_flight++;
+        --space;
+        ++submitted;
+
+        int error = 0;
+        if (req->sqe.opcode != IO_RING_OP_NOP && req->sqe.opcode != IO_RING_OP_READ && req->sqe.opcode != IO_RING_OP_WRITE) {
+            error = EINVAL;
+        } else if (req->sqe.opcode != IO_RING_OP_NOP && GetFileFromFd(ring->fd_table, req->sqe.fd, &req->file) != 0) {
+            error = EBADF;
+        }
+
+        if (error != 0 || req->sqe.opcode == IO_RING_OP_NOP) {
+            PostCompletion(ring, req->sqe.user_data, 0, error);
+            FreeHeap(req);
+            continue;
+        }
+
+        /*
+         * Stops the file going away if the process closes it while the request
+         * is still waiting or in progress.
+         */
+        ReferenceFile(req->file);
+        ListInsertEnd(ring->queue, req);
+        ReleaseSemaphore(ring->work);
+    }
+
+    if (submitted > 0) {
+        AccessRing(ring, offsetof(struct io_ring, sq_head), &ring->sq_head, sizeof(uint32_t), true);
+    }
+    ReleaseMutex(ring->lock);
+
+    *submitted_out = submitted;
+    return res;
+}
+
+/**
+ * Waits until there are at least `min_complete` completions which the process
+ * hasn't dealt with yet. It stops waiting early if nothing else is in flight,
+ * as no more completions could arrive.
+ *
+ * @param timeout_ms How long to wait, or -1 to wait forever.
+ * @return 0 on success (including if the timeout expires), or EINVAL if the
+ *         ring memory can't be accessed.
+ */
+int WaitForAioRing(struct aio_ring* ring, uint32_t min_complete, int timeout_ms) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    uint64_t deadline = GetSystemTimer() + ((uint64_t) timeout_ms) * 1000000ULL;
+    int res = 0;
+
+    AcquireMutex(ring->lock, -1);
+    while (true) {
+        uint32_t cq_head;
+        res = AccessRing(ring, offsetof(struct io_ring, cq_head), &cq_head, sizeof(uint32_t), false);
+        if (res != 0 || ring->cq_tail - cq_head >= min_complete || ring->in_flight == 0) {
+            break;
+        }
+
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            uint64_t now = GetSystemTimer();
+            if (now >= deadline) {
+                break;
+            }
+            wait_ms = (int) ((deadline - now + 999999) / 1000000);
+        }
+
+        /*
+         * A completion could get posted between letting go of the lock and
+         * blocking, but the semaphore will still have been released, so it
+         * doesn't get missed. Stale wakeups from earlier timeouts just mean
+         * going round the loop again.
+         */
+        ring->waiters++;
+        ReleaseMutex(ring->lock);
+        res = AcquireSemaphore(ring->completed, wait_ms);
+        AcquireMutex(ring->lock, -1);
+
+        if (res == ETIMEDOUT) {
+            res = 0;
+            break;
+        } else if (res != 0) {
+            break;
+        }
+    }
+    ReleaseMutex(ring->lock);
+
+    return res;
+}
+
+/**
+ * Stops a ring's workers and frees it. Requests which are still waiting are
+ * thrown away, ones on pipes and terminals are cancelled, and any others are
+ * allowed to finish first. The ring memory isn't unmapped, and nothing gets
+ * posted to it once this returns.
+ */
+void DestroyAioRing(struct aio_ring* ring) {
+    EXACT_IRQL(IRQL_STANDARD);
+
+    AcquireMutex(ring->lock, -1);
+    ring->closing = true;
+    ReleaseMutex(ring->lock);
+
+    ReleaseSemaphoreEx(ring->work, AIO_RING_WORKERS);
+    for (int i = 0; i < AIO_RING_WORKERS; ++i) {
+        AcquireSemaphore(ring->exited, -1);
+    }
+
+    while (ListSize(ring->queue) > 0) {
+        struct aio_request* req = ListGetData(ring->queue, 0);
+        ListDeleteIndex(ring->queue, 0);
+        DereferenceFile(req->file);
+        FreeHeap(req);
+    }
+
+    ListDestroy(ring->queue);
+    DestroyMutex(ring->lock);
+    DestroySemaphore(ring->work, SEM_DONT_CARE);
+    DestroySemaphore(ring->completed, SEM_DONT_CARE);
+    DestroySemaphore(ring->exited, SEM_DONT_CARE);
+    FreeHeap(ring);
+}
@@ -2,7 +2,7 @@
 #include <errno.h>
 #include <string.h>
 #include <common.h>
-#include <semaphore.h>
+#include <rwlock.h>
 #include <vfs.h>
 #include <fcntl.h>
 #include <log.h>
@@ -15,8 +15,12 @@ struct fd {
     int flags;              /* FD_CLOEXEC ( == O_CLOEXEC for this OS)*/
 };
 
+/*
+ * Most accesses to the table are just looking up a file descriptor on a read
+ * or write, so those can be done in parallel.
+ */
 struct fd_table {
-    struct semaphore* lock;
+    struct rwlock* lock;
     struct fd* entries;
 };
 
@@ -27,7 +31,7 @@ struct fd_table* CreateFdTable(void) {
 
     struct fd_table* table = AllocHeap(sizeof(struct fd_table));
 
-    table->lock = CreateMutex("filedes");
+    table->lock = CreateRwLock("filedes");
     table->entries = MapVirtEasy(TABLE_SIZE, true);
 
     for (int i = 0; i < PROC_MAX_FD; ++i) {
@@ -42,9 +46,9 @@ struct fd_table* CopyFdTable(struct fd_table* original) {
 
     struct fd_table* new_table = CreateFdTable();
 
-    AcquireMutex(original->lock, -1);
+    AcquireRwLockRead(original->lock);
     memcpy(new_table->entries, original->entries, TABLE_SIZE);
-    ReleaseMutex(original->lock);
+    ReleaseRwLockRead(original->lock);
     
     return new_table;
 }
@@ -52,7 +56,7 @@ struct fd_table* CopyFdTable(struct fd_table* original) {
 void DestroyFdTable(struct fd_table* table) {
     EXACT_IRQL(IRQL_STANDARD);
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockWrite(table->lock);
 
     for (int i = 0; i < PROC_MAX_FD; ++i) {
         if (table->entries[i].file != NULL) {
@@ -62,8 +66,8 @@ void DestroyFdTable(struct fd_table* table) {
 
     UnmapVirt((size_t) table->entries, TABLE_SIZE);
 
-    ReleaseMutex(table->lock);
-    DestroyMutex(table->lock);
+    ReleaseRwLockWrite(table->lock);
+    DestroyRwLock(table->lock);
 }
 
 int CreateFd(struct fd_table* table, struct file* file, int* fd_out, int flags) {
@@ -73,38 +77,38 @@ int CreateFd(struct fd_table* table, struct file* file, int* fd_out, int flags)
         return EINVAL;
     }
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockWrite(table->lock);
 
     for (int i = 0; i < PROC_MAX_FD; ++i) {
         if (table->entries[i].file == NULL) {
             table->entries[i].file = file;
             table->entries[i].flags = flags;
-            ReleaseMutex(table->lock);
+            ReleaseRwLockWrite(table->lock);
             *fd_out = i;
             LogWriteSerial("Creating fd... file = [0x%X, 0x%X], fd = %d\n", file, file->node, i);
             return 0;
         }
     }
 
-    ReleaseMutex(table->lock);
+    ReleaseRwLockWrite(table->lock);
     return EMFILE;
 }
 
 int RemoveFd(struct fd_table* table, struct file* file) {
     EXACT_IRQL(IRQL_STANDARD);
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockWrite(table->lock);
 
     for (int i = 0; i < PROC_MAX_FD; ++i) {
         if (table->entries[i].file == file) {
             table->entries[i].file = NULL;
             LogWriteSerial("Removing fd... file = [0x%X, 0x%X], fd = %d\n", file, file->node, i);
-            ReleaseMutex(table->lock);
+            ReleaseRwLockWrite(table->lock);
             return 0;
         }
     }
 
-    ReleaseMutex(table->lock);
+    ReleaseRwLockWrite(table->lock);
     return EINVAL;
 }
 
@@ -116,18 +120,25 @@ int GetFileFromFd(struct fd_table* table, int fd, struct file** out) {
         return out == NULL ? EINVAL : EBADF;
     }
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockRead(table->lock);
     struct file* result = table->entries[fd].file;
-    ReleaseMutex(table->lock);
+    ReleaseRwLockRead(table->lock);
 
     *out = result;
     return result == NULL ? EBADF : 0;
 }
 
+static struct file* GetFileFromFdWithLockHeld(struct fd_table* table, int fd) {
+    if (fd < 0 || fd >= PROC_MAX_FD) {
+        return NULL;
+    }
+    return table->entries[fd].file;
+}
+
 int HandleExecFd(struct fd_table* table) {
     EXACT_IRQL(IRQL_STANDARD);
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockWrite(table->lock);
 
     for (int i = 0; i < PROC_MAX_FD; ++i) {
         if (table->entries[i].file != NULL) {
@@ -136,26 +147,25 @@ int HandleExecFd(struct fd_table* table) {
                 table->entries[i].file = NULL;
                 int res = CloseFile(file);
                 if (res != 0) {
-                    ReleaseMutex(table->lock);
+                    ReleaseRwLockWrite(table->lock);
                     return res;
                 }
             }
         }
     }
 
-    ReleaseMutex(table->lock);
+    ReleaseRwLockWrite(table->lock);
     return 0;
 }
 
 int DupFd(struct fd_table* table, int oldfd, int* newfd) {
     EXACT_IRQL(IRQL_STANDARD);
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockWrite(table->lock);
 
-    struct file* original_file;
-    int res = GetFileFromFd(table, oldfd, &original_file);
-    if (res != 0 || original_file == NULL) {
-        ReleaseMutex(table->lock);
+    struct file* original_file = GetFileFromFdWithLockHeld(table, oldfd);
+    if (original_file == NULL) {
+        ReleaseRwLockWrite(table->lock);
         return EBADF;
     }
 
@@ -163,13 +173,13 @@ int DupFd(struct fd_table* table, int oldfd, int* newfd) {
         if (table->entries[i].file == NULL) {
             table->entries[i].file = original_file;
             table->entries[i].flags = 0;
-            ReleaseMutex(table->lock);
+            ReleaseRwLockWrite(table->lock);
             *newfd = i;
             return 0;
         }
     }
 
-    ReleaseMutex(table->lock);
+    ReleaseRwLockWrite(table->lock);
     return EMFILE;
 }
 
@@ -180,17 +190,16 @@ int DupFd2(struct fd_table* table, int oldfd, int newfd, int flags) {
         return EINVAL;
     }
 
-    AcquireMutex(table->lock, -1);
+    AcquireRwLockWrite(table->lock);
 
-    struct file* original_file;
-    int res = GetFileFromFd(table, oldfd, &original_file);
+    struct file* original_file = GetFileFromFdWithLockHeld(table, oldfd);
 
     /*
     * "If oldfd is not a valid file descriptor, then the call fails,
     * and newfd is not closed."
     */
-    if (res != 0 || original_file == NULL) {
-        ReleaseMutex(table->lock);
+    if (original_file == NULL || newfd < 0 || newfd >= PROC_MAX_FD) {
+        ReleaseRwLockWrite(table->lock);
         return EBADF;
     }
 
@@ -199,13 +208,12 @@ int DupFd2(struct fd_table* table, int oldfd, int newfd, int flags) {
     * value as oldfd, then dup2() does nothing..."
     */
     if (oldfd == newfd) {
-        ReleaseMutex(table->lock);
+        ReleaseRwLockWrite(table->lock);
         return 0;
     }
 
-    struct file* current_file;
-    res = GetFileFromFd(table, oldfd, &current_file);
-    if (res == 0 && current_file != NULL) {
+    struct file* current_file = GetFileFromFdWithLockHeld(table, newfd);
+    if (current_file != NULL) {
         /*
         * "If the file descriptor newfd was previously open, it is closed
         * before being reused; the close is performed silently (i.e., any
@@ -217,6 +225,6 @@ int DupFd2(struct fd_table* table, int oldfd, int newfd, int flags) {
     table->entries[newfd].file = original_file;
     table->entries[newfd].flags = flags;
     
-    ReleaseMutex(table->lock);
+    ReleaseRwLockWrite(table->lock);
     return 0;
 }
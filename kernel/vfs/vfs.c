@@ -1,5 +1,6 @@
 #include <vfs.h>
 #include <spinlock.h>
+#include <rwlock.h>
 #include <irql.h>
 #include <log.h>
 #include <assert.h>
@@ -35,7 +36,11 @@ struct mounted_file {
 	char* name;
 };
 
-static struct spinlock vfs_lock;
+/*
+ * Protects `mount_points`. Mounts hardly ever change after boot, but every
+ * absolute path lookup reads them.
+ */
+static struct spin_rwlock vfs_lock;
 static struct linked_list* mount_points = NULL;
 
 int NextDevId(void) {
@@ -83,8 +88,10 @@ int RootsRead(struct vnode* node, struct transfer* io) {
 		return PerformTransfer(&dir, io, sizeof(struct dirent));
 	}
 
+	int prev_irql = AcquireSpinRwLockRead(&vfs_lock);
 	struct mounted_file* root = ListGetDataAtIndex(mount_points, index - 2);
 	if (root == NULL) {
+		ReleaseSpinRwLockRead(&vfs_lock, prev_irql);
 		return ENOENT;
 	}
 
@@ -95,6 +102,8 @@ int RootsRead(struct vnode* node, struct transfer* io) {
 	dir.d_namlen = strlen(root->name);
 	strncpy(dir.d_name, root->name, sizeof(dir.d_name));
 	dir.d_name[sizeof(dir.d_name) - 1] = 0;
+	ReleaseSpinRwLockRead(&vfs_lock, prev_irql);
+
 	return PerformTransfer(&dir, io, sizeof(struct dirent));
 }
 
@@ -103,11 +112,14 @@ int RootsFollow(struct vnode* node, struct vnode** output, const char* name) {
 		*output = node;
 		return 0;
 	}
+	int prev_irql = AcquireSpinRwLockRead(&vfs_lock);
 	struct mounted_file* root = GetMountPointFromName(name);
 	if (root == NULL) {
+		ReleaseSpinRwLockRead(&vfs_lock, prev_irql);
 		return ENOENT;
 	}
 	*output = root->node->node;
+	ReleaseSpinRwLockRead(&vfs_lock, prev_irql);
     return 0;
 }
 
@@ -125,7 +137,7 @@ void InitRootsFilesystem(void) {
 }
 
 void InitVfs(void) {
-    InitSpinlock(&vfs_lock, "vfs", IRQL_SCHEDULER);
+    InitSpinRwLock(&vfs_lock, "vfs", IRQL_SCHEDULER);
     mount_points = ListCreate();
 }
 
@@ -159,7 +171,7 @@ static int CheckValidComponentName(const char* name)
 
 static int DoesMountPointExist(const char* name) {
     assert(name != NULL);
-    assert(IsSpinlockHeld(&vfs_lock));
+    assert(IsSpinRwLockWriteHeld(&vfs_lock));
 
     if (GetMountPointFromName(name) != NULL) {
         return EEXIST;
@@ -249,10 +261,10 @@ int AddVfsMount(struct vnode* node, const char* name) {
 		return status;
 	}
 
-    AcquireSpinlock(&vfs_lock);
+    AcquireSpinRwLockWrite(&vfs_lock);
 
     if (DoesMountPointExist(name) == EEXIST) {
-        ReleaseSpinlock(&vfs_lock);
+        ReleaseSpinRwLockWrite(&vfs_lock);
         return EEXIST;
     }
 
@@ -264,7 +276,7 @@ int AddVfsMount(struct vnode* node, const char* name) {
 
 	LogWriteSerial("MOUNTED TO THE VFS: %s\n", name);
 
-    ReleaseSpinlock(&vfs_lock);
+    ReleaseSpinRwLockWrite(&vfs_lock);
     return 0;
 }
 
@@ -279,14 +291,14 @@ int RemoveVfsMount(const char* name) {
 		return EINVAL;
 	}
 
-	AcquireSpinlock(&vfs_lock);
+	AcquireSpinRwLockWrite(&vfs_lock);
 
 	/*
 	* Scan through the mount table for the device
 	*/ 
     struct mounted_file* actual = GetMountPointFromName(name);
     if (actual == NULL) {
-        ReleaseSpinlock(&vfs_lock);
+        ReleaseSpinRwLockWrite(&vfs_lock);
         return ENODEV;
     }
 
@@ -303,7 +315,7 @@ int RemoveVfsMount(const char* name) {
 	ListDeleteData(mount_points, actual);
     FreeHeap(actual->name);
 
-    ReleaseSpinlock(&vfs_lock);
+    ReleaseSpinRwLockWrite(&vfs_lock);
     return 0;
 }
 
@@ -349,12 +361,15 @@ static int GetVnodeFromPath(const char* path, struct vnode** out, bool want_pare
 			return err;
 		}
 
+		int prev_irql = AcquireSpinRwLockRead(&vfs_lock);
 		struct mounted_file* mount = GetMountPointFromName(component_buffer);
 		struct file* current_file = mount == NULL ? NULL : mount->node;
 		if (current_file == NULL) {
+			ReleaseSpinRwLockRead(&vfs_lock, prev_irql);
 			return ENODEV;
 		}
 		current_vnode = current_file->node;
+		ReleaseSpinRwLockRead(&vfs_lock, prev_irql);
 		LogWriteSerial("Got mount point: %s, 0x%X, 0x%X, 0x%X\n", component_buffer, mount, current_file, current_vnode);
 	}
 	
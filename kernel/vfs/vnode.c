@@ -186,4 +186,11 @@ int VnodeOpDelete(struct vnode* node) {
         return EINVAL;
     }
     return node->ops.delete(node);
-}
\ No newline at end of file
+}
+int VnodeOpWait(struct vnode* node, int events, struct poll_table* table) {
+    CheckVnode(node);
+    if (node->ops.wait == NULL) {
+        return events & (VNODE_WAIT_READ | VNODE_WAIT_WRITE);
+    }
+    return node->ops.wait(node, events, table);
+}
@@ -27,6 +27,17 @@ enum system_call_numbers {
     SYSCALL_SIGNAL,
     SYSCALL_PGID,
     SYSCALL_ALARM,
+    SYSCALL_FUTEX,
+    SYSCALL_CREATETHREAD,
+    SYSCALL_SETTLS,
+    SYSCALL_SPLICE,
+    SYSCALL_VMSPLICE,
+    SYSCALL_POLL,
+    SYSCALL_SHMOPEN,
+    SYSCALL_SHMUNLINK,
+    SYSCALL_TRUNCATE,
+    SYSCALL_IORINGSETUP,
+    SYSCALL_IORINGENTER,
     
     _SYSCALL_NUM_ENTRIES
 };
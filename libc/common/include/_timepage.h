@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * The layout of the read-only page the kernel maps into every process, so that
+ * the time can be read without a system call. The kernel makes `sequence` odd
+ * while it is updating the rest of the page, and increments it again when it is
+ * done. A reader must wait for it to be even, read what it needs, and try again
+ * if `sequence` changed in the meantime.
+ *
+ * The system time (nanoseconds since boot) is `tick_time` if `using_tsc` is
+ * zero. Otherwise it is `time_base`, plus the number of timestamp counter cycles
+ * since `tsc_base`, multiplied by `mult` and shifted right by `shift`.
+ *
+ * UTC time (microseconds since 1 January 1601) is `utc_base` plus the system
+ * time, and local time adds `timezone_offset` (also in microseconds) to that.
+ */
+struct time_page {
+    volatile uint32_t sequence;
+    uint32_t using_tsc;
+    uint64_t tick_time;
+    uint64_t tsc_base;
+    uint64_t time_base;
+    uint32_t mult;
+    uint32_t shift;
+    uint64_t utc_base;
+    int64_t timezone_offset;
+};
@@ -45,6 +45,7 @@
 #define EINTR			33			// Interrupted by signal
 #define ECANCELED		34			// Operation cancelled
 #define EOVERFLOW		35			// Overflow
+#define EDEADLK			36			// Would deadlock
 #ifndef COMPILE_KERNEL
 
 int* __thread_local_errno_();
@@ -0,0 +1,27 @@
+#pragma once
+
+/**
+ * Waits until another thread calls OsFutexWake() on the same address, as long
+ * as the word at that address still holds the expected value. This is the
+ * building block for locks - they only need to call it when they are
+ * contended.
+ *
+ * @param address    The word to wait on. Must be aligned.
+ * @param expected   If the word doesn't hold this value, the call returns
+ *                   straight away.
+ * @param timeout_ms The most milliseconds to wait for, or -1 to wait forever.
+ * @return Zero if woken by OsFutexWake(); EAGAIN if the word didn't hold
+ *         `expected`; ETIMEDOUT if the timeout expired; EINTR if interrupted
+ *         by a signal; or another errno code.
+ */
+int OsFutexWait(volatile int* address, int expected, int timeout_ms);
+
+/**
+ * Wakes up threads in this process that are waiting on an address with
+ * OsFutexWait().
+ *
+ * @param address The word the threads are waiting on. Must be aligned.
+ * @param count   The most threads to wake up.
+ * @return Zero on success, or an errno code.
+ */
+int OsFutexWake(volatile int* address, int count);
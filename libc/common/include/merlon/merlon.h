@@ -1,3 +1,6 @@
 
 #include <merlon/sysinfo.h>
-#include <merlon/time.h>
\ No newline at end of file
+#include <merlon/time.h>
+#include <merlon/futex.h>
+#include <merlon/thread.h>
+#include <merlon/splice.h>
\ No newline at end of file
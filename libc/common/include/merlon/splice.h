@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Moves data between a pipe and another file without it being copied through
+ * a user buffer. One of the files must be a pipe, and the other must not be.
+ * The other file is read or written at its current position.
+ *
+ * @param fd_in     Where the data comes from.
+ * @param fd_out    Where the data goes.
+ * @param length    The most bytes to move.
+ * @param moved_out Set to the number of bytes moved. Zero means the end of the
+ *                  input was reached.
+ * @return Zero on success; EINVAL if neither (or both) of the files are pipes;
+ *         EAGAIN if the pipe is non-blocking and isn't ready; or another errno
+ *         code.
+ */
+int OsSplice(int fd_in, int fd_out, size_t length, size_t* moved_out);
+
+/**
+ * Writes memory into a pipe without it being copied into the pipe's buffer.
+ * Instead, the pages are lent to the pipe and readers copy straight out of 
+ * them. It works best with page-aligned buffers, and returns once the data has
+ * been read, which may be less than `length`.
+ *
+ * @param fd        The pipe to write to.
+ * @param buffer    The data to write.
+ * @param length    The most bytes to write.
+ * @param moved_out Set to the number of bytes written.
+ * @return Zero on success; EFAULT if the buffer can't be read; or another 
+ *         errno code.
+ */
+int OsVmsplice(int fd, const void* buffer, size_t length, size_t* moved_out);
@@ -29,3 +29,12 @@ size_t OsGetFreeMemoryKilobytes(void);
  * @param length The maximum length of the string to write to `string`.
  */
 void OsGetVersion(int* major, int* minor, char* string, int length);
+
+/**
+ * Writes the contention counters of the kernel's tracked spinlocks (e.g. 
+ * "phys", "scheduler", "heapspin" or "gml") to the serial port.
+ *
+ * @param name The name of the lock to dump, or NULL to dump all of them.
+ * @return Zero on success, or an errno code.
+ */
+int OsDumpSpinlockStats(const char* name);
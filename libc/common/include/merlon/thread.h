@@ -0,0 +1,34 @@
+#pragma once
+
+/**
+ * Starts a new thread in the current process. It gets its own stack, and
+ * starts running `entry` with `arg`. The entry point must not return - it
+ * should call OsExitThread() instead.
+ *
+ * @param entry     Where the new thread starts running.
+ * @param arg       The argument passed to `entry`.
+ * @param tls       The new thread's thread-local storage base, which the GS
+ *                  segment starts at.
+ * @param clear_tid If not NULL, the new thread's id is written here when it
+ *                  starts. When it exits, zero is written here instead, and any
+ *                  OsFutexWait() calls on it are woken. That's how threads are
+ *                  joined.
+ * @param tid_out   If not NULL, the new thread's id is written here.
+ * @return Zero on success; EAGAIN if the process has too many threads; or
+ *         another errno code.
+ */
+int OsCreateThread(void (*entry)(void*), void* arg, void* tls, volatile int* clear_tid, int* tid_out);
+
+/**
+ * Exits the calling thread. If it is the last thread in the process, the
+ * process exits with `status`.
+ */
+void OsExitThread(int status);
+
+/**
+ * Changes where the calling thread's thread-local storage (the GS segment)
+ * starts.
+ *
+ * @return Zero on success, or an errno code.
+ */
+int OsSetThreadLocalStorage(void* base);
@@ -0,0 +1,18 @@
+#pragma once
+
+#define POLLIN      (1 << 0)
+#define POLLOUT     (1 << 1)
+#define POLLERR     (1 << 2)
+#define POLLNVAL    (1 << 3)
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+    int fd;
+    short events;
+    short revents;
+};
+
+#ifndef COMPILE_KERNEL
+int poll(struct pollfd fds[], nfds_t nfds, int timeout);
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sys/types.h>
+
+/*
+ * POSIX threads, built on OsCreateThread() and futexes. Each thread's
+ * thread-local storage starts with a pointer to its `struct pthread`.
+ */
+
+struct pthread;
+typedef struct pthread* pthread_t;
+
+typedef struct {
+    int detach_state;
+} pthread_attr_t;
+
+/*
+ * `state` is 0 when unlocked, 1 when locked, and 2 when locked and someone
+ * might be waiting for it.
+ */
+typedef struct {
+    volatile int state;
+} pthread_mutex_t;
+
+typedef struct {
+    int unused;
+} pthread_mutexattr_t;
+
+/*
+ * `sequence` changes on every signal or broadcast, so that a waiter can tell
+ * if it missed one between unlocking the mutex and going to sleep.
+ */
+typedef struct {
+    volatile int sequence;
+} pthread_cond_t;
+
+typedef struct {
+    int unused;
+} pthread_condattr_t;
+
+#define PTHREAD_CREATE_JOINABLE     0
+#define PTHREAD_CREATE_DETACHED     1
+
+#define PTHREAD_MUTEX_INITIALIZER   {0}
+#define PTHREAD_COND_INITIALIZER    {0}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*), void* arg);
+int pthread_join(pthread_t thread, void** retval);
+int pthread_detach(pthread_t thread);
+void pthread_exit(void* retval) __attribute__((noreturn));
+pthread_t pthread_self(void);
+int pthread_equal(pthread_t a, pthread_t b);
+
+int pthread_attr_init(pthread_attr_t* attr);
+int pthread_attr_destroy(pthread_attr_t* attr);
+int pthread_attr_setdetachstate(pthread_attr_t* attr, int detach_state);
+int pthread_attr_getdetachstate(const pthread_attr_t* attr, int* detach_state);
+
+int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr);
+int pthread_mutex_destroy(pthread_mutex_t* mutex);
+int pthread_mutex_lock(pthread_mutex_t* mutex);
+int pthread_mutex_trylock(pthread_mutex_t* mutex);
+int pthread_mutex_unlock(pthread_mutex_t* mutex);
+
+int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr);
+int pthread_cond_destroy(pthread_cond_t* cond);
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+int pthread_cond_signal(pthread_cond_t* cond);
+int pthread_cond_broadcast(pthread_cond_t* cond);
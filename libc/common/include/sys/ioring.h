@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The layout of an asynchronous I/O ring, which the kernel maps into the
+ * process when io_ring_setup() is called. It holds a submission queue and a
+ * completion queue, each with `entries` slots, at `sq_offset` and `cq_offset`
+ * bytes from the start of the ring. `entries` is always a power of two.
+ *
+ * To submit a request, fill in the slot at index `sq_tail % entries`, and then
+ * increment `sq_tail`. Any number can be queued up before calling
+ * io_ring_enter(), which hands them to the kernel and can wait for some of them
+ * to finish. The kernel increments `sq_head` as it takes each one.
+ *
+ * Completions get posted to the slot at `cq_tail % entries` in the order that
+ * requests finish, which isn't necessarily the order they were submitted in,
+ * and so `user_data` is copied across to tell them apart. Once a completion has
+ * been dealt with, increment `cq_head` to give the slot back. The kernel won't
+ * take more submissions than there is room for completions, so if the
+ * completion queue fills up, submissions are left where they are until there's
+ * space.
+ */
+
+#define IO_RING_MAX_ENTRIES 256
+
+#define IO_RING_OP_NOP      0
+#define IO_RING_OP_READ     1
+#define IO_RING_OP_WRITE    2
+
+/*
+ * An `offset` of IO_RING_SEEK_POSITION uses (and updates) the file's seek
+ * position, like read() and write() do.
+ */
+#define IO_RING_SEEK_POSITION ((uint64_t) -1)
+
+struct io_ring_sqe {
+    uint64_t user_data;
+    uint64_t offset;
+    void* buffer;
+    size_t length;
+    int fd;
+    int opcode;
+};
+
+/*
+ * `error` is 0 if the request succeeded, or an errno code if it didn't.
+ */
+struct io_ring_cqe {
+    uint64_t user_data;
+    size_t transferred;
+    int error;
+};
+
+struct io_ring {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t entries;
+    uint32_t sq_offset;
+    uint32_t cq_offset;
+};
+
+#define IO_RING_SQES(ring) ((struct io_ring_sqe*) (void*) ((uint8_t*) (ring) + (ring)->sq_offset))
+#define IO_RING_CQES(ring) ((struct io_ring_cqe*) (void*) ((uint8_t*) (ring) + (ring)->cq_offset))
+
+#ifndef COMPILE_KERNEL
+struct io_ring* io_ring_setup(unsigned int entries);
+int io_ring_enter(unsigned int to_submit, unsigned int min_complete, int timeout);
+#endif
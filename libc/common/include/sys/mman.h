@@ -25,4 +25,11 @@
 
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
 int munmap(void* addr, size_t length);
-int mprotect(void *addr, size_t len, int prot);
\ No newline at end of file
+int mprotect(void *addr, size_t len, int prot);
+
+/*
+ * Shared memory objects are opened by name (which isn't a path) rather than
+ * through the filesystem, sized with ftruncate(), and mapped with MAP_SHARED.
+ */
+int shm_open(const char* name, int oflag, mode_t mode);
+int shm_unlink(const char* name);
\ No newline at end of file
@@ -19,6 +19,7 @@ ssize_t read(int fd, void* buffer, size_t size);
 ssize_t write(int fd, const void* buffer, size_t size);
 
 off_t lseek(int fd, off_t offset, int whence);
+int ftruncate(int fd, off_t length);
 
 int dup(int oldfd);
 int dup2(int oldfd, int newfd);
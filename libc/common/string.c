@@ -218,6 +218,8 @@ char* strerror(int err) {
 		return "Operation cancelled";
 	case EOVERFLOW:
 		return "Overflow";
+	case EDEADLK:
+		return "Would deadlock";
 	default:
 		return "Unknown error";
 	}
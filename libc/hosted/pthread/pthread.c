@@ -0,0 +1,262 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <merlon/thread.h>
+#include <merlon/futex.h>
+
+/*
+ * `tid` is the kernel's clear-on-exit word: it's non-zero while the thread is
+ * running, and the kernel sets it to zero (and wakes any futex waiters) once
+ * the thread has exited. `self` must come first, as it's what the thread-local
+ * storage segment points at.
+ */
+struct pthread {
+    struct pthread* self;
+    volatile int tid;
+    void* (*start_routine)(void*);
+    void* arg;
+    void* retval;
+    bool detached;
+    struct pthread* next_detached;
+};
+
+#define FUTEX_WAKE_ALL  0x7FFFFFFF
+
+/*
+ * The main thread doesn't get a thread-local storage area until another thread
+ * is created, so until then pthread_self() just returns this.
+ */
+static struct pthread main_thread = {.self = &main_thread, .tid = 1};
+static bool multithreaded = false;
+
+/*
+ * Detached threads can't free their own `struct pthread`, as the kernel writes
+ * to it after they exit. They get freed here once they're done.
+ */
+static pthread_mutex_t detached_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pthread* detached_threads = NULL;
+
+static void ReapDetachedThreads(void) {
+    pthread_mutex_lock(&detached_lock);
+    struct pthread** prev = &detached_threads;
+    while (*prev != NULL) {
+        struct pthread* thread = *prev;
+        if (__atomic_load_n(&thread->tid, __ATOMIC_ACQUIRE) == 0) {
+            *prev = thread->next_detached;
+            free(thread);
+        } else {
+            prev = &thread->next_detached;
+        }
+    }
+    pthread_mutex_unlock(&detached_lock);
+}
+
+static void AddDetachedThread(struct pthread* thread) {
+    pthread_mutex_lock(&detached_lock);
+    thread->next_detached = detached_threads;
+    detached_threads = thread;
+    pthread_mutex_unlock(&detached_lock);
+}
+
+static void ThreadStart(void* arg) {
+    struct pthread* self = arg;
+    pthread_exit(self->start_routine(self->arg));
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*), void* arg) {
+    if (!multithreaded) {
+        int res = OsSetThreadLocalStorage(&main_thread);
+        if (res != 0) {
+            return res;
+        }
+        multithreaded = true;
+    }
+
+    ReapDetachedThreads();
+
+    struct pthread* new_thread = malloc(sizeof(struct pthread));
+    if (new_thread == NULL) {
+        return EAGAIN;
+    }
+    new_thread->self = new_thread;
+    new_thread->tid = -1;       // until the kernel fills it in, it must look like it's running
+    new_thread->start_routine = start_routine;
+    new_thread->arg = arg;
+    new_thread->retval = NULL;
+    new_thread->detached = attr != NULL && attr->detach_state == PTHREAD_CREATE_DETACHED;
+    new_thread->next_detached = NULL;
+
+    if (new_thread->detached) {
+        AddDetachedThread(new_thread);
+    }
+
+    int res = OsCreateThread(ThreadStart, new_thread, new_thread, &new_thread->tid, NULL);
+    if (res != 0) {
+        if (new_thread->detached) {
+            new_thread->tid = 0;        // gets freed by the next reap
+        } else {
+            free(new_thread);
+        }
+        return res;
+    }
+
+    *thread = new_thread;
+    return 0;
+}
+
+int pthread_join(pthread_t thread, void** retval) {
+    if (thread == pthread_self()) {
+        return EDEADLK;
+    }
+    if (thread->detached) {
+        return EINVAL;
+    }
+
+    int tid;
+    while ((tid = __atomic_load_n(&thread->tid, __ATOMIC_ACQUIRE)) != 0) {
+        OsFutexWait(&thread->tid, tid, -1);
+    }
+
+    if (retval != NULL) {
+        *retval = thread->retval;
+    }
+    if (thread != &main_thread) {
+        free(thread);
+    }
+    return 0;
+}
+
+int pthread_detach(pthread_t thread) {
+    if (thread->detached) {
+        return EINVAL;
+    }
+    thread->detached = true;
+    if (thread != &main_thread) {
+        AddDetachedThread(thread);
+    }
+    return 0;
+}
+
+void pthread_exit(void* retval) {
+    pthread_self()->retval = retval;
+    OsExitThread(0);
+    while (true) {
+        ;
+    }
+}
+
+pthread_t pthread_self(void) {
+    if (!multithreaded) {
+        return &main_thread;
+    }
+    struct pthread* self;
+    asm volatile ("mov %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+int pthread_equal(pthread_t a, pthread_t b) {
+    return a == b;
+}
+
+int pthread_attr_init(pthread_attr_t* attr) {
+    attr->detach_state = PTHREAD_CREATE_JOINABLE;
+    return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t* attr) {
+    (void) attr;
+    return 0;
+}
+
+int pthread_attr_setdetachstate(pthread_attr_t* attr, int detach_state) {
+    if (detach_state != PTHREAD_CREATE_JOINABLE && detach_state != PTHREAD_CREATE_DETACHED) {
+        return EINVAL;
+    }
+    attr->detach_state = detach_state;
+    return 0;
+}
+
+int pthread_attr_getdetachstate(const pthread_attr_t* attr, int* detach_state) {
+    *detach_state = attr->detach_state;
+    return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr) {
+    (void) attr;
+    mutex->state = 0;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t* mutex) {
+    return mutex->state == 0 ? 0 : EBUSY;
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    /*
+     * Contended - mark it so that the unlock knows to wake us, and sleep until
+     * we're the one that changes it from unlocked.
+     */
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        OsFutexWait(&mutex->state, 2, -1);
+    }
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+    if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2) {
+        OsFutexWake(&mutex->state, 1);
+    }
+    return 0;
+}
+
+int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr) {
+    (void) attr;
+    cond->sequence = 0;
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t* cond) {
+    (void) cond;
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    int sequence = __atomic_load_n(&cond->sequence, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(mutex);
+    OsFutexWait(&cond->sequence, sequence, -1);
+
+    /*
+     * Other waiters may have been woken at the same time, so take the mutex as
+     * if it's contended, or they might never get woken up to take it.
+     */
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        OsFutexWait(&mutex->state, 2, -1);
+    }
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t* cond) {
+    __atomic_add_fetch(&cond->sequence, 1, __ATOMIC_RELEASE);
+    OsFutexWake(&cond->sequence, 1);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t* cond) {
+    __atomic_add_fetch(&cond->sequence, 1, __ATOMIC_RELEASE);
+    OsFutexWake(&cond->sequence, FUTEX_WAKE_ALL);
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <voidptr.h>
+#include <pthread.h>
 
 /*
  * See kernel/heap.c for a commented heap implementation (this is a simplified)
@@ -105,6 +106,11 @@ static bool IsAllocated(struct block* block) {
 
 static struct block* _head_block[TOTAL_NUM_FREE_LISTS];
 
+/*
+ * Protects the free lists, now that threads can share the heap.
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static size_t GetSize(struct block* block) {
     size_t size = block->size & ~3;
     assert(*(((size_t*) block) + (size / sizeof(size_t)) - 1) == size);
@@ -273,9 +279,9 @@ void* malloc(size_t size) {
     }
     size = RoundUpSize(size);
 
-    // TODO: lock
+    pthread_mutex_lock(&heap_lock);
     struct block* block = FindBlock(size);
-    // TODO: unlock
+    pthread_mutex_unlock(&heap_lock);
 
     assert(((size_t) block & (ALIGNMENT - 1)) == 0);
 
@@ -291,11 +297,9 @@ void free(void* ptr) {
     block->prev = NULL;
     block->next = NULL;
 
-    // TODO: lock...
-
+    pthread_mutex_lock(&heap_lock);
     AddBlock(block);
-
-    // TODO: unlock...
+    pthread_mutex_unlock(&heap_lock);
 }
 
 void* calloc(size_t num, size_t size) {